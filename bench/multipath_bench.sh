@@ -0,0 +1,247 @@
+#!/bin/bash
+# -*- coding: utf-8-unix; -*-
+#  FILENAME     :  multipath_bench.sh
+#  DESCRIPTION  :  1台の上でマルチパス転送を繰り返し計測するベンチマーク
+#
+#  network namespace で「送信ノード - 中継ノード(hops段) - 受信ノード」を
+#  経路数だけ作り，send.out / rooter.out / receive.out を実際に動かす。
+#  経路ごとに tc netem で遅延と帯域を付けられる。
+#  namespace を作れない環境 (root でない等) では 127.0.0.1 上の
+#  別ポートで同じ構成を組む (遅延・帯域の設定は効かない)。
+#
+#  USAGE        :  sudo bench/multipath_bench.sh [-o result.csv]
+#  パラメータは環境変数で与える (空白区切りで複数指定するとすべての組合せを回す)
+#    SIZES    ファイルサイズ           既定 "16M 64M"
+#    CHUNKS   チャンクサイズ (-c)      既定 "1048576"
+#    PATHS    経路数                   既定 "2 4"
+#    HOPS     経路あたりの中継段数     既定 "0 1"
+#    STREAMS  経路あたりのTCP接続数 (-P) 既定 "1"
+#    SPLITS   分担方法: dynamic (-s) または比率 "70:30" (-s -r)
+#                                      既定 "dynamic"
+#    RATES    経路ごとの帯域 (カンマ区切り，足りない分は最後の値) 既定 "200mbit"
+#    DELAYS   経路ごとの片道遅延 (カンマ区切り)                  既定 "0ms"
+#    REPS     繰り返し回数             既定 5
+#    BACKEND  受信側の -m              既定 "epoll"
+
+set -u
+
+SIZES=${SIZES:-"16M 64M"}
+CHUNKS=${CHUNKS:-"1048576"}
+PATHS=${PATHS:-"2 4"}
+HOPS=${HOPS:-"0 1"}
+STREAMS=${STREAMS:-"1"}
+SPLITS=${SPLITS:-"dynamic"}
+RATES=${RATES:-"200mbit"}
+DELAYS=${DELAYS:-"0ms"}
+REPS=${REPS:-5}
+BACKEND=${BACKEND:-"epoll"}
+PORT=10000
+TIMEOUT=${TIMEOUT:-120}
+
+SRC_DIR=$(cd "$(dirname "$0")/.." && pwd)
+OUT=result.csv
+while getopts "o:h" opt; do
+    case $opt in
+    o) OUT=$OPTARG ;;
+    *) sed -n '2,27p' "$0"; exit 0 ;;
+    esac
+done
+
+WORK=$(mktemp -d /tmp/mpbench.XXXXXX)
+BIN=$WORK/bin
+mkdir -p "$BIN"
+
+# ---- ビルド ----
+gcc -O2 "$SRC_DIR/send.c" -o "$BIN/send.out" -lpthread -lz || exit 1
+gcc -O2 "$SRC_DIR/tcp_echo_rooter.c" -o "$BIN/rooter.out" -lpthread || exit 1
+gcc -O2 "$SRC_DIR/receive_tcp.c" -o "$BIN/receive.out" -lpthread -lz || exit 1
+gcc -O2 "$SRC_DIR/filesplit.c" -o "$BIN/split.out" -lm -lpthread || exit 1
+
+# ---- トポロジ ----
+NETNS=0
+if [ "$(id -u)" = 0 ] && ip netns add mpb_probe 2>/dev/null; then
+    ip netns del mpb_probe
+    NETNS=1
+else
+    echo "network namespace is not available: falling back to loopback (RATES/DELAYS ignored)" >&2
+fi
+
+# カンマ区切りのリストから i 番目 (1始まり) を取り出す。足りなければ最後の値
+nth() {
+    local IFS=, i=$2 v last
+    for v in $1; do
+        last=$v
+        i=$((i - 1))
+        [ $i -eq 0 ] && break
+    done
+    echo "$last"
+}
+
+in_ns() {
+    local ns=$1
+    shift
+    if [ "$NETNS" = 1 ]; then ip netns exec "$ns" "$@"; else "$@"; fi
+}
+
+teardown() {
+    pkill -x send.out 2>/dev/null
+    pkill -x rooter.out 2>/dev/null
+    if [ "$NETNS" = 1 ]; then
+        for ns in $(ip netns list | awk '/^mpb_/ {print $1}'); do
+            ip netns del "$ns"
+        done
+    fi
+}
+trap 'teardown; rm -rf "$WORK"' EXIT
+
+# 経路 k の j 段目のリンク (j = 0 が送信側，j = hops が受信側) を 10.j.k.0/24 で張る
+# 左端 (.1) が送信ノード寄り，右端 (.2) が受信ノード寄り
+ns_of() {
+    local k=$1 j=$2 hops=$3
+    if [ "$j" -eq 0 ]; then echo mpb_snd
+    elif [ "$j" -gt "$hops" ]; then echo mpb_rcv
+    else echo "mpb_p${k}h${j}"
+    fi
+}
+
+# 経路数 np，中継段数 hops のトポロジを作る。
+# SEND_ARGS (-p の並び) と RECV_HOSTS (受信側が接続する先) を設定する
+setup_topology() {
+    local np=$1 hops=$2 k j left right a b
+    teardown
+    SEND_ARGS=""
+    RECV_HOSTS=""
+    RELAYS=()
+    if [ "$NETNS" = 1 ]; then
+        ip netns add mpb_snd
+        ip netns add mpb_rcv
+        for k in $(seq 1 "$np"); do
+            for j in $(seq 1 "$hops"); do
+                ip netns add "mpb_p${k}h${j}"
+            done
+            for j in $(seq 0 "$hops"); do
+                left=$(ns_of "$k" "$j" "$hops")
+                right=$(ns_of "$k" $((j + 1)) "$hops")
+                a="mpb${k}l${j}a"
+                b="mpb${k}l${j}b"
+                ip link add "$a" netns "$left" type veth peer name "$b" netns "$right"
+                ip -n "$left" addr add "10.$j.$k.1/24" dev "$a"
+                ip -n "$right" addr add "10.$j.$k.2/24" dev "$b"
+                ip -n "$left" link set "$a" up
+                ip -n "$right" link set "$b" up
+                ip -n "$left" link set lo up
+                ip -n "$right" link set lo up
+            done
+            # 送信側の出口にだけ遅延と帯域を付ける (データの向き)
+            # netem が無いカーネルでは tbf で帯域だけ絞る
+            if ! ip netns exec mpb_snd tc qdisc add dev "mpb${k}l0a" root netem \
+                    delay "$(nth "$DELAYS" "$k")" rate "$(nth "$RATES" "$k")" limit 100000 2>/dev/null; then
+                echo "netem is not available: path$k uses tbf (rate only)" >&2
+                ip netns exec mpb_snd tc qdisc add dev "mpb${k}l0a" root tbf \
+                    rate "$(nth "$RATES" "$k")" burst 64kb latency 50ms
+            fi
+            SEND_ARGS="$SEND_ARGS -p path$k=10.0.$k.1:$PORT"
+            # 中継ノードは1つ送信側寄りのリンクの .1 へ中継する
+            for j in $(seq 1 "$hops"); do
+                RELAYS+=("mpb_p${k}h${j}|10.$((j - 1)).$k.1|$PORT|$PORT")
+            done
+            RECV_HOSTS="$RECV_HOSTS 10.$hops.$k.1:$PORT"
+        done
+    else
+        # ループバック: 経路 k の送信側は PORT+k*10，j 段目の中継は PORT+k*10+j
+        for k in $(seq 1 "$np"); do
+            SEND_ARGS="$SEND_ARGS -p path$k=127.0.0.1:$((PORT + k * 10))"
+            for j in $(seq 1 "$hops"); do
+                RELAYS+=("-|127.0.0.1|$((PORT + k * 10 + j - 1))|127.0.0.1:$((PORT + k * 10 + j))")
+            done
+            RECV_HOSTS="$RECV_HOSTS 127.0.0.1:$((PORT + k * 10 + hops))"
+        done
+    fi
+}
+
+start_relays() {
+    local r ns dst dport listen
+    for r in "${RELAYS[@]+"${RELAYS[@]}"}"; do
+        IFS='|' read -r ns dst dport listen <<< "$r"
+        in_ns "$ns" "$BIN/rooter.out" -l "$listen" "$dst" "$dport" > /dev/null 2>&1 &
+    done
+}
+
+# 昇順に並んだ値から百分位数 (最近傍順位法) を求める
+percentile() {
+    local p=$1
+    shift
+    local n=$#
+    local idx=$(( (p * n + 99) / 100 ))
+    [ "$idx" -lt 1 ] && idx=1
+    eval "echo \${$idx}"
+}
+
+# ---- 計測 ----
+echo "size,chunk,paths,hops,streams,split,backend,reps,ok,mbps_p50,mbps_p90,mbps_p99,sec_p50,sec_p90,sec_p99" > "$OUT"
+
+for size in $SIZES; do
+    src=$WORK/src_$size.dat
+    head -c "$size" /dev/urandom > "$src"
+    for np in $PATHS; do
+        for hops in $HOPS; do
+            setup_topology "$np" "$hops"
+            for chunk in $CHUNKS; do
+              for streams in $STREAMS; do
+                for split in $SPLITS; do
+                    # 分担方法に応じた送信側の引数
+                    if [ "$split" = dynamic ]; then
+                        mode_args="-s $src"
+                        pos=$(for k in $(seq 1 "$np"); do printf '1 '; done)
+                    else
+                        tr ':' '\n' <<< "$split" > "$WORK/ratio.txt"
+                        if [ "$(wc -l < "$WORK/ratio.txt")" -ne "$np" ]; then
+                            echo "skip: split $split does not match $np paths" >&2
+                            continue
+                        fi
+                        "$BIN/split.out" -r "$src" "$WORK/ratio.txt" > "$WORK/ranges.txt" || continue
+                        mode_args="-s $src -r $WORK/ranges.txt"
+                        pos=$(seq -s ' ' 1 "$np")
+                    fi
+                    secs=()
+                    mbps=()
+                    ok=0
+                    for rep in $(seq 1 "$REPS"); do
+                        pkill -x send.out 2>/dev/null
+                        pkill -x rooter.out 2>/dev/null
+                        sleep 0.3
+                        # shellcheck disable=SC2086
+                        in_ns mpb_snd "$BIN/send.out" $SEND_ARGS -P "$streams" -c "$chunk" $mode_args $pos \
+                            > "$WORK/send.log" 2>&1 &
+                        start_relays
+                        sleep 0.5
+                        # shellcheck disable=SC2086
+                        in_ns mpb_rcv timeout "$TIMEOUT" "$BIN/receive.out" -m "$BACKEND" \
+                            "$WORK/out.dat" $RECV_HOSTS > "$WORK/recv.log" 2>&1
+                        rc=$?
+                        if [ $rc -eq 0 ] && cmp -s "$src" "$WORK/out.dat"; then
+                            ok=$((ok + 1))
+                            secs+=("$(awk '/Total Elapsed Time/ {print $5}' "$WORK/recv.log")")
+                            mbps+=("$(awk '/Effective Throughput/ {print $4}' "$WORK/recv.log")")
+                        else
+                            echo "run failed: size=$size paths=$np hops=$hops streams=$streams split=$split rep=$rep rc=$rc" >&2
+                        fi
+                        rm -f "$WORK/out.dat"
+                    done
+                    if [ "$ok" -gt 0 ]; then
+                        # shellcheck disable=SC2207
+                        s_sorted=($(printf '%s\n' "${secs[@]}" | sort -g))
+                        # shellcheck disable=SC2207
+                        m_sorted=($(printf '%s\n' "${mbps[@]}" | sort -g))
+                        row="$(percentile 50 "${m_sorted[@]}"),$(percentile 90 "${m_sorted[@]}"),$(percentile 99 "${m_sorted[@]}")"
+                        row="$row,$(percentile 50 "${s_sorted[@]}"),$(percentile 90 "${s_sorted[@]}"),$(percentile 99 "${s_sorted[@]}")"
+                    else
+                        row=",,,,,"
+                    fi
+                    echo "$size,$chunk,$np,$hops,$streams,$split,$BACKEND,$REPS,$ok,$row" | tee -a "$OUT"
+                done
+              done
+            done
+        done
+    done
+done
@@ -1,11 +1,17 @@
+#define _GNU_SOURCE /* copy_file_range, fallocate用 */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "icslab2_pack.h"
 
 #define BUF_SZ (64 * 1024)
+#define DEF_SPLIT_JOBS 16   /* 並列分割の既定スレッド数 (-j で変える。パート数より多くは起こさない) */
 
 typedef struct {
     double frac;  /* 小数部分 */
@@ -163,31 +169,307 @@ static int split_file(FILE *inf, const off_t *want, int parts)
             }
             remaining -= (off_t)wn;
         }
-        /* 最後のファイルには "exit" を追記する */
-        if (i == parts - 1) {
-            const char *tail = "exit";
-            if (fwrite(tail, 1, strlen(tail), outf) != strlen(tail)) {
-                perror("fwrite(exit)");
-                fclose(outf);
+        fclose(outf);
+    }
+
+    free(buf);
+    return 0;
+}
+
+/* ---- 並列分割エンジン ----                                         */
+/* 各パートの開始位置は want[] から決まるので，全パートを同時に書ける。 */
+/* コピーは copy_file_range() でカーネルに任せ (対応FSならreflinkや    */
+/* サーバ側コピーになる)，使えなければ pread/pwrite で行う。            */
+typedef struct {
+    int infd;
+    const off_t *want;
+    off_t *start;           /* 各パートの入力内の開始位置 */
+    pack_t *pack;           /* NULLでなければ各パートをこの索引の位置に書く (-p) */
+    int packfd;
+    int parts;
+    int next;               /* 次に処理するパート */
+    int failed;
+    pthread_mutex_t lock;
+} split_job_t;
+
+/* pread/pwrite による範囲コピー */
+static int copy_range_rw(int infd, off_t in_off, int outfd, off_t out_off, off_t len)
+{
+    unsigned char *buf = malloc(BUF_SZ);
+    if (!buf) {
+        perror("malloc");
+        return -1;
+    }
+    while (len > 0) {
+        size_t chunk = (size_t)(len > BUF_SZ ? BUF_SZ : len);
+        ssize_t rn = pread(infd, buf, chunk, in_off);
+        if (rn <= 0) {
+            if (rn < 0 && errno == EINTR) continue;
+            if (rn < 0) perror("pread");
+            break; /* EOFなら短いまま終わる (逐次版と同じ) */
+        }
+        ssize_t done = 0;
+        while (done < rn) {
+            ssize_t wn = pwrite(outfd, buf + done, rn - done, out_off + done);
+            if (wn < 0) {
+                if (errno == EINTR) continue;
+                perror("pwrite");
                 free(buf);
                 return -1;
             }
+            done += wn;
         }
-        fclose(outf);
+        in_off += rn;
+        out_off += rn;
+        len -= rn;
     }
+    free(buf);
+    return 0;
+}
 
+/* copy_file_range による範囲コピー，使えないFSなら pread/pwrite に切り替える */
+static int copy_range(int infd, off_t in_off, int outfd, off_t out_off, off_t len)
+{
+    while (len > 0) {
+        ssize_t n = copy_file_range(infd, &in_off, outfd, &out_off, (size_t)len, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                errno == EOPNOTSUPP || errno == EBADF) {
+                return copy_range_rw(infd, in_off, outfd, out_off, len);
+            }
+            perror("copy_file_range");
+            return -1;
+        }
+        if (n == 0) break; /* 入力の終端 */
+        len -= n;
+    }
+    return 0;
+}
+
+/* パックに書いたパートを読み直してCRC32Cを索引に入れる */
+static int pack_part_crc(int fd, pack_entry_t *e)
+{
+    unsigned char *buf = malloc(BUF_SZ);
+    uint64_t done = 0;
+    uint32_t crc = 0;
+
+    if (!buf) {
+        perror("malloc");
+        return -1;
+    }
+    while (done < e->len) {
+        size_t chunk = (size_t)(e->len - done > BUF_SZ ? BUF_SZ : e->len - done);
+        ssize_t rn = pread(fd, buf, chunk, (off_t)(e->pack_off + done));
+        if (rn <= 0) {
+            if (rn < 0 && errno == EINTR) continue;
+            if (rn < 0) perror("pread pack");
+            else fprintf(stderr, "pack: part %u is shorter than its index entry\n", e->part);
+            free(buf);
+            return -1;  /* 呼び出し側がパックを消す */
+        }
+        crc = crc32c(crc, buf, (size_t)rn);
+        done += (uint64_t)rn;
+    }
+    e->crc = crc;
     free(buf);
     return 0;
 }
 
+static int split_one_part(split_job_t *job, int i)
+{
+    char outname[256];
+    off_t size = job->want[i];
+
+    if (job->pack != NULL) {
+        /* 1つのファイルの決まった位置に書く (領域は全体をまとめて確保済み) */
+        pack_entry_t *e = &job->pack->parts[i];
+        if (copy_range(job->infd, job->start[i], job->packfd, (off_t)e->pack_off, size) < 0) return -1;
+        return pack_part_crc(job->packfd, e);
+    }
+    snprintf(outname, sizeof(outname), "%d.txt", i + 1);//出力ファイル名を作成
+    int outfd = open(outname, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (outfd < 0) {
+        perror("open output");
+        return -1;
+    }
+    /* 最終サイズで領域を確保しておく (断片化とメタデータ更新を減らす) */
+    if (size > 0) {
+        int rc = fallocate(outfd, 0, 0, size);
+        if (rc < 0 && errno != EOPNOTSUPP && errno != ENOSYS) {
+            perror("fallocate");
+            close(outfd);
+            return -1;
+        }
+    }
+    if (copy_range(job->infd, job->start[i], outfd, 0, size) < 0) {
+        close(outfd);
+        return -1;
+    }
+    return close(outfd);
+}
+
+static void *split_worker(void *arg)
+{
+    split_job_t *job = arg;
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        int i = job->failed ? job->parts : job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= job->parts) break;
+        if (split_one_part(job, i) < 0) {
+            pthread_mutex_lock(&job->lock);
+            job->failed = 1;
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+    return NULL;
+}
+
+/* 全パートを jobs 本のスレッドで並列に書き出す */
+/* pack が NULL でなければ，パートファイルの代わりに packfd の索引の位置に書く */
+static int split_file_parallel(FILE *inf, const off_t *want, int parts, int jobs, pack_t *pack, int packfd)
+{
+    split_job_t job;
+    pthread_t *th;
+    int started = 0;
+
+    memset(&job, 0, sizeof(job));
+    job.infd = fileno(inf);
+    job.pack = pack;
+    job.packfd = packfd;
+    job.want = want;
+    job.parts = parts;
+    job.start = malloc(sizeof(off_t) * parts);
+    th = malloc(sizeof(pthread_t) * (jobs > 0 ? jobs : 1));
+    if (!job.start || !th) {
+        perror("malloc");
+        free(job.start);
+        free(th);
+        return -1;
+    }
+    off_t off = 0;
+    for (int i = 0; i < parts; i++) {
+        job.start[i] = off;
+        off += want[i];
+    }
+    pthread_mutex_init(&job.lock, NULL);
+
+    if (jobs > parts) jobs = parts;
+    for (int t = 0; t < jobs; t++) {
+        if (pthread_create(&th[t], NULL, split_worker, &job) != 0) {
+            perror("pthread_create");
+            break;
+        }
+        started++;
+    }
+    if (started == 0) split_worker(&job); /* スレッドが作れなければ自分で処理 */
+    for (int t = 0; t < started; t++) pthread_join(th[t], NULL);
+
+    pthread_mutex_destroy(&job.lock);
+    free(job.start);
+    free(th);
+    return job.failed ? -1 : 0;
+}
+
+/* 全パートを1つのファイルにまとめる (索引付き，本体は PACK_ALIGN 境界)  */
+/* ファイルの作成と領域の確保は1回で済み，send.out -k はパート番号から   */
+/* 索引を直接引いて，その範囲を sendfile で送る                         */
+static int split_file_pack(FILE *inf, const off_t *want, int parts, int jobs, const char *packname)
+{
+    pack_t pack;
+    uint64_t size;
+    int fd, rc;
+
+    memset(&pack, 0, sizeof(pack));
+    pack.parts = malloc(sizeof(pack_entry_t) * parts);
+    if (!pack.parts) {
+        perror("malloc");
+        return -1;
+    }
+    size = pack_layout(&pack, want, parts, PACK_ALIGN);
+    fd = open(packname, O_CREAT | O_RDWR | O_TRUNC, 0644);     /* CRCを求めるので読み直す */
+    if (fd < 0) {
+        perror(packname);
+        free(pack.parts);
+        return -1;
+    }
+    rc = fallocate(fd, 0, 0, (off_t)size);
+    if (rc < 0 && errno != EOPNOTSUPP && errno != ENOSYS) {
+        perror("fallocate");
+        goto out;
+    }
+    /* 確保できなくても，パートの間の詰め物と末尾は0として読めるようにしておく */
+    if ((rc = ftruncate(fd, (off_t)size)) < 0) {
+        perror("ftruncate");
+        goto out;
+    }
+    rc = split_file_parallel(inf, want, parts, jobs, &pack, fd);
+    if (rc == 0 && (rc = pack_write_index(fd, &pack)) < 0) perror("write pack index");
+out:
+    if (close(fd) < 0 && rc == 0) {
+        perror("close");
+        rc = -1;
+    }
+    if (rc < 0) unlink(packname);   /* 索引の無い半端なファイルを残さない */
+    free(pack.parts);
+    return rc;
+}
+
+/* 分割せずに各パートの範囲表 (パート番号 開始位置 長さ) を書き出す */
+/* send.out -s 元ファイル -r 範囲表 で元ファイルから直接送るときに使う */
+static int write_ranges(FILE *out, const off_t *want, int parts)
+{
+    off_t off = 0;
+    fprintf(out, "# part offset length\n");
+    for (int i = 0; i < parts; i++) {
+        fprintf(out, "%d %lld %lld\n", i + 1, (long long)off, (long long)want[i]);
+        off += want[i];
+    }
+    return ferror(out) ? -1 : 0;
+}
+
 int main(int argc, char **argv)
 {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s inputfile ratio_list.txt\n", argv[0]);
+    int ranges_only = 0;//1なら分割ファイルを作らず範囲表だけを出力
+    int serial = 0;//1なら従来の逐次コピー
+    int jobs = DEF_SPLIT_JOBS;//並列分割のスレッド数
+    const char *packname = NULL;//NULLでなければ全パートをこの1ファイルにまとめる
+    int opt;
+    while ((opt = getopt(argc, argv, "rsj:p:")) != -1) {
+        switch (opt) {
+        case 'p':
+            packname = optarg;
+            break;
+        case 'r':
+            ranges_only = 1;
+            break;
+        case 's':
+            serial = 1;
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            if (jobs < 1) jobs = 1;
+            break;
+        default:
+            return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "Usage: %s [-r | -p pack_file] [-s] [-j jobs] inputfile ratio_list.txt\n", argv[0]);
+        fprintf(stderr, "  -r       print the range table (part offset length) instead of writing part files\n");
+        fprintf(stderr, "  -p pack  write all parts into one indexed file instead of N.txt (send.out -k)\n");
+        fprintf(stderr, "  -s       write parts one after another with fread/fwrite\n");
+        fprintf(stderr, "  -j jobs  number of parts written in parallel (default %d)\n", DEF_SPLIT_JOBS);
+        return 1;
+    }
+    if (packname != NULL && ranges_only) {
+        fprintf(stderr, "-p and -r cannot be combined\n");
         return 1;
     }
-    const char *infile = argv[1];//分割するファイル名
-    const char *ratiofile = argv[2];//比率ファイル名
+    if (packname != NULL && serial) jobs = 1;   /* 逐次でもパックは位置を指定して書く */
+    const char *infile = argv[optind];//分割するファイル名
+    const char *ratiofile = argv[optind + 1];//比率ファイル名
 
     /* 入力ファイルを開きサイズを求める */
     FILE *inf = fopen(infile, "rb");
@@ -224,8 +506,12 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    /* 分割ファイルを書き出す */
-    int rc = split_file(inf, want, parts);
+    /* 分割ファイル (または範囲表) を書き出す */
+    int rc;
+    if (ranges_only) rc = write_ranges(stdout, want, parts);
+    else if (packname != NULL) rc = split_file_pack(inf, want, parts, jobs, packname);
+    else if (serial) rc = split_file(inf, want, parts);
+    else rc = split_file_parallel(inf, want, parts, jobs, NULL, -1);
 
     free(weights);
     free(want);
@@ -0,0 +1,410 @@
+/* -*- mode: c; coding: utf-8-unix; ##: nil; -*-                    */
+/*                                                                  */
+/*  FILENAME     :  icslab2_cdc.h                                   */
+/*  DESCRIPTION  :  Content-defined chunking and chunk index        */
+/*                                                                  */
+/*-------------------------- <include>  ----------------------------*/
+
+#ifndef ICSLAB2_CDC_H
+#define ICSLAB2_CDC_H
+
+#include "icslab2_net.h"
+#include "icslab2_crc32c.h"
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/*-------------------------- <define>   ----------------------------*/
+/* 内容で切れ目を決めるチャンク分割 (重複排除 send.out -s / receive.out -D) */
+/* 直前64バイトから求まるギアハッシュ h = (h << 1) + gear[byte] の上位   */
+/* ビットが0になる位置で切る (FastCDC)。途中にバイトが挿入・削除されても， */
+/* その先の切れ目は同じ内容の位置に戻るので，前回とほとんど同じファイル  */
+/* は大部分のチャンクが前回のものと一致する。                             */
+/* 平均より短い間は判定を厳しく (CDC_BITS_S)，長くなったら緩く (CDC_BITS_L) */
+/* して長さを平均の近くに寄せる。CDC_MIN は64以上なので，判定する位置の   */
+/* ハッシュはチャンクの先頭によらない。そこで切れ目の候補はブロックを     */
+/* CDC_LANES 個に分けて並行して (依存の無い計算を交互に並べて) 求め，     */
+/* その後で先頭から長さの条件に合う候補を選ぶ。                           */
+/* チャンクは (長さ, CRC32C, 64ビットハッシュ) で見分ける                 */
+#define CDC_MIN             (16 * 1024)
+#define CDC_AVG             (64 * 1024)
+#define CDC_MAX             (256 * 1024)
+#define CDC_BITS_S          18              /* 平均より短い間に見る上位ビット数 */
+#define CDC_BITS_L          14              /* 平均を超えてから見る上位ビット数 */
+#define CDC_LANES           4               /* cdc_candidates は4本に合わせて書いてある */
+#define CDC_BLOCK           (1024 * 1024)   /* 候補をまとめて求める単位 */
+#define CDC_REC_LEN         16              /* 一覧の1チャンク: u32 長さ，u32 CRC32C，u64 ハッシュ */
+
+/* チャンクの一覧はファイルの横に "<ファイル>.cdc" として残し，ファイルの */
+/* サイズと更新時刻が同じなら次回は読み直さずに使う                       */
+/*   "FSPCDC1\0"，u64 サイズ，u64 更新時刻 (ns)，u64 チャンク数，一覧     */
+#define CDC_INDEX_SUFFIX    ".cdc"
+#define CDC_INDEX_MAGIC     "FSPCDC1"
+#define CDC_INDEX_HDR_LEN   32
+
+typedef struct {
+    uint64_t off;           /* ファイル内の位置 (一覧の長さを足したもの) */
+    uint32_t len;
+    uint32_t crc;           /* CRC32C */
+    uint64_t hash;          /* 64ビットハッシュ (xxHash64) */
+} cdc_chunk_t;
+
+typedef struct {
+    cdc_chunk_t *c;
+    size_t n, cap;
+    uint64_t size;          /* 全チャンクの長さの合計 */
+} cdc_list_t;
+
+static uint64_t cdc_gear[256];
+static pthread_once_t cdc_once = PTHREAD_ONCE_INIT;
+
+/* ギアハッシュの表 (送信側と受信側で同じになるよう固定の種から作る) */
+static inline void cdc_init(void)
+{
+    uint64_t x = 0x46535043444331ULL;   /* "FSPCDC1" */
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);     /* splitmix64 */
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        cdc_gear[i] = z ^ (z >> 31);
+    }
+}
+
+static inline uint64_t cdc_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t cdc_read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return le64toh(v);
+}
+
+static inline uint64_t cdc_round(uint64_t acc, uint64_t in)
+{
+    acc += in * 14029467366897019727ULL;
+    return cdc_rotl(acc, 31) * 11400714785074694791ULL;
+}
+
+static inline uint64_t cdc_merge(uint64_t h, uint64_t v)
+{
+    h ^= cdc_round(0, v);
+    return h * 11400714785074694791ULL + 9650029242287828579ULL;
+}
+
+/* xxHash64 (種0)。32バイトごとに4本の独立した累積値で回す */
+static inline uint64_t cdc_hash64(const uint8_t *p, size_t len)
+{
+    const uint64_t P1 = 11400714785074694791ULL, P2 = 14029467366897019727ULL;
+    const uint64_t P3 = 1609587929392839161ULL, P4 = 9650029242287828579ULL;
+    const uint64_t P5 = 2870177450012600261ULL;
+    const uint8_t *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = P1 + P2, v2 = P2, v3 = 0, v4 = 0 - P1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = cdc_round(v1, cdc_read64(p));
+            v2 = cdc_round(v2, cdc_read64(p + 8));
+            v3 = cdc_round(v3, cdc_read64(p + 16));
+            v4 = cdc_round(v4, cdc_read64(p + 24));
+        }
+        h = cdc_rotl(v1, 1) + cdc_rotl(v2, 7) + cdc_rotl(v3, 12) + cdc_rotl(v4, 18);
+        h = cdc_merge(h, v1);
+        h = cdc_merge(h, v2);
+        h = cdc_merge(h, v3);
+        h = cdc_merge(h, v4);
+    } else {
+        h = P5;
+    }
+    h += len;
+    for (; p + 8 <= end; p += 8) {
+        h ^= cdc_round(0, cdc_read64(p));
+        h = cdc_rotl(h, 27) * P1 + P4;
+    }
+    if (p + 4 <= end) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        h ^= (uint64_t)le32toh(v) * P1;
+        h = cdc_rotl(h, 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * P5;
+        h = cdc_rotl(h, 11) * P1;
+    }
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline int cdc_add(cdc_list_t *l, const uint8_t *p, uint64_t off, uint32_t len)
+{
+    cdc_chunk_t *c;
+
+    if (l->n == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 1024;
+        cdc_chunk_t *tmp = realloc(l->c, sizeof(cdc_chunk_t) * cap);
+        if (tmp == NULL) return -1;
+        l->c = tmp;
+        l->cap = cap;
+    }
+    c = &l->c[l->n++];
+    c->off = off;
+    c->len = len;
+    c->crc = p != NULL ? crc32c(0, p + off, len) : 0;
+    c->hash = p != NULL ? cdc_hash64(p + off, len) : 0;
+    l->size = off + len;
+    return 0;
+}
+
+/* p[b0, b1) のうち切れ目の候補 (そこまでを1チャンクにできる位置の次) を */
+/* cand に昇順で入れ，数を返す。候補は (b0 からの位置 << 1) | 厳しい判定 */
+/* にも通るか。lanes[k] は CDC_BLOCK / CDC_LANES 要素の作業領域          */
+static inline size_t cdc_candidates(const uint8_t *p, uint64_t b0, uint64_t b1,
+                                    uint32_t *cand, uint32_t *lanes[CDC_LANES])
+{
+    const uint64_t lim_l = 1ULL << (64 - CDC_BITS_L);
+    const uint64_t mask_s = ~0ULL << (64 - CDC_BITS_S);
+    uint64_t seg = (b1 - b0 + CDC_LANES - 1) / CDC_LANES;
+    uint64_t pos[CDC_LANES], end[CDC_LANES], h[CDC_LANES];
+    size_t n[CDC_LANES], total = 0;
+    uint64_t common = seg;      /* 4本とも残っている長さ */
+    int k;
+
+    pthread_once(&cdc_once, cdc_init);
+    for (k = 0; k < CDC_LANES; k++) {
+        uint64_t s = b0 + k * seg < b1 ? b0 + k * seg : b1;
+        uint64_t w = s >= 63 ? s - 63 : 0;
+        pos[k] = s;
+        end[k] = s + seg < b1 ? s + seg : b1;
+        if (end[k] - s < common) common = end[k] - s;
+        n[k] = 0;
+        /* 直前63バイトでハッシュを温める (これで位置 s の値はファイル先頭からと同じ) */
+        for (h[k] = 0; w < s; w++) h[k] = (h[k] << 1) + cdc_gear[p[w]];
+    }
+    /* 4本の列は互いに依存しないので，交互に回すとCPUが重ねて実行する。 */
+    /* 候補は平均 2^CDC_BITS_L バイトに1回なので，記録はまとめて判定する */
+    {
+        const uint8_t *q0 = p + pos[0], *q1 = p + pos[1], *q2 = p + pos[2], *q3 = p + pos[3];
+        uint64_t h0 = h[0], h1 = h[1], h2 = h[2], h3 = h[3];
+        uint64_t i;
+        for (i = 0; i < common; i++) {
+            h0 = (h0 << 1) + cdc_gear[q0[i]];
+            h1 = (h1 << 1) + cdc_gear[q1[i]];
+            h2 = (h2 << 1) + cdc_gear[q2[i]];
+            h3 = (h3 << 1) + cdc_gear[q3[i]];
+            if (__builtin_expect((h0 < lim_l) | (h1 < lim_l) | (h2 < lim_l) | (h3 < lim_l), 0)) {
+                const uint64_t hs[CDC_LANES] = { h0, h1, h2, h3 };
+                for (k = 0; k < CDC_LANES; k++) {
+                    if (hs[k] < lim_l) {
+                        lanes[k][n[k]++] = (uint32_t)((pos[k] + i + 1 - b0) << 1) | ((hs[k] & mask_s) == 0);
+                    }
+                }
+            }
+        }
+        h[0] = h0; h[1] = h1; h[2] = h2; h[3] = h3;
+        for (k = 0; k < CDC_LANES; k++) pos[k] += common;
+    }
+    for (k = 0; k < CDC_LANES; k++) {
+        for (; pos[k] < end[k]; pos[k]++) {
+            h[k] = (h[k] << 1) + cdc_gear[p[pos[k]]];
+            if (h[k] < lim_l) lanes[k][n[k]++] = (uint32_t)((pos[k] + 1 - b0) << 1) | ((h[k] & mask_s) == 0);
+        }
+        memcpy(cand + total, lanes[k], sizeof(uint32_t) * n[k]);
+        total += n[k];
+    }
+    return total;
+}
+
+/* p[0, size) をチャンクに切って l に入れる。メモリが足りなければ-1 */
+static inline int cdc_split(const uint8_t *p, uint64_t size, cdc_list_t *l)
+{
+    uint32_t *cand = malloc(sizeof(uint32_t) * (CDC_BLOCK + CDC_LANES));
+    uint32_t *lanes[CDC_LANES];
+    uint64_t start = 0, b0;
+    int k, rc = 0;
+
+    memset(l, 0, sizeof(*l));
+    for (k = 0; k < CDC_LANES; k++) lanes[k] = malloc(sizeof(uint32_t) * (CDC_BLOCK / CDC_LANES + 1));
+    for (k = 0; k < CDC_LANES; k++) {
+        if (lanes[k] == NULL) rc = -1;
+    }
+    if (cand == NULL) rc = -1;
+
+    for (b0 = 0; rc == 0 && b0 < size; b0 += CDC_BLOCK) {
+        uint64_t b1 = size - b0 < CDC_BLOCK ? size : b0 + CDC_BLOCK;
+        size_t i, n = cdc_candidates(p, b0, b1, cand, lanes);
+
+        for (i = 0; rc == 0 && i < n; i++) {
+            uint64_t cut = b0 + (cand[i] >> 1);
+            /* 候補の無いまま最大長を超えたら最大長で切る */
+            while (rc == 0 && cut - start > CDC_MAX) {
+                rc = cdc_add(l, p, start, CDC_MAX);
+                start += CDC_MAX;
+            }
+            if (cut - start < CDC_MIN || (cut - start < CDC_AVG && !(cand[i] & 1))) continue;
+            if (rc == 0) rc = cdc_add(l, p, start, (uint32_t)(cut - start));
+            start = cut;
+        }
+    }
+    while (rc == 0 && start < size) {
+        uint32_t len = size - start > CDC_MAX ? CDC_MAX : (uint32_t)(size - start);
+        rc = cdc_add(l, p, start, len);
+        start += len;
+    }
+    for (k = 0; k < CDC_LANES; k++) free(lanes[k]);
+    free(cand);
+    return rc;
+}
+
+static inline void cdc_free(cdc_list_t *l)
+{
+    free(l->c);
+    memset(l, 0, sizeof(*l));
+}
+
+/* 一覧を (長さ, CRC32C, ハッシュ) の並びにする (free で解放) */
+static inline unsigned char *cdc_pack(const cdc_list_t *l, size_t *len)
+{
+    unsigned char *buf = malloc(l->n * CDC_REC_LEN + 1), *p;
+    size_t i;
+
+    if (buf == NULL) return NULL;
+    for (i = 0, p = buf; i < l->n; i++, p += CDC_REC_LEN) {
+        uint32_t u32 = htonl(l->c[i].len);
+        uint64_t u64 = htobe64(l->c[i].hash);
+        memcpy(p, &u32, 4);
+        u32 = htonl(l->c[i].crc);
+        memcpy(p + 4, &u32, 4);
+        memcpy(p + 8, &u64, 8);
+    }
+    *len = l->n * CDC_REC_LEN;
+    return buf;
+}
+
+/* cdc_pack の並びを読む。位置は長さを先頭から足していく */
+static inline int cdc_unpack(cdc_list_t *l, const unsigned char *p, size_t len)
+{
+    uint64_t off = 0;
+    size_t i;
+
+    memset(l, 0, sizeof(*l));
+    if (len % CDC_REC_LEN != 0) {
+        errno = EPROTO;
+        return -1;
+    }
+    l->n = l->cap = len / CDC_REC_LEN;
+    if ((l->c = malloc(sizeof(cdc_chunk_t) * (l->n + 1))) == NULL) return -1;
+    for (i = 0; i < l->n; i++, p += CDC_REC_LEN) {
+        uint32_t u32;
+        uint64_t u64;
+        memcpy(&u32, p, 4);
+        l->c[i].len = ntohl(u32);
+        memcpy(&u32, p + 4, 4);
+        l->c[i].crc = ntohl(u32);
+        memcpy(&u64, p + 8, 8);
+        l->c[i].hash = be64toh(u64);
+        l->c[i].off = off;
+        off += l->c[i].len;
+    }
+    l->size = off;
+    return 0;
+}
+
+static inline uint64_t cdc_mtime_ns(const struct stat *st)
+{
+    return (uint64_t)st->st_mtim.tv_sec * 1000000000ULL + (uint64_t)st->st_mtim.tv_nsec;
+}
+
+/* "<path>.cdc" を読む。無いか，st のファイルと合わなければ-1 */
+static inline int cdc_index_load(const char *path, const struct stat *st, cdc_list_t *l)
+{
+    unsigned char hdr[CDC_INDEX_HDR_LEN], *buf = NULL;
+    char name[4096];
+    uint64_t u64[3];
+    size_t len;
+    int fd, rc = -1;
+
+    snprintf(name, sizeof(name), "%s%s", path, CDC_INDEX_SUFFIX);
+    if ((fd = open(name, O_RDONLY)) < 0) return -1;
+    if (read_all(fd, hdr, sizeof(hdr)) < 0 || memcmp(hdr, CDC_INDEX_MAGIC, 8) != 0) goto out;
+    memcpy(u64, hdr + 8, sizeof(u64));
+    if (be64toh(u64[0]) != (uint64_t)st->st_size || be64toh(u64[1]) != cdc_mtime_ns(st) ||
+        be64toh(u64[2]) > (uint64_t)st->st_size / CDC_MIN + 1) {
+        goto out;   /* 一覧を作った後でファイルが変わった */
+    }
+    len = (size_t)be64toh(u64[2]) * CDC_REC_LEN;
+    if ((buf = malloc(len + 1)) == NULL || read_all(fd, buf, len) < 0) goto out;
+    if (cdc_unpack(l, buf, len) == 0) {
+        if (l->size == (uint64_t)st->st_size) rc = 0;
+        else cdc_free(l);
+    }
+out:
+    free(buf);
+    close(fd);
+    return rc;
+}
+
+/* 一覧を "<path>.cdc" に書く (書き終えてから置き換える) */
+static inline int cdc_index_save(const char *path, const struct stat *st, const cdc_list_t *l)
+{
+    unsigned char hdr[CDC_INDEX_HDR_LEN], *buf;
+    char name[4096], tmp[4096 + 8];
+    uint64_t u64[3];
+    size_t len;
+    int fd, rc;
+
+    if ((buf = cdc_pack(l, &len)) == NULL) return -1;
+    snprintf(name, sizeof(name), "%s%s", path, CDC_INDEX_SUFFIX);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, CDC_INDEX_MAGIC, 8);
+    u64[0] = htobe64((uint64_t)st->st_size);
+    u64[1] = htobe64(cdc_mtime_ns(st));
+    u64[2] = htobe64((uint64_t)l->n);
+    memcpy(hdr + 8, u64, sizeof(u64));
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        free(buf);
+        return -1;
+    }
+    rc = write_all(fd, hdr, sizeof(hdr)) < 0 || write_all(fd, buf, len) < 0 ? -1 : 0;
+    free(buf);
+    if (close(fd) < 0) rc = -1;
+    if (rc == 0) rc = rename(tmp, name);
+    if (rc < 0) unlink(tmp);
+    return rc;
+}
+
+/* 開いたファイル fd (パス path) のチャンク一覧を得る。残っている一覧が */
+/* 使えればそれを読み，無ければファイルを切って一覧を残しておく。        */
+/* 切り直したら1，読んだら0，失敗なら-1                                  */
+static inline int cdc_index(const char *path, int fd, cdc_list_t *l)
+{
+    struct stat st;
+    void *m = NULL;
+
+    if (fstat(fd, &st) < 0) return -1;
+    if (cdc_index_load(path, &st, l) == 0) return 0;
+    if (st.st_size > 0) {
+        m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (m == MAP_FAILED) return -1;
+        madvise(m, (size_t)st.st_size, MADV_SEQUENTIAL);
+    }
+    if (cdc_split(m, (uint64_t)st.st_size, l) < 0) {
+        if (m != NULL) munmap(m, (size_t)st.st_size);
+        cdc_free(l);
+        return -1;
+    }
+    if (m != NULL) munmap(m, (size_t)st.st_size);
+    cdc_index_save(path, &st, l);   /* 書けなくても (読み取り専用の場所など) 今回は使える */
+    return 1;
+}
+
+#endif
@@ -0,0 +1,205 @@
+/* -*- mode: c; coding: utf-8-unix; ##: nil; -*-                    */
+/*                                                                  */
+/*  FILENAME     :  icslab2_crc32c.h                                */
+/*  DESCRIPTION  :  CRC32C (Castagnoli) checksum                    */
+/*                                                                  */
+/*-------------------------- <include>  ----------------------------*/
+
+#ifndef ICSLAB2_CRC32C_H
+#define ICSLAB2_CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>          /* _mm_crc32_u64 (SSE4.2) */
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>           /* __crc32cd (ARMv8 CRC拡張) */
+#endif
+
+/*-------------------------- <define>   ----------------------------*/
+/* チャンクごとのチェックサムと，それを並べて得るファイル全体の値    */
+/* crc32c(crc, buf, len) は続けて呼べる:                            */
+/*   crc32c(crc32c(0, a, n), b, m) == a と b を連結したもののCRC   */
+/* crc32c_combine() で，別々に求めた2つの範囲のCRCをデータを読まず */
+/* に連結できる (経路ごとに順不同で届くチャンクの集計に使う)        */
+#define CRC32C_POLY     0x82f63b78u     /* 反転表現の生成多項式 */
+#define CRC32C_LANE     4096            /* 命令を3列並べて計算する単位 */
+
+static uint32_t crc32c_table[8][256];   /* ソフトウェア実装用 (slice-by-8) */
+static uint32_t crc32c_x2n[32];         /* x^(2^k) mod P (combine用) */
+static uint32_t crc32c_lane_shift;      /* x^(8 * CRC32C_LANE) mod P */
+static int crc32c_hw;                   /* CPUのCRC命令を使えるか */
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/* a(x) * b(x) mod P (zlibのmultmodpと同じ) */
+static inline uint32_t crc32c_multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t m = 1u << 31, p = 0;
+
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+/* x^(8 * n) mod P (nバイト分ずらすための係数) */
+static inline uint32_t crc32c_x8n(uint64_t n)
+{
+    uint32_t p = 1u << 31;      /* x^0 */
+    int k = 3;                  /* 1バイト = x^8 なので 2^3 から */
+
+    while (n > 0) {
+        if (n & 1) p = crc32c_multmodp(crc32c_x2n[k & 31], p);
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+static inline void crc32c_init(void)
+{
+    uint32_t c, p;
+    int i, k;
+
+    for (i = 0; i < 256; i++) {
+        c = (uint32_t)i;
+        for (k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc32c_table[0][i] = c;
+    }
+    for (i = 0; i < 256; i++) {
+        c = crc32c_table[0][i];
+        for (k = 1; k < 8; k++) {
+            c = crc32c_table[0][c & 0xff] ^ (c >> 8);
+            crc32c_table[k][i] = c;
+        }
+    }
+
+    p = 1u << 30;               /* x^1 */
+    crc32c_x2n[0] = p;
+    for (k = 1; k < 32; k++) crc32c_x2n[k] = p = crc32c_multmodp(p, p);
+    crc32c_lane_shift = crc32c_x8n(CRC32C_LANE);
+
+#if defined(__x86_64__)
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    crc32c_hw = 1;
+#endif
+}
+
+/* テーブル引き (8バイトずつ) */
+static inline uint32_t crc32c_sw(uint32_t c, const unsigned char *p, size_t len)
+{
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        c = crc32c_table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        w ^= c;     /* リトルエンディアンを前提とする */
+        c = crc32c_table[7][w & 0xff] ^
+            crc32c_table[6][(w >> 8) & 0xff] ^
+            crc32c_table[5][(w >> 16) & 0xff] ^
+            crc32c_table[4][(w >> 24) & 0xff] ^
+            crc32c_table[3][(w >> 32) & 0xff] ^
+            crc32c_table[2][(w >> 40) & 0xff] ^
+            crc32c_table[1][(w >> 48) & 0xff] ^
+            crc32c_table[0][w >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        c = crc32c_table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+        len--;
+    }
+    return c;
+}
+
+#if defined(__x86_64__)
+/* SSE4.2 のcrc32命令。-msse4.2 なしでもこの関数だけ命令を使えるようにする */
+/* crc32命令は遅延が3サイクルあるので，3つの区間を並べて計算してから */
+/* crc32c_multmodp() でつなぐ (1列だけだと命令の遅延で頭打ちになる)  */
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32c_hw_update(uint32_t c, const unsigned char *p, size_t len)
+{
+    uint64_t c64 = c;
+
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        c64 = _mm_crc32_u8((uint32_t)c64, *p++);
+        len--;
+    }
+    while (len >= 3 * CRC32C_LANE) {
+        uint64_t c1 = 0, c2 = 0, w0, w1, w2;
+        size_t i;
+        for (i = 0; i < CRC32C_LANE; i += 8) {
+            memcpy(&w0, p + i, 8);
+            memcpy(&w1, p + CRC32C_LANE + i, 8);
+            memcpy(&w2, p + 2 * CRC32C_LANE + i, 8);
+            c64 = _mm_crc32_u64(c64, w0);
+            c1 = _mm_crc32_u64(c1, w1);
+            c2 = _mm_crc32_u64(c2, w2);
+        }
+        c64 = crc32c_multmodp(crc32c_lane_shift, (uint32_t)c64) ^ (uint32_t)c1;
+        c64 = crc32c_multmodp(crc32c_lane_shift, (uint32_t)c64) ^ (uint32_t)c2;
+        p += 3 * CRC32C_LANE;
+        len -= 3 * CRC32C_LANE;
+    }
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c64 = _mm_crc32_u64(c64, w);
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        c64 = _mm_crc32_u8((uint32_t)c64, *p++);
+        len--;
+    }
+    return (uint32_t)c64;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static inline uint32_t crc32c_hw_update(uint32_t c, const unsigned char *p, size_t len)
+{
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c = __crc32cd(c, w);
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        c = __crc32cb(c, *p++);
+        len--;
+    }
+    return c;
+}
+#endif
+
+/* crc に続けて buf の len バイトを加えたCRC32Cを返す (最初は crc = 0) */
+static inline uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    uint32_t c = ~crc;
+
+    pthread_once(&crc32c_once, crc32c_init);
+#if defined(__x86_64__) || (defined(__aarch64__) && defined(__ARM_FEATURE_CRC32))
+    if (crc32c_hw) return ~crc32c_hw_update(c, buf, len);
+#endif
+    return ~crc32c_sw(c, buf, len);
+}
+
+/* crc1 (前半) と crc2 (長さ len2 の後半) から連結したデータのCRCを求める */
+static inline uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_multmodp(crc32c_x8n(len2), crc1) ^ crc2;
+}
+
+#endif
@@ -0,0 +1,286 @@
+/* -*- mode: c; coding: utf-8-unix; ##: nil; -*-                    */
+/*                                                                  */
+/*  FILENAME     :  icslab2_metrics.h                               */
+/*  DESCRIPTION  :  Lock-free metrics registry, Prometheus endpoint */
+/*                                                                  */
+/*-------------------------- <include>  ----------------------------*/
+
+#ifndef ICSLAB2_METRICS_H
+#define ICSLAB2_METRICS_H
+
+#include "icslab2_net.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/un.h>
+
+/*-------------------------- <define>   ----------------------------*/
+/* 動作中の計測値 (send.out / rooter.out / receive.out の -M)         */
+/* 計測値はプロセスに1つの表に登録する。登録は空いている行を原子的に  */
+/* 取って埋め，埋め終えてから公開するので，読む側は埋めかけの行を見な */
+/* い。値の更新は原子的な加算・代入だけで，ロックを取らない。        */
+/* 既存のカウンタ (経路の累積バイト数など) は場所を登録して読むときに */
+/* 値を取るので，送受信の処理に手を加えずに載せられる。              */
+/* -M [host:]port か -M unix:/path でHTTPを待ち受け，GETに表全体を    */
+/* Prometheusのテキスト形式で返す (パスは問わない)                    */
+#define METRICS_MAX         512             /* 登録できる行の数 (溢れた分は黙って捨てる) */
+#define METRICS_NAME_LEN    64
+#define METRICS_LABEL_LEN   96
+#define METRICS_REQ_LEN     4096            /* 読むリクエストの上限 (中身は見ない) */
+#define METRICS_REQ_MS      1000            /* リクエストを待つ時間 */
+
+enum { METRIC_COUNTER, METRIC_GAUGE };
+enum { METRIC_OWN, METRIC_U64, METRIC_INT };    /* 値の置き場所 */
+
+typedef struct {
+    char name[METRICS_NAME_LEN];
+    char labels[METRICS_LABEL_LEN];     /* path="lo" など (空ならラベル無し) */
+    const char *help;
+    int type;
+    int src;                            /* METRIC_OWN なら value，それ以外は ptr の先 */
+    const void *ptr;
+    double scale;                       /* 0でなければ値に掛けて小数で出す (ns -> 秒など) */
+    int64_t value;
+    int ready;                          /* 埋め終えた (読んでよい) */
+} metric_t;
+
+static struct {
+    metric_t m[METRICS_MAX];
+    int n;                              /* 取った行の数 (METRICS_MAX を超えることがある) */
+    int fd;                             /* 待ち受けソケット (-1 = 出していない) */
+    pthread_t th;
+} metrics = { .fd = -1 };
+
+/* 行を取って埋める。表が一杯なら NULL (更新の関数は NULL を無視する) */
+static inline metric_t *metric_register(const char *name, int type, const char *help, int src,
+                                        const void *ptr, const char *labels_fmt, va_list ap)
+{
+    int i = __atomic_fetch_add(&metrics.n, 1, __ATOMIC_RELAXED);
+    metric_t *m;
+
+    if (i >= METRICS_MAX) return NULL;
+    m = &metrics.m[i];
+    snprintf(m->name, sizeof(m->name), "%s", name);
+    if (labels_fmt != NULL) vsnprintf(m->labels, sizeof(m->labels), labels_fmt, ap);
+    m->help = help;
+    m->type = type;
+    m->src = src;
+    m->ptr = ptr;
+    __atomic_store_n(&m->ready, 1, __ATOMIC_RELEASE);
+    return m;
+}
+
+/* 自分で値を持つ行 (metric_add / metric_set で更新する) */
+static inline metric_t *metric_new(const char *name, int type, const char *help,
+                                   const char *labels_fmt, ...)
+{
+    metric_t *m;
+    va_list ap;
+
+    va_start(ap, labels_fmt);
+    m = metric_register(name, type, help, METRIC_OWN, NULL, labels_fmt, ap);
+    va_end(ap);
+    return m;
+}
+
+/* 既にある uint64_t / int の場所を読む行 */
+static inline metric_t *metric_watch_u64(const char *name, int type, const char *help,
+                                         const uint64_t *p, const char *labels_fmt, ...)
+{
+    metric_t *m;
+    va_list ap;
+
+    va_start(ap, labels_fmt);
+    m = metric_register(name, type, help, METRIC_U64, p, labels_fmt, ap);
+    va_end(ap);
+    return m;
+}
+
+static inline metric_t *metric_watch_int(const char *name, int type, const char *help,
+                                         const int *p, const char *labels_fmt, ...)
+{
+    metric_t *m;
+    va_list ap;
+
+    va_start(ap, labels_fmt);
+    m = metric_register(name, type, help, METRIC_INT, p, labels_fmt, ap);
+    va_end(ap);
+    return m;
+}
+
+/* 値に掛ける倍率 (ns で数えて秒で出すなど) */
+static inline metric_t *metric_scaled(metric_t *m, double scale)
+{
+    if (m != NULL) m->scale = scale;
+    return m;
+}
+
+static inline void metric_add(metric_t *m, int64_t n)
+{
+    if (m != NULL) __atomic_fetch_add(&m->value, n, __ATOMIC_RELAXED);
+}
+
+static inline void metric_set(metric_t *m, int64_t v)
+{
+    if (m != NULL) __atomic_store_n(&m->value, v, __ATOMIC_RELAXED);
+}
+
+static inline int64_t metric_read(const metric_t *m)
+{
+    switch (m->src) {
+    case METRIC_U64: return (int64_t)__atomic_load_n((const uint64_t *)m->ptr, __ATOMIC_RELAXED);
+    case METRIC_INT: return __atomic_load_n((const int *)m->ptr, __ATOMIC_RELAXED);
+    default:         return __atomic_load_n(&m->value, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void metric_print(FILE *out, const metric_t *m)
+{
+    int64_t v = metric_read(m);
+
+    fprintf(out, "%s", m->name);
+    if (m->labels[0] != '\0') fprintf(out, "{%s}", m->labels);
+    if (m->scale != 0) fprintf(out, " %.9g\n", (double)v * m->scale);
+    else fprintf(out, " %lld\n", (long long)v);
+}
+
+/* 表全体をテキスト形式にする (free で解放)。同じ名前の行は最初の行の */
+/* 位置にまとめ，HELP と TYPE を1回だけ付ける                         */
+static inline char *metrics_render(size_t *len)
+{
+    int n = __atomic_load_n(&metrics.n, __ATOMIC_RELAXED), i, j;
+    char *buf = NULL;
+    FILE *out;
+
+    if (n > METRICS_MAX) n = METRICS_MAX;
+    if ((out = open_memstream(&buf, len)) == NULL) return NULL;
+    for (i = 0; i < n; i++) {
+        const metric_t *m = &metrics.m[i];
+        if (!__atomic_load_n(&m->ready, __ATOMIC_ACQUIRE)) continue;
+        for (j = 0; j < i; j++) {
+            if (__atomic_load_n(&metrics.m[j].ready, __ATOMIC_ACQUIRE) &&
+                strcmp(metrics.m[j].name, m->name) == 0) break;
+        }
+        if (j < i) continue;    /* 前の行と一緒に出した */
+        fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", m->name, m->help, m->name,
+                m->type == METRIC_COUNTER ? "counter" : "gauge");
+        for (j = i; j < n; j++) {
+            const metric_t *o = &metrics.m[j];
+            if (__atomic_load_n(&o->ready, __ATOMIC_ACQUIRE) && strcmp(o->name, m->name) == 0) {
+                metric_print(out, o);
+            }
+        }
+    }
+    fclose(out);
+    return buf;
+}
+
+/* 読み手が先に閉じても SIGPIPE で落ちないように send で書く */
+static inline int metrics_send(int sock, const char *p, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* 1つの接続に答える: リクエストを (中身は見ずに) 読んでから表を返す */
+static inline void metrics_answer(int sock)
+{
+    char req[METRICS_REQ_LEN], hdr[256];
+    struct pollfd pfd = { sock, POLLIN, 0 };
+    size_t got = 0, len = 0;
+    char *body;
+    int hl;
+
+    while (got < sizeof(req) - 1 && poll(&pfd, 1, METRICS_REQ_MS) > 0) {
+        ssize_t n = read(sock, req + got, sizeof(req) - 1 - got);
+        if (n <= 0) break;
+        got += (size_t)n;
+        req[got] = '\0';
+        if (strstr(req, "\r\n\r\n") != NULL || strstr(req, "\n\n") != NULL) break;
+    }
+    if (got < 4 || strncmp(req, "GET ", 4) != 0) {
+        static const char bad[] = "HTTP/1.0 405 Method Not Allowed\r\nContent-Length: 0\r\n\r\n";
+        metrics_send(sock, bad, sizeof(bad) - 1);
+        return;
+    }
+    if ((body = metrics_render(&len)) == NULL) return;
+    hl = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+                  "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                  "Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+    if (metrics_send(sock, hdr, (size_t)hl) == 0) metrics_send(sock, body, len);
+    free(body);
+}
+
+static inline void *metrics_thread(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        int sock = accept(metrics.fd, NULL, NULL);
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("metrics accept");
+            return NULL;
+        }
+        metrics_answer(sock);
+        close(sock);
+    }
+}
+
+/* spec ("[host:]port" か "unix:/path") で待ち受けて答えるスレッドを起こす */
+static inline int metrics_serve(const char *spec)
+{
+    int yes = 1;
+
+    if (strncmp(spec, "unix:", 5) == 0) {
+        struct sockaddr_un sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        if (strlen(spec + 5) >= sizeof(sa.sun_path)) {
+            fprintf(stderr, "metrics socket path too long: %s\n", spec + 5);
+            return -1;
+        }
+        strcpy(sa.sun_path, spec + 5);
+        unlink(sa.sun_path);    /* 前回の残り */
+        metrics.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (metrics.fd < 0 || bind(metrics.fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) goto fail;
+    } else {
+        struct sockaddr_in sa;
+        const char *colon = strrchr(spec, ':');
+        char host[64] = "127.0.0.1";    /* 既定は手元からだけ */
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        if (colon != NULL) snprintf(host, sizeof(host), "%.*s", (int)(colon - spec), spec);
+        sa.sin_port = htons((uint16_t)atoi(colon != NULL ? colon + 1 : spec));
+        if (inet_pton(AF_INET, host, &sa.sin_addr) != 1) {
+            fprintf(stderr, "bad metrics address: %s\n", spec);
+            return -1;
+        }
+        metrics.fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (metrics.fd >= 0) setsockopt(metrics.fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (metrics.fd < 0 || bind(metrics.fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) goto fail;
+    }
+    if (listen(metrics.fd, 16) < 0 || pthread_create(&metrics.th, NULL, metrics_thread, NULL) != 0) goto fail;
+    pthread_detach(metrics.th);
+    metric_set(metric_new("process_start_time_seconds", METRIC_GAUGE,
+                          "Start time of the process since unix epoch in seconds.", NULL),
+               (int64_t)time(NULL));
+    return 0;
+fail:
+    perror(spec);
+    if (metrics.fd >= 0) close(metrics.fd);
+    metrics.fd = -1;
+    return -1;
+}
+
+#endif
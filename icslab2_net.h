@@ -21,6 +21,9 @@
 #include <arpa/inet.h>
 #include <sys/epoll.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <errno.h>
+#include <endian.h>
 
 /*
 #include <stdio.h>
@@ -47,4 +50,221 @@
 /* バッファ長 */
 #define BUF_LEN             1000
 
+/*-------------------------- <calibration> -------------------------*/
+/* 帯域測定 (send.out -C / receive.out -C) の既定値 */
+#define CALIB_SECONDS       3                       /* 1経路あたりの測定時間 */
+#define CALIB_HISTORY_FILE  "calib_history.txt"     /* 測定履歴 */
+#define CALIB_RATIO_FILE    "splitlist.txt"         /* filesplitが読む比率ファイル */
+#define CALIB_HISTORY_ALPHA 0.5                     /* 履歴の指数移動平均の重み */
+
+/*-------------------------- <frame>    ----------------------------*/
+/* マルチパス転送用のフレーム形式                                   */
+/* 各チャンクの前にヘッダを付け，受信側はoffsetの位置にpwriteする。 */
+/* ヘッダの各フィールドはネットワークバイトオーダで送る。           */
+#define FRAME_MAGIC         0x46535032u     /* "FSP2" */
+#define FRAME_HDR_LEN       32              /* ヘッダのバイト数 */
+#define FRAME_CHUNK_LEN     (1024 * 1024)   /* 1フレームの最大ペイロード */
+
+/* フレーム種別 */
+#define FRAME_FILE          1   /* ファイル情報 (offset = ファイル全体のサイズ) */
+#define FRAME_DATA          2   /* データ (offsetからlengthバイトが続く) */
+#define FRAME_END           3   /* この接続での送信終了 */
+#define FRAME_PROBE         4   /* 帯域測定用 (ペイロードは捨てる) */
+#define FRAME_RESUME        5   /* 受信側 -> 送信側: 接続直後に送る再送範囲の一覧 */
+                                /* (offset = 既知のファイルサイズ，ペイロードは */
+                                /*  (開始位置, 長さ) の u64 の組。組が0個なら全体) */
+#define FRAME_RESUME_MAX    4096    /* RESUMEフレームに載せる範囲の最大数 */
+#define FRAME_STREAMS       6   /* 送信側 -> 受信側: RESUMEへの返事 */
+                                /* (offset = この経路に張るTCP接続の本数) */
+#define MAX_STREAMS         16      /* 1経路あたりのTCP接続の上限 */
+#define FRAME_HELLO         7   /* 受信側 -> 送信側 (UDP): データの宛先を知らせる */
+                                /* (file_id = STREAMSで受け取ったセッション識別子) */
+#define FRAME_POLL          8   /* 送信側 -> 受信側 (TCP): チャンクのデータグラムを送り終えた */
+                                /* (offset = チャンクの先頭，raw_len = 長さ，crc = CRC32C， */
+                                /*  file_id = 最後に送ったデータグラムの通し番号) */
+#define FRAME_NACK          9   /* 受信側 -> 送信側 (TCP): POLLへの返事 (offset = チャンクの先頭， */
+                                /*  ペイロードは欠けている (開始位置, 長さ) の u64 の組。0組なら受信完了) */
+#define FRAME_PARITY        10  /* 消失訂正のパリティ (offset = ストライプの先頭，length = 長さ， */
+                                /*  raw_len = (ストライプのデータチャンク数 << 8) | パリティ番号) */
+#define FRAME_ACK           11  /* 受信側 -> 送信側 (TCP): チャンクを受け取った (offset = 先頭， */
+                                /*  raw_len = 長さ。重複して届いたチャンクにも返す) */
+#define FRAME_MANIFEST      12  /* 送信側 -> 受信側: ディレクトリの一覧 (icslab2_tree.h)。経路の1本目の */
+                                /*  接続でSTREAMSに続けて送る (offset = 全ファイルを並べた長さ， */
+                                /*  raw_len = エントリ数，crc = ペイロードのCRC32C) */
+#define FRAME_EOS           13  /* 送信側 -> 受信側: 長さの分からない入力を読み切った (offset = 全体の */
+                                /*  長さ)。全チャンクを送り終えた接続がENDの前に送る */
+#define FRAME_CDC           14  /* 送信側 -> 受信側: RESUME (FRAME_F_DEDUP) への返事。送信ファイルの */
+                                /*  チャンク一覧 (icslab2_cdc.h，offset = ファイルサイズ，raw_len = */
+                                /*  チャンク数，crc = ペイロードのCRC32C)。受信側は手元にあるチャンク */
+                                /*  を写し，欠けている範囲を改めてRESUMEで送る */
+
+/* フラグ */
+#define FRAME_F_CRC         0x01    /* crc にペイロードのCRC32Cが入っている */
+#define FRAME_F_ZLIB        0x02    /* ペイロードはdeflate(raw)で圧縮されている */
+#define FRAME_F_UDP         0x04    /* STREAMS: この経路のデータはUDPで送る */
+                                    /* (file_id = セッション識別子) */
+#define FRAME_F_FEC         0x08    /* FILE: パリティを付けて送る (raw_len = (k << 8) | m， */
+                                    /*  crc = チャンク長。k チャンクごとに m 個のパリティ) */
+#define FRAME_F_ACK         0x10    /* FILE: 受け取ったチャンクごとにACKを返す (crc = チャンク長) */
+#define FRAME_F_TREE        0x20    /* STREAMS: ディレクトリを送る (続けてMANIFESTが届く) */
+#define FRAME_F_STREAM      0x40    /* FILE: 標準入力などを読みながら送る (offset は0で，長さは */
+                                    /*  EOSで届く) */
+#define FRAME_F_DEDUP       0x80    /* RESUME: 範囲を決める前にチャンク一覧 (FRAME_CDC) を求める */
+
+typedef struct {
+    uint32_t magic;
+    uint8_t  type;
+    uint8_t  flags;
+    uint16_t path_id;       /* 送信側の経路番号 (0 = Node1向け, ...) */
+    uint32_t file_id;       /* ファイル識別子 */
+    uint32_t length;        /* ヘッダに続くペイロード長 */
+    uint64_t offset;        /* 元ファイル内でのバイト位置 */
+    uint32_t crc;           /* 圧縮前のペイロードのCRC32C (FRAME_F_CRC のとき) */
+    uint32_t raw_len;       /* 圧縮前の長さ (FRAME_F_ZLIB のとき，それ以外は0) */
+} frame_hdr_t;
+
+/* ヘッダをバイト列に変換 */
+static inline void frame_hdr_pack(unsigned char *p, const frame_hdr_t *h)
+{
+    uint32_t u32;
+    uint16_t u16;
+    uint64_t u64;
+
+    u32 = htonl(FRAME_MAGIC);   memcpy(p + 0, &u32, 4);
+    p[4] = h->type;
+    p[5] = h->flags;
+    u16 = htons(h->path_id);    memcpy(p + 6, &u16, 2);
+    u32 = htonl(h->file_id);    memcpy(p + 8, &u32, 4);
+    u32 = htonl(h->length);     memcpy(p + 12, &u32, 4);
+    u64 = htobe64(h->offset);   memcpy(p + 16, &u64, 8);
+    u32 = htonl(h->crc);        memcpy(p + 24, &u32, 4);
+    u32 = htonl(h->raw_len);    memcpy(p + 28, &u32, 4);
+}
+
+/* バイト列からヘッダを復元，magicが一致しなければ-1 */
+static inline int frame_hdr_unpack(const unsigned char *p, frame_hdr_t *h)
+{
+    uint32_t u32;
+    uint16_t u16;
+    uint64_t u64;
+
+    memcpy(&u32, p + 0, 4);  h->magic = ntohl(u32);
+    if (h->magic != FRAME_MAGIC) return -1;
+    h->type = p[4];
+    h->flags = p[5];
+    memcpy(&u16, p + 6, 2);  h->path_id = ntohs(u16);
+    memcpy(&u32, p + 8, 4);  h->file_id = ntohl(u32);
+    memcpy(&u32, p + 12, 4); h->length = ntohl(u32);
+    memcpy(&u64, p + 16, 8); h->offset = be64toh(u64);
+    memcpy(&u32, p + 24, 4); h->crc = ntohl(u32);
+    memcpy(&u32, p + 28, 4); h->raw_len = ntohl(u32);
+    return 0;
+}
+
+/*-------------------------- <udp>      ----------------------------*/
+/* UDP経路のデータグラム: フレームヘッダ (DATA) + チャンク情報 + ペイロード */
+/* ヘッダの offset/length/crc はこのデータグラムのペイロードのもの，      */
+/* file_id はセッション識別子，raw_len は経路内で送った順の通し番号。      */
+/* チャンク情報で受信側はPOLLより先に届いたデータグラムからでもチャンクの  */
+/* 受信状態を作れる。通し番号はPOLLに追い越されたデータグラムを待つのに使う */
+#define UDP_HDR_LEN         (FRAME_HDR_LEN + 16)
+#define UDP_SEG_LEN         1424    /* 1データグラムのペイロード (48 + 1424 = 1500 - IP/UDPヘッダ) */
+
+typedef struct {
+    frame_hdr_t h;
+    uint64_t chunk_off;     /* チャンクの先頭 (元ファイル内の位置) */
+    uint32_t chunk_len;
+    uint32_t chunk_crc;     /* チャンク全体のCRC32C */
+} udp_hdr_t;
+
+static inline void udp_hdr_pack(unsigned char *p, const udp_hdr_t *u)
+{
+    uint64_t u64;
+    uint32_t u32;
+
+    frame_hdr_pack(p, &u->h);
+    u64 = htobe64(u->chunk_off);    memcpy(p + FRAME_HDR_LEN, &u64, 8);
+    u32 = htonl(u->chunk_len);      memcpy(p + FRAME_HDR_LEN + 8, &u32, 4);
+    u32 = htonl(u->chunk_crc);      memcpy(p + FRAME_HDR_LEN + 12, &u32, 4);
+}
+
+static inline int udp_hdr_unpack(const unsigned char *p, udp_hdr_t *u)
+{
+    uint64_t u64;
+    uint32_t u32;
+
+    if (frame_hdr_unpack(p, &u->h) < 0) return -1;
+    memcpy(&u64, p + FRAME_HDR_LEN, 8);      u->chunk_off = be64toh(u64);
+    memcpy(&u32, p + FRAME_HDR_LEN + 8, 4);  u->chunk_len = ntohl(u32);
+    memcpy(&u32, p + FRAME_HDR_LEN + 12, 4); u->chunk_crc = ntohl(u32);
+    return 0;
+}
+
+/* read_all / write_all が呼んだ read / write の回数 (計測値 -M 用)。 */
+/* net_count_io を立てたときだけ数える                                  */
+static int net_count_io;
+static uint64_t net_reads, net_writes;
+
+/* lenバイトすべて書き終えるまでwriteを繰り返す (短い書き込み対策) */
+static inline int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (net_count_io) __atomic_fetch_add(&net_writes, 1, __ATOMIC_RELAXED);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* lenバイトすべて読み終えるまでreadを繰り返す。途中で切断されたら-1 */
+static inline int read_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (net_count_io) __atomic_fetch_add(&net_reads, 1, __ATOMIC_RELAXED);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* 組み立て済みのヘッダを送る */
+static inline int send_frame(int sock, const frame_hdr_t *h)
+{
+    unsigned char p[FRAME_HDR_LEN];
+
+    frame_hdr_pack(p, h);
+    return write_all(sock, p, FRAME_HDR_LEN);
+}
+
+/* ヘッダを組み立てて送る */
+static inline int send_frame_hdr(int sock, uint8_t type, uint16_t path_id,
+                                 uint32_t file_id, uint64_t offset, uint32_t length)
+{
+    frame_hdr_t h;
+
+    memset(&h, 0, sizeof(h));
+    h.type = type;
+    h.path_id = path_id;
+    h.file_id = file_id;
+    h.offset = offset;
+    h.length = length;
+    return send_frame(sock, &h);
+}
+
 #endif
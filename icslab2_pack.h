@@ -0,0 +1,192 @@
+/* -*- mode: c; coding: utf-8-unix; ##: nil; -*-                    */
+/*                                                                  */
+/*  FILENAME     :  icslab2_pack.h                                  */
+/*  DESCRIPTION  :  Indexed single-file container of split parts    */
+/*                                                                  */
+/*-------------------------- <include>  ----------------------------*/
+
+#ifndef ICSLAB2_PACK_H
+#define ICSLAB2_PACK_H
+
+#include "icslab2_crc32c.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/stat.h>
+
+/*-------------------------- <define>   ----------------------------*/
+/* パートをまとめた1つのファイル (split.out -p / send.out -k)          */
+/*   ヘッダ (PACK_HDR_LEN)                                           */
+/*   索引: パート1から順に PACK_ENTRY_LEN バイトずつ                 */
+/*   本体: 各パートを PACK_ALIGN の倍数の位置から置く (間は0)        */
+/* 索引の i 番目はパート i + 1 なので，パートは番号から直接引ける。  */
+/* 数値はビッグエンディアン。索引のCRC32Cをヘッダに載せ，ヘッダは    */
+/* 本体を書き終えてから最後に書くので，途中で止まった分割は開けない */
+#define PACK_MAGIC      "FSPPACK1"      /* 8バイト (終端は含まない) */
+#define PACK_HDR_LEN    32              /* magic, n_parts, align, total, index_crc, 予約 */
+#define PACK_ENTRY_LEN  32              /* part, crc, pack_off, src_off, len */
+#define PACK_ALIGN      4096            /* 本体の境界 (ページ，ブロック境界に揃える) */
+
+typedef struct {
+    uint32_t part;          /* パート番号 (1から) */
+    uint32_t crc;           /* 本体のCRC32C */
+    uint64_t pack_off;      /* このファイル内の位置 */
+    uint64_t src_off;       /* 元ファイル内の位置 */
+    uint64_t len;
+} pack_entry_t;
+
+typedef struct {
+    int fd;
+    uint32_t n_parts;
+    uint32_t align;
+    uint64_t total;         /* 元ファイルのサイズ */
+    pack_entry_t *parts;
+} pack_t;
+
+/* パートの長さから各パートの位置を決める。ファイル全体の長さを返す */
+static inline uint64_t pack_layout(pack_t *p, const off_t *lens, int n, uint32_t align)
+{
+    uint64_t pos = PACK_HDR_LEN + (uint64_t)n * PACK_ENTRY_LEN, src = 0;
+    int i;
+
+    p->n_parts = (uint32_t)n;
+    p->align = align;
+    for (i = 0; i < n; i++) {
+        pos = (pos + align - 1) / align * align;
+        p->parts[i].part = (uint32_t)i + 1;
+        p->parts[i].crc = 0;
+        p->parts[i].pack_off = pos;
+        p->parts[i].src_off = src;
+        p->parts[i].len = (uint64_t)lens[i];
+        pos += (uint64_t)lens[i];
+        src += (uint64_t)lens[i];
+    }
+    p->total = src;
+    return pos;
+}
+
+static inline void pack_entry_pack(unsigned char *q, const pack_entry_t *e)
+{
+    uint32_t u32;
+    uint64_t u64;
+
+    u32 = htobe32(e->part);     memcpy(q, &u32, 4);
+    u32 = htobe32(e->crc);      memcpy(q + 4, &u32, 4);
+    u64 = htobe64(e->pack_off); memcpy(q + 8, &u64, 8);
+    u64 = htobe64(e->src_off);  memcpy(q + 16, &u64, 8);
+    u64 = htobe64(e->len);      memcpy(q + 24, &u64, 8);
+}
+
+static inline void pack_entry_unpack(const unsigned char *q, pack_entry_t *e)
+{
+    uint32_t u32;
+    uint64_t u64;
+
+    memcpy(&u32, q, 4);      e->part = be32toh(u32);
+    memcpy(&u32, q + 4, 4);  e->crc = be32toh(u32);
+    memcpy(&u64, q + 8, 8);  e->pack_off = be64toh(u64);
+    memcpy(&u64, q + 16, 8); e->src_off = be64toh(u64);
+    memcpy(&u64, q + 24, 8); e->len = be64toh(u64);
+}
+
+/* ヘッダと索引を fd の先頭に書く (本体を書き終えてから呼ぶ) */
+static inline int pack_write_index(int fd, const pack_t *p)
+{
+    size_t len = PACK_HDR_LEN + (size_t)p->n_parts * PACK_ENTRY_LEN;
+    unsigned char *buf = calloc(1, len);
+    uint32_t u32;
+    uint64_t u64;
+    ssize_t n;
+    uint32_t i;
+
+    if (buf == NULL) return -1;
+    for (i = 0; i < p->n_parts; i++) pack_entry_pack(buf + PACK_HDR_LEN + (size_t)i * PACK_ENTRY_LEN, &p->parts[i]);
+    memcpy(buf, PACK_MAGIC, 8);
+    u32 = htobe32(p->n_parts); memcpy(buf + 8, &u32, 4);
+    u32 = htobe32(p->align);   memcpy(buf + 12, &u32, 4);
+    u64 = htobe64(p->total);   memcpy(buf + 16, &u64, 8);
+    u32 = htobe32(crc32c(0, buf + PACK_HDR_LEN, len - PACK_HDR_LEN));
+    memcpy(buf + 24, &u32, 4);
+    n = pwrite(fd, buf, len, 0);
+    free(buf);
+    if (n != (ssize_t)len) {
+        if (n >= 0) errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static inline void pack_close(pack_t *p)
+{
+    if (p->fd >= 0) close(p->fd);
+    free(p->parts);
+    p->fd = -1;
+    p->parts = NULL;
+}
+
+/* path を開いて索引を読む。形式が違えば errno = EINVAL で -1 */
+static inline int pack_open(const char *path, pack_t *p)
+{
+    unsigned char hdr[PACK_HDR_LEN], *idx = NULL;
+    uint32_t u32, want_crc, i;
+    uint64_t u64, src = 0;
+    struct stat st;
+    size_t len;
+
+    memset(p, 0, sizeof(*p));
+    if ((p->fd = open(path, O_RDONLY)) < 0) return -1;
+    if (fstat(p->fd, &st) < 0) goto fail;
+    if (pread(p->fd, hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) || memcmp(hdr, PACK_MAGIC, 8) != 0) {
+        errno = EINVAL;
+        goto fail;
+    }
+    memcpy(&u32, hdr + 8, 4);  p->n_parts = be32toh(u32);
+    memcpy(&u32, hdr + 12, 4); p->align = be32toh(u32);
+    memcpy(&u64, hdr + 16, 8); p->total = be64toh(u64);
+    memcpy(&u32, hdr + 24, 4); want_crc = be32toh(u32);
+    len = (size_t)p->n_parts * PACK_ENTRY_LEN;
+    if (PACK_HDR_LEN + (uint64_t)len > (uint64_t)st.st_size) {
+        errno = EINVAL;
+        goto fail;
+    }
+    idx = malloc(len ? len : 1);
+    p->parts = malloc(sizeof(pack_entry_t) * (p->n_parts ? p->n_parts : 1));
+    if (idx == NULL || p->parts == NULL) goto fail;
+    if (pread(p->fd, idx, len, PACK_HDR_LEN) != (ssize_t)len || crc32c(0, idx, len) != want_crc) {
+        errno = EINVAL;
+        goto fail;
+    }
+    /* 番号が順に並び，本体がファイルに収まり，元ファイルを隙間なく覆っていること */
+    for (i = 0; i < p->n_parts; i++) {
+        pack_entry_t *e = &p->parts[i];
+        pack_entry_unpack(idx + (size_t)i * PACK_ENTRY_LEN, e);
+        if (e->part != i + 1 || e->src_off != src || e->pack_off < PACK_HDR_LEN + len ||
+            e->pack_off + e->len > (uint64_t)st.st_size) {
+            errno = EINVAL;
+            goto fail;
+        }
+        src += e->len;
+    }
+    if (src != p->total) {
+        errno = EINVAL;
+        goto fail;
+    }
+    free(idx);
+    return 0;
+fail:
+    free(idx);
+    pack_close(p);
+    return -1;
+}
+
+/* パート番号から索引を引く (無ければ NULL) */
+static inline const pack_entry_t *pack_part(const pack_t *p, long part)
+{
+    if (part < 1 || part > (long)p->n_parts) return NULL;
+    return &p->parts[part - 1];
+}
+
+#endif
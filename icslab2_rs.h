@@ -0,0 +1,227 @@
+/* -*- mode: c; coding: utf-8-unix; ##: nil; -*-                    */
+/*                                                                  */
+/*  FILENAME     :  icslab2_rs.h                                    */
+/*  DESCRIPTION  :  Reed-Solomon erasure code over GF(2^8)          */
+/*                                                                  */
+/*-------------------------- <include>  ----------------------------*/
+
+#ifndef ICSLAB2_RS_H
+#define ICSLAB2_RS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <tmmintrin.h>          /* _mm_shuffle_epi8 (SSSE3) */
+#elif defined(__aarch64__)
+#include <arm_neon.h>           /* vqtbl1q_u8 */
+#endif
+
+/*-------------------------- <define>   ----------------------------*/
+/* k個のデータブロックから m個のパリティブロックを作り，k + m 個のうち   */
+/* どの k 個が揃っても元のデータを復元できる (消失訂正)                  */
+/* パリティ j はデータ i に係数 1 / (x_j + y_i) (x_j = 128 + j, y_i = i) */
+/* を掛けて足したもの (コーシー行列)。係数が k や m によらないので，     */
+/* 受信側はパリティの番号だけ分かれば復元できる                          */
+#define RS_POLY         0x11d           /* x^8 + x^4 + x^3 + x^2 + 1 */
+#define RS_MAX_K        32              /* データブロック数の上限 */
+#define RS_MAX_M        16              /* パリティブロック数の上限 */
+
+static uint8_t rs_exp[512];             /* 生成元 2 のべき (2倍の長さで mod 255 を省く) */
+static uint8_t rs_log[256];
+static int rs_simd;                     /* CPUの表引き命令 (pshufb/tbl) を使えるか */
+static pthread_once_t rs_once = PTHREAD_ONCE_INIT;
+
+static inline void rs_init(void)
+{
+    int i, x = 1;
+
+    for (i = 0; i < 255; i++) {
+        rs_exp[i] = rs_exp[i + 255] = (uint8_t)x;
+        rs_log[x] = (uint8_t)i;
+        x <<= 1;
+        if (x & 0x100) x ^= RS_POLY;
+    }
+    rs_exp[510] = rs_exp[0];
+    rs_exp[511] = rs_exp[1];
+
+#if defined(__x86_64__)
+    rs_simd = __builtin_cpu_supports("ssse3");
+#elif defined(__aarch64__)
+    rs_simd = 1;
+#endif
+}
+
+static inline uint8_t rs_mul(uint8_t a, uint8_t b)
+{
+    if (a == 0 || b == 0) return 0;
+    return rs_exp[rs_log[a] + rs_log[b]];
+}
+
+static inline uint8_t rs_inv(uint8_t a)
+{
+    return rs_exp[255 - rs_log[a]];     /* a != 0 */
+}
+
+/* パリティ j がデータ i に掛ける係数 */
+static inline uint8_t rs_coef(int j, int i)
+{
+    pthread_once(&rs_once, rs_init);
+    return rs_inv((uint8_t)((128 + j) ^ i));
+}
+
+#if defined(__x86_64__)
+/* 16バイトずつ: 下位4ビットと上位4ビットの積を16要素の表から引いて足す */
+__attribute__((target("ssse3")))
+static inline size_t rs_mul_add_simd(uint8_t *dst, const uint8_t *src, const uint8_t lo[16],
+                                     const uint8_t hi[16], size_t len)
+{
+    const __m128i tl = _mm_loadu_si128((const __m128i *)lo);
+    const __m128i th = _mm_loadu_si128((const __m128i *)hi);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i l = _mm_and_si128(v, mask);
+        __m128i h = _mm_and_si128(_mm_srli_epi64(v, 4), mask);
+        __m128i r = _mm_xor_si128(_mm_shuffle_epi8(tl, l), _mm_shuffle_epi8(th, h));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, r));
+    }
+    return i;
+}
+#elif defined(__aarch64__)
+static inline size_t rs_mul_add_simd(uint8_t *dst, const uint8_t *src, const uint8_t lo[16],
+                                     const uint8_t hi[16], size_t len)
+{
+    const uint8x16_t tl = vld1q_u8(lo);
+    const uint8x16_t th = vld1q_u8(hi);
+    const uint8x16_t mask = vdupq_n_u8(0x0f);
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8(src + i);
+        uint8x16_t r = veorq_u8(vqtbl1q_u8(tl, vandq_u8(v, mask)), vqtbl1q_u8(th, vshrq_n_u8(v, 4)));
+        vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), r));
+    }
+    return i;
+}
+#endif
+
+/* dst[0..len) ^= c * src[0..len) */
+static inline void rs_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+    size_t i = 0;
+
+    pthread_once(&rs_once, rs_init);
+    if (c == 0) return;
+    if (c == 1) {
+        for (; i < len; i++) dst[i] ^= src[i];
+        return;
+    }
+#if defined(__x86_64__) || defined(__aarch64__)
+    if (rs_simd) {
+        uint8_t lo[16], hi[16];
+        int x;
+        for (x = 0; x < 16; x++) {
+            lo[x] = rs_mul(c, (uint8_t)x);
+            hi[x] = rs_mul(c, (uint8_t)(x << 4));
+        }
+        i = rs_mul_add_simd(dst, src, lo, hi, len);
+    }
+#endif
+    {
+        const uint8_t *e = rs_exp + rs_log[c];
+        for (; i < len; i++) {
+            if (src[i] != 0) dst[i] ^= e[rs_log[src[i]]];
+        }
+    }
+}
+
+/* パリティ j を out[0..len) に作る。data[i] の長さ lens[i] が len より */
+/* 短ければ残りは0とみなす (末尾の短いブロック)                       */
+static inline void rs_encode(uint8_t *out, size_t len, const uint8_t *const *data,
+                             const size_t *lens, int k, int j)
+{
+    int i;
+
+    memset(out, 0, len);
+    for (i = 0; i < k; i++) rs_mul_add(out, data[i], rs_coef(j, i), lens[i]);
+}
+
+/* n×n 行列 a (行優先) の逆行列を inv に求める。正則でなければ-1 */
+static inline int rs_invert(uint8_t *a, uint8_t *inv, int n)
+{
+    int r, c, k;
+
+    memset(inv, 0, (size_t)n * n);
+    for (r = 0; r < n; r++) inv[r * n + r] = 1;
+    for (c = 0; c < n; c++) {
+        uint8_t f;
+        for (r = c; r < n && a[r * n + c] == 0; r++) ;
+        if (r == n) return -1;
+        if (r != c) {
+            for (k = 0; k < n; k++) {
+                uint8_t t = a[r * n + k]; a[r * n + k] = a[c * n + k]; a[c * n + k] = t;
+                t = inv[r * n + k]; inv[r * n + k] = inv[c * n + k]; inv[c * n + k] = t;
+            }
+        }
+        f = rs_inv(a[c * n + c]);
+        for (k = 0; k < n; k++) {
+            a[c * n + k] = rs_mul(a[c * n + k], f);
+            inv[c * n + k] = rs_mul(inv[c * n + k], f);
+        }
+        for (r = 0; r < n; r++) {
+            if (r == c || a[r * n + c] == 0) continue;
+            f = a[r * n + c];
+            for (k = 0; k < n; k++) {
+                a[r * n + k] ^= rs_mul(f, a[c * n + k]);
+                inv[r * n + k] ^= rs_mul(f, inv[c * n + k]);
+            }
+        }
+    }
+    return 0;
+}
+
+/* 欠けたデータを復元する。                                            */
+/*   data[i]  : 届いたデータ i (欠けていればNULL)。長さ lens[i]         */
+/*   par[j]   : 届いたパリティ j (無ければNULL)。長さはすべて len       */
+/*   out[i]   : 欠けたデータ i の復元先 (len バイト)                    */
+/* 欠けたデータの数だけパリティが無ければ-1 (par の中身は書き換える)  */
+static inline int rs_decode(uint8_t *const *out, const uint8_t *const *data, const size_t *lens,
+                            int k, uint8_t *const *par, int m, size_t len)
+{
+    uint8_t a[RS_MAX_M * RS_MAX_M], inv[RS_MAX_M * RS_MAX_M];
+    int lost[RS_MAX_M], rows[RS_MAX_M];
+    int n_lost = 0, n_rows = 0, i, j, r;
+
+    for (i = 0; i < k; i++) {
+        if (data[i] != NULL) continue;
+        if (n_lost == RS_MAX_M) return -1;
+        lost[n_lost++] = i;
+    }
+    if (n_lost == 0) return 0;
+    for (j = 0; j < m && n_rows < n_lost; j++) {
+        if (par[j] != NULL) rows[n_rows++] = j;
+    }
+    if (n_rows < n_lost) return -1;
+
+    /* 使うパリティから届いたデータの分を引くと，欠けたデータだけの式になる */
+    for (r = 0; r < n_rows; r++) {
+        for (i = 0; i < k; i++) {
+            if (data[i] != NULL) rs_mul_add(par[rows[r]], data[i], rs_coef(rows[r], i), lens[i]);
+        }
+        for (i = 0; i < n_lost; i++) a[r * n_lost + i] = rs_coef(rows[r], lost[i]);
+    }
+    if (rs_invert(a, inv, n_lost) < 0) return -1;
+    for (i = 0; i < n_lost; i++) {
+        memset(out[lost[i]], 0, len);
+        for (r = 0; r < n_rows; r++) rs_mul_add(out[lost[i]], par[rows[r]], inv[i * n_lost + r], len);
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,171 @@
+/* -*- mode: c; coding: utf-8-unix; ##: nil; -*-                    */
+/*                                                                  */
+/*  FILENAME     :  icslab2_telemetry.h                             */
+/*  DESCRIPTION  :  Per-path throughput / TCP_INFO time series      */
+/*                                                                  */
+/*-------------------------- <include>  ----------------------------*/
+
+#ifndef ICSLAB2_TELEMETRY_H
+#define ICSLAB2_TELEMETRY_H
+
+#include "icslab2_net.h"
+#include <pthread.h>
+#include <time.h>
+#include <linux/tcp.h>          /* struct tcp_info (pacing_rate等を含む版) */
+
+/*-------------------------- <define>   ----------------------------*/
+/* 既定のサンプリング間隔 [ms] */
+#define TELEM_INTERVAL_MS   100
+
+/* 経路ごとのカウンタ                                               */
+/* bytes は送受信スレッドが telem_add() で増やし，サンプラーが読む */
+typedef struct {
+    char name[64];          /* 経路名 (CSVのpath列) */
+    int sock;               /* TCP_INFOを読むソケット (-1 = 未接続) */
+    uint64_t bytes;         /* 累積バイト数 */
+    uint64_t last_bytes;    /* 前回サンプル時のbytes (サンプラー専用) */
+} telem_path_t;
+
+/* サンプラー                                                       */
+/* 一定間隔ですべての経路のカウンタとTCP_INFOを1行ずつCSVに書く    */
+typedef struct {
+    FILE *out;
+    int interval_ms;
+    telem_path_t **paths;
+    int n_paths;
+    int stop;
+    pthread_t th;
+    pthread_mutex_t lock;   /* sock の付け替えとgetsockoptの排他 */
+    struct timespec t0;     /* 計測開始 (CLOCK_MONOTONIC) */
+    struct timespec last;   /* 前回サンプル時刻 */
+} telem_t;
+
+static inline void telem_add(telem_path_t *p, uint64_t n)
+{
+    __atomic_fetch_add(&p->bytes, n, __ATOMIC_RELAXED);
+}
+
+static inline double telem_elapsed(const struct timespec *a, const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1000000000.0;
+}
+
+/* 経路のソケットを登録する (サンプル中のgetsockoptと競合しないように) */
+static inline void telem_set_sock(telem_t *t, telem_path_t *p, int sock)
+{
+    if (t == NULL) {
+        p->sock = sock;
+        return;
+    }
+    pthread_mutex_lock(&t->lock);
+    p->sock = sock;
+    pthread_mutex_unlock(&t->lock);
+}
+
+/* 経路のソケットを登録から外して閉じる (閉じたfd番号の再利用対策) */
+static inline void telem_close_sock(telem_t *t, telem_path_t *p, int sock)
+{
+    if (t != NULL) pthread_mutex_lock(&t->lock);
+    if (p->sock == sock) p->sock = -1;
+    close(sock);
+    if (t != NULL) pthread_mutex_unlock(&t->lock);
+}
+
+/* 全経路を1回サンプルする */
+static inline void telem_sample(telem_t *t)
+{
+    struct timespec now;
+    double dt, ms;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    dt = telem_elapsed(&t->last, &now);
+    ms = telem_elapsed(&t->t0, &now) * 1000.0;
+    t->last = now;
+
+    pthread_mutex_lock(&t->lock);
+    for (i = 0; i < t->n_paths; i++) {
+        telem_path_t *p = t->paths[i];
+        uint64_t bytes = __atomic_load_n(&p->bytes, __ATOMIC_RELAXED);
+        uint64_t delta = bytes - p->last_bytes;
+        struct tcp_info ti;
+        socklen_t len = sizeof(ti);
+        int have_info = 0;
+
+        p->last_bytes = bytes;
+        memset(&ti, 0, sizeof(ti));
+        if (p->sock >= 0 && getsockopt(p->sock, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0) {
+            have_info = 1;
+        }
+        fprintf(t->out, "%.1f,%s,%llu,%.3f,", ms, p->name, (unsigned long long)bytes,
+                dt > 0 ? delta * 8.0 / dt / 1000000.0 : 0.0);
+        if (have_info) {
+            fprintf(t->out, "%u,%u,%u,%u,%llu,%llu\n", ti.tcpi_rtt, ti.tcpi_rttvar,
+                    ti.tcpi_snd_cwnd, ti.tcpi_total_retrans,
+                    (unsigned long long)ti.tcpi_pacing_rate,
+                    (unsigned long long)ti.tcpi_delivery_rate);
+        } else {
+            fprintf(t->out, ",,,,,\n");
+        }
+    }
+    pthread_mutex_unlock(&t->lock);
+    fflush(t->out);
+}
+
+static inline void *telem_thread(void *arg)
+{
+    telem_t *t = arg;
+    struct timespec next = t->t0;
+
+    while (!__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE)) {
+        next.tv_nsec += (long)t->interval_ms * 1000000L;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        telem_sample(t);
+    }
+    return NULL;
+}
+
+/* サンプラーを開始する。file が "-" なら標準エラー出力に書く */
+static inline int telem_start(telem_t *t, const char *file, int interval_ms,
+                              telem_path_t **paths, int n_paths)
+{
+    memset(t, 0, sizeof(*t));
+    t->out = strcmp(file, "-") == 0 ? stderr : fopen(file, "w");
+    if (t->out == NULL) {
+        perror("fopen telemetry");
+        return -1;
+    }
+    t->interval_ms = interval_ms > 0 ? interval_ms : TELEM_INTERVAL_MS;
+    t->paths = paths;
+    t->n_paths = n_paths;
+    pthread_mutex_init(&t->lock, NULL);
+    fprintf(t->out, "time_ms,path,bytes,mbps,rtt_us,rttvar_us,cwnd,total_retrans,"
+                    "pacing_rate_Bps,delivery_rate_Bps\n");
+    clock_gettime(CLOCK_MONOTONIC, &t->t0);
+    t->last = t->t0;
+    if (pthread_create(&t->th, NULL, telem_thread, t) != 0) {
+        perror("pthread_create telemetry");
+        if (t->out != stderr) fclose(t->out);
+        t->out = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* サンプラーを止め，最後に1回サンプルして閉じる */
+static inline void telem_stop(telem_t *t)
+{
+    if (t->out == NULL) return;
+    __atomic_store_n(&t->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(t->th, NULL);
+    telem_sample(t);
+    if (t->out != stderr) fclose(t->out);
+    t->out = NULL;
+    pthread_mutex_destroy(&t->lock);
+}
+
+#endif
@@ -0,0 +1,192 @@
+/* -*- mode: c; coding: utf-8-unix; ##: nil; -*-                    */
+/*                                                                  */
+/*  FILENAME     :  icslab2_tree.h                                  */
+/*  DESCRIPTION  :  Directory manifest (files packed end to end)    */
+/*                                                                  */
+/*-------------------------- <include>  ----------------------------*/
+
+#ifndef ICSLAB2_TREE_H
+#define ICSLAB2_TREE_H
+
+#include "icslab2_net.h"
+#include <sys/stat.h>           /* S_ISDIR */
+
+/*-------------------------- <define>   ----------------------------*/
+/* ディレクトリの転送 (send.out -d / receive.out -d)                */
+/* ツリーの通常ファイルをパス順に隙間なく並べたものを1つのファイル  */
+/* とみなし，そのままチャンクに切って全経路で分担する。小さいファイル */
+/* は何個もまとめて1チャンクになり，大きいファイルは経路に振り分け   */
+/* られる。受信側は一覧 (MANIFESTフレーム) から並べた位置をファイルと */
+/* その中の位置に戻して書く。                                       */
+/* MANIFESTのペイロードはエントリごとに                              */
+/*   u64 サイズ，u32 モード (st_mode)，u16 パスの長さ，パス (終端なし) */
+/* をネットワークバイトオーダで並べたもの。パスはツリーの根からの相対 */
+/* で，ディレクトリも (サイズ0で) 載せる                             */
+#define TREE_REC_LEN        14              /* パスを除くエントリの長さ */
+#define TREE_MAX_PATH       4095
+
+typedef struct {
+    char *path;             /* 根からの相対パス */
+    uint64_t size;          /* ディレクトリなら0 */
+    uint64_t base;          /* 並べたときの先頭位置 */
+    uint32_t mode;          /* st_mode (種別とパーミッション) */
+} tree_entry_t;
+
+typedef struct {
+    tree_entry_t *e;        /* パス順 (base も昇順) */
+    int n, cap;
+    int n_files, n_dirs;
+    uint64_t total;         /* 全ファイルを並べた長さ */
+} tree_t;
+
+/* 受け取ったパスがツリーの外を指さないか (絶対パス，"..", 空の要素は不可) */
+static inline int tree_path_ok(const char *path)
+{
+    const char *p = path;
+
+    if (*p == '\0' || *p == '/') return 0;
+    while (*p != '\0') {
+        const char *s = strchr(p, '/');
+        size_t n = s != NULL ? (size_t)(s - p) : strlen(p);
+        if (n == 0 || (n == 1 && p[0] == '.') || (n == 2 && p[0] == '.' && p[1] == '.')) return 0;
+        p += n;
+        if (*p == '/') p++;
+        if (s != NULL && *p == '\0') return 0;
+    }
+    return 1;
+}
+
+/* エントリを加える (並べる位置は tree_layout で決める) */
+static inline int tree_add(tree_t *t, const char *path, uint64_t size, uint32_t mode)
+{
+    tree_entry_t *e;
+
+    if (strlen(path) > TREE_MAX_PATH) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (t->n == t->cap) {
+        int cap = t->cap ? t->cap * 2 : 256;
+        tree_entry_t *tmp = realloc(t->e, sizeof(tree_entry_t) * cap);
+        if (tmp == NULL) return -1;
+        t->e = tmp;
+        t->cap = cap;
+    }
+    e = &t->e[t->n];
+    if ((e->path = strdup(path)) == NULL) return -1;
+    e->size = S_ISDIR(mode) ? 0 : size;
+    e->base = 0;
+    e->mode = mode;
+    t->n++;
+    return 0;
+}
+
+static inline int tree_entry_cmp(const void *a, const void *b)
+{
+    return strcmp(((const tree_entry_t *)a)->path, ((const tree_entry_t *)b)->path);
+}
+
+/* パス順に並べ替えて各ファイルの位置を決める (親ディレクトリが子より前に来る) */
+static inline void tree_layout(tree_t *t)
+{
+    uint64_t pos = 0;
+    int i;
+
+    qsort(t->e, (size_t)t->n, sizeof(tree_entry_t), tree_entry_cmp);
+    t->n_files = t->n_dirs = 0;
+    for (i = 0; i < t->n; i++) {
+        t->e[i].base = pos;
+        pos += t->e[i].size;
+        if (S_ISDIR(t->e[i].mode)) t->n_dirs++;
+        else t->n_files++;
+    }
+    t->total = pos;
+}
+
+/* 位置 off を含むファイルの番号 (off < total のこと)                */
+/* 空のファイルは次のファイルと base が同じなので，同じ base の最後を返す */
+static inline int tree_find(const tree_t *t, uint64_t off)
+{
+    int lo = 0, hi = t->n - 1;
+
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (t->e[mid].base <= off) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+/* MANIFESTのペイロードを作る (free で解放) */
+static inline unsigned char *tree_pack(const tree_t *t, size_t *len)
+{
+    unsigned char *buf, *p;
+    size_t n = 0;
+    int i;
+
+    for (i = 0; i < t->n; i++) n += TREE_REC_LEN + strlen(t->e[i].path);
+    if ((buf = malloc(n > 0 ? n : 1)) == NULL) return NULL;
+    p = buf;
+    for (i = 0; i < t->n; i++) {
+        uint64_t u64 = htobe64(t->e[i].size);
+        uint32_t u32 = htonl(t->e[i].mode);
+        uint16_t plen = (uint16_t)strlen(t->e[i].path);
+        uint16_t u16 = htons(plen);
+        memcpy(p, &u64, 8);
+        memcpy(p + 8, &u32, 4);
+        memcpy(p + 12, &u16, 2);
+        memcpy(p + TREE_REC_LEN, t->e[i].path, plen);
+        p += TREE_REC_LEN + plen;
+    }
+    *len = n;
+    return buf;
+}
+
+static inline void tree_free(tree_t *t)
+{
+    int i;
+
+    for (i = 0; i < t->n; i++) free(t->e[i].path);
+    free(t->e);
+    memset(t, 0, sizeof(*t));
+}
+
+/* MANIFESTのペイロードを読む。並び順は送信側のまま (パス順) で，位置は */
+/* 先頭から足していく。ツリーの外を指すパスがあれば-1                  */
+static inline int tree_unpack(tree_t *t, const unsigned char *p, size_t len)
+{
+    char path[TREE_MAX_PATH + 1];
+    uint64_t pos = 0;
+
+    memset(t, 0, sizeof(*t));
+    while (len > 0) {
+        uint64_t u64;
+        uint32_t u32;
+        uint16_t u16;
+        size_t plen;
+
+        if (len < TREE_REC_LEN) goto bad;
+        memcpy(&u64, p, 8);
+        memcpy(&u32, p + 8, 4);
+        memcpy(&u16, p + 12, 2);
+        plen = ntohs(u16);
+        if (plen > TREE_MAX_PATH || len < TREE_REC_LEN + plen) goto bad;
+        memcpy(path, p + TREE_REC_LEN, plen);
+        path[plen] = '\0';
+        if (!tree_path_ok(path) || tree_add(t, path, be64toh(u64), ntohl(u32)) < 0) goto bad;
+        t->e[t->n - 1].base = pos;
+        pos += t->e[t->n - 1].size;
+        if (S_ISDIR(ntohl(u32))) t->n_dirs++;
+        else t->n_files++;
+        p += TREE_REC_LEN + plen;
+        len -= TREE_REC_LEN + plen;
+    }
+    t->total = pos;
+    return 0;
+bad:
+    tree_free(t);
+    errno = EPROTO;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,284 @@
+/* -*- mode: c; coding: utf-8-unix; ##: nil; -*-                    */
+/*                                                                  */
+/*  FILENAME     :  icslab2_tune.h                                  */
+/*  DESCRIPTION  :  Per-path socket tuning profiles (BDP sizing)    */
+/*                                                                  */
+/*-------------------------- <include>  ----------------------------*/
+
+#ifndef ICSLAB2_TUNE_H
+#define ICSLAB2_TUNE_H
+
+#include "icslab2_net.h"
+#include <linux/tcp.h>          /* struct tcp_info, TCP_NOTSENT_LOWAT, TCP_CONGESTION */
+
+/*-------------------------- <define>   ----------------------------*/
+/* 経路ごとのプロファイル                                            */
+/* 転送中にTCP_INFOから測ったRTTと帯域をファイルに残し，次回からは   */
+/* 帯域遅延積 (BDP) に合わせてソケットバッファ等を設定する。         */
+/* ファイルは1行1経路のテキスト:                                    */
+/*   <名前> <RTT[ms]> <帯域[Mbps]> <再送率> <輻輳制御> <ペーシング[Mbps]> */
+/* 輻輳制御は auto (測定値から選ぶ)，- (既定のまま)，または名前。    */
+/* ペーシングは -1 (測定値から選ぶ)，0 (制限しない)，または値。      */
+/* 新しい経路は auto / -1 で作られ，手で書き換えればそれが使われる  */
+#define TUNE_MIN_BUF        (256 * 1024)            /* バッファの下限 */
+#define TUNE_MAX_BUF        (256 * 1024 * 1024)     /* バッファの上限 */
+#define TUNE_BDP_GAIN       2       /* バッファ = BDP × この値 (再送・揺らぎの分) */
+#define TUNE_MIN_LOWAT      (64 * 1024)             /* TCP_NOTSENT_LOWATの下限 */
+#define TUNE_MAX_LOWAT      (4 * 1024 * 1024)       /* TCP_NOTSENT_LOWATの上限 */
+#define TUNE_ALPHA          0.5     /* 前回までの値との指数移動平均の重み */
+#define TUNE_LOSSY          0.01    /* これより再送の多い経路は損失がある経路とみなす */
+#define TUNE_LONG_RTT_MS    20.0    /* これより長いRTTの経路は長距離とみなす */
+#define TUNE_PACING_GAIN    1.1     /* 損失のある経路のペーシング = 帯域 × この値 */
+#define TUNE_MAX_PROFILES   256
+
+enum {
+    TUNE_SEND = 1,          /* 主に送る側のソケット */
+    TUNE_RECV = 2           /* 主に受ける側のソケット */
+};
+
+typedef struct {
+    char name[64];          /* 経路名 (送信側は -p の名前，受信側は接続先) */
+    double rtt_ms;          /* 最小RTT */
+    double bw_mbps;         /* 経路の帯域 (接続を複数張ったときは合計) */
+    double loss;            /* 再送したセグメントの割合 */
+    char cc[16];            /* TCP_CONGESTION ("auto" / "-" / 名前) */
+    double pacing_mbps;     /* SO_MAX_PACING_RATE (-1 = 自動，0 = 制限しない) */
+} tune_profile_t;
+
+typedef struct {
+    tune_profile_t p[TUNE_MAX_PROFILES];
+    int n;
+    const char *file;
+} tune_db_t;
+
+/* 1本の接続の測定値 (tune_sample() で転送中に更新する) */
+typedef struct {
+    uint32_t min_rtt_us;    /* 0 = まだ測っていない */
+    uint64_t max_rate_Bps;  /* 配送レートの最大値 */
+    uint32_t retrans;
+    uint32_t segs_out;
+} tune_meas_t;
+
+/* プロファイルを読み込む。ファイルが無ければ空で始める */
+static inline int tune_load(tune_db_t *db, const char *file)
+{
+    char line[256];
+    FILE *fp;
+
+    memset(db, 0, sizeof(*db));
+    db->file = file;
+    fp = fopen(file, "r");
+    if (fp == NULL) return errno == ENOENT ? 0 : -1;
+    while (fgets(line, sizeof(line), fp) && db->n < TUNE_MAX_PROFILES) {
+        tune_profile_t *p = &db->p[db->n];
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%63s %lf %lf %lf %15s %lf", p->name, &p->rtt_ms, &p->bw_mbps,
+                   &p->loss, p->cc, &p->pacing_mbps) != 6) continue;
+        db->n++;
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* 書き出す (一時ファイルに書いてから置き換える) */
+static inline int tune_save(const tune_db_t *db)
+{
+    char tmp[512];
+    FILE *fp;
+    int i;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", db->file);
+    fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        perror("fopen tuning profile");
+        return -1;
+    }
+    fprintf(fp, "# name rtt_ms bw_mbps loss cc pacing_mbps\n");
+    for (i = 0; i < db->n; i++) {
+        const tune_profile_t *p = &db->p[i];
+        fprintf(fp, "%s %.3f %.3f %.5f %s %.3f\n", p->name, p->rtt_ms, p->bw_mbps,
+                p->loss, p->cc, p->pacing_mbps);
+    }
+    if (fclose(fp) != 0 || rename(tmp, db->file) < 0) {
+        perror("write tuning profile");
+        return -1;
+    }
+    return 0;
+}
+
+static inline tune_profile_t *tune_find(tune_db_t *db, const char *name)
+{
+    int i;
+
+    for (i = 0; i < db->n; i++) {
+        if (strcmp(db->p[i].name, name) == 0) return &db->p[i];
+    }
+    return NULL;
+}
+
+/* 帯域遅延積 [バイト] */
+static inline double tune_bdp(const tune_profile_t *p)
+{
+    return p->bw_mbps * 1000000.0 / 8.0 * p->rtt_ms / 1000.0;
+}
+
+static inline int tune_clamp(double v, int lo, int hi)
+{
+    return v < lo ? lo : v > hi ? hi : (int)v;
+}
+
+/* ソケットバッファの大きさ: BDPの TUNE_BDP_GAIN 倍 */
+static inline int tune_bufsize(const tune_profile_t *p)
+{
+    return tune_clamp(tune_bdp(p) * TUNE_BDP_GAIN, TUNE_MIN_BUF, TUNE_MAX_BUF);
+}
+
+/* 送信側で未送信のまま溜めておく量: BDPの1/4                        */
+/* 少なく保つと，チャンクを経路に割り当てるのが実際に送れる直前になる */
+static inline int tune_lowat(const tune_profile_t *p)
+{
+    return tune_clamp(tune_bdp(p) / 4, TUNE_MIN_LOWAT, TUNE_MAX_LOWAT);
+}
+
+/* 輻輳制御アルゴリズムがこのカーネルで使えるか */
+static inline int tune_cc_available(const char *cc)
+{
+    char buf[256], *tok, *save;
+    FILE *fp = fopen("/proc/sys/net/ipv4/tcp_available_congestion_control", "r");
+    int found = 0;
+
+    if (fp == NULL) return 0;
+    if (fgets(buf, sizeof(buf), fp)) {
+        for (tok = strtok_r(buf, " \n", &save); tok; tok = strtok_r(NULL, " \n", &save)) {
+            if (strcmp(tok, cc) == 0) found = 1;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+/* 使う輻輳制御 (NULL = 既定のまま)                                */
+/* auto なら，損失のある経路や長距離の経路でBBRを選ぶ (使えれば)   */
+static inline const char *tune_cc(const tune_profile_t *p)
+{
+    if (strcmp(p->cc, "-") == 0) return NULL;
+    if (strcmp(p->cc, "auto") != 0) return p->cc;
+    if ((p->loss > TUNE_LOSSY || p->rtt_ms > TUNE_LONG_RTT_MS) && tune_cc_available("bbr")) {
+        return "bbr";
+    }
+    return NULL;
+}
+
+/* ペーシングの上限 [Mbps] (0 = 制限しない)                          */
+/* 自動なら，損失のある経路では浅いキューで落ちないよう帯域に合わせる */
+static inline double tune_pacing(const tune_profile_t *p)
+{
+    if (p->pacing_mbps >= 0) return p->pacing_mbps;
+    return p->loss > TUNE_LOSSY ? p->bw_mbps * TUNE_PACING_GAIN : 0.0;
+}
+
+/* バッファを設定する。上限 (net.core.[rw]mem_max) を超える分は      */
+/* CAP_NET_ADMIN があれば *BUFFORCE で，なければ上限まで設定される   */
+static inline void tune_setbuf(int sock, int force_opt, int opt, int size)
+{
+    if (setsockopt(sock, SOL_SOCKET, force_opt, &size, sizeof(size)) == 0) return;
+    if (setsockopt(sock, SOL_SOCKET, opt, &size, sizeof(size)) < 0) perror("setsockopt buffer");
+}
+
+/* プロファイルをソケットに当てる                                    */
+/* 受信バッファはウィンドウスケールが決まる接続前 (connect/listen前) */
+/* に設定しておく必要がある                                          */
+static inline void tune_apply(int sock, const tune_profile_t *p, int role)
+{
+    int size = tune_bufsize(p);
+    const char *cc = tune_cc(p);
+    double pacing = tune_pacing(p);
+
+    if (role & TUNE_SEND) {
+        int lowat = tune_lowat(p);
+        tune_setbuf(sock, SO_SNDBUFFORCE, SO_SNDBUF, size);
+        if (setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) < 0) {
+            perror("setsockopt TCP_NOTSENT_LOWAT");
+        }
+        if (pacing > 0) {
+            /* 古いカーネルのSO_MAX_PACING_RATEは32bit (約34Gbpsまで) */
+            uint64_t rate = (uint64_t)(pacing * 1000000.0 / 8.0);
+            if (setsockopt(sock, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) < 0) {
+                uint32_t rate32 = rate > 0xffffffffu ? 0xffffffffu : (uint32_t)rate;
+                if (setsockopt(sock, SOL_SOCKET, SO_MAX_PACING_RATE, &rate32, sizeof(rate32)) < 0) {
+                    perror("setsockopt SO_MAX_PACING_RATE");
+                }
+            }
+        }
+    }
+    if (role & TUNE_RECV) {
+        tune_setbuf(sock, SO_RCVBUFFORCE, SO_RCVBUF, size);
+    }
+    if (cc != NULL && setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, cc, strlen(cc)) < 0) {
+        perror("setsockopt TCP_CONGESTION");
+    }
+}
+
+/* 転送中の接続からRTT・配送レート・再送数を拾う */
+static inline void tune_sample(tune_meas_t *m, int sock)
+{
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+
+    memset(&ti, 0, sizeof(ti));
+    if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0) return;
+    if (ti.tcpi_min_rtt > 0 && (m->min_rtt_us == 0 || ti.tcpi_min_rtt < m->min_rtt_us)) {
+        m->min_rtt_us = ti.tcpi_min_rtt;
+    }
+    if (!ti.tcpi_delivery_rate_app_limited && ti.tcpi_delivery_rate > m->max_rate_Bps) {
+        m->max_rate_Bps = ti.tcpi_delivery_rate;
+    }
+    m->retrans = ti.tcpi_total_retrans;
+    m->segs_out = ti.tcpi_segs_out;
+}
+
+/* 測定値をプロファイルに取り込む (前回までの値との指数移動平均)  */
+/* 再送率を測れない側は loss < 0 で呼ぶ                            */
+/* 名前の無いプロファイルは新しく作る。取り込んだプロファイルを返す */
+static inline tune_profile_t *tune_update(tune_db_t *db, const char *name,
+                                          double rtt_ms, double bw_mbps, double loss)
+{
+    tune_profile_t *p = tune_find(db, name);
+
+    if (rtt_ms <= 0 || bw_mbps <= 0) return p;      /* 測れていない */
+    if (p == NULL) {
+        if (db->n >= TUNE_MAX_PROFILES) return NULL;
+        p = &db->p[db->n++];
+        memset(p, 0, sizeof(*p));
+        snprintf(p->name, sizeof(p->name), "%s", name);
+        p->rtt_ms = rtt_ms;
+        p->bw_mbps = bw_mbps;
+        p->loss = loss >= 0 ? loss : 0.0;
+        snprintf(p->cc, sizeof(p->cc), "auto");
+        p->pacing_mbps = -1.0;
+    } else {
+        p->rtt_ms = TUNE_ALPHA * rtt_ms + (1.0 - TUNE_ALPHA) * p->rtt_ms;
+        p->bw_mbps = TUNE_ALPHA * bw_mbps + (1.0 - TUNE_ALPHA) * p->bw_mbps;
+        if (loss >= 0) p->loss = TUNE_ALPHA * loss + (1.0 - TUNE_ALPHA) * p->loss;
+    }
+    return p;
+}
+
+/* 表示用の1行 */
+static inline void tune_describe(const tune_profile_t *p, char *buf, size_t len)
+{
+    const char *cc = tune_cc(p);
+    double pacing = tune_pacing(p);
+
+    snprintf(buf, len, "rtt %.2f ms, %.1f Mbps, loss %.2f%% -> buffer %d KiB, lowat %d KiB, cc %s, pacing ",
+             p->rtt_ms, p->bw_mbps, p->loss * 100.0, tune_bufsize(p) / 1024, tune_lowat(p) / 1024,
+             cc != NULL ? cc : "default");
+    if (pacing > 0) {
+        size_t n = strlen(buf);
+        snprintf(buf + n, len - n, "%.1f Mbps", pacing);
+    } else {
+        snprintf(buf + strlen(buf), len - strlen(buf), "off");
+    }
+}
+
+#endif
@@ -7,38 +7,377 @@
 /*  UPDATE       :                                                  */
 /*                                                                  */
 
-#define _POSIX_C_SOURCE 200112L /* getaddrinfo, clock_gettime用 */
+#define _GNU_SOURCE             /* getaddrinfo, clock_gettime, htobe64用 */
 #include "icslab2_net.h"
+#include "icslab2_telemetry.h"
+#include "icslab2_crc32c.h"
+#include "icslab2_tune.h"
+#include "icslab2_rs.h"
+#include "icslab2_tree.h"
+#include "icslab2_cdc.h"
+#include "icslab2_metrics.h"
+#include <zlib.h>               /* 圧縮されたチャンクの展開 */
 #include <time.h>               /* clock_gettime, struct timespec */
 #include <sys/stat.h>           /* fstat */
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>              /* getaddrinfo用 */
+#include <sys/mman.h>           /* io_uringのリング用 */
+#include <sys/syscall.h>        /* io_uring_setup/enter/register */
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sched.h>              /* CPUアフィニティ */
+#include <poll.h>
+#include <limits.h>             /* IOV_MAX */
+#include <sys/uio.h>            /* pwritev */
+#include <netinet/udp.h>        /* UDP_GRO */
+#include <signal.h>             /* SIGPIPE (-) */
+
+#ifdef IORING_RECV_MULTISHOT
+#define HAVE_URING_RECV         /* カーネルヘッダがマルチショット受信に対応 */
+#endif
 
 #define MAX_EVENTS 30
 
+typedef struct udp_recv udp_recv_t;
+
+/* 経路ごとのフレーム解析状態 */
+typedef struct {
+    int sock;
+    unsigned char hdr[FRAME_HDR_LEN];   /* 受信途中のヘッダ */
+    int hdr_got;                        /* hdrに溜まったバイト数 */
+    uint64_t off;                       /* 次のペイロードを書き込む位置 */
+    uint32_t remain;                    /* 現在のフレームの残りペイロード */
+    int mid_frame;                      /* フレームの途中で読み終えた (early_finish が */
+                                        /* 他のスレッドから見るので parse_frames が atomic に書く) */
+    int discard;                        /* 現在のフレームのペイロードを捨てる (PROBE，使わないパリティ) */
+    int dup;                            /* 現在のフレームは書き終えたチャンクの重複 (捨ててACKだけ返す) */
+    int ended;                          /* ENDフレームを受信済みか，early_finish が止めた */
+                                        /* (他のスレッドも書くので path_ended / path_end で扱う) */
+    int path_id;                        /* 送信側の経路番号 (未受信なら-1) */
+    /* チェックサム用 */
+    int check;                          /* 現在のフレームにCRCが付いている */
+    uint32_t crc;                       /* 受信済みペイロードのCRC32C */
+    uint32_t want_crc;                  /* ヘッダに載っていたCRC32C */
+    uint64_t chunk_off;                 /* 現在のフレームの先頭位置 */
+    uint32_t chunk_len;                 /* 現在のフレームの長さ (圧縮前) */
+    /* 圧縮されたフレームの展開用 */
+    int zlib;                           /* 現在のフレームは圧縮されている */
+    int zs_ready;                       /* zs を inflateInit2 済み */
+    z_stream zs;
+    unsigned char *zout;                /* 展開先 (ZOUT_LEN バイト) */
+    /* パリティ (FRAME_PARITY) の受け取り用 */
+    int parity;                         /* 現在のフレームはパリティ */
+    uint32_t par_info;                  /* ヘッダの raw_len (データチャンク数とパリティ番号) */
+    unsigned char *par;                 /* パリティを溜めるバッファ (受け取り終えたら fec に渡す) */
+    /* 帯域測定用 */
+    uint64_t probe_bytes;               /* 受信したPROBEペイロードの合計 */
+    uint64_t probe_base;                /* 測定開始時点のprobe_bytes */
+    struct timespec probe_first;        /* 測定開始時刻 */
+    struct timespec probe_last;         /* 最後にPROBEを受信した時刻 */
+    telem_path_t tm;                    /* 受信バイト数のカウンタ */
+    /* ソケット調整用 (-t) */
+    uint32_t rtt_us;                    /* 接続時に測ったRTT */
+    struct timespec ended_at;           /* ENDフレームを受け取った時刻 */
+    udp_recv_t *udp;                    /* データをUDPで受ける経路 (TCPならNULL) */
+} path_state_t;
+
+#define MAX_CALIB_PATHS 64
+
+#define ZOUT_LEN    (256 * 1024)        /* 圧縮されたペイロードを一度に展開する量 */
+
+/* 受信ループの実装 */
+#define RECV_EPOLL  0   /* epoll + read + pwrite */
+#define RECV_URING  1   /* io_uring (マルチショット受信 + 書き込み) */
+#define RECV_THREADS 2  /* 経路ごとの受信スレッド + pwrite */
+
+/* 受信スレッドモードのバッファ */
+#define THREAD_BUF_SZ   (1024 * 1024)   /* 1回のread()で受ける最大バイト数 */
+
+/* 受信したペイロードの書き出し先 (off = 元ファイル内の位置) */
+typedef int (*payload_fn)(void *arg, const unsigned char *p, size_t len, uint64_t off);
+
+static telem_t telem;
+static telem_t *telem_p = NULL;     /* 時系列計測 (-T) をしていなければNULL */
+
+/* 動作中の計測値 (-M)。出していなければ NULL で，数えない */
+static metric_t *m_read, *m_pwrite, *m_pwritev, *m_recvmmsg, *m_uring_enter;
+static metric_t *m_chunks, *m_verified;
+
+/* 検査済みチャンクの記録 (ファイル全体のCRCを組み立てる) */
+/* 経路ごとに順不同で届くので，最後にoffset順に並べてつなぐ */
+typedef struct {
+    uint64_t off;
+    uint32_t len;
+    uint32_t crc;
+} crc_rec_t;
+
+static struct {
+    pthread_mutex_t lock;           /* 受信スレッドモードでは複数スレッドから追加される */
+    crc_rec_t *recs;
+    size_t n, cap;
+    int n_bad;                      /* CRCが一致しなかったチャンク数 */
+} crc_log = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0 };
+
+/* 再開用の完了ビットマップ (-R)                                    */
+/* 出力ファイルの横に "<出力>.resume" を置き，ブロックごとに受信済み */
+/* かを1ビットで記録する。出力を fdatasync してからビットを立てて    */
+/* fsync するので，ビットが立っているブロックは必ずディスクにある    */
+#define RESUME_SUFFIX       ".resume"
+#define RESUME_MAGIC        "FSPRSM1"                   /* 8バイト (終端含む) */
+#define RESUME_HDR_LEN      24                          /* magic + file_size + block */
+#define RESUME_BLOCK        (64 * 1024)                 /* 1ビットが表すバイト数 */
+#define RESUME_CKPT_BYTES   (64ULL * 1024 * 1024)       /* この量を受け取るごとに記録 */
+#define RESUME_READ_LEN     (1024 * 1024)               /* 再開後の全体CRC計算で読む単位 */
+
+static struct {
+    int enabled;
+    int loaded;                     /* 既存のビットマップから再開した */
+    int fd;                         /* ビットマップファイル (-1 = まだ作っていない) */
+    char *path;
+    int out_fd;
+    uint64_t file_size;             /* ビットマップが表すファイルのサイズ */
+    uint64_t n_blocks;
+    unsigned char *bits;
+    uint64_t pending;               /* 前回の記録以降に検査を通ったバイト数 */
+    uint64_t had;                   /* 再開する前から揃っていたバイト数 */
+    pthread_mutex_t ckpt_lock;      /* 記録は1スレッドずつ */
+} resume = { 0, 0, -1, NULL, -1, 0, 0, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+/* 消失訂正 (送信側の -E)                                              */
+/* 送信側は k チャンクごとのストライプに m 個のパリティを足して，全経路 */
+/* に混ぜて送ってくる。ストライプのデータとパリティが合わせて k 個届けば */
+/* 欠けたデータチャンクを復元するので，止まった経路を待たずに終われる   */
+typedef struct {
+    uint32_t have;                      /* 揃ったデータチャンク (ビット i = i番目) */
+    int n_par;
+    unsigned char *par[RS_MAX_M];       /* 届いたパリティ (パリティ番号順，データが揃ったら捨てる) */
+} fec_stripe_t;
+
+static struct {
+    pthread_mutex_t lock;
+    int k, m;                           /* 0ならパリティの無い転送 */
+    uint64_t chunk_len;
+    uint64_t file_size;
+    uint64_t n_stripes;
+    fec_stripe_t *stripes;
+    uint64_t n_chunks, n_have;          /* データチャンクの総数と揃った数 */
+    uint64_t *todo;                     /* 復元できるようになったストライプ */
+    size_t n_todo, cap_todo;
+    uint64_t n_rebuilt;                 /* 復元したチャンク数 */
+    int fd;                             /* 出力ファイル (揃ったチャンクを読んで復元を書く) */
+} fec = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, 0, NULL, 0, 0, NULL, 0, 0, 0, -1 };
+
+/* 終盤の重複送信 (送信側 -G)                                       */
+/* 送信側は終盤に確認の取れていないチャンクを空いた経路でも送るので， */
+/* 同じチャンクが複数の経路から届く。先に届いた方だけを書き，どちら   */
+/* にもACKを返す (送信側はACKで確認待ちを消し，重複の送信をやめる)    */
+static struct {
+    int on;                             /* FILEフレームでACKを求められた */
+    uint64_t chunk_len;
+    uint64_t n_chunks, n_have;          /* チャンクの総数と揃った数 */
+    unsigned char *have;                /* チャンクごとの受信済みフラグ */
+    uint64_t dup_bytes;                 /* 捨てた重複のバイト数 */
+} ack;                                  /* crc_log.lock で守る */
+
+/* 標準入力などを読みながら送るストリーム (送信側 -s -)              */
+/* FILEフレームでは長さが分からず，全チャンクを送り終えた接続が EOS  */
+/* フレームで全体の長さを知らせてくる。EOSが届かないまま終われば，    */
+/* 送信側が入力を読み切れなかったので失敗とする                       */
+static struct {
+    int on;                             /* FILEフレームに FRAME_F_STREAM が付いていた */
+    int ended;                          /* EOSが届いた */
+} input;
+
+/* 標準出力・パイプへの順序どおりの出力 (出力ファイル名 "-" か FIFO)  */
+/* 経路ごとのデータは先の位置から届くことがあるので，受け取ったデータは */
+/* いったん ORDER_BLOCK ごとのブロックに置き，先頭から隙間なく検査を通っ */
+/* た部分を書き出しスレッドが順に出力へ書く。ブロックは書き出した位置か */
+/* ら n_ring 個分 (-B) までしか置かず，その先のデータを受け取った受信ス */
+/* レッドは書き出しが進むまで待つ (その接続はTCPのウィンドウが閉じて送 */
+/* 信側が止まる)。UDP経路はその間のデータグラムを捨ててNACKで送り直して */
+/* もらう。待っている受信スレッドしか残っておらず書き出しも進まないとき */
+/* (切れた経路のチャンクを他の経路が後回しで運ぶ場合) だけ上限を広げる  */
+#define ORDER_BLOCK         (1024 * 1024)
+#define ORDER_BUF_MIB       64                  /* -B の既定値 */
+#define ORDER_MIN_BLOCKS    4                   /* 1回の read() の分 (THREAD_BUF_SZ) より十分大きく */
+#define ORDER_UDP_MIB       32                  /* UDP経路があるときの下限 (送信側は確認待ちを16MiBまで */
+                                                /*  送るので，それより狭いと捨てる一方になる) */
+#define ORDER_STALL_MS      200                 /* 全員が待ってこれだけ進まなければ上限を広げる */
+
+typedef struct {
+    uint64_t off, end;
+} order_range_t;
+
+static struct {
+    int on;
+    pthread_mutex_t lock;
+    pthread_cond_t space;               /* 書き出しが進んだ (受信スレッドが待つ) */
+    pthread_cond_t ready;               /* 書き出せる部分が増えた (書き出しスレッドが待つ) */
+    int out_fd;
+    unsigned char **ring;               /* ブロック b は ring[b % n_ring] (NULL = 置いていない) */
+    uint64_t n_ring;
+    unsigned char **pool;               /* 書き出し終えて空いたブロック (n_ring 個まで) */
+    uint64_t n_pool;
+    uint64_t n_live, max_live;          /* 置いているブロック数とその最大 */
+    uint64_t delivered;                 /* 出力に書き終えた位置 */
+    uint64_t verified;                  /* 先頭から隙間なく検査を通った位置 */
+    order_range_t *pending;             /* verified より先で検査を通った範囲 (位置順) */
+    int n_pending, cap_pending;
+    int n_writers, n_waiting;           /* 待つことのある受信スレッドと，そのうち待っている数 */
+    int done, failed;
+    int n_grown;
+    pthread_t th;
+} order = { .lock = PTHREAD_MUTEX_INITIALIZER, .space = PTHREAD_COND_INITIALIZER,
+            .ready = PTHREAD_COND_INITIALIZER, .out_fd = -1 };
+
+/* 前回受け取ったファイルとの重複排除 (-D basis)                       */
+/* 1本目の接続で送信側のチャンク一覧 (FRAME_CDC) をもらい，basis の一覧 */
+/* と (長さ, CRC32C, ハッシュ) が一致するチャンクを出力に写す。写す前に */
+/* basis から読んだ中身のCRC32Cを確かめ，受信したチャンクと同じく       */
+/* crc_log に記録する。送信側には写せなかった範囲だけを RESUME で頼む   */
+#define DEDUP_COPY_LEN      (4 * 1024 * 1024)   /* basis から1度に読んで写す上限 */
+
+static struct {
+    int fd;                             /* basis (-1 = 重複排除しない) */
+    cdc_list_t have;                    /* basis の一覧 */
+    uint32_t *table;                    /* have をハッシュで引く表 (番号 + 1，0 = 空き) */
+    size_t mask;
+    cdc_list_t want;                    /* 送信側のファイルの一覧 */
+    int asked;                          /* 一覧を求めた (1本目の接続) */
+    int planned;                        /* 一覧が届いて頼む範囲を決めた */
+    uint64_t *missing;                  /* 頼んだ範囲 (開始位置, 長さ) の組 */
+    int n_missing;
+    uint64_t n_copied, copied_bytes;    /* basis から写したチャンク */
+} dedup = { -1, { NULL, 0, 0, 0 }, NULL, 0, { NULL, 0, 0, 0 }, 0, 0, NULL, 0, 0, 0 };
+
+/* データが揃った時点で残りの接続を止める (消失訂正・終盤の重複送信) */
+static struct {
+    pthread_mutex_t lock;
+    int uring;                          /* io_uringの受信ループだけが行う (書き込みが非同期) */
+    path_state_t *paths;                /* 揃ったら受信をやめる接続 */
+    int n_paths;
+    int finished;
+} early = { PTHREAD_MUTEX_INITIALIZER, 0, NULL, 0, 0 };
+
+/* ディレクトリの受信 (-d)                                            */
+/* 送信側はツリーのファイルを並べたものを1つのファイルとして送ってくる。 */
+/* 一覧 (MANIFEST) が届いたらディレクトリを作り，作成スレッドが並びの   */
+/* 順にファイルを作って開いておく (大きいファイルは全体を確保する)。    */
+/* ファイルの作成は1つずつが遅いので，受信ループはデータが届いたときに  */
+/* 開いてあるファイルに書くだけで済むよう先回りする。書き終えたファイル */
+/* は閉じ，作成スレッドが開いたままにする数は OUTDIR_MAX_OPEN まで      */
+#define OUTDIR_CREATORS     2                   /* 作成スレッドの数 */
+#define OUTDIR_MAX_OPEN     256                 /* 先回りして開いておくファイルの上限 */
+#define OUTDIR_PREALLOC_MIN (1024 * 1024)       /* これ以上のファイルは作ったときに全体を確保する */
+#define OUTDIR_MODE_MASK    (07777 & ~(S_ISUID | S_ISGID))  /* 送られてきた許可のうち使うもの */
+
+typedef struct {
+    int fd;                             /* 開いていなければ-1 */
+    int created;                        /* 作った (以降は開き直すだけ，ディレクトリは終わりに許可を戻す) */
+    int creating;                       /* 作成中 (他のスレッドは待つ) */
+    int users;                          /* 書き込み中のスレッド数 */
+    uint64_t left;                      /* まだ書いていないバイト数 */
+} tree_file_t;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;                /* 作成を終えた，ファイルを閉じた */
+    const char *root;                   /* NULLなら1つのファイルに受ける */
+    int root_fd;
+    int loaded;                         /* 一覧を受け取った (2本目以降の経路の一覧は照合だけ) */
+    uint32_t crc;                       /* 受け取った一覧のCRC32C */
+    tree_t t;
+    tree_file_t *files;                 /* t.e と同じ並び */
+    pthread_t creators[OUTDIR_CREATORS];
+    int n_creators;
+    int next;                           /* 作成スレッドが次に見るエントリ */
+    int n_open;                         /* 開いているファイル数 */
+    int stop;
+} outdir = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, -1, 0, 0,
+             { NULL, 0, 0, 0, 0, 0 }, NULL, { 0 }, 0, 0, 0, 0 };
+
 int epoll_ctl_add_in(int epfd, int fd);
+int run_epoll(path_state_t *paths, int n_paths, int fd, uint64_t *file_size);
+void note_probe(path_state_t *ps);
+int crc_log_add(const path_state_t *ps);
+int inflate_payload(path_state_t *ps, const unsigned char *p, size_t n, payload_fn fn, void *arg);
+void path_state_free(path_state_t *ps);
+int crc_log_digest(uint64_t file_size, uint32_t *digest);
+int resume_load(const char *out_name);
+int resume_file_crc(int fd, uint64_t size, uint32_t *digest);
+void resume_checkpoint(uint64_t file_size, int force);
+int resume_missing(uint64_t **ranges);
+int resume_complete(void);
+int send_resume(int sock, const uint64_t *ranges, int n);
+void fec_init(uint64_t file_size, uint32_t info, uint32_t chunk_len);
+void fec_note_data(uint64_t off, uint32_t len);
+void fec_add_parity(uint64_t off, uint32_t len, uint32_t info, unsigned char *buf);
+int fec_parity_ok(int path_id, uint32_t len);
+void ack_init(uint64_t file_size, uint32_t chunk_len);
+int stream_begin(void);
+int ack_have(uint64_t off);
+int send_ack(const path_state_t *ps);
+void early_finish(int from_uring);
+int read_manifest(int sock);
+int order_is_stream(const char *name);
+int order_open(int out_fd, uint64_t buf_mib);
+int order_fits(uint64_t off, size_t len);
+void order_commit(uint64_t off, uint32_t len);
+void order_enter(void);
+void order_leave(void);
+int order_close(void);
+int dedup_open(const char *basis);
+int dedup_negotiate(int sock, unsigned char *hdr);
+void dedup_save(const char *out_name, int fd);
+void outdir_close(void);
+void recv_metrics(path_state_t *paths, int n_paths, const uint64_t *file_size);
+int out_pwrite(int fd, const unsigned char *p, size_t len, uint64_t off);
+int parse_frames(path_state_t *ps, const unsigned char *p, size_t n, uint64_t *file_size,
+                 payload_fn fn, void *arg);
+#ifdef HAVE_URING_RECV
+int run_uring(path_state_t *paths, int n_paths, int fd, uint64_t *file_size);
+#endif
+int run_threads(path_state_t *paths, int n_paths, int fd, uint64_t *file_size,
+                const int *cpus, int n_cpus);
+double calib_mbps(const path_state_t *ps);
+double calib_path_mbps(const path_state_t *paths, int n, int path_id);
+int calib_first(const path_state_t *paths, int i);
+int connect_stream(const struct addrinfo *res, const tune_profile_t *tp,
+                   const uint64_t *missing, int n_missing, int *n_streams, uint32_t *udp_token);
+udp_recv_t *udp_recv_open(int tcp_sock, uint32_t token, const tune_profile_t *tp);
+void udp_recv_free(udp_recv_t *u);
+int udp_recv_start(path_state_t *paths, int n_paths, int fd);
+int udp_recv_join(path_state_t *paths, int n_paths, uint64_t *file_size);
+void tune_record(tune_db_t *db, char **hosts, int n_hosts, const path_state_t *paths,
+                 char **conn_hosts, int n_conns, const struct timespec *start, const struct timespec *end);
+int calib_save(const path_state_t *paths, int n, char **hosts,
+               const char *history_file, const char *ratio_file);
 
 int main(int argc, char** argv)
 {
     char **server_ipaddr_strs;
+    char **server_port_strs;        /* 経路ごとのポート ("host:port" で指定) */
     unsigned int port = TCP_SERVER_PORT;
     char *filename = NULL;
     int fd = 1;                             /* 標準出力 */
     char *dummy_file = "HELLO.txt";               /* ダミーのリクエストメッセージ */
 
     int n_servers;
-    int *serverSocks;
-    int epfd;
-
-    struct epoll_event events[MAX_EVENTS];
-    int nfds;
+    int n_conns = 0;                /* 張ったTCP接続の数 (経路ごとに複数本のことがある) */
+    int n_streams, k;
+    int n_tcp;                      /* UDP経路を除いた接続の数 (paths の先頭から) */
+    uint32_t udp_token;
+    char **conn_hosts;              /* 接続ごとの宛先 (表示用) */
+    int backend = RECV_EPOLL;       /* 受信ループの実装 */
+    int cpus[MAX_CALIB_PATHS];      /* 受信スレッドを固定するCPU (-a) */
+    int n_cpus = 0;
 
     struct sockaddr_in  *serverAddrs;
     int     addrLen;                /* clientAddrのサイズ */
 
-    char    buf[BUF_LEN];           /* 受信バッファ */
-    int     n;                      /* 受信バイト数 */
+    path_state_t *paths;            /* 経路ごとの受信状態 */
+    uint64_t file_size = 0;         /* FILEフレームで通知された元ファイルのサイズ */
     int     isEnd = 0;              /* 終了フラグ，0でなければ終了 */
 
     int     yes = 1;                /* setsockopt()用 */
@@ -46,42 +385,243 @@ int main(int argc, char** argv)
     int i;
 
     /* getaddrinfo用 */
-    struct addrinfo hints, *res, *rp;
+    struct addrinfo hints, *res;
     int err;
     char port_str[16];
 
     double elapsed_sec;
     struct timespec start_time, end_time;
     struct stat info;
+    off_t transferred;              /* ネットワークで受けたバイト数 */
     double throughput_bps;
+    uint32_t digest;                /* ファイル全体のCRC32C */
+
+    /* 再開用 */
+    int resume_opt = 0;             /* -R: 完了ビットマップを使う */
+    int dir_opt = 0;                /* -d: 出力先はディレクトリ (送信側の -d) */
+    char *basis = NULL;             /* -D: 重複排除に使う手元のファイル */
+    uint64_t order_mib = ORDER_BUF_MIB;     /* -B: 順序どおりの出力で先に届いた分を置く上限 */
+    int order_fd = -1;              /* 順序どおりに書き出す先 (-1 = 出力ファイルに書く) */
+    uint64_t *missing = NULL;       /* 送信側に頼む範囲 (開始位置, 長さ) の組 */
+    int n_missing = 0;
+
+    /* 帯域測定モード用 */
+    char *history_file = NULL;      /* NULLでなければ帯域測定モード */
+    char *ratio_file = CALIB_RATIO_FILE;
+    char **hosts;
+    int opt;
+
+    /* ソケット調整用 (-t) */
+    char *tune_file = NULL;
+    tune_db_t *tune_db = NULL;
+    tune_profile_t *tp;
+
+    /* 動作中の計測値 (-M) */
+    char *metrics_spec = NULL;
+
+    /* 時系列計測用 */
+    char *telem_file = NULL;
+    int telem_interval = TELEM_INTERVAL_MS;
+    telem_path_t **tm_paths;
 
     /* コマンドライン引数の処理 */
-    if(argc < 3) {
-        printf("Usage: %s [output_file] [ip_address]\n", argv[0]);
+    while ((opt = getopt(argc, argv, "m:a:C:W:T:i:Rt:dD:B:M:")) != -1) {
+        switch (opt) {
+        case 't':
+            tune_file = optarg;
+            break;
+        case 'R':
+            resume_opt = 1;
+            break;
+        case 'd':
+            dir_opt = 1;
+            break;
+        case 'D':
+            basis = optarg;
+            break;
+        case 'B':
+            order_mib = strtoull(optarg, NULL, 10);
+            break;
+        case 'T':
+            telem_file = optarg;
+            break;
+        case 'M':
+            metrics_spec = optarg;
+            net_count_io = 1;   /* 接続の最初から数える */
+            break;
+        case 'i':
+            telem_interval = atoi(optarg);
+            break;
+        case 'a': {
+            /* カンマ区切りのCPU番号，経路の順に割り当てる */
+            char *tok = strtok(optarg, ",");
+            while (tok != NULL && n_cpus < MAX_CALIB_PATHS) {
+                cpus[n_cpus++] = atoi(tok);
+                tok = strtok(NULL, ",");
+            }
+            break;
+        }
+        case 'm':
+            if (strcmp(optarg, "epoll") == 0) backend = RECV_EPOLL;
+            else if (strcmp(optarg, "threads") == 0) backend = RECV_THREADS;
+#ifdef HAVE_URING_RECV
+            else if (strcmp(optarg, "uring") == 0) backend = RECV_URING;
+#endif
+            else {
+                fprintf(stderr, "unknown mode: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'C':
+            history_file = optarg;
+            break;
+        case 'W':
+            ratio_file = optarg;
+            break;
+        default:
+            return 1;
+        }
+    }
+    if((history_file == NULL && argc - optind < 2) || (history_file != NULL && argc - optind < 1)) {
+        printf("Usage: %s [-m epoll|uring|threads] [-a cpu,cpu,...] [-R | -D basis_file] [output_file] [ip_address[:port]]\n", argv[0]);
+        printf("       %s [-m epoll|uring|threads] [-a cpu,cpu,...] -d output_directory [ip_address[:port]]\n", argv[0]);
+        printf("       %s -C history_file [-W ratio_file] [ip_address[:port]]   (bandwidth calibration)\n", argv[0]);
+        printf("Common options: -T telemetry.csv [-i interval_ms]  per-path throughput and TCP_INFO samples\n");
+        printf("  -R  resumable: keep a completion bitmap in output_file.resume and, if it exists,\n"
+               "      fetch only the missing ranges\n");
+        printf("  -t profile  size receive buffers from each host's measured RTT and bandwidth,\n"
+               "      and update the per-host profile after the transfer\n");
+        printf("  -d  receive a directory sent with send.out -d and recreate it under output_directory\n");
+        printf("  output_file '-' (stdout) or a FIFO: write the data in order as soon as each prefix\n"
+               "      is complete; -B mib bounds the reorder buffer (default %d)\n", ORDER_BUF_MIB);
+        printf("  -D basis_file  dedup against a previous copy: chunks of the sender's file that\n"
+               "      basis_file already has are copied locally and only the rest is sent\n"
+               "      (send.out -s; chunk lists are kept in <file>.cdc)\n");
+        printf("  -M [host:]port|unix:path  serve live counters in Prometheus text format over HTTP\n");
         return 0;
     }
 
-    printf("set outputfile: %s", argv[1]);
-    filename = argv[1];
-    fd = open(filename, O_CREAT | O_WRONLY, 0644);
-    if(fd < 0) {
-        perror("open");
+    if (basis != NULL && (resume_opt || dir_opt || history_file != NULL)) {
+        fprintf(stderr, "-D cannot be combined with -R, -d or -C\n");
         return 1;
     }
+    if (history_file == NULL && dir_opt) {
+        /* ディレクトリの受信: ファイルは一覧が届いてから作る */
+        if (resume_opt) {
+            fprintf(stderr, "-R cannot be combined with -d\n");
+            return 1;
+        }
+        filename = argv[optind];
+        printf("set output directory: %s\n", filename);
+        if (mkdir(filename, 0755) < 0 && errno != EEXIST) {
+            perror(filename);
+            return 1;
+        }
+        outdir.root = filename;
+        outdir.root_fd = open(filename, O_RDONLY | O_DIRECTORY);
+        if (outdir.root_fd < 0) {
+            perror(filename);
+            return 1;
+        }
+        fd = -1;
+        hosts = &argv[optind + 1];
+    } else if (history_file == NULL && order_is_stream(argv[optind])) {
+        /* 標準出力やパイプに順に書き出す: 先頭から揃った分をすぐに渡す */
+        filename = argv[optind];
+        if (resume_opt || basis != NULL) {
+            fprintf(stderr, "-R and -D need a regular output file\n");
+            return 1;
+        }
+        if (strcmp(filename, "-") == 0) {
+            order_fd = dup(STDOUT_FILENO);
+            dup2(STDERR_FILENO, STDOUT_FILENO);     /* 表示はデータに混ぜない */
+        } else {
+            order_fd = open(filename, O_WRONLY);
+        }
+        if (order_fd < 0) {
+            perror(filename);
+            return 1;
+        }
+        signal(SIGPIPE, SIG_IGN);   /* 読み手が閉じたら write のエラーで止める */
+        printf("set outputfile: %s (in order, reorder buffer %llu MiB)\n", filename,
+               (unsigned long long)order_mib);
+        if (backend != RECV_THREADS) {
+            /* 先に進みすぎた接続だけを待たせるため，接続ごとのスレッドで受ける */
+            printf("in-order output: receiving with one thread per connection\n");
+            backend = RECV_THREADS;
+        }
+        fd = -1;
+        hosts = &argv[optind + 1];
+    } else if (history_file == NULL) {
+        printf("set outputfile: %s", argv[optind]);
+        filename = argv[optind];
+        /* -R で前回のビットマップが残っていれば，出力を切り詰めずに続きから受け取る */
+        err = resume_opt ? resume_load(filename) : 0;
+        if (err < 0) return 1;
+        if (err > 0) {
+            n_missing = resume_missing(&missing);
+            if (n_missing < 0) return 1;
+            if (n_missing == 0) {
+                printf("\n%s is already complete\n", filename);
+                unlink(resume.path);
+                return 0;
+            }
+            printf(" (resuming: %d missing ranges)", n_missing);
+            fd = open(filename, O_CREAT | O_RDWR, 0644);     /* 最後に全体のCRCを読み直す */
+        } else {
+            struct stat bst;
+            /* 出力を切り詰めると basis が消えてしまう */
+            if (basis != NULL && stat(basis, &bst) == 0 && stat(filename, &info) == 0 &&
+                bst.st_dev == info.st_dev && bst.st_ino == info.st_ino) {
+                fprintf(stderr, "\n-D %s: the basis must be a different file than the output\n", basis);
+                return 1;
+            }
+            fd = open(filename, O_CREAT | O_RDWR | O_TRUNC, 0644);     /* パリティからの復元で読む */
+        }
+        if(fd < 0) {
+            perror("open");
+            return 1;
+        }
+        printf("\n");
+        resume.out_fd = fd;
+        if (basis != NULL && dedup_open(basis) < 0) return 1;
+        hosts = &argv[optind + 1];
+    } else {
+        fd = -1;
+        hosts = &argv[optind];
+    }
 
-    n_servers = argc - 2;
+    n_servers = argc - (int)(hosts - argv);
+    if (tune_file != NULL) {
+        tune_db = malloc(sizeof(tune_db_t));
+        if (tune_db == NULL || tune_load(tune_db, tune_file) < 0) {
+            perror(tune_file);
+            return 1;
+        }
+    }
     serverAddrs = (struct sockaddr_in *)malloc(sizeof(struct sockaddr_in) * n_servers);
-    serverSocks = (int *)malloc(sizeof(int) * n_servers);
+    paths = (path_state_t *)calloc((size_t)n_servers * MAX_STREAMS, sizeof(path_state_t));
+    tm_paths = (telem_path_t **)malloc(sizeof(telem_path_t *) * n_servers * MAX_STREAMS);
+    conn_hosts = (char **)malloc(sizeof(char *) * n_servers * MAX_STREAMS);
     server_ipaddr_strs = (char **)malloc(sizeof(char *) * n_servers);
+    server_port_strs = (char **)malloc(sizeof(char *) * n_servers);
 
+    /* ポート番号を文字列に変換 (既定値) */
+    snprintf(port_str, sizeof(port_str), "%d", port);
+
+    /* "host[:port]" を分ける。ホスト名は長さを問わない */
     for (i = 0; i < n_servers; i++) {
-        server_ipaddr_strs[i] = (char *)malloc(sizeof(char) * 16);
-        strcpy(server_ipaddr_strs[i], argv[i + 2]);
+        char *colon;
+        server_ipaddr_strs[i] = strdup(hosts[i]);
+        colon = strrchr(server_ipaddr_strs[i], ':');
+        if (colon != NULL) {
+            *colon = '\0';
+            server_port_strs[i] = colon + 1;
+        } else {
+            server_port_strs[i] = port_str;
+        }
     }
 
-    /* ポート番号を文字列に変換 */
-    snprintf(port_str, sizeof(port_str), "%d", port);
-
     for (i = 0; i < n_servers; i++) {
         /* getaddrinfo の設定 */
         memset(&hints, 0, sizeof(hints));
@@ -89,84 +629,209 @@ int main(int argc, char** argv)
         hints.ai_socktype = SOCK_STREAM; /* TCP */
 
         /* ホスト名(またはIP)とポートからアドレス情報を解決 */
-        err = getaddrinfo(server_ipaddr_strs[i], port_str, &hints, &res);
+        err = getaddrinfo(server_ipaddr_strs[i], server_port_strs[i], &hints, &res);
         if (err != 0) {
             fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
             return 1;
         }
 
-        /* 解決されたアドレスのリストを順に試す */
-        for (rp = res; rp != NULL; rp = rp->ai_next) {
-            serverSocks[i] = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-            if (serverSocks[i] < 0) continue;
-
-            if (connect(serverSocks[i], rp->ai_addr, rp->ai_addrlen) != -1) {
-                break; /* 接続成功 */
-            }
-
-            close(serverSocks[i]); /* 失敗したら閉じる */
+        /* 1本目への返事 (STREAMSフレーム) でこの経路の本数が分かるので， */
+        /* 残りも同じ宛先に張る。接続ごとに受信状態を1つ持つ              */
+        n_streams = 1;
+        tp = tune_db != NULL ? tune_find(tune_db, hosts[i]) : NULL;
+        if (tp != NULL) {
+            char desc[256];
+            tune_describe(tp, desc, sizeof(desc));
+            printf("%s: %s\n", hosts[i], desc);
         }
-
-        if (rp == NULL) { /* どのアドレスにも接続できなかった */
-            fprintf(stderr, "Could not connect to %s\n", server_ipaddr_strs[i]);
-            return 1;
+        for (k = 0; k < n_streams; k++) {
+            int sock = connect_stream(res, tp, missing, n_missing, &n_streams, &udp_token);
+            if (sock < 0) {
+                if (k == 0) { /* どのアドレスにも接続できなかった */
+                    fprintf(stderr, "Could not connect to %s\n", hosts[i]);
+                    return 1;
+                }
+                fprintf(stderr, "%s: only %d of %d streams connected\n", hosts[i], k, n_streams);
+                break;
+            }
+            paths[n_conns].sock = sock;
+            paths[n_conns].path_id = -1;
+            if (udp_token != 0) {
+                /* 送信側がこの経路のデータをUDPで送る */
+                paths[n_conns].udp = udp_recv_open(sock, udp_token, tp);
+                if (paths[n_conns].udp == NULL) return 1;
+            }
+            if (k == 0) {
+                snprintf(paths[n_conns].tm.name, sizeof(paths[n_conns].tm.name), "%s", hosts[i]);
+            } else {
+                snprintf(paths[n_conns].tm.name, sizeof(paths[n_conns].tm.name), "%.50s#%d", hosts[i], k);
+            }
+            paths[n_conns].tm.sock = sock;
+            tm_paths[n_conns] = &paths[n_conns].tm;
+            if (tune_db != NULL) {
+                tune_meas_t m;
+                memset(&m, 0, sizeof(m));
+                tune_sample(&m, sock);      /* 接続時のRTT */
+                paths[n_conns].rtt_us = m.min_rtt_us;
+            }
+            conn_hosts[n_conns] = hosts[i];
+            n_conns++;
         }
 
         freeaddrinfo(res); /* メモリ解放 */
     }
 
-    epfd = epoll_create(MAX_EVENTS);
-    if (epfd < 0) {
-        perror("epoll_create");
+    if (outdir.root != NULL && !outdir.loaded) {
+        fprintf(stderr, "sender is not sending a directory: rerun without -d\n");
         return 1;
     }
 
-    for (i = 0; i < n_servers; i++) {
-        if (epoll_ctl_add_in(epfd, serverSocks[i]) != 0) {
-            perror("epoll_ctrl_add_in");
-            return 1;
+    /* UDP経路は専用のスレッドで受けるので，受信ループに渡す接続の後ろにまとめる */
+    n_tcp = 0;
+    for (i = 0; i < n_conns; i++) {
+        if (paths[i].udp == NULL) {
+            path_state_t tmp = paths[i];
+            char *h = conn_hosts[i];
+            for (k = i; k > n_tcp; k--) {
+                paths[k] = paths[k - 1];
+                conn_hosts[k] = conn_hosts[k - 1];
+            }
+            paths[n_tcp] = tmp;
+            conn_hosts[n_tcp] = h;
+            n_tcp++;
         }
     }
+    for (i = 0; i < n_conns; i++) tm_paths[i] = &paths[i].tm;
 
-    clock_gettime(CLOCK_REALTIME, &start_time);
+    if (telem_file != NULL && telem_start(&telem, telem_file, telem_interval, tm_paths, n_conns) == 0) {
+        telem_p = &telem;
+    }
 
-    int active_connections = n_servers; /* アクティブな接続数 */
+    /* データが揃ったら，まだ終わっていない接続を止める */
+    fec.fd = fd;
+    early.paths = paths;
+    early.n_paths = n_conns;
 
-    while(active_connections > 0) {
-        nfds = epoll_wait(epfd, events, MAX_EVENTS, 60000);
+    /* 経過時間は時刻合わせの影響を受けない単調増加クロックで測る */
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
 
-        if (nfds < 0) {
-            perror("epoll_wait");
-            break;
+    if (order_fd >= 0) {
+        if (n_tcp < n_conns && order_mib < ORDER_UDP_MIB) {
+            printf("in-order output: reorder buffer raised to %d MiB for UDP paths\n", ORDER_UDP_MIB);
+            order_mib = ORDER_UDP_MIB;
         }
-        if (nfds == 0) {
-            fprintf(stderr, "Timeout\n");
-            break;
+        if (order_open(order_fd, order_mib) < 0) {
+            perror("in-order output");
+            return 1;
         }
+    }
 
-        for (i = 0; i < nfds; i++) {
-            int sock_fd = events[i].data.fd;
-            n = read(sock_fd, buf, BUF_LEN);
-            
-            if (n > 0) {
-                /* データ受信 */
-                write(fd, buf, n);
-            } else {
-                /* 切断 (n=0) またはエラー (n<0) */
-                /* 監視対象から削除 */
-                epoll_ctl(epfd, EPOLL_CTL_DEL, sock_fd, NULL);
-                /* ソケットを閉じる (後でまとめて閉じる処理があるなら二重クローズに注意) */
-                /* ここで閉じると、下のループでの close(serverSocks[i]) でエラーになるが、
-                   通常は無視しても問題ないか、あるいは管理フラグを立てる */
-                close(sock_fd); 
-                active_connections--;
+    if (metrics_spec != NULL) {
+        if (metrics_serve(metrics_spec) < 0) return 1;
+        recv_metrics(paths, n_conns, &file_size);
+    }
+
+    /* 受信ループ */
+#ifdef HAVE_URING_RECV
+    /* io_uringの受信ループは書き込みが非同期なので，復元と再開用の記録は */
+    /* そのループだけが行う (UDP経路のスレッドより先に決めておく)        */
+    if (backend == RECV_URING && n_tcp > 0) early.uring = 1;
+#endif
+    err = udp_recv_start(paths + n_tcp, n_conns - n_tcp, fd);
+    if (err != 0 || n_tcp == 0) {
+        /* TCPの経路が無い */
+    } else
+#ifdef HAVE_URING_RECV
+    if (backend == RECV_URING) {
+        err = run_uring(paths, n_tcp, fd, &file_size);
+    } else
+#endif
+    if (backend == RECV_THREADS) {
+        err = run_threads(paths, n_tcp, fd, &file_size, cpus, n_cpus);
+    } else {
+        err = run_epoll(paths, n_tcp, fd, &file_size);
+    }
+    if (udp_recv_join(paths + n_tcp, n_conns - n_tcp, &file_size) != 0) err = 1;
+    /* 受信を終えた時点でまだ復元していないストライプがあれば復元する */
+    early.uring = 0;
+    early.n_paths = 0;
+    early_finish(0);
+    if (order_close() < 0) err = 1;
+    if (err != 0) {
+        resume_checkpoint(file_size, 1);
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    if (telem_p != NULL) telem_stop(telem_p);
+    if (tune_db != NULL) {
+        tune_record(tune_db, hosts, n_servers, paths, conn_hosts, n_conns, &start_time, &end_time);
+        free(tune_db);
+    }
+
+    if (history_file != NULL) {
+        /* 帯域測定モード: 結果を履歴に追記し，比率ファイルを更新して終わる */
+        /* 複数本張った経路は接続ごとの値を足して経路の値とする */
+        for (i = 0; i < n_conns; i++) {
+            if (calib_first(paths, i)) {
+                printf("path %d (%s): %.3f Mbps\n", paths[i].path_id, conn_hosts[i],
+                       calib_path_mbps(paths, n_conns, paths[i].path_id));
             }
         }
+        err = calib_save(paths, n_conns, conn_hosts, history_file, ratio_file);
+        free(serverAddrs);
+        for (i = 0; i < n_conns; i++) {
+            path_state_free(&paths[i]);
+        }
+        free(paths);
+        free(tm_paths);
+        free(conn_hosts);
+        for (i = 0; i < n_servers; i++) {
+            free(server_ipaddr_strs[i]);
+        }
+        free(server_ipaddr_strs);
+        free(server_port_strs);
+        return err == 0 ? 0 : 1;
     }
 
-    clock_gettime(CLOCK_REALTIME, &end_time);
+    /* 通知されたサイズに揃える (末尾のチャンクが欠けていても長さは元ファイルと同じ) */
+    if (fd < 0) {
+        /* ディレクトリ: 各ファイルは作ったときに元の長さで確保してある */
+        /* 順序どおりの出力: 書き出したのは先頭から揃った分まで       */
+        memset(&info, 0, sizeof(info));
+        info.st_size = (off_t)file_size;
+    } else {
+        if (file_size > 0 && ftruncate(fd, (off_t)file_size) < 0) {
+            perror("ftruncate");
+        }
+        fstat(fd, &info);
+    }
 
-    fstat(fd, &info);
+    /* 届いた分をビットマップに記録する。途中で切れていれば次回 -R で続きから */
+    resume_checkpoint(file_size, 1);
+    if (resume.loaded) {
+        /* 再開した転送: 全体のCRCは出力ファイルから求める */
+        if (file_size != resume.file_size || !resume_complete() ||
+            resume_file_crc(fd, file_size, &digest) < 0) {
+            err = -1;
+        }
+    } else if (input.on && !input.ended) {
+        fprintf(stderr, "the sender did not reach the end of its input stream\n");
+        err = -1;
+    } else if (crc_log_digest(file_size, &digest) < 0) {
+        err = -1;
+    } else if (order_fd >= 0 && order.delivered != file_size) {
+        fprintf(stderr, "only %llu of %llu bytes were written to the output\n",
+                (unsigned long long)order.delivered, (unsigned long long)file_size);
+        err = -1;
+    }
+    if (resume.enabled) {
+        if (err == 0 && resume_complete()) {
+            unlink(resume.path);
+        } else if (resume.fd >= 0) {
+            fprintf(stderr, "transfer incomplete: rerun with -R to fetch the rest (%s)\n", resume.path);
+        }
+    }
 
     /* 既にループ内で閉じているので、ここの close ループは削除するか、
        エラーチェックを外すのが安全です。
@@ -175,28 +840,145 @@ int main(int argc, char** argv)
     //     close(serverSocks[i]); 
     // }
     
-    close(fd);
+    /* 次回 -D でこのファイルを basis にするときは一覧を作り直さずに済む */
+    if (err == 0 && crc_log.n_bad == 0 && fd >= 0) dedup_save(filename, fd);
+    if (fd >= 0) close(fd);
+    outdir_close();
 
     free(serverAddrs);
-    free(serverSocks);
+    for (i = 0; i < n_conns; i++) {
+        path_state_free(&paths[i]);
+        udp_recv_free(paths[i].udp);
+    }
+    free(paths);
+    free(tm_paths);
+    free(conn_hosts);
     for (i = 0; i < n_servers; i++) {
         free(server_ipaddr_strs[i]);
     }
     free(server_ipaddr_strs);
+    free(server_port_strs);
 
     /* tv_nsec (ナノ秒) を使用するように修正 */
     elapsed_sec = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_nsec - start_time.tv_nsec) / 1000000000.0;
+    /* basis から写した分 (-D) と前回までに受け取っていた分 (-R) は */
+    /* 計測を始める前からあるので含めない                           */
+    transferred = info.st_size - (dedup.planned ? (off_t)dedup.copied_bytes : 0) -
+                  (resume.loaded ? (off_t)resume.had : 0);
     if (elapsed_sec > 0) {
-        throughput_bps = (info.st_size * 8.0) / elapsed_sec;
+        throughput_bps = (transferred * 8.0) / elapsed_sec;
     } else {
         throughput_bps = 0.0;
     }
 
-    printf("Total Bytes Transferred : %ld bytes\n", info.st_size); /* %lld -> %ld */
+    printf("Total Bytes Transferred : %ld bytes\n", transferred); /* %lld -> %ld */
     printf("Total Elapsed Time      : %.6f sec\n", elapsed_sec);
     printf("Effective Throughput    : %.3f Mbps\n", throughput_bps / 1000000.0);
 
-    return  0;
+    /* 受信時に検査したチャンクのCRCからファイル全体のCRCを組み立てる */
+    if (err == 0 && crc_log.n_bad == 0) {
+        printf("File CRC32C             : %08x (%zu chunks verified%s)\n", digest, crc_log.n,
+               resume.loaded ? ", resumed" : "");
+        if (outdir.root != NULL) {
+            printf("Directory               : %s (files packed in path order)\n", outdir.root);
+        }
+        if (fec.k > 0) {
+            printf("Parity                  : %d+%d, %llu chunks rebuilt\n", fec.k, fec.m,
+                   (unsigned long long)fec.n_rebuilt);
+        }
+        if (ack.on) {
+            printf("End-game Duplicates     : %llu bytes discarded\n", (unsigned long long)ack.dup_bytes);
+        }
+        if (order_fd >= 0) {
+            printf("In-order Output         : %llu bytes, reorder buffer peak %llu MiB%s\n",
+                   (unsigned long long)order.delivered, (unsigned long long)(order.max_live * ORDER_BLOCK >> 20),
+                   order.n_grown > 0 ? " (raised while paths waited for a gap)" : "");
+        }
+        if (dedup.planned) {
+            printf("Dedup                   : %llu bytes copied from the basis (%llu of %zu chunks)\n",
+                   (unsigned long long)dedup.copied_bytes, (unsigned long long)dedup.n_copied, dedup.want.n);
+        }
+        err = 0;
+    } else {
+        fprintf(stderr, "Integrity check FAILED: %d chunks with bad CRC32C, %zu chunks verified\n",
+                crc_log.n_bad, crc_log.n);
+        err = 1;
+    }
+    free(crc_log.recs);
+    for (i = 0; fec.stripes != NULL && (uint64_t)i < fec.n_stripes; i++) {
+        for (k = 0; k < fec.m; k++) free(fec.stripes[i].par[k]);
+    }
+    free(fec.stripes);
+    free(fec.todo);
+    free(ack.have);
+    free(missing);
+    free(dedup.missing);
+    free(dedup.table);
+    cdc_free(&dedup.have);
+    cdc_free(&dedup.want);
+    if (dedup.fd >= 0) close(dedup.fd);
+    free(resume.bits);
+    free(resume.path);
+    if (resume.fd >= 0) close(resume.fd);
+
+    return  err;
+}
+
+/* res のアドレスに接続し，欲しい範囲を伝えて送信側の返事を受け取る */
+/* 返事に載っている経路の本数を *n_streams に入れ，ソケットを返す     */
+/* データをUDPで送る経路ならセッション識別子を *udp_token に入れる (TCPなら0) */
+/* tp があれば接続前に受信バッファ等を設定する (ウィンドウスケールは接続時に決まる) */
+int connect_stream(const struct addrinfo *res, const tune_profile_t *tp,
+                   const uint64_t *missing, int n_missing, int *n_streams, uint32_t *udp_token)
+{
+    const struct addrinfo *rp;
+    unsigned char hdr[FRAME_HDR_LEN];
+    frame_hdr_t h;
+    int sock = -1, rc;
+
+    /* 解決されたアドレスのリストを順に試す */
+    for (rp = res; rp != NULL; rp = rp->ai_next) {
+        sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (sock < 0) continue;
+        if (tp != NULL) tune_apply(sock, tp, TUNE_RECV);
+
+        if (connect(sock, rp->ai_addr, rp->ai_addrlen) != -1) {
+            break; /* 接続成功 */
+        }
+
+        close(sock); /* 失敗したら閉じる */
+    }
+    if (rp == NULL) return -1;
+
+    /* 接続ごとに欲しい範囲を伝える (新規の転送なら「全体」)。-D なら1本目で */
+    /* チャンク一覧をもらって範囲を決め，以降の接続でもその範囲を伝える      */
+    if (dedup.fd >= 0 && !dedup.asked) {
+        rc = dedup_negotiate(sock, hdr);
+    } else {
+        if (dedup.planned) {
+            missing = dedup.missing;
+            n_missing = dedup.n_missing;
+        }
+        rc = send_resume(sock, missing, n_missing) < 0 || read_all(sock, hdr, sizeof(hdr)) < 0 ? -1 : 0;
+    }
+    if (rc < 0) {
+        perror("stream handshake");
+        close(sock);
+        return -1;
+    }
+    if (frame_hdr_unpack(hdr, &h) < 0 || h.type != FRAME_STREAMS ||
+        h.offset < 1 || h.offset > MAX_STREAMS) {
+        fprintf(stderr, "unexpected reply from sender\n");
+        close(sock);
+        return -1;
+    }
+    if ((h.flags & FRAME_F_TREE) && read_manifest(sock) < 0) {
+        close(sock);
+        return -1;
+    }
+    *n_streams = (int)h.offset;
+    *udp_token = (h.flags & FRAME_F_UDP) ? h.file_id : 0;
+    return sock;
 }
 
 int epoll_ctl_add_in(int epfd, int fd)
@@ -212,3 +994,2918 @@ int epoll_ctl_add_in(int epfd, int fd)
     }
     return 0;
 }
+
+/* 接続の受信を終えたか */
+static inline int path_ended(const path_state_t *ps)
+{
+    return __atomic_load_n(&ps->ended, __ATOMIC_ACQUIRE);
+}
+
+/* 接続の受信を終えた印を付ける。ENDフレームを受けたスレッドと early_finish */
+/* のうち先に付けた方だけが時刻を記録して1を返す                           */
+static int path_end(path_state_t *ps)
+{
+    struct timespec now;
+    int zero = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!__atomic_compare_exchange_n(&ps->ended, &zero, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return 0;
+    ps->ended_at = now;
+    return 1;
+}
+
+/* 受信したバイト列をフレームとして解析し，ペイロードを fn に渡す */
+/* ヘッダやペイロードが複数のread()にまたがっても続きから処理する */
+int parse_frames(path_state_t *ps, const unsigned char *p, size_t n, uint64_t *file_size,
+                 payload_fn fn, void *arg)
+{
+    frame_hdr_t h;
+
+    while (n > 0) {
+        if (ps->remain > 0) {
+            /* ペイロード部分 */
+            size_t len = n < ps->remain ? n : ps->remain;
+            if (ps->discard) {
+                ps->probe_bytes += len;
+            } else if (ps->dup) {
+                /* 先に届いた方を書いてあるので読み捨てる */
+            } else if (ps->parity) {
+                /* パリティは出力に書かずに溜めておく */
+                memcpy(ps->par + (ps->chunk_len - ps->remain), p, len);
+                ps->crc = crc32c(ps->crc, p, len);
+            } else if (ps->zlib) {
+                /* 展開しながら書き出す (offは展開後のバイト数だけ進む) */
+                if (inflate_payload(ps, p, len, fn, arg) < 0) return -1;
+            } else {
+                /* 書き出す前に受信バッファ上でCRCを進める */
+                if (ps->check) ps->crc = crc32c(ps->crc, p, len);
+                if (fn(arg, p, len, ps->off) < 0) return -1;
+                ps->off += len;
+            }
+            ps->remain -= (uint32_t)len;
+            p += len;
+            n -= len;
+            if (ps->remain == 0 && ps->parity) {
+                if (ps->crc == ps->want_crc) {
+                    fec_add_parity(ps->chunk_off, ps->chunk_len, ps->par_info, ps->par);
+                } else {
+                    /* 壊れたパリティは使わない (データの照合とは別なので失敗にはしない) */
+                    fprintf(stderr, "path %d: CRC32C mismatch in parity at offset %llu\n",
+                            ps->path_id, (unsigned long long)ps->chunk_off);
+                    free(ps->par);
+                }
+                ps->par = NULL;
+                ps->parity = 0;
+            } else if (ps->remain == 0 && ps->dup) {
+                pthread_mutex_lock(&crc_log.lock);
+                ack.dup_bytes += ps->chunk_len;
+                pthread_mutex_unlock(&crc_log.lock);
+                ps->dup = 0;
+                if (send_ack(ps) < 0) return -1;
+            } else if (ps->remain == 0 && !ps->discard) {
+                if (crc_log_add(ps) == 0 && ack.on && send_ack(ps) < 0) return -1;
+            }
+            continue;
+        }
+
+        /* ヘッダ部分 */
+        size_t len = FRAME_HDR_LEN - ps->hdr_got;
+        if (len > n) len = n;
+        memcpy(ps->hdr + ps->hdr_got, p, len);
+        ps->hdr_got += (int)len;
+        p += len;
+        n -= len;
+        if (ps->hdr_got < FRAME_HDR_LEN) break;
+        ps->hdr_got = 0;
+
+        if (frame_hdr_unpack(ps->hdr, &h) < 0) {
+            fprintf(stderr, "bad frame magic\n");
+            return -1;
+        }
+        ps->path_id = h.path_id;
+        ps->discard = 0;
+        switch (h.type) {
+        case FRAME_FILE:
+            if (h.flags & FRAME_F_STREAM) {
+                if (stream_begin() < 0) return -1;
+            } else {
+                *file_size = h.offset;
+            }
+            if (h.flags & FRAME_F_FEC) fec_init(h.offset, h.raw_len, h.crc);
+            if (h.flags & FRAME_F_ACK) ack_init(h.offset, h.crc);
+            break;
+        case FRAME_PARITY: {
+            /* 長さを確かめてから読み溜める */
+            int ok = fec_parity_ok(ps->path_id, h.length);
+            if (ok < 0) return -1;
+            if (ok == 0) {
+                ps->remain = h.length;
+                ps->discard = 1;
+                break;
+            }
+            ps->par = malloc(h.length > 0 ? h.length : 1);
+            if (ps->par == NULL) {
+                perror("malloc");
+                return -1;
+            }
+            ps->parity = 1;
+            ps->par_info = h.raw_len;
+            ps->remain = h.length;
+            ps->crc = 0;
+            ps->want_crc = h.crc;
+            ps->chunk_off = h.offset;
+            ps->chunk_len = h.length;
+            if (h.length == 0) {
+                free(ps->par);
+                ps->par = NULL;
+                ps->parity = 0;
+            }
+            break;
+        }
+        case FRAME_DATA: {
+            /* 通知されたサイズを越えて書かせない (ストリームは長さが後で決まる) */
+            uint64_t extent = (h.flags & FRAME_F_ZLIB) ? h.raw_len : h.length;
+            if (*file_size > 0 && !__atomic_load_n(&input.on, __ATOMIC_RELAXED) &&
+                (h.offset > *file_size || extent > *file_size - h.offset)) {
+                fprintf(stderr, "path %d: data at %llu+%llu beyond the end of the file (%llu bytes)\n",
+                        ps->path_id, (unsigned long long)h.offset, (unsigned long long)extent,
+                        (unsigned long long)*file_size);
+                return -1;
+            }
+            ps->off = h.offset;
+            ps->remain = h.length;
+            ps->check = (h.flags & FRAME_F_CRC) != 0;
+            ps->crc = 0;
+            ps->want_crc = h.crc;
+            ps->chunk_off = h.offset;
+            ps->chunk_len = h.length;
+            ps->zlib = (h.flags & FRAME_F_ZLIB) != 0;
+            ps->dup = ack.on && h.length > 0 && ack_have(h.offset);
+            if (ps->zlib) {
+                ps->chunk_len = h.raw_len;
+                if (!ps->zs_ready) {
+                    ps->zout = malloc(ZOUT_LEN);
+                    if (ps->zout == NULL || inflateInit2(&ps->zs, -15) != Z_OK) {
+                        fprintf(stderr, "cannot set up inflate\n");
+                        return -1;
+                    }
+                    ps->zs_ready = 1;
+                }
+                inflateReset(&ps->zs);
+            }
+            if (h.length == 0) crc_log_add(ps);
+            break;
+        }
+        case FRAME_EOS:
+            *file_size = h.offset;
+            __atomic_store_n(&input.ended, 1, __ATOMIC_RELAXED);
+            break;
+        case FRAME_END:
+            path_end(ps);
+            break;
+        case FRAME_PROBE:
+            ps->remain = h.length;
+            ps->discard = 1;
+            break;
+        default:
+            fprintf(stderr, "unknown frame type %d\n", h.type);
+            return -1;
+        }
+    }
+    __atomic_store_n(&ps->mid_frame, ps->remain > 0 || ps->hdr_got > 0, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* 圧縮されたペイロードの一部 (p, n) を展開して fn に渡す */
+/* 展開後のデータでCRCを進めるので，照合は圧縮前のデータに対して行われる */
+int inflate_payload(path_state_t *ps, const unsigned char *p, size_t n, payload_fn fn, void *arg)
+{
+    int rc;
+
+    ps->zs.next_in = (unsigned char *)p;
+    ps->zs.avail_in = (uInt)n;
+    do {
+        size_t got;
+        ps->zs.next_out = ps->zout;
+        ps->zs.avail_out = ZOUT_LEN;
+        rc = inflate(&ps->zs, Z_NO_FLUSH);
+        if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+            /* 壊れた圧縮データ: 残りは捨て，CRCの照合で不一致として扱う */
+            fprintf(stderr, "path %d: inflate failed at offset %llu\n",
+                    ps->path_id, (unsigned long long)ps->chunk_off);
+            ps->crc = ~ps->want_crc;
+            return 0;
+        }
+        got = ZOUT_LEN - ps->zs.avail_out;
+        if (got > ps->chunk_off + ps->chunk_len - ps->off) {
+            got = (size_t)(ps->chunk_off + ps->chunk_len - ps->off); /* 宣言より長い分は捨てる */
+            ps->crc = ~ps->want_crc;
+        }
+        if (got > 0) {
+            if (ps->check) ps->crc = crc32c(ps->crc, ps->zout, got);
+            if (fn(arg, ps->zout, got, ps->off) < 0) return -1;
+            ps->off += got;
+        }
+    } while (rc != Z_STREAM_END && (ps->zs.avail_in > 0 || ps->zs.avail_out == 0));
+    return 0;
+}
+
+void path_state_free(path_state_t *ps)
+{
+    if (ps->zs_ready) inflateEnd(&ps->zs);
+    free(ps->zout);
+    free(ps->par);
+}
+
+/* 出力に書き終えたチャンクを記録する。既に記録したチャンクなら1 */
+static int crc_log_record(uint64_t off, uint32_t len, uint32_t crc)
+{
+    pthread_mutex_lock(&crc_log.lock);
+    if (ack.on && off % ack.chunk_len == 0 && off / ack.chunk_len < ack.n_chunks) {
+        /* 別の経路から同時に届いた重複は後から書き終えた方を記録しない */
+        if (ack.have[off / ack.chunk_len]) {
+            ack.dup_bytes += len;
+            pthread_mutex_unlock(&crc_log.lock);
+            return 1;
+        }
+        ack.have[off / ack.chunk_len] = 1;
+        ack.n_have++;
+    }
+    if (crc_log.n == crc_log.cap) {
+        size_t cap = crc_log.cap ? crc_log.cap * 2 : 1024;
+        crc_rec_t *tmp = realloc(crc_log.recs, sizeof(crc_rec_t) * cap);
+        if (tmp == NULL) {
+            perror("realloc");
+            pthread_mutex_unlock(&crc_log.lock);
+            return -1;
+        }
+        crc_log.recs = tmp;
+        crc_log.cap = cap;
+    }
+    crc_log.recs[crc_log.n].off = off;
+    crc_log.recs[crc_log.n].len = len;
+    crc_log.recs[crc_log.n].crc = crc;
+    crc_log.n++;
+    resume.pending += len;
+    order_commit(off, len);
+    metric_add(m_chunks, 1);
+    metric_add(m_verified, len);
+    pthread_mutex_unlock(&crc_log.lock);
+    return 0;
+}
+
+/* フレームを受け終えたらCRCを照合して記録する。一致しなければ-1 */
+int crc_log_add(const path_state_t *ps)
+{
+    if (!ps->check) return -1;  /* CRCの付いていないフレームは照合できない */
+    if (ps->crc != ps->want_crc ||
+        (ps->zlib && ps->off != ps->chunk_off + ps->chunk_len)) {
+        pthread_mutex_lock(&crc_log.lock);
+        crc_log.n_bad++;
+        pthread_mutex_unlock(&crc_log.lock);
+        fprintf(stderr, "path %d: CRC32C mismatch at offset %llu (%u bytes): got %08x, expected %08x\n",
+                ps->path_id, (unsigned long long)ps->chunk_off, ps->chunk_len, ps->crc, ps->want_crc);
+        return -1;
+    }
+    if (crc_log_record(ps->chunk_off, ps->chunk_len, ps->crc) == 0) {
+        fec_note_data(ps->chunk_off, ps->chunk_len);
+    }
+    return 0;
+}
+
+static int crc_rec_cmp(const void *a, const void *b)
+{
+    const crc_rec_t *x = a, *y = b;
+    if (x->off != y->off) return x->off < y->off ? -1 : 1;
+    return 0;
+}
+
+/* 記録したチャンクをoffset順につないでファイル全体のCRC32Cを求める */
+/* 先頭から隙間なく file_size まで覆えていなければ-1 */
+int crc_log_digest(uint64_t file_size, uint32_t *digest)
+{
+    uint64_t pos = 0;
+    uint32_t crc = 0;
+    size_t i;
+
+    qsort(crc_log.recs, crc_log.n, sizeof(crc_rec_t), crc_rec_cmp);
+    for (i = 0; i < crc_log.n; i++) {
+        const crc_rec_t *r = &crc_log.recs[i];
+        if (r->off + r->len <= pos) continue;                 /* 既につないだ範囲の重複 */
+        if (r->off != pos) break;                             /* 欠けているか，ずれている */
+        crc = crc32c_combine(crc, r->crc, r->len);
+        pos += r->len;
+    }
+    *digest = crc;
+    return pos == file_size ? 0 : -1;
+}
+
+/* ---- 消失訂正 ---- */
+
+/* FILEフレームで送信側がパリティを付けると知らせてきた (info = (k << 8) | m) */
+void fec_init(uint64_t file_size, uint32_t info, uint32_t chunk_len)
+{
+    int k = (int)(info >> 8), m = (int)(info & 0xff);
+
+    pthread_mutex_lock(&fec.lock);
+    /* 順序どおりの出力では揃ったチャンクを読み直せないのでパリティは使わない */
+    if (fec.k == 0 && !order.on && k >= 1 && k <= RS_MAX_K && m >= 1 && m <= RS_MAX_M && chunk_len > 0) {
+        fec.chunk_len = chunk_len;
+        fec.file_size = file_size;
+        fec.n_chunks = (file_size + chunk_len - 1) / chunk_len;
+        fec.n_stripes = (fec.n_chunks + k - 1) / k;
+        fec.stripes = calloc(fec.n_stripes + 1, sizeof(fec_stripe_t));
+        if (fec.stripes == NULL) {
+            perror("calloc");   /* パリティを使わずに受け取る */
+        } else {
+            fec.k = k;
+            fec.m = m;
+        }
+    }
+    pthread_mutex_unlock(&fec.lock);
+}
+
+/* ストライプ s のデータチャンク数 */
+static int fec_stripe_k(uint64_t s)
+{
+    uint64_t left = fec.n_chunks - s * fec.k;
+    return left < (uint64_t)fec.k ? (int)left : fec.k;
+}
+
+/* ストライプの状態が変わった: データが揃えばパリティを捨て，  */
+/* 揃っていなくても合わせて k 個あれば復元の予定に入れる        */
+/* (fec.lock を持って呼ぶ)                                      */
+static void fec_update(uint64_t s)
+{
+    fec_stripe_t *st = &fec.stripes[s];
+    int ke = fec_stripe_k(s), got = __builtin_popcount(st->have), j;
+
+    if (got == ke) {
+        for (j = 0; j < fec.m; j++) {
+            free(st->par[j]);
+            st->par[j] = NULL;
+        }
+        st->n_par = 0;
+        return;
+    }
+    /* ちょうど k 個になったときに1回だけ予定に入れる */
+    if (got + st->n_par != ke) return;
+    if (fec.n_todo == fec.cap_todo) {
+        size_t cap = fec.cap_todo ? fec.cap_todo * 2 : 64;
+        uint64_t *tmp = realloc(fec.todo, sizeof(uint64_t) * cap);
+        if (tmp == NULL) {
+            perror("realloc");
+            return;
+        }
+        fec.todo = tmp;
+        fec.cap_todo = cap;
+    }
+    fec.todo[fec.n_todo++] = s;
+}
+
+/* データチャンクを出力に書き終えた */
+void fec_note_data(uint64_t off, uint32_t len)
+{
+    uint64_t idx, s;
+    uint32_t bit;
+
+    if (fec.k == 0) return;
+    pthread_mutex_lock(&fec.lock);
+    idx = off / fec.chunk_len;
+    if (off % fec.chunk_len == 0 && idx < fec.n_chunks &&
+        len == (idx + 1 < fec.n_chunks ? fec.chunk_len : fec.file_size - off)) {
+        s = idx / fec.k;
+        bit = 1u << (idx % fec.k);
+        if (!(fec.stripes[s].have & bit)) {
+            fec.stripes[s].have |= bit;
+            fec.n_have++;
+            fec_update(s);
+        }
+    }
+    pthread_mutex_unlock(&fec.lock);
+}
+
+/* PARITYフレームを読み溜める前に長さを確かめる。1 = 受け取る，           */
+/* 0 = 順序どおりの出力でパリティを使わないので読み捨てる，-1 = 不正        */
+int fec_parity_ok(int path_id, uint32_t len)
+{
+    int rc;
+
+    pthread_mutex_lock(&fec.lock);
+    if (fec.k > 0) {
+        rc = len <= fec.chunk_len ? 1 : -1;
+    } else {
+        rc = order.on ? 0 : -1;
+    }
+    pthread_mutex_unlock(&fec.lock);
+    if (rc < 0 && fec.k > 0) {
+        fprintf(stderr, "path %d: parity frame of %u bytes is longer than a chunk\n", path_id, len);
+    } else if (rc < 0) {
+        fprintf(stderr, "path %d: parity frame without an FEC FILE frame\n", path_id);
+    }
+    return rc;
+}
+
+/* 検査を通ったパリティを受け取る (buf は fec が解放する) */
+void fec_add_parity(uint64_t off, uint32_t len, uint32_t info, unsigned char *buf)
+{
+    uint64_t stripe_len, s;
+    int j = (int)(info & 0xff);
+
+    pthread_mutex_lock(&fec.lock);
+    stripe_len = fec.chunk_len * (uint64_t)fec.k;
+    if (fec.k == 0 || off % stripe_len != 0 || off / stripe_len >= fec.n_stripes || j >= fec.m ||
+        len != (fec.file_size - off < fec.chunk_len ? fec.file_size - off : fec.chunk_len)) {
+        pthread_mutex_unlock(&fec.lock);
+        free(buf);
+        return;
+    }
+    s = off / stripe_len;
+    if (fec.stripes[s].par[j] != NULL ||
+        __builtin_popcount(fec.stripes[s].have) == fec_stripe_k(s)) {
+        free(buf);              /* 重複したか，もう要らない */
+    } else {
+        fec.stripes[s].par[j] = buf;
+        fec.stripes[s].n_par++;
+        fec_update(s);
+    }
+    pthread_mutex_unlock(&fec.lock);
+}
+
+/* ストライプ s の欠けたデータチャンクを，揃ったデータ (出力から読む) と */
+/* パリティから復元して出力に書く (fec.lock を持って呼ぶ)                */
+static int fec_rebuild(uint64_t s)
+{
+    fec_stripe_t *st = &fec.stripes[s];
+    int ke = fec_stripe_k(s), i, rc = -1;
+    uint64_t start = s * fec.k * fec.chunk_len;
+    size_t len = fec.file_size - start < fec.chunk_len ? (size_t)(fec.file_size - start) : fec.chunk_len;
+    const uint8_t *data[RS_MAX_K];
+    uint8_t *bufs[RS_MAX_K], *out[RS_MAX_K];
+    size_t lens[RS_MAX_K];
+
+    for (i = 0; i < ke; i++) {
+        uint64_t pos = start + (uint64_t)i * fec.chunk_len;
+        lens[i] = fec.file_size - pos < fec.chunk_len ? (size_t)(fec.file_size - pos) : fec.chunk_len;
+        bufs[i] = malloc(len);
+        data[i] = NULL;
+        out[i] = bufs[i];
+        if (bufs[i] == NULL) {
+            perror("malloc");
+            ke = i;
+            goto out;
+        }
+        if (st->have & (1u << i)) {
+            if (pread(fec.fd, bufs[i], lens[i], (off_t)pos) != (ssize_t)lens[i]) {
+                perror("pread");
+                i++;
+                ke = i;
+                goto out;
+            }
+            data[i] = bufs[i];
+        }
+    }
+    if (rs_decode(out, data, lens, ke, st->par, fec.m, len) < 0) {
+        fprintf(stderr, "cannot rebuild stripe at offset %llu\n", (unsigned long long)start);
+        goto out;
+    }
+    for (i = 0; i < ke; i++) {
+        uint64_t pos = start + (uint64_t)i * fec.chunk_len;
+        if (data[i] != NULL) continue;
+        if (pwrite(fec.fd, out[i], lens[i], (off_t)pos) != (ssize_t)lens[i]) {
+            perror("pwrite");
+            goto out;
+        }
+        /* 検査済みのデータと検査済みのパリティから求めたので，そのまま記録する */
+        if (crc_log_record(pos, (uint32_t)lens[i], crc32c(0, out[i], lens[i])) < 0) goto out;
+        st->have |= 1u << i;
+        fec.n_have++;
+        fec.n_rebuilt++;
+    }
+    fec_update(s);              /* 揃ったのでパリティを捨てる */
+    rc = 0;
+out:
+    for (i = 0; i < ke; i++) free(bufs[i]);
+    return rc;
+}
+
+/* 予定に入ったストライプを復元する (fec.lock を持って呼ぶ) */
+static void fec_service(void)
+{
+    while (fec.n_todo > 0) {
+        uint64_t s = fec.todo[--fec.n_todo];
+        if (__builtin_popcount(fec.stripes[s].have) < fec_stripe_k(s)) fec_rebuild(s);
+    }
+}
+
+/* ---- ストリーム ---- */
+
+/* FILEフレームで送信側が長さの分からない入力を送ると知らせてきた。 */
+/* 送信側は読み直せないので，途中から続ける (-R) ことはできない      */
+int stream_begin(void)
+{
+    __atomic_store_n(&input.on, 1, __ATOMIC_RELAXED);
+    if (resume.enabled) {
+        fprintf(stderr, "the sender streams its input, which cannot be resumed: run without -R\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* ---- 終盤の重複送信 ---- */
+
+/* FILEフレームで送信側がチャンクごとのACKを求めてきた */
+void ack_init(uint64_t file_size, uint32_t chunk_len)
+{
+    pthread_mutex_lock(&crc_log.lock);
+    if (!ack.on && chunk_len > 0) {
+        ack.chunk_len = chunk_len;
+        ack.n_chunks = (file_size + chunk_len - 1) / chunk_len;
+        ack.have = calloc(ack.n_chunks + 1, 1);
+        if (ack.have == NULL) {
+            perror("calloc");   /* 重複をそのまま書く (ACKも返さない) */
+        } else {
+            ack.on = 1;
+        }
+    }
+    pthread_mutex_unlock(&crc_log.lock);
+}
+
+/* チャンク off を既に書き終えているか */
+int ack_have(uint64_t off)
+{
+    int have;
+
+    pthread_mutex_lock(&crc_log.lock);
+    have = off % ack.chunk_len == 0 && off / ack.chunk_len < ack.n_chunks && ack.have[off / ack.chunk_len];
+    pthread_mutex_unlock(&crc_log.lock);
+    return have;
+}
+
+/* 受け取ったチャンクを届いた接続で確認する (重複して届いた分にも返す) */
+/* 揃ったので止めた接続には返さない                                      */
+int send_ack(const path_state_t *ps)
+{
+    unsigned char p[FRAME_HDR_LEN];
+    frame_hdr_t h;
+
+    if (path_ended(ps)) return 0;
+    memset(&h, 0, sizeof(h));
+    h.type = FRAME_ACK;
+    h.path_id = (uint16_t)ps->path_id;
+    h.offset = ps->chunk_off;
+    h.raw_len = ps->chunk_len;
+    frame_hdr_pack(p, &h);
+    /* 止めた直後の接続に書いてもSIGPIPEで終わらないようにする */
+    return send(ps->sock, p, sizeof(p), MSG_NOSIGNAL) == (ssize_t)sizeof(p) || path_ended(ps) ? 0 : -1;
+}
+
+/* データがすべて揃ったら残りの経路の受信をやめる。パリティで復元できる */
+/* ストライプは先に復元する                                             */
+/* 呼び出し時点で，記録済みのチャンクはすべて出力ファイルに書き込まれている必要がある */
+void early_finish(int from_uring)
+{
+    int i, n_stopped = 0, done = 0;
+
+    if ((fec.k == 0 && !ack.on) || early.finished || (early.uring && !from_uring)) return;
+    pthread_mutex_lock(&early.lock);
+    if (fec.k > 0) {
+        pthread_mutex_lock(&fec.lock);
+        fec_service();
+        done = fec.n_have == fec.n_chunks;
+        pthread_mutex_unlock(&fec.lock);
+    }
+    pthread_mutex_lock(&crc_log.lock);
+    if (ack.on && ack.n_have == ack.n_chunks) done = 1;
+    pthread_mutex_unlock(&crc_log.lock);
+    if (!done || early.finished) {
+        pthread_mutex_unlock(&early.lock);
+        return;
+    }
+    /* 止まった経路 (や後に残ったパリティ) を待たずに終える */
+    for (i = 0; i < early.n_paths; i++) {
+        path_state_t *ps = &early.paths[i];
+        if (path_ended(ps)) continue;
+        /* ACKを待っている送信側は確認が揃えば自分でENDを送ってくるので， */
+        /* 揃ったチャンクをまだ送ってきている接続 (遅い経路) だけを止める  */
+        if (ack.on && (ps->udp != NULL || !__atomic_load_n(&ps->mid_frame, __ATOMIC_ACQUIRE))) continue;
+        if (!path_end(ps)) continue;    /* その間にENDが届いた */
+        shutdown(ps->sock, SHUT_RDWR);
+        n_stopped++;
+    }
+    if (!ack.on) early.finished = 1;
+    if (n_stopped > 0 && fec.k > 0) {
+        printf("all chunks present (%llu rebuilt from parity): stopped %d unfinished connections\n",
+               (unsigned long long)fec.n_rebuilt, n_stopped);
+    } else if (n_stopped > 0) {
+        printf("all chunks present: stopped %d connections still sending duplicates\n", n_stopped);
+    }
+    pthread_mutex_unlock(&early.lock);
+}
+
+/* ---- 再開用ビットマップ ---- */
+
+static int resume_write_all(void)
+{
+    unsigned char hdr[RESUME_HDR_LEN];
+    uint64_t u64;
+    uint32_t u32;
+
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, RESUME_MAGIC, 8);
+    u64 = htobe64(resume.file_size);  memcpy(hdr + 8, &u64, 8);
+    u32 = htonl(RESUME_BLOCK);        memcpy(hdr + 16, &u32, 4);
+    if (pwrite(resume.fd, hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+        pwrite(resume.fd, resume.bits, (resume.n_blocks + 7) / 8, RESUME_HDR_LEN) !=
+            (ssize_t)((resume.n_blocks + 7) / 8)) {
+        perror("write resume bitmap");
+        return -1;
+    }
+    return 0;
+}
+
+static int resume_alloc(uint64_t file_size)
+{
+    resume.file_size = file_size;
+    resume.n_blocks = (file_size + RESUME_BLOCK - 1) / RESUME_BLOCK;
+    resume.bits = calloc((resume.n_blocks + 7) / 8 + 1, 1);
+    if (resume.bits == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    return 0;
+}
+
+/* 既存のビットマップを読む。あれば1，無ければ0 (新規の転送)，壊れていれば-1 */
+int resume_load(const char *out_name)
+{
+    unsigned char hdr[RESUME_HDR_LEN];
+    uint64_t u64, b;
+    uint32_t u32;
+    size_t len;
+
+    resume.enabled = 1;
+    len = strlen(out_name) + sizeof(RESUME_SUFFIX);
+    resume.path = malloc(len);
+    if (resume.path == NULL) return -1;
+    snprintf(resume.path, len, "%s%s", out_name, RESUME_SUFFIX);
+
+    resume.fd = open(resume.path, O_RDWR);
+    if (resume.fd < 0) return 0;
+    if (read(resume.fd, hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) ||
+        memcmp(hdr, RESUME_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s is not a resume bitmap\n", resume.path);
+        return -1;
+    }
+    memcpy(&u64, hdr + 8, 8);
+    memcpy(&u32, hdr + 16, 4);
+    if (ntohl(u32) != RESUME_BLOCK || resume_alloc(be64toh(u64)) < 0) {
+        fprintf(stderr, "%s: unsupported block size\n", resume.path);
+        return -1;
+    }
+    len = (resume.n_blocks + 7) / 8;
+    if (pread(resume.fd, resume.bits, len, RESUME_HDR_LEN) != (ssize_t)len) {
+        fprintf(stderr, "%s is truncated\n", resume.path);
+        return -1;
+    }
+    /* 前回までに揃っていた量 (転送の結果の表示から除く) */
+    for (b = 0; b < resume.n_blocks; b++) {
+        uint64_t off = b * RESUME_BLOCK;
+        if (resume.bits[b >> 3] & (1u << (b & 7))) {
+            resume.had += resume.file_size - off < RESUME_BLOCK ? resume.file_size - off : RESUME_BLOCK;
+        }
+    }
+    resume.loaded = 1;
+    return 1;
+}
+
+static void resume_mark(uint64_t start, uint64_t end)
+{
+    uint64_t b = (start + RESUME_BLOCK - 1) / RESUME_BLOCK;   /* 先頭が欠けたブロックは除く */
+    uint64_t e = end == resume.file_size ? resume.n_blocks : end / RESUME_BLOCK;
+
+    for (; b < e; b++) resume.bits[b >> 3] |= (unsigned char)(1u << (b & 7));
+}
+
+/* 受信済みの範囲を出力ファイルごとディスクに記録する                   */
+/* force が0なら RESUME_CKPT_BYTES 受け取るたびに1回だけ (他のスレッドが */
+/* 記録中なら待たずに戻る)。呼び出し時点で，記録済みのチャンクはすべて  */
+/* 出力ファイルに書き込まれている必要がある                             */
+void resume_checkpoint(uint64_t file_size, int force)
+{
+    crc_rec_t *recs;
+    uint64_t start = 0, end = 0;
+    size_t n, i;
+
+    if (!resume.enabled) return;
+    if (force) {
+        pthread_mutex_lock(&resume.ckpt_lock);
+    } else if (__atomic_load_n(&resume.pending, __ATOMIC_RELAXED) < RESUME_CKPT_BYTES ||
+               pthread_mutex_trylock(&resume.ckpt_lock) != 0) {
+        return;
+    }
+
+    if (resume.bits == NULL) {
+        /* 最初の記録: FILEフレームでサイズが分かってから作る */
+        if (file_size == 0 || resume_alloc(file_size) < 0) goto out;
+    } else if (file_size != 0 && file_size != resume.file_size) {
+        /* 前回と元ファイルが違う: ビットマップは使えない */
+        fprintf(stderr, "source size changed (%llu -> %llu bytes): cannot resume\n",
+                (unsigned long long)resume.file_size, (unsigned long long)file_size);
+        resume.enabled = 0;
+        goto out;
+    }
+    if (resume.fd < 0) {
+        resume.fd = open(resume.path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (resume.fd < 0) {
+            perror("open resume bitmap");
+            goto out;
+        }
+    }
+
+    /* 今までに検査を通ったチャンクの一覧を写してから出力を同期する */
+    pthread_mutex_lock(&crc_log.lock);
+    n = crc_log.n;
+    recs = malloc(sizeof(crc_rec_t) * (n + 1));
+    if (recs != NULL) memcpy(recs, crc_log.recs, sizeof(crc_rec_t) * n);
+    resume.pending = 0;
+    pthread_mutex_unlock(&crc_log.lock);
+    if (recs == NULL) goto out;
+
+    if (fdatasync(resume.out_fd) < 0) {
+        perror("fdatasync");
+        free(recs);
+        goto out;
+    }
+
+    /* 連続した範囲にまとめ，その中に丸ごと入るブロックのビットを立てる */
+    qsort(recs, n, sizeof(crc_rec_t), crc_rec_cmp);
+    for (i = 0; i < n; i++) {
+        if (recs[i].off > end) {
+            resume_mark(start, end);
+            start = recs[i].off;
+            end = recs[i].off;
+        }
+        if (recs[i].off + recs[i].len > end) end = recs[i].off + recs[i].len;
+    }
+    resume_mark(start, end);
+    free(recs);
+
+    if (resume_write_all() == 0 && fsync(resume.fd) < 0) perror("fsync");
+out:
+    pthread_mutex_unlock(&resume.ckpt_lock);
+}
+
+/* まだ受け取っていない範囲を (開始位置, 長さ) の組で返す。組の数を返す */
+/* 組が多すぎるときは間の短い受信済み部分ごとまとめて FRAME_RESUME_MAX に収める */
+int resume_missing(uint64_t **ranges)
+{
+    uint64_t *r = NULL;
+    uint64_t gap = 0;           /* これ以下の受信済み部分は埋めてしまう (ブロック数) */
+    uint64_t b;
+    int n;
+
+    if (resume.bits == NULL) {
+        *ranges = NULL;
+        return 0;
+    }
+    r = malloc(sizeof(uint64_t) * 2 * FRAME_RESUME_MAX);
+    if (r == NULL) return -1;
+    for (;;) {
+        uint64_t run_start = 0, last_end = 0;
+        int in_run = 0;
+        n = 0;
+        for (b = 0; b <= resume.n_blocks && n <= FRAME_RESUME_MAX; b++) {
+            int missing = b < resume.n_blocks && !(resume.bits[b >> 3] & (1u << (b & 7)));
+            if (missing && !in_run) {
+                if (n > 0 && b - last_end <= gap) {
+                    n--;                    /* 直前の範囲とつなぐ */
+                    run_start = r[2 * n] / RESUME_BLOCK;
+                } else {
+                    run_start = b;
+                }
+                in_run = 1;
+            } else if (!missing && in_run) {
+                if (n == FRAME_RESUME_MAX) {
+                    n++;                    /* 収まらない */
+                    break;
+                }
+                r[2 * n] = run_start * RESUME_BLOCK;
+                r[2 * n + 1] = (b == resume.n_blocks ? resume.file_size : b * RESUME_BLOCK) - r[2 * n];
+                n++;
+                last_end = b;
+                in_run = 0;
+            }
+        }
+        if (n <= FRAME_RESUME_MAX) break;
+        gap = gap ? gap * 2 : 1;
+    }
+    *ranges = r;
+    return n;
+}
+
+/* すべてのブロックを受け取ったか */
+int resume_complete(void)
+{
+    uint64_t b;
+
+    if (resume.bits == NULL) return 0;
+    for (b = 0; b < resume.n_blocks; b++) {
+        if (!(resume.bits[b >> 3] & (1u << (b & 7)))) return 0;
+    }
+    return 1;
+}
+
+/* 再開した転送では今回受け取っていない部分があるので，出力ファイルを読んで */
+/* 全体のCRC32Cを求める                                                     */
+int resume_file_crc(int fd, uint64_t size, uint32_t *digest)
+{
+    unsigned char *buf = malloc(RESUME_READ_LEN);
+    uint64_t off = 0;
+    uint32_t crc = 0;
+    ssize_t n;
+
+    if (buf == NULL) return -1;
+    while (off < size) {
+        n = pread(fd, buf, size - off < RESUME_READ_LEN ? (size_t)(size - off) : RESUME_READ_LEN, (off_t)off);
+        if (n <= 0) {
+            free(buf);
+            return -1;
+        }
+        crc = crc32c(crc, buf, (size_t)n);
+        off += (uint64_t)n;
+    }
+    free(buf);
+    *digest = crc;
+    return 0;
+}
+
+/* 接続直後に送信側へ再送してほしい範囲を伝える (n = 0 なら全体) */
+int send_resume(int sock, const uint64_t *ranges, int n)
+{
+    unsigned char *p;
+    int i, rc;
+
+    p = malloc((size_t)n * 16 + 1);
+    if (p == NULL) return -1;
+    for (i = 0; i < 2 * n; i++) {
+        uint64_t u64 = htobe64(ranges[i]);
+        memcpy(p + 8 * i, &u64, 8);
+    }
+    rc = send_frame_hdr(sock, FRAME_RESUME, 0, 0, resume.file_size, (uint32_t)n * 16) < 0 ||
+         write_all(sock, p, (size_t)n * 16) < 0 ? -1 : 0;
+    free(p);
+    return rc;
+}
+
+/* ---- 重複排除 ---- */
+
+/* basis を開いてチャンク一覧を得る ("<basis>.cdc" が使えればそれを読む) */
+int dedup_open(const char *basis)
+{
+    size_t size = 2, i;
+    int rc;
+
+    if ((dedup.fd = open(basis, O_RDONLY)) < 0) {
+        perror(basis);
+        return -1;
+    }
+    if ((rc = cdc_index(basis, dedup.fd, &dedup.have)) < 0) {
+        perror(basis);
+        return -1;
+    }
+    while (size < dedup.have.n * 2) size *= 2;
+    if ((dedup.table = calloc(size, sizeof(uint32_t))) == NULL) return -1;
+    dedup.mask = size - 1;
+    for (i = 0; i < dedup.have.n; i++) {
+        size_t j = dedup.have.c[i].hash & dedup.mask;
+        while (dedup.table[j] != 0) j = (j + 1) & dedup.mask;
+        dedup.table[j] = (uint32_t)i + 1;
+    }
+    printf("dedup basis: %s, %zu chunks (%s)\n", basis, dedup.have.n,
+           rc == 0 ? "index read" : "index built");
+    return 0;
+}
+
+/* c と同じチャンクの basis 内の位置 (無ければ-1) */
+static int64_t dedup_find(const cdc_chunk_t *c)
+{
+    size_t j;
+
+    for (j = c->hash & dedup.mask; dedup.table[j] != 0; j = (j + 1) & dedup.mask) {
+        const cdc_chunk_t *b = &dedup.have.c[dedup.table[j] - 1];
+        if (b->hash == c->hash && b->len == c->len && b->crc == c->crc) return (int64_t)b->off;
+    }
+    return -1;
+}
+
+/* basis の off から len バイトを読む */
+static int dedup_read(unsigned char *buf, size_t len, uint64_t off)
+{
+    while (len > 0) {
+        ssize_t n = pread(dedup.fd, buf, len, (off_t)off);
+        if (n <= 0) return -1;
+        buf += n;
+        len -= (size_t)n;
+        off += (uint64_t)n;
+    }
+    return 0;
+}
+
+/* 送信側の一覧 dedup.want のうち basis にあるチャンクを出力 fd に写し， */
+/* 送信側に頼む範囲を dedup.missing に入れる                              */
+static int dedup_plan(int fd)
+{
+    const cdc_list_t *w = &dedup.want;
+    int64_t *src = malloc(sizeof(int64_t) * (w->n + 1));   /* basis 内の位置 (-1 = 無い) */
+    unsigned char *ok = calloc(w->n + 1, 1);                /* 写せた */
+    unsigned char *buf = malloc(DEDUP_COPY_LEN);
+    uint64_t *r = malloc(sizeof(uint64_t) * 2 * FRAME_RESUME_MAX);
+    uint64_t gap = 0;           /* これ以下の写せた部分は頼む範囲に含めてしまう */
+    size_t i, j, k;
+    int n, rc = -1;
+
+    if (src == NULL || ok == NULL || buf == NULL || r == NULL) goto out;
+    for (i = 0; i < w->n; i++) src[i] = dedup_find(&w->c[i]);
+
+    /* basis でも続いているチャンクはまとめて読み，1つずつ確かめて写す */
+    for (i = 0; i < w->n; i = j) {
+        uint64_t len = w->c[i].len;
+        int all = 1;
+
+        j = i + 1;
+        if (src[i] < 0) continue;
+        while (j < w->n && src[j] == src[j - 1] + (int64_t)w->c[j - 1].len &&
+               len + w->c[j].len <= DEDUP_COPY_LEN) {
+            len += w->c[j++].len;
+        }
+        if (dedup_read(buf, (size_t)len, (uint64_t)src[i]) < 0) continue;  /* 送ってもらう */
+        for (k = i; k < j; k++) {
+            ok[k] = crc32c(0, buf + (w->c[k].off - w->c[i].off), w->c[k].len) == w->c[k].crc;
+            if (!ok[k]) all = 0;
+        }
+        for (k = i; k < j; k++) {
+            size_t m = k + 1;
+            uint64_t l = w->c[k].len;
+            if (!ok[k]) continue;
+            if (all) {
+                m = j;      /* まとめて書く */
+                l = len;
+            }
+            if (out_pwrite(fd, buf + (w->c[k].off - w->c[i].off), (size_t)l, w->c[k].off) < 0) goto out;
+            k = m - 1;
+        }
+    }
+
+    /* 写せなかったチャンクの範囲。多すぎるときは間の短い写せた部分ごとまとめる */
+    for (;;) {
+        n = 0;
+        for (i = 0; i < w->n && n <= FRAME_RESUME_MAX; i++) {
+            if (ok[i]) continue;
+            if (n > 0 && w->c[i].off - (r[2 * n - 2] + r[2 * n - 1]) <= gap) {
+                r[2 * n - 1] = w->c[i].off + w->c[i].len - r[2 * n - 2];
+            } else if (n == FRAME_RESUME_MAX) {
+                n++;                    /* 収まらない */
+            } else {
+                r[2 * n] = w->c[i].off;
+                r[2 * n + 1] = w->c[i].len;
+                n++;
+            }
+        }
+        if (n <= FRAME_RESUME_MAX) break;
+        gap = gap ? gap * 2 : CDC_AVG;
+    }
+
+    /* 頼む範囲の外に残った写したチャンクを記録する (範囲内は届いたもので置き換わる) */
+    for (i = 0, k = 0; i < w->n; i++) {
+        if (!ok[i]) continue;
+        while (k < (size_t)n && r[2 * k] + r[2 * k + 1] <= w->c[i].off) k++;
+        if (k < (size_t)n && r[2 * k] < w->c[i].off + w->c[i].len) continue;
+        if (crc_log_record(w->c[i].off, w->c[i].len, w->c[i].crc) < 0) goto out;
+        dedup.n_copied++;
+        dedup.copied_bytes += w->c[i].len;
+    }
+
+    /* 全部写せたら，送るものが無いと分かるよう末尾の空の範囲を頼む (0個だと全体になる) */
+    if (n == 0) {
+        r[0] = w->size;
+        r[1] = 0;
+        n = 1;
+    }
+    dedup.missing = r;
+    dedup.n_missing = n;
+    r = NULL;
+    rc = 0;
+out:
+    free(src);
+    free(ok);
+    free(buf);
+    free(r);
+    return rc;
+}
+
+/* 1本目の接続で送信側のチャンク一覧を求め，basis から写せない範囲を頼む。 */
+/* 送信側の返事 (STREAMS) のヘッダを hdr に入れる。送信側が一覧を返さない  */
+/* (対応していない・1ファイルの転送でない) ときは全体を受け取る            */
+int dedup_negotiate(int sock, unsigned char *hdr)
+{
+    unsigned char *p;
+    frame_hdr_t h;
+    uint64_t size;
+    int rc;
+
+    dedup.asked = 1;
+    memset(&h, 0, sizeof(h));
+    h.type = FRAME_RESUME;
+    h.flags = FRAME_F_DEDUP;
+    if (send_frame(sock, &h) < 0 ||
+        read_all(sock, hdr, FRAME_HDR_LEN) < 0) {
+        return -1;
+    }
+    if (frame_hdr_unpack(hdr, &h) < 0 || h.type != FRAME_CDC) {
+        printf("dedup: the sender has no chunk list for this transfer, receiving everything\n");
+        return 0;
+    }
+    if ((uint64_t)h.raw_len > h.offset / CDC_MIN + 1 || h.length != (uint64_t)h.raw_len * CDC_REC_LEN ||
+        (p = malloc((size_t)h.length + 1)) == NULL) {
+        fprintf(stderr, "dedup: bad chunk list\n");
+        return -1;
+    }
+    if (read_all(sock, p, h.length) < 0) {
+        free(p);
+        return -1;
+    }
+    rc = crc32c(0, p, h.length) == h.crc ? cdc_unpack(&dedup.want, p, h.length) : -1;
+    free(p);
+    if (rc < 0 || dedup.want.size != h.offset) {
+        fprintf(stderr, "dedup: bad chunk list\n");
+        return -1;
+    }
+    if (dedup_plan(resume.out_fd) < 0) {
+        perror("dedup");
+        return -1;
+    }
+    dedup.planned = 1;
+    size = dedup.want.size;
+    printf("dedup: %llu of %zu chunks (%llu of %llu bytes) copied from the basis, requesting %d ranges\n",
+           (unsigned long long)dedup.n_copied, dedup.want.n, (unsigned long long)dedup.copied_bytes,
+           (unsigned long long)size, dedup.n_missing);
+    if (send_resume(sock, dedup.missing, dedup.n_missing) < 0 ||
+        read_all(sock, hdr, FRAME_HDR_LEN) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* 受け取ったファイルの一覧を "<出力>.cdc" に残し，次回の basis に使えるようにする */
+void dedup_save(const char *out_name, int fd)
+{
+    struct stat st;
+
+    if (!dedup.planned || fstat(fd, &st) < 0 || (uint64_t)st.st_size != dedup.want.size) return;
+    if (cdc_index_save(out_name, &st, &dedup.want) < 0) perror("dedup: save chunk index");
+}
+
+/* ---- ディレクトリの受信 ---- */
+
+/* i 番目のファイルを作る (outdir.lock を持たずに呼ぶ) */
+static int outdir_make(int i)
+{
+    const tree_entry_t *e = &outdir.t.e[i];
+    int fd = openat(outdir.root_fd, e->path, O_WRONLY | O_CREAT | O_TRUNC, e->mode & OUTDIR_MODE_MASK);
+
+    if (fd < 0) {
+        perror(e->path);
+        return -1;
+    }
+    if (e->size >= OUTDIR_PREALLOC_MIN && fallocate(fd, 0, 0, (off_t)e->size) < 0 &&
+        errno != EOPNOTSUPP) {
+        perror("fallocate");
+    }
+    return fd;
+}
+
+/* i 番目のファイルの作成を引き受ける。他のスレッドが作成中なら待つ。  */
+/* 引き受けたら1，既に作ってあれば0 (outdir.lock を持って呼ぶ)         */
+static int outdir_claim(int i)
+{
+    tree_file_t *f = &outdir.files[i];
+
+    while (f->creating) pthread_cond_wait(&outdir.cond, &outdir.lock);
+    if (f->created) return 0;
+    f->creating = 1;
+    return 1;
+}
+
+/* 作ったファイルを登録する。空のファイルはすぐ閉じる (outdir.lock を持って呼ぶ) */
+static void outdir_made(int i, int fd)
+{
+    tree_file_t *f = &outdir.files[i];
+
+    f->creating = 0;
+    if (fd >= 0) {
+        f->created = 1;
+        if (f->left > 0) {
+            f->fd = fd;
+            outdir.n_open++;
+        } else {
+            close(fd);
+        }
+    }
+    pthread_cond_broadcast(&outdir.cond);
+}
+
+/* 作成スレッド: 並びの順にファイルを作って開いておく */
+static void *outdir_creator(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&outdir.lock);
+    while (!outdir.stop && outdir.next < outdir.t.n) {
+        int i = outdir.next;
+        int fd;
+
+        if (S_ISDIR(outdir.t.e[i].mode)) {
+            outdir.next++;
+            continue;
+        }
+        if (outdir.n_open >= OUTDIR_MAX_OPEN) {
+            pthread_cond_wait(&outdir.cond, &outdir.lock);
+            continue;
+        }
+        outdir.next++;
+        if (!outdir_claim(i)) continue;     /* 先にデータが届いて受信側で作った */
+        pthread_mutex_unlock(&outdir.lock);
+        fd = outdir_make(i);
+        pthread_mutex_lock(&outdir.lock);
+        outdir_made(i, fd);
+    }
+    pthread_mutex_unlock(&outdir.lock);
+    return NULL;
+}
+
+/* 一覧のとおりにディレクトリを作り，ファイルを作るスレッドを起こす */
+static int outdir_create(void)
+{
+    int i;
+
+    outdir.files = calloc((size_t)outdir.t.n + 1, sizeof(tree_file_t));
+    if (outdir.files == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    for (i = 0; i < outdir.t.n; i++) {
+        const tree_entry_t *e = &outdir.t.e[i];
+        outdir.files[i].fd = -1;
+        outdir.files[i].left = e->size;
+        /* 自分では書けないディレクトリも中身を作るまでは書けるようにしておく */
+        /* (許可は outdir_close で戻す)                                       */
+        if (!S_ISDIR(e->mode)) continue;
+        if (mkdirat(outdir.root_fd, e->path, (e->mode & OUTDIR_MODE_MASK) | 0700) == 0) {
+            outdir.files[i].created = 1;
+        } else if (errno != EEXIST) {
+            perror(e->path);
+            return -1;
+        }
+    }
+    for (i = 0; i < OUTDIR_CREATORS; i++) {
+        if (pthread_create(&outdir.creators[i], NULL, outdir_creator, NULL) != 0) break;
+        outdir.n_creators++;
+    }
+    return 0;
+}
+
+/* STREAMSに続いて届くディレクトリの一覧を読む。最初に届いた一覧でツリーを作り， */
+/* 他の経路から届いた一覧はそれと同じかだけを見る                             */
+int read_manifest(int sock)
+{
+    unsigned char hdr[FRAME_HDR_LEN];
+    unsigned char *p;
+    frame_hdr_t h;
+    int rc = 0;
+
+    if (read_all(sock, hdr, sizeof(hdr)) < 0) return -1;
+    if (frame_hdr_unpack(hdr, &h) < 0 || h.type != FRAME_MANIFEST || h.length > (1u << 30)) {
+        fprintf(stderr, "unexpected manifest from sender\n");
+        return -1;
+    }
+    if ((p = malloc(h.length > 0 ? h.length : 1)) == NULL || read_all(sock, p, h.length) < 0) {
+        perror("read manifest");
+        free(p);
+        return -1;
+    }
+    if (crc32c(0, p, h.length) != h.crc) {
+        fprintf(stderr, "CRC32C mismatch in the directory manifest\n");
+        free(p);
+        return -1;
+    }
+    if (outdir.root == NULL) {
+        fprintf(stderr, "sender is sending a directory: rerun with -d output_directory\n");
+        rc = -1;
+    } else if (outdir.loaded) {
+        if (h.crc != outdir.crc) {
+            fprintf(stderr, "paths sent different directory manifests\n");
+            rc = -1;
+        }
+    } else if (tree_unpack(&outdir.t, p, h.length) < 0 || outdir.t.total != h.offset) {
+        fprintf(stderr, "bad directory manifest\n");
+        rc = -1;
+    } else {
+        rc = outdir_create();
+        outdir.loaded = 1;
+        outdir.crc = h.crc;
+        printf("%s: %d files, %d directories, %llu bytes\n", outdir.root, outdir.t.n_files,
+               outdir.t.n_dirs, (unsigned long long)outdir.t.total);
+    }
+    free(p);
+    return rc;
+}
+
+/* i 番目のファイルを書くために開く。作成スレッドがまだ作っていなければここで作る */
+static int outdir_open(int i)
+{
+    const tree_entry_t *e = &outdir.t.e[i];
+    tree_file_t *f = &outdir.files[i];
+    int fd;
+
+    pthread_mutex_lock(&outdir.lock);
+    if (f->fd < 0 && outdir_claim(i)) {
+        pthread_mutex_unlock(&outdir.lock);
+        fd = outdir_make(i);
+        pthread_mutex_lock(&outdir.lock);
+        outdir_made(i, fd);
+    }
+    if (f->fd < 0 && f->created) {
+        /* 書き終えて閉じたファイルにもう一度届いた (再送の重複など) */
+        f->fd = openat(outdir.root_fd, e->path, O_WRONLY);
+        if (f->fd >= 0) outdir.n_open++;
+    }
+    if (f->fd >= 0) f->users++;
+    fd = f->fd;
+    pthread_mutex_unlock(&outdir.lock);
+    if (fd < 0) fprintf(stderr, "cannot open %s for writing\n", e->path);
+    return fd;
+}
+
+/* i 番目のファイルに len バイト書き終えた。全部書いたら閉じる */
+static void outdir_release(int i, uint64_t len)
+{
+    tree_file_t *f = &outdir.files[i];
+
+    pthread_mutex_lock(&outdir.lock);
+    f->users--;
+    f->left -= len < f->left ? len : f->left;
+    if (f->left == 0 && f->users == 0) {
+        close(f->fd);
+        f->fd = -1;
+        outdir.n_open--;
+        pthread_cond_broadcast(&outdir.cond);
+    }
+    pthread_mutex_unlock(&outdir.lock);
+}
+
+/* 並べた位置 off からの len バイトを各ファイルに書き分ける */
+static int outdir_pwrite(const unsigned char *p, size_t len, uint64_t off)
+{
+    int i = tree_find(&outdir.t, off);
+
+    for (; len > 0 && i < outdir.t.n; i++) {
+        const tree_entry_t *e = &outdir.t.e[i];
+        size_t seg, done = 0;
+        int fd;
+
+        if (off >= e->base + e->size) continue;     /* 空のファイル，ディレクトリ */
+        seg = e->base + e->size - off < len ? (size_t)(e->base + e->size - off) : len;
+        if ((fd = outdir_open(i)) < 0) return -1;
+        while (done < seg) {
+            ssize_t n = pwrite(fd, p + done, seg - done, (off_t)(off - e->base + done));
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                perror(e->path);
+                outdir_release(i, 0);
+                return -1;
+            }
+            done += (size_t)n;
+        }
+        outdir_release(i, seg);
+        p += seg;
+        off += seg;
+        len -= seg;
+    }
+    if (len > 0) {
+        fprintf(stderr, "data beyond the end of the directory at %llu\n", (unsigned long long)off);
+        return -1;
+    }
+    return 0;
+}
+
+/* 書きかけのまま残ったファイルを閉じる */
+void outdir_close(void)
+{
+    int i;
+
+    pthread_mutex_lock(&outdir.lock);
+    outdir.stop = 1;
+    pthread_cond_broadcast(&outdir.cond);
+    pthread_mutex_unlock(&outdir.lock);
+    for (i = 0; i < outdir.n_creators; i++) pthread_join(outdir.creators[i], NULL);
+    for (i = 0; outdir.files != NULL && i < outdir.t.n; i++) {
+        if (outdir.files[i].fd >= 0) close(outdir.files[i].fd);
+    }
+    /* 作ったディレクトリの許可を一覧のとおりに戻す。親が先に並んでいるので */
+    /* 後ろから戻し，親の許可で中に入れなくなる前に子を済ませる            */
+    for (i = outdir.t.n - 1; outdir.files != NULL && i >= 0; i--) {
+        const tree_entry_t *e = &outdir.t.e[i];
+        if (S_ISDIR(e->mode) && outdir.files[i].created && (e->mode & 0700) != 0700 &&
+            fchmodat(outdir.root_fd, e->path, e->mode & OUTDIR_MODE_MASK, 0) < 0) {
+            perror(e->path);
+        }
+    }
+    free(outdir.files);
+    outdir.files = NULL;
+    tree_free(&outdir.t);
+    if (outdir.root_fd >= 0) close(outdir.root_fd);
+}
+
+/* ---- 順序どおりの出力 ---- */
+
+/* 出力先が標準出力 ("-") かパイプなどの通常でないファイルか */
+int order_is_stream(const char *name)
+{
+    struct stat st;
+
+    if (strcmp(name, "-") == 0) return 1;
+    return stat(name, &st) == 0 && !S_ISREG(st.st_mode);
+}
+
+/* ブロック b の置き場所 (無ければ空いたブロックを割り当てる。order.lock を持って呼ぶ) */
+static unsigned char *order_block(uint64_t b)
+{
+    unsigned char **slot = &order.ring[b % order.n_ring];
+
+    if (*slot == NULL) {
+        *slot = order.n_pool > 0 ? order.pool[--order.n_pool] : malloc(ORDER_BLOCK);
+        if (*slot == NULL) return NULL;
+        if (++order.n_live > order.max_live) order.max_live = order.n_live;
+    }
+    return *slot;
+}
+
+/* 書き出しを終えた位置を pos まで進め，通り過ぎたブロックを空ける (order.lock を持って呼ぶ) */
+static void order_advance(uint64_t pos)
+{
+    uint64_t b;
+
+    for (b = order.delivered / ORDER_BLOCK; b < pos / ORDER_BLOCK; b++) {
+        unsigned char **slot = &order.ring[b % order.n_ring];
+        if (*slot == NULL) continue;
+        order.pool[order.n_pool++] = *slot;
+        *slot = NULL;
+        order.n_live--;
+    }
+    order.delivered = pos;
+    pthread_cond_broadcast(&order.space);
+}
+
+/* 全員が待ったまま進まない: 置けるブロック数を倍にする (order.lock を持って呼ぶ) */
+static int order_grow(void)
+{
+    uint64_t n = order.n_ring * 2, b, base = order.delivered / ORDER_BLOCK;
+    unsigned char **ring = calloc(n, sizeof(unsigned char *));
+    unsigned char **pool = realloc(order.pool, sizeof(unsigned char *) * n);
+
+    if (pool != NULL) order.pool = pool;
+    if (ring == NULL || pool == NULL) {
+        free(ring);
+        return -1;
+    }
+    for (b = base; b < base + order.n_ring; b++) ring[b % n] = order.ring[b % order.n_ring];
+    free(order.ring);
+    order.ring = ring;
+    order.n_ring = n;
+    order.n_grown++;
+    fprintf(stderr, "in-order output: all paths are waiting for a gap, reorder buffer raised to %llu MiB\n",
+            (unsigned long long)(n * ORDER_BLOCK >> 20));
+    return 0;
+}
+
+/* 書き出しスレッド: 検査を通った先頭からの部分を出力に書く */
+static void *order_writer(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&order.lock);
+    for (;;) {
+        uint64_t pos = order.delivered;
+        size_t in = (size_t)(pos % ORDER_BLOCK), n;
+        const unsigned char *buf;
+
+        while (order.verified == order.delivered && !order.done && !order.failed) {
+            pthread_cond_wait(&order.ready, &order.lock);
+        }
+        if (order.failed || order.verified == order.delivered) break;
+        n = ORDER_BLOCK - in;
+        if (order.verified - pos < n) n = (size_t)(order.verified - pos);
+        buf = order.ring[(pos / ORDER_BLOCK) % order.n_ring];
+        /* 書き出し中のブロックは delivered を進めるまで空かないのでロックを外して書く */
+        pthread_mutex_unlock(&order.lock);
+        if (write_all(order.out_fd, buf + in, n) < 0) {
+            perror("in-order output");
+            pthread_mutex_lock(&order.lock);
+            order.failed = 1;
+            pthread_cond_broadcast(&order.space);
+            break;
+        }
+        pthread_mutex_lock(&order.lock);
+        order_advance(pos + n);
+    }
+    pthread_mutex_unlock(&order.lock);
+    return NULL;
+}
+
+/* 出力 out_fd に順に書き出す準備をし，書き出しスレッドを起こす */
+int order_open(int out_fd, uint64_t buf_mib)
+{
+    order.n_ring = buf_mib * 1024 * 1024 / ORDER_BLOCK;
+    if (order.n_ring < ORDER_MIN_BLOCKS) order.n_ring = ORDER_MIN_BLOCKS;
+    order.ring = calloc(order.n_ring, sizeof(unsigned char *));
+    order.pool = malloc(sizeof(unsigned char *) * order.n_ring);
+    if (order.ring == NULL || order.pool == NULL) return -1;
+    order.out_fd = out_fd;
+    order.on = 1;
+    if (pthread_create(&order.th, NULL, order_writer, NULL) != 0) {
+        order.on = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/* off から len バイトが今置けるか (UDP経路は置けなければ捨てる) */
+int order_fits(uint64_t off, size_t len)
+{
+    int fits;
+
+    pthread_mutex_lock(&order.lock);
+    fits = off + len <= (order.delivered / ORDER_BLOCK + order.n_ring) * ORDER_BLOCK;
+    pthread_mutex_unlock(&order.lock);
+    return fits;
+}
+
+/* 受け取ったデータをブロックに置く。置ける範囲に入るまで待つ */
+static int order_write(const unsigned char *p, size_t len, uint64_t off)
+{
+    uint64_t end = off + len;
+
+    pthread_mutex_lock(&order.lock);
+    while (!order.failed && end > (order.delivered / ORDER_BLOCK + order.n_ring) * ORDER_BLOCK) {
+        uint64_t seen = order.delivered;
+        struct timespec ts;
+        int rc;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += ORDER_STALL_MS * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        order.n_waiting++;
+        rc = pthread_cond_timedwait(&order.space, &order.lock, &ts);
+        order.n_waiting--;
+        if (rc == ETIMEDOUT && order.delivered == seen && order.verified == seen &&
+            order.n_waiting + 1 >= order.n_writers && order_grow() < 0) {
+            order.failed = 1;
+        }
+    }
+    if (order.failed) {
+        pthread_mutex_unlock(&order.lock);
+        return -1;
+    }
+    if (off < order.delivered) {
+        /* 書き出し済み (終盤の重複送信で同時に届いた方) */
+        size_t skip = order.delivered - off < len ? (size_t)(order.delivered - off) : len;
+        p += skip;
+        off += skip;
+    }
+    while (off < end) {
+        size_t in = (size_t)(off % ORDER_BLOCK);
+        size_t n = end - off < ORDER_BLOCK - in ? (size_t)(end - off) : ORDER_BLOCK - in;
+        unsigned char *buf = order_block(off / ORDER_BLOCK);
+        if (buf == NULL) {
+            perror("in-order output");
+            order.failed = 1;
+            pthread_cond_broadcast(&order.space);
+            pthread_mutex_unlock(&order.lock);
+            return -1;
+        }
+        memcpy(buf + in, p, n);
+        p += n;
+        off += n;
+    }
+    pthread_mutex_unlock(&order.lock);
+    return 0;
+}
+
+/* 検査を通ったチャンクを書き出せるようにする (crc_log.lock を持って呼ばれる) */
+void order_commit(uint64_t off, uint32_t len)
+{
+    uint64_t end = off + len, was;
+    int i;
+
+    if (!order.on) return;
+    pthread_mutex_lock(&order.lock);
+    was = order.verified;
+    if (off <= order.verified) {
+        if (end > order.verified) order.verified = end;
+    } else {
+        if (order.n_pending == order.cap_pending) {
+            int cap = order.cap_pending ? order.cap_pending * 2 : 64;
+            order_range_t *tmp = realloc(order.pending, sizeof(order_range_t) * cap);
+            if (tmp == NULL) {
+                perror("realloc");  /* 書き出せないまま終わる (最後の照合で失敗にする) */
+                pthread_mutex_unlock(&order.lock);
+                return;
+            }
+            order.pending = tmp;
+            order.cap_pending = cap;
+        }
+        for (i = order.n_pending; i > 0 && order.pending[i - 1].off > off; i--) {
+            order.pending[i] = order.pending[i - 1];
+        }
+        order.pending[i].off = off;
+        order.pending[i].end = end;
+        order.n_pending++;
+    }
+    /* つながった分を取り込む */
+    for (i = 0; i < order.n_pending && order.pending[i].off <= order.verified; i++) {
+        if (order.pending[i].end > order.verified) order.verified = order.pending[i].end;
+    }
+    if (i > 0) {
+        memmove(order.pending, order.pending + i, sizeof(order_range_t) * (order.n_pending - i));
+        order.n_pending -= i;
+    }
+    if (order.verified != was) pthread_cond_signal(&order.ready);
+    pthread_mutex_unlock(&order.lock);
+}
+
+/* 待つことのある受信スレッド (TCP) の開始と終了 */
+void order_enter(void)
+{
+    if (!order.on) return;
+    pthread_mutex_lock(&order.lock);
+    order.n_writers++;
+    pthread_mutex_unlock(&order.lock);
+}
+
+void order_leave(void)
+{
+    if (!order.on) return;
+    pthread_mutex_lock(&order.lock);
+    order.n_writers--;
+    pthread_cond_broadcast(&order.space);   /* 残りが全員待っているかを見直させる */
+    pthread_mutex_unlock(&order.lock);
+}
+
+/* 受信を終えた: 残りを書き出して書き出しスレッドを止める。書けなかったら-1 */
+int order_close(void)
+{
+    uint64_t i;
+
+    if (!order.on) return 0;
+    pthread_mutex_lock(&order.lock);
+    order.done = 1;
+    pthread_cond_signal(&order.ready);
+    pthread_mutex_unlock(&order.lock);
+    pthread_join(order.th, NULL);
+    order.on = 0;
+    if (close(order.out_fd) < 0) order.failed = 1;     /* 読み手に終わりを知らせる */
+    for (i = 0; i < order.n_ring; i++) free(order.ring[i]);
+    for (i = 0; i < order.n_pool; i++) free(order.pool[i]);
+    free(order.ring);
+    free(order.pool);
+    free(order.pending);
+    return order.failed ? -1 : 0;
+}
+
+/* 接続ごと・出力側の計測値を登録する (-M)。値は既にあるカウンタを読む */
+void recv_metrics(path_state_t *paths, int n_paths, const uint64_t *file_size)
+{
+    static const char calls[] = "System calls made to receive and store data, by call.";
+    int i;
+
+    for (i = 0; i < n_paths; i++) {
+        metric_watch_u64("icslab2_recv_bytes_total", METRIC_COUNTER, "Bytes read from the network, by connection.",
+                         &paths[i].tm.bytes, "conn=\"%s\"", paths[i].tm.name);
+    }
+    m_chunks = metric_new("icslab2_recv_chunks_total", METRIC_COUNTER, "Chunks that passed the CRC32C check.", NULL);
+    m_verified = metric_new("icslab2_recv_verified_bytes_total", METRIC_COUNTER,
+                            "Bytes of chunks that passed the CRC32C check.", NULL);
+    metric_watch_int("icslab2_recv_crc_failures_total", METRIC_COUNTER, "Chunks that failed the CRC32C check.",
+                     &crc_log.n_bad, NULL);
+    metric_watch_u64("icslab2_recv_duplicate_bytes_total", METRIC_COUNTER,
+                     "Bytes of end-game duplicates dropped.", &ack.dup_bytes, NULL);
+    metric_watch_u64("icslab2_recv_file_bytes", METRIC_GAUGE, "Size of the file being received (0 until known).",
+                     file_size, NULL);
+    if (order.on) {
+        metric_scaled(metric_watch_u64("icslab2_recv_reorder_buffered_bytes", METRIC_GAUGE,
+                                       "Reorder buffer held for in-order output.", &order.n_live, NULL),
+                      ORDER_BLOCK);
+        metric_watch_u64("icslab2_recv_delivered_bytes_total", METRIC_COUNTER,
+                         "Bytes written in order to the output stream.", &order.delivered, NULL);
+        metric_watch_u64("icslab2_recv_contiguous_bytes", METRIC_GAUGE,
+                         "Verified bytes from the start of the file without a gap.", &order.verified, NULL);
+    }
+    m_read = metric_new("icslab2_recv_syscalls_total", METRIC_COUNTER, calls, "call=\"read\"");
+    m_pwrite = metric_new("icslab2_recv_syscalls_total", METRIC_COUNTER, calls, "call=\"pwrite\"");
+    m_pwritev = metric_new("icslab2_recv_syscalls_total", METRIC_COUNTER, calls, "call=\"pwritev\"");
+    m_recvmmsg = metric_new("icslab2_recv_syscalls_total", METRIC_COUNTER, calls, "call=\"recvmmsg\"");
+    m_uring_enter = metric_new("icslab2_recv_syscalls_total", METRIC_COUNTER, calls, "call=\"io_uring_enter\"");
+    metric_watch_u64("icslab2_recv_syscalls_total", METRIC_COUNTER, calls, &net_writes, "call=\"write\"");
+}
+
+/* 出力の off の位置に書く (ディレクトリの受信なら各ファイルに書き分ける) */
+int out_pwrite(int fd, const unsigned char *p, size_t len, uint64_t off)
+{
+    if (order.on) return order_write(p, len, off);
+    if (outdir.root != NULL) return outdir_pwrite(p, len, off);
+    metric_add(m_pwrite, 1);
+    if (pwrite(fd, p, len, (off_t)off) != (ssize_t)len) {
+        perror("pwrite");
+        return -1;
+    }
+    return 0;
+}
+
+/* ペイロードを出力ファイルのoffの位置に書き込む */
+static int payload_pwrite(void *arg, const unsigned char *p, size_t len, uint64_t off)
+{
+    return out_pwrite(*(int *)arg, p, len, off);
+}
+
+/* PROBEを受け取っていれば測定区間を更新する (最初のPROBEを受け取った時点から測る) */
+void note_probe(path_state_t *ps)
+{
+    if (ps->probe_bytes == 0) return;
+    if (ps->probe_first.tv_sec == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &ps->probe_first);
+        ps->probe_base = ps->probe_bytes;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ps->probe_last);
+}
+
+/* epoll による受信ループ: 読めるソケットから read() してフレームを処理する */
+int run_epoll(path_state_t *paths, int n_paths, int fd, uint64_t *file_size)
+{
+    struct epoll_event events[MAX_EVENTS];
+    char    buf[BUF_LEN];           /* 受信バッファ */
+    int     n;                      /* 受信バイト数 */
+    int     nfds, epfd, i;
+
+    epfd = epoll_create(MAX_EVENTS);
+    if (epfd < 0) {
+        perror("epoll_create");
+        return 1;
+    }
+
+    for (i = 0; i < n_paths; i++) {
+        if (epoll_ctl_add_in(epfd, paths[i].sock) != 0) {
+            perror("epoll_ctrl_add_in");
+            return 1;
+        }
+    }
+
+    int active_connections = n_paths; /* アクティブな接続数 */
+
+    while(active_connections > 0) {
+        nfds = epoll_wait(epfd, events, MAX_EVENTS, 60000);
+
+        if (nfds < 0) {
+            perror("epoll_wait");
+            break;
+        }
+        if (nfds == 0) {
+            fprintf(stderr, "Timeout\n");
+            break;
+        }
+
+        for (i = 0; i < nfds; i++) {
+            int sock_fd = events[i].data.fd;
+            path_state_t *ps = NULL;
+            int k;
+            for (k = 0; k < n_paths; k++) {
+                if (paths[k].sock == sock_fd) ps = &paths[k];
+            }
+            n = read(sock_fd, buf, BUF_LEN);
+            metric_add(m_read, 1);
+            
+            if (n > 0) telem_add(&ps->tm, (uint64_t)n);
+            if (n > 0 && parse_frames(ps, (unsigned char *)buf, n, file_size, payload_pwrite, &fd) == 0) {
+                /* データ受信 (フレームを解析してoffsetの位置に書き込み済み) */
+                note_probe(ps);
+            } else {
+                /* 切断 (n=0) またはエラー (n<0)，不正なフレーム */
+                if (n == 0 && !path_ended(ps)) {
+                    fprintf(stderr, "path %d closed before END frame\n", (int)(ps - paths));
+                }
+                /* 監視対象から削除してソケットを閉じる */
+                epoll_ctl(epfd, EPOLL_CTL_DEL, sock_fd, NULL);
+                telem_close_sock(telem_p, &ps->tm, sock_fd);
+                active_connections--;
+            }
+        }
+        resume_checkpoint(*file_size, 0);
+        early_finish(0);
+    }
+    close(epfd);
+    return 0;
+}
+
+/* ---- 経路ごとの受信スレッド ----                                        */
+/* 経路ごとに1スレッドが自分のソケットだけを読み，ペイロードを pwrite する。 */
+/* 出力ファイルは最初のFILEフレームで最終サイズに fallocate しておくので，   */
+/* 各スレッドは互いに待つことなく自分の範囲を書ける。                        */
+
+/* 出力ファイルの事前確保 (全スレッドで1回だけ) */
+static pthread_mutex_t prealloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t prealloc_size = 0;
+
+static void prealloc_output(int fd, uint64_t size)
+{
+    if (fd < 0) return;     /* ディレクトリの受信: ファイルごとに確保する */
+    /* 確保済みなら読むたびにロックを取らない */
+    if (size <= __atomic_load_n(&prealloc_size, __ATOMIC_ACQUIRE)) return;
+    pthread_mutex_lock(&prealloc_lock);
+    if (size > prealloc_size) {
+        if (fallocate(fd, 0, 0, (off_t)size) < 0 && errno != EOPNOTSUPP) {
+            perror("fallocate");
+        }
+        __atomic_store_n(&prealloc_size, size, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&prealloc_lock);
+}
+
+typedef struct {
+    path_state_t *ps;
+    int fd;                 /* 出力ファイル */
+    int cpu;                /* 固定するCPU (-1なら固定しない) */
+    uint64_t file_size;     /* このスレッドが受け取ったFILEフレームのサイズ */
+    int failed;
+} recv_thread_arg_t;
+
+static void *recv_thread(void *arg)
+{
+    recv_thread_arg_t *ta = arg;
+    path_state_t *ps = ta->ps;
+    unsigned char *buf;
+    ssize_t n;
+
+    if (ta->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(ta->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            fprintf(stderr, "cannot pin receiver thread to cpu %d\n", ta->cpu);
+        }
+    }
+    /* 読んだ分はすぐ pwrite するので，スレッドごとに1つを使い回す */
+    buf = aligned_alloc(4096, THREAD_BUF_SZ);
+    if (buf == NULL) {
+        perror("receive buffer");
+        ta->failed = 1;
+        return NULL;
+    }
+
+    order_enter();
+    for (;;) {
+        n = read(ps->sock, buf, THREAD_BUF_SZ);
+        metric_add(m_read, 1);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) perror("read");
+            break;
+        }
+        telem_add(&ps->tm, (uint64_t)n);
+        if (parse_frames(ps, buf, (size_t)n, &ta->file_size, payload_pwrite, &ta->fd) < 0) {
+            ta->failed = 1;
+            break;
+        }
+        prealloc_output(ta->fd, ta->file_size);
+        note_probe(ps);
+        resume_checkpoint(ta->file_size, 0);
+        early_finish(0);
+    }
+    order_leave();
+    telem_close_sock(telem_p, &ps->tm, ps->sock);
+    free(buf);
+    return NULL;
+}
+
+int run_threads(path_state_t *paths, int n_paths, int fd, uint64_t *file_size,
+                const int *cpus, int n_cpus)
+{
+    pthread_t *th = malloc(sizeof(pthread_t) * n_paths);
+    recv_thread_arg_t *args = calloc(n_paths, sizeof(recv_thread_arg_t));
+    int *started = calloc(n_paths, sizeof(int));
+    int i, failed = 0;
+
+    if (!th || !args || !started) {
+        perror("malloc");
+        free(th);
+        free(args);
+        free(started);
+        return 1;
+    }
+    for (i = 0; i < n_paths; i++) {
+        args[i].ps = &paths[i];
+        args[i].fd = fd;
+        args[i].cpu = n_cpus > 0 ? cpus[i % n_cpus] : -1;
+        if (pthread_create(&th[i], NULL, recv_thread, &args[i]) != 0) {
+            perror("pthread_create");
+            telem_close_sock(telem_p, &paths[i].tm, paths[i].sock);
+            failed = 1;
+            continue;
+        }
+        started[i] = 1;
+    }
+    for (i = 0; i < n_paths; i++) {
+        if (!started[i]) continue;
+        pthread_join(th[i], NULL);
+        if (!path_ended(&paths[i]) && !args[i].failed) {
+            fprintf(stderr, "path %d closed before END frame\n", i);
+        }
+        if (args[i].failed) failed = 1;
+        if (args[i].file_size > *file_size) *file_size = args[i].file_size;
+    }
+    free(th);
+    free(args);
+    free(started);
+    return failed;
+}
+
+/* ---- UDP経路 ----                                                       */
+/* 送信側が STREAMS に FRAME_F_UDP を付けてきた経路は，TCP接続を制御用に   */
+/* 残し，データはUDPで受ける。経路ごとに1スレッドがUDPソケットと制御用の   */
+/* TCP接続の両方を見る。データグラムはチャンクごとのビットマップで受信済み */
+/* かを記録し (重複は捨てる)，POLLが来たら欠けている範囲をNACKで返す。     */
+/* 欠けの無くなったチャンクはデータグラムごとのCRCをつないでチャンク全体の */
+/* CRCと照合し，TCPで届いたチャンクと同じように記録する                   */
+#define UDP_RCVBUF          (16 * 1024 * 1024)
+#define UDP_RECV_BATCH      32              /* 1回のrecvmmsgで受け取るメッセージ数 */
+#define UDP_RECV_BUF_SZ     (64 * 1024)     /* GROでまとめて届く最大の大きさ */
+#define UDP_HELLO_MS        100             /* 最初のデータが届くまでHELLOを送る間隔 */
+#define UDP_NACK_DELAY_MS   20              /* データグラムが途絶えてからNACKを返すまでの時間 */
+#define UDP_DONE_RING       256             /* 受信を終えたチャンクを覚えておく数 (重複の破棄用) */
+
+/* 受信途中のチャンク */
+typedef struct {
+    uint64_t off;
+    uint32_t len;
+    uint32_t crc;                       /* 送信側が求めたチャンク全体のCRC32C */
+    uint32_t n_segs, n_got;
+    unsigned char *bits;                /* 受け取ったデータグラム */
+    uint32_t *seg_crc;                  /* データグラムごとのCRC32C */
+    int polled;                         /* POLLを受け取って返事待ち */
+    uint32_t poll_seq;                  /* POLLの前に送られた最後のデータグラムの通し番号 */
+    struct timespec polled_at;
+} udp_chunk_t;
+
+struct udp_recv {
+    path_state_t *ps;
+    int sock;                           /* UDPソケット (制御用TCP接続と同じ相手にconnect済み) */
+    uint32_t token;                     /* セッション識別子 */
+    int fd;                             /* 出力ファイル */
+    uint64_t file_size;
+    int gro;                            /* UDP_GRO が使える */
+    int got_data;                       /* 送信側に宛先が届いた (HELLOをやめる) */
+    int failed;
+    udp_chunk_t *chunks;
+    int n_chunks, cap_chunks;
+    uint64_t done[UDP_DONE_RING];       /* 受信を終えたチャンクの先頭 */
+    int n_done;
+    unsigned char *bufs;                /* UDP_RECV_BATCH * UDP_RECV_BUF_SZ */
+    struct iovec wv[IOV_MAX];           /* 連続した位置のペイロードをまとめて書く */
+    int n_wv;
+    uint64_t wv_off, wv_end;
+    uint64_t n_dgrams, n_dup, n_bad;
+    uint32_t max_seq;                   /* 届いたデータグラムの通し番号の最大 */
+    int have_seq;
+    struct timespec last_rx;            /* 最後にデータグラムが届いた時刻 */
+    pthread_t th;
+    int started;                        /* th を起動した */
+};
+
+/* 制御用のTCP接続と同じ相手にUDPソケットを向ける (中継ルーターを通る経路なら中継ルーター) */
+udp_recv_t *udp_recv_open(int tcp_sock, uint32_t token, const tune_profile_t *tp)
+{
+    struct sockaddr_storage peer;
+    socklen_t plen = sizeof(peer);
+    udp_recv_t *u;
+    int size = UDP_RCVBUF, one = 1;
+
+    if (getpeername(tcp_sock, (struct sockaddr *)&peer, &plen) < 0) {
+        perror("getpeername");
+        return NULL;
+    }
+    u = calloc(1, sizeof(udp_recv_t));
+    if (u == NULL) return NULL;
+    u->token = token;
+    u->bufs = malloc((size_t)UDP_RECV_BATCH * UDP_RECV_BUF_SZ);
+    u->sock = socket(peer.ss_family, SOCK_DGRAM, 0);
+    if (u->bufs == NULL || u->sock < 0 || connect(u->sock, (struct sockaddr *)&peer, plen) < 0) {
+        perror("UDP socket");
+        if (u->sock >= 0) close(u->sock);
+        free(u->bufs);
+        free(u);
+        return NULL;
+    }
+    /* 送信側のバーストを受け止められるよう受信バッファは大きめにする */
+    if (tp != NULL && tune_bufsize(tp) > size) size = tune_bufsize(tp);
+    if (setsockopt(u->sock, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0) {
+        setsockopt(u->sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+#ifdef UDP_GRO
+    u->gro = setsockopt(u->sock, SOL_UDP, UDP_GRO, &one, sizeof(one)) == 0;
+#endif
+    (void)one;
+    return u;
+}
+
+void udp_recv_free(udp_recv_t *u)
+{
+    int i;
+
+    if (u == NULL) return;
+    for (i = 0; i < u->n_chunks; i++) {
+        free(u->chunks[i].bits);
+        free(u->chunks[i].seg_crc);
+    }
+    free(u->chunks);
+    free(u->bufs);
+    close(u->sock);
+    free(u);
+}
+
+static int udp_is_done(const udp_recv_t *u, uint64_t off)
+{
+    int i, n = u->n_done < UDP_DONE_RING ? u->n_done : UDP_DONE_RING;
+    for (i = 0; i < n; i++) {
+        if (u->done[i] == off) return 1;
+    }
+    return 0;
+}
+
+/* チャンクの受信状態を探す。無ければ作る (create が0なら作らずNULL) */
+static udp_chunk_t *udp_chunk_get(udp_recv_t *u, uint64_t off, uint32_t len, uint32_t crc, int create)
+{
+    udp_chunk_t *c;
+    int i;
+
+    for (i = 0; i < u->n_chunks; i++) {
+        if (u->chunks[i].off == off) return &u->chunks[i];
+    }
+    if (!create || len == 0) return NULL;
+    if (u->n_chunks == u->cap_chunks) {
+        int cap = u->cap_chunks ? u->cap_chunks * 2 : 64;
+        udp_chunk_t *tmp = realloc(u->chunks, sizeof(udp_chunk_t) * cap);
+        if (tmp == NULL) return NULL;
+        u->chunks = tmp;
+        u->cap_chunks = cap;
+    }
+    c = &u->chunks[u->n_chunks];
+    memset(c, 0, sizeof(*c));
+    c->off = off;
+    c->len = len;
+    c->crc = crc;
+    c->n_segs = (len + UDP_SEG_LEN - 1) / UDP_SEG_LEN;
+    c->bits = calloc((c->n_segs + 7) / 8, 1);
+    c->seg_crc = malloc(sizeof(uint32_t) * c->n_segs);
+    if (c->bits == NULL || c->seg_crc == NULL) {
+        free(c->bits);
+        free(c->seg_crc);
+        return NULL;
+    }
+    u->n_chunks++;
+    return c;
+}
+
+#define UDP_HAS(c, s)   ((c)->bits[(s) >> 3] & (1u << ((s) & 7)))
+
+/* POLLへの返事: 欠けているデータグラムの範囲 (c が NULL なら受信完了)   */
+/* 範囲が FRAME_RESUME_MAX を超えるときは先頭から載せ，残りは次のPOLLで返す */
+static int udp_send_nack(udp_recv_t *u, const udp_chunk_t *c, uint64_t off)
+{
+    uint64_t *r = NULL;
+    frame_hdr_t h;
+    uint32_t s;
+    int n = 0, i, rc;
+
+    if (c != NULL) {
+        r = malloc(sizeof(uint64_t) * 2 * FRAME_RESUME_MAX);
+        if (r == NULL) return -1;
+        for (s = 0; s < c->n_segs; s++) {
+            uint64_t pos = c->off + (uint64_t)s * UDP_SEG_LEN;
+            uint64_t len = s + 1 < c->n_segs ? UDP_SEG_LEN : c->off + c->len - pos;
+            if (UDP_HAS(c, s)) continue;
+            if (n > 0 && r[2 * (n - 1)] + r[2 * (n - 1) + 1] == pos) {
+                r[2 * (n - 1) + 1] += len;      /* 直前の範囲に続く */
+            } else if (n < FRAME_RESUME_MAX) {
+                r[2 * n] = pos;
+                r[2 * n + 1] = len;
+                n++;
+            } else {
+                break;
+            }
+        }
+        for (i = 0; i < 2 * n; i++) r[i] = htobe64(r[i]);
+    }
+    memset(&h, 0, sizeof(h));
+    h.type = FRAME_NACK;
+    h.path_id = (uint16_t)u->ps->path_id;
+    h.offset = off;
+    h.length = (uint32_t)n * 16;
+    rc = send_frame(u->ps->sock, &h) < 0 || write_all(u->ps->sock, r, (size_t)n * 16) < 0 ? -1 : 0;
+    free(r);
+    return rc;
+}
+
+/* まとめておいた書き込みを出力ファイルに書く */
+static int udp_flush(udp_recv_t *u)
+{
+    int i = 0;
+    uint64_t off = u->wv_off;
+
+    if (outdir.root != NULL || order.on) {
+        /* ディレクトリの受信: まとめた書き込みもファイルごとに書き分ける */
+        for (i = 0; i < u->n_wv; i++) {
+            if (out_pwrite(u->fd, u->wv[i].iov_base, u->wv[i].iov_len, off) < 0) return -1;
+            off += u->wv[i].iov_len;
+        }
+        u->n_wv = 0;
+        return 0;
+    }
+    while (i < u->n_wv) {
+        ssize_t n = pwritev(u->fd, u->wv + i, u->n_wv - i, (off_t)off);
+        metric_add(m_pwritev, 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("pwritev");
+            return -1;
+        }
+        off += (uint64_t)n;
+        /* 書けた分だけ進める (短い書き込み対策) */
+        while (i < u->n_wv && (size_t)n >= u->wv[i].iov_len) {
+            n -= (ssize_t)u->wv[i].iov_len;
+            i++;
+        }
+        if (i < u->n_wv && n > 0) {
+            u->wv[i].iov_base = (char *)u->wv[i].iov_base + n;
+            u->wv[i].iov_len -= (size_t)n;
+        }
+    }
+    u->n_wv = 0;
+    return 0;
+}
+
+/* チャンクのデータグラムがすべて揃った: CRCを照合して記録し，返事待ちなら完了を返す */
+static int udp_chunk_complete(udp_recv_t *u, udp_chunk_t *c)
+{
+    path_state_t *ps = u->ps;
+    uint32_t crc = 0, s;
+    int polled = c->polled, rc = 0;
+    uint64_t off = c->off;
+
+    /* 記録する前に出力へ書いておく (再開用の記録は書き込み済みを前提にする) */
+    if (udp_flush(u) < 0) return -1;
+    for (s = 0; s < c->n_segs; s++) {
+        uint32_t len = s + 1 < c->n_segs ? UDP_SEG_LEN : c->len - s * UDP_SEG_LEN;
+        crc = crc32c_combine(crc, c->seg_crc[s], len);
+    }
+    ps->check = 1;
+    ps->zlib = 0;
+    ps->crc = crc;
+    ps->want_crc = c->crc;
+    ps->chunk_off = c->off;
+    ps->chunk_len = c->len;
+    crc_log_add(ps);
+
+    u->done[u->n_done++ % UDP_DONE_RING] = c->off;
+    free(c->bits);
+    free(c->seg_crc);
+    *c = u->chunks[--u->n_chunks];
+    if (polled) rc = udp_send_nack(u, NULL, off);
+    return rc;
+}
+
+/* 1つのデータグラムを処理する */
+static int udp_handle_dgram(udp_recv_t *u, const unsigned char *p, size_t n)
+{
+    udp_hdr_t uh;
+    udp_chunk_t *c;
+    uint64_t rel;
+    uint32_t s;
+
+    u->n_dgrams++;
+    if (n < UDP_HDR_LEN || udp_hdr_unpack(p, &uh) < 0 || uh.h.type != FRAME_DATA ||
+        uh.h.file_id != u->token || uh.h.length != n - UDP_HDR_LEN ||
+        uh.h.offset < uh.chunk_off || uh.h.offset + uh.h.length > uh.chunk_off + uh.chunk_len) {
+        u->n_bad++;             /* 前のセッションのものか壊れている */
+        return 0;
+    }
+    p += UDP_HDR_LEN;
+    if (crc32c(0, p, uh.h.length) != uh.h.crc) {
+        u->n_bad++;             /* 捨てればNACKで再送される */
+        return 0;
+    }
+    u->got_data = 1;
+    u->ps->path_id = uh.h.path_id;
+    if (!u->have_seq || (int32_t)(uh.h.raw_len - u->max_seq) > 0) u->max_seq = uh.h.raw_len;
+    u->have_seq = 1;
+    rel = uh.h.offset - uh.chunk_off;
+    if (rel % UDP_SEG_LEN != 0 || udp_is_done(u, uh.chunk_off)) {
+        u->n_dup++;
+        return 0;
+    }
+    if (order.on && !order_fits(uh.h.offset, uh.h.length)) {
+        u->n_bad++;             /* 順に書き出すのが追いつくまで捨ててNACKで送り直してもらう */
+        return 0;
+    }
+    c = udp_chunk_get(u, uh.chunk_off, uh.chunk_len, uh.chunk_crc, 1);
+    if (c == NULL) {
+        perror("udp chunk");
+        return -1;
+    }
+    s = (uint32_t)(rel / UDP_SEG_LEN);
+    if (UDP_HAS(c, s)) {
+        u->n_dup++;
+        return 0;
+    }
+    c->bits[s >> 3] |= (unsigned char)(1u << (s & 7));
+    c->seg_crc[s] = uh.h.crc;
+    c->n_got++;
+
+    /* 直前のペイロードに続いていればまとめて書く */
+    if (u->n_wv > 0 && (u->n_wv == IOV_MAX || u->wv_end != uh.h.offset)) {
+        if (udp_flush(u) < 0) return -1;
+    }
+    if (u->n_wv == 0) u->wv_off = uh.h.offset;
+    u->wv[u->n_wv].iov_base = (void *)p;
+    u->wv[u->n_wv].iov_len = uh.h.length;
+    u->n_wv++;
+    u->wv_end = uh.h.offset + uh.h.length;
+
+    if (c->n_got == c->n_segs) return udp_chunk_complete(u, c);
+    return 0;
+}
+
+/* 届いているデータグラムをまとめて受け取る */
+static int udp_recv_batch(udp_recv_t *u)
+{
+    struct mmsghdr msgs[UDP_RECV_BATCH];
+    struct iovec iov[UDP_RECV_BATCH];
+    char ctrl[UDP_RECV_BATCH][CMSG_SPACE(sizeof(int))];
+    int i, n, round;
+
+    for (round = 0; round < 8; round++) {
+        memset(msgs, 0, sizeof(msgs));
+        for (i = 0; i < UDP_RECV_BATCH; i++) {
+            iov[i].iov_base = u->bufs + (size_t)i * UDP_RECV_BUF_SZ;
+            iov[i].iov_len = UDP_RECV_BUF_SZ;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = ctrl[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+        }
+        n = recvmmsg(u->sock, msgs, UDP_RECV_BATCH, MSG_DONTWAIT, NULL);
+        metric_add(m_recvmmsg, 1);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) break;
+            if (errno == ECONNREFUSED) break;   /* HELLOが届く前の送信側からのICMP */
+            perror("recvmmsg");
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            const unsigned char *p = iov[i].iov_base;
+            size_t len = msgs[i].msg_len, seg = len;
+            struct cmsghdr *cm;
+
+            /* GROでまとめられたデータグラムは gso_size ごとに分ける */
+            for (cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cm != NULL; cm = CMSG_NXTHDR(&msgs[i].msg_hdr, cm)) {
+#ifdef UDP_GRO
+                if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                    int gso;
+                    memcpy(&gso, CMSG_DATA(cm), sizeof(gso));
+                    if (gso > 0) seg = (size_t)gso;
+                }
+#endif
+            }
+            telem_add(&u->ps->tm, len);
+            while (len > 0) {
+                size_t one = len < seg ? len : seg;
+                if (udp_handle_dgram(u, p, one) < 0) return -1;
+                p += one;
+                len -= one;
+            }
+        }
+        /* 受信バッファを使い回すので，次のrecvmmsgの前に書き出す */
+        if (udp_flush(u) < 0) return -1;
+        if (n < UDP_RECV_BATCH) break;
+    }
+    return 0;
+}
+
+/* 制御用のTCP接続からフレームを1つ読む */
+static int udp_read_ctrl(udp_recv_t *u)
+{
+    path_state_t *ps = u->ps;
+    unsigned char hdr[FRAME_HDR_LEN];
+    frame_hdr_t h;
+    udp_chunk_t *c;
+
+    if (read_all(ps->sock, hdr, sizeof(hdr)) < 0 || frame_hdr_unpack(hdr, &h) < 0) {
+        fprintf(stderr, "path %d closed before END frame\n", ps->path_id);
+        return -1;
+    }
+    ps->path_id = h.path_id;
+    switch (h.type) {
+    case FRAME_FILE:
+        if (h.flags & FRAME_F_STREAM) {
+            if (stream_begin() < 0) return -1;
+        } else {
+            u->file_size = h.offset;
+        }
+        if (h.flags & FRAME_F_FEC) fec_init(h.offset, h.raw_len, h.crc);
+        if (h.flags & FRAME_F_ACK) ack_init(h.offset, h.crc);   /* UDPのチャンクはNACKで確認する */
+        break;
+    case FRAME_PARITY: {
+        /* パリティはTCP接続のほうで届く */
+        unsigned char *buf;
+        int ok = fec_parity_ok(ps->path_id, h.length);
+
+        if (ok < 0) return -1;
+        buf = malloc(h.length > 0 ? h.length : 1);
+        if (buf == NULL || read_all(ps->sock, buf, h.length) < 0) {
+            free(buf);
+            fprintf(stderr, "path %d closed in a parity frame\n", ps->path_id);
+            return -1;
+        }
+        telem_add(&ps->tm, h.length);
+        if (!ok) {
+            free(buf);      /* 順序どおりの出力では使わない */
+        } else if (crc32c(0, buf, h.length) == h.crc) {
+            fec_add_parity(h.offset, h.length, h.raw_len, buf);
+        } else {
+            fprintf(stderr, "path %d: CRC32C mismatch in parity at offset %llu\n",
+                    ps->path_id, (unsigned long long)h.offset);
+            free(buf);
+        }
+        break;
+    }
+    case FRAME_POLL:
+        u->got_data = 1;
+        if (udp_is_done(u, h.offset)) return udp_send_nack(u, NULL, h.offset);
+        /* データグラムが1つも届いていないチャンクもここで作る */
+        c = udp_chunk_get(u, h.offset, h.raw_len, h.crc, 1);
+        if (c == NULL) return -1;
+        c->polled = 1;
+        c->poll_seq = h.file_id;
+        clock_gettime(CLOCK_MONOTONIC, &c->polled_at);
+        break;
+    case FRAME_EOS:
+        u->file_size = h.offset;
+        __atomic_store_n(&input.ended, 1, __ATOMIC_RELAXED);
+        break;
+    case FRAME_END:
+        path_end(ps);
+        break;
+    default:
+        fprintf(stderr, "unknown control frame type %d\n", h.type);
+        return -1;
+    }
+    return 0;
+}
+
+static double udp_ms_since(const struct timespec *t)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000.0 + (now.tv_nsec - t->tv_nsec) / 1000000.0;
+}
+
+static void *udp_recv_thread(void *arg)
+{
+    udp_recv_t *u = arg;
+    path_state_t *ps = u->ps;
+    struct timespec hello_at = { 0, 0 };
+    int i;
+
+    order_enter();      /* 待ちはしないが，走っている間は他の経路の詰まりを解くかもしれない */
+    while (!path_ended(ps)) {
+        struct pollfd pfd[2] = { { ps->sock, POLLIN, 0 }, { u->sock, POLLIN, 0 } };
+        int timeout = 100;
+
+        /* 送信側がこちらの宛先を知るまでHELLOを送り続ける */
+        if (!u->got_data && (hello_at.tv_sec == 0 || udp_ms_since(&hello_at) >= UDP_HELLO_MS)) {
+            unsigned char p[FRAME_HDR_LEN];
+            frame_hdr_t h;
+            memset(&h, 0, sizeof(h));
+            h.type = FRAME_HELLO;
+            h.file_id = u->token;
+            frame_hdr_pack(p, &h);
+            if (send(u->sock, p, sizeof(p), 0) < 0 && errno != ECONNREFUSED) perror("send HELLO");
+            clock_gettime(CLOCK_MONOTONIC, &hello_at);
+        }
+        if (!u->got_data) timeout = UDP_HELLO_MS;
+        for (i = 0; i < u->n_chunks; i++) {
+            if (u->chunks[i].polled) timeout = 1;
+        }
+        if (poll(pfd, 2, timeout) < 0 && errno != EINTR) {
+            perror("poll");
+            u->failed = 1;
+            break;
+        }
+        if (pfd[1].revents & POLLIN) clock_gettime(CLOCK_MONOTONIC, &u->last_rx);
+        if ((pfd[1].revents & POLLIN) && udp_recv_batch(u) < 0) {
+            u->failed = 1;
+            break;
+        }
+        if ((pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) && udp_read_ctrl(u) < 0) {
+            u->failed = !path_ended(ps);
+            break;
+        }
+        /* 欠けたままのデータグラムを知らせる。TCPのPOLLは途中の中継ルーターや */
+        /* キューに溜まったデータグラムを追い越すので，POLLの前に送られた最後の */
+        /* データグラム (以降) が届くか，データグラムが途絶えるまで待つ          */
+        for (i = 0; i < u->n_chunks; i++) {
+            udp_chunk_t *c = &u->chunks[i];
+            if (!c->polled) continue;
+            if ((u->have_seq && (int32_t)(u->max_seq - c->poll_seq) >= 0) ||
+                (udp_ms_since(&c->polled_at) >= UDP_NACK_DELAY_MS &&
+                 udp_ms_since(&u->last_rx) >= UDP_NACK_DELAY_MS)) {
+                c->polled = 0;
+                if (udp_send_nack(u, c, c->off) < 0) {
+                    u->failed = 1;
+                    break;
+                }
+            }
+        }
+        if (u->failed) break;
+        prealloc_output(u->fd, u->file_size);
+        /* io_uringの受信ループは記録したチャンクをまだ書いている途中のことがある */
+        /* ので，記録はそのループだけが書き込みの済んだときに行う              */
+        if (!early.uring) resume_checkpoint(u->file_size, 0);
+        early_finish(0);
+    }
+    order_leave();
+    telem_close_sock(telem_p, &ps->tm, ps->sock);
+    return NULL;
+}
+
+/* UDP経路の受信スレッドを起動する (paths はすべてUDP経路) */
+int udp_recv_start(path_state_t *paths, int n_paths, int fd)
+{
+    int i;
+
+    for (i = 0; i < n_paths; i++) {
+        udp_recv_t *u = paths[i].udp;
+        u->ps = &paths[i];
+        u->fd = fd;
+        if (pthread_create(&u->th, NULL, udp_recv_thread, u) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+        u->started = 1;
+    }
+    return 0;
+}
+
+/* 受信スレッドの終了を待つ。*file_size を通知されたサイズに更新する */
+int udp_recv_join(path_state_t *paths, int n_paths, uint64_t *file_size)
+{
+    int i, failed = 0;
+
+    for (i = 0; i < n_paths; i++) {
+        udp_recv_t *u = paths[i].udp;
+        if (!u->started) continue;  /* 起動の途中で失敗した */
+        pthread_join(u->th, NULL);
+        if (u->failed) failed = 1;
+        if (u->file_size > *file_size) *file_size = u->file_size;
+        printf("path %d (UDP%s): %llu datagrams, %llu duplicates, %llu dropped\n",
+               paths[i].path_id, u->gro ? "/GRO" : "", (unsigned long long)u->n_dgrams,
+               (unsigned long long)u->n_dup, (unsigned long long)u->n_bad);
+    }
+    return failed;
+}
+
+#ifdef HAVE_URING_RECV
+/* ---- io_uring 受信バックエンド ----                                      */
+/* 各経路のソケットにマルチショット受信を1つずつ出しておき，受信データは    */
+/* 登録済みのバッファリングから選ばせる。受信したバッファをフレームとして   */
+/* 解析し，ペイロード部分の書き込みを同じリングに積む。バッファは書き込みが */
+/* すべて終わった時点でリングに戻す。liburingは使わずシステムコールを直接   */
+/* 呼ぶので，追加のライブラリなしでビルドできる。                          */
+#define URING_ENTRIES   1024
+#define URING_BUF_SZ    (64 * 1024)     /* 受信バッファ1つの大きさ */
+#define URING_NBUFS     256             /* 受信バッファの数 (2のべき乗) */
+#define URING_BGID      0               /* バッファグループ番号 */
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned sq_local_tail;             /* まだカーネルに渡していないSQEの末尾 */
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+    struct io_uring_buf_ring *br;       /* 受信バッファリング */
+    size_t br_sz;
+    unsigned short br_tail;
+    unsigned char *bufs;                /* 受信バッファ本体 */
+    int *refs;                          /* バッファごとの使用中の数 */
+    int *starved;                       /* バッファ不足で受信が止まった経路 */
+    int recycled;                       /* 今回の刈り取りでバッファが戻った */
+    int n_paths;
+} uring_t;
+
+/* 書き込み要求 (user_dataにはこの構造体のアドレスを入れる) */
+typedef struct {
+    int bid;                            /* 参照している受信バッファ */
+    const unsigned char *p;
+    size_t len;
+    uint64_t off;
+} uring_write_t;
+
+/* ペイロード書き込みのコールバック引数 */
+typedef struct {
+    uring_t *u;
+    int out_fd;
+    int bid;
+    int *writes;                        /* 完了待ちの書き込み数 */
+} uring_ctx_t;
+
+/* user_data: 奇数 = 経路iの受信 ((i << 1) | 1)，偶数 = uring_write_t */
+#define URING_UD_RECV(i)    (((uint64_t)(i) << 1) | 1)
+
+static int uring_setup(uring_t *u, int n_paths)
+{
+    struct io_uring_params prm;
+    struct io_uring_buf_reg reg;
+    int bid;
+
+    memset(u, 0, sizeof(*u));
+    memset(&prm, 0, sizeof(prm));
+    u->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &prm);
+    if (u->fd < 0) {
+        perror("io_uring_setup");
+        return -1;
+    }
+    u->sq_entries = prm.sq_entries;
+    u->sq_ring_sz = prm.sq_off.array + prm.sq_entries * sizeof(unsigned);
+    u->cq_ring_sz = prm.cq_off.cqes + prm.cq_entries * sizeof(struct io_uring_cqe);
+    if (prm.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_sz > u->sq_ring_sz) u->sq_ring_sz = u->cq_ring_sz;
+        u->cq_ring_sz = u->sq_ring_sz;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) {
+        perror("mmap sq ring");
+        return -1;
+    }
+    if (prm.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = mmap(NULL, u->cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED) {
+            perror("mmap cq ring");
+            return -1;
+        }
+    }
+    u->sqes_sz = prm.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        perror("mmap sqes");
+        return -1;
+    }
+    u->sq_head  = (unsigned *)((char *)u->sq_ring + prm.sq_off.head);
+    u->sq_tail  = (unsigned *)((char *)u->sq_ring + prm.sq_off.tail);
+    u->sq_mask  = (unsigned *)((char *)u->sq_ring + prm.sq_off.ring_mask);
+    u->sq_array = (unsigned *)((char *)u->sq_ring + prm.sq_off.array);
+    u->cq_head  = (unsigned *)((char *)u->cq_ring + prm.cq_off.head);
+    u->cq_tail  = (unsigned *)((char *)u->cq_ring + prm.cq_off.tail);
+    u->cq_mask  = (unsigned *)((char *)u->cq_ring + prm.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + prm.cq_off.cqes);
+    u->sq_local_tail = *u->sq_tail;
+
+    /* 受信バッファリングを登録する */
+    u->br_sz = sizeof(struct io_uring_buf) * URING_NBUFS;
+    u->br = mmap(NULL, u->br_sz, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    u->bufs = aligned_alloc(4096, (size_t)URING_BUF_SZ * URING_NBUFS);
+    u->refs = calloc(URING_NBUFS, sizeof(int));
+    u->starved = calloc(n_paths, sizeof(int));
+    u->n_paths = n_paths;
+    if (u->br == MAP_FAILED || !u->bufs || !u->refs || !u->starved) {
+        perror("alloc recv buffers");
+        return -1;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)u->br;
+    reg.ring_entries = URING_NBUFS;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("io_uring_register(PBUF_RING)");
+        return -1;
+    }
+    for (bid = 0; bid < URING_NBUFS; bid++) {
+        struct io_uring_buf *b = &u->br->bufs[u->br_tail & (URING_NBUFS - 1)];
+        b->addr = (unsigned long)(u->bufs + (size_t)bid * URING_BUF_SZ);
+        b->len = URING_BUF_SZ;
+        b->bid = (unsigned short)bid;
+        u->br_tail++;
+    }
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void uring_teardown(uring_t *u)
+{
+    if (u->sqes && u->sqes != MAP_FAILED) munmap(u->sqes, u->sqes_sz);
+    if (u->cq_ring && u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring) munmap(u->cq_ring, u->cq_ring_sz);
+    if (u->sq_ring && u->sq_ring != MAP_FAILED) munmap(u->sq_ring, u->sq_ring_sz);
+    if (u->br && u->br != MAP_FAILED) munmap(u->br, u->br_sz);
+    free(u->bufs);
+    free(u->refs);
+    free(u->starved);
+    if (u->fd >= 0) close(u->fd);
+}
+
+/* 溜まっているSQEをカーネルに渡し，wait個以上の完了を待つ */
+static int uring_enter(uring_t *u, unsigned wait)
+{
+    unsigned to_submit = u->sq_local_tail - *u->sq_tail;
+
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+    for (;;) {
+        int ret = (int)syscall(__NR_io_uring_enter, u->fd, to_submit, wait,
+                               wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        metric_add(m_uring_enter, 1);
+        if (ret >= 0) return 0;
+        if (errno == EINTR) continue;
+        if (errno == EBUSY || errno == EAGAIN) return 0;   /* 先に完了を刈り取る */
+        perror("io_uring_enter");
+        return -1;
+    }
+}
+
+static struct io_uring_sqe *uring_get_sqe(uring_t *u)
+{
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    while (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        if (uring_enter(u, 0) < 0) return NULL;    /* SQが埋まっていれば先に渡す */
+    }
+    idx = u->sq_local_tail & *u->sq_mask;
+    sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    u->sq_local_tail++;
+    return sqe;
+}
+
+/* 経路iにマルチショット受信を出す */
+static int uring_arm_recv(uring_t *u, int i, int sock)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sock;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = URING_UD_RECV(i);
+    u->starved[i] = 0;
+    return 0;
+}
+
+static int uring_queue_write(uring_t *u, int out_fd, uring_write_t *w)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = out_fd;
+    sqe->addr = (unsigned long)w->p;
+    sqe->len = (unsigned)w->len;
+    sqe->off = w->off;
+    sqe->user_data = (uint64_t)(uintptr_t)w;
+    return 0;
+}
+
+/* 受信バッファの参照を1つ外し，誰も使っていなければリングに戻す */
+static void uring_buf_put(uring_t *u, int bid)
+{
+    struct io_uring_buf *b;
+
+    if (--u->refs[bid] > 0) return;
+    b = &u->br->bufs[u->br_tail & (URING_NBUFS - 1)];
+    b->addr = (unsigned long)(u->bufs + (size_t)bid * URING_BUF_SZ);
+    b->len = URING_BUF_SZ;
+    b->bid = (unsigned short)bid;
+    u->br_tail++;
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+    u->recycled = 1;
+}
+
+/* ペイロードを書き込み要求としてリングに積む */
+static int payload_uring(void *arg, const unsigned char *p, size_t len, uint64_t off)
+{
+    uring_ctx_t *ctx = arg;
+    uring_write_t *w;
+
+    /* 展開済みデータなどリングのバッファ以外にあるものは，すぐに上書き */
+    /* されるので書き込みの完了を待たずにここで書いてしまう。         */
+    /* ディレクトリの受信も書き終えたファイルを閉じるのでここで書く   */
+    if (outdir.root != NULL ||
+        p < ctx->u->bufs || p >= ctx->u->bufs + (size_t)URING_NBUFS * URING_BUF_SZ) {
+        return out_pwrite(ctx->out_fd, p, len, off);
+    }
+    w = malloc(sizeof(uring_write_t));
+    if (!w) {
+        perror("malloc");
+        return -1;
+    }
+    w->bid = ctx->bid;
+    w->p = p;
+    w->len = len;
+    w->off = off;
+    if (uring_queue_write(ctx->u, ctx->out_fd, w) < 0) {
+        free(w);
+        return -1;
+    }
+    ctx->u->refs[ctx->bid]++;
+    (*ctx->writes)++;
+    return 0;
+}
+
+/* io_uring による受信ループ */
+int run_uring(path_state_t *paths, int n_paths, int fd, uint64_t *file_size)
+{
+    uring_t u;
+    uring_ctx_t ctx;
+    int active = n_paths;       /* 受信中の経路数 */
+    int writes = 0;             /* 完了待ちの書き込み数 */
+    int failed = 0;
+    int *bad;                   /* フレームが壊れていた経路 (以降のデータは捨てる) */
+    int i;
+
+    if (uring_setup(&u, n_paths) < 0) {
+        uring_teardown(&u);
+        return 1;
+    }
+    bad = calloc(n_paths, sizeof(int));
+    if (!bad) {
+        perror("calloc");
+        uring_teardown(&u);
+        return 1;
+    }
+    ctx.u = &u;
+    ctx.out_fd = fd;
+    ctx.writes = &writes;
+    early.uring = 1;            /* 書き込みが非同期なので復元はこのループで行う */
+
+    for (i = 0; i < n_paths; i++) {
+        if (uring_arm_recv(&u, i, paths[i].sock) < 0) {
+            uring_teardown(&u);
+            free(bad);
+            return 1;
+        }
+    }
+
+    while (active > 0 || writes > 0) {
+        unsigned head, tail;
+
+        if (uring_enter(&u, 1) < 0) {
+            failed = 1;
+            break;
+        }
+
+        head = *u.cq_head;
+        tail = __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &u.cqes[head & *u.cq_mask];
+            uint64_t ud = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+
+            if (ud & 1) {
+                /* 受信の完了 */
+                path_state_t *ps;
+                i = (int)(ud >> 1);
+                ps = &paths[i];
+
+                if (res > 0) {
+                    int bid = (int)(flags >> IORING_CQE_BUFFER_SHIFT);
+                    ctx.bid = bid;
+                    u.refs[bid] = 1;    /* 解析が終わるまで保持 */
+                    telem_add(&ps->tm, (uint64_t)res);
+                    if (!bad[i]) {
+                        if (parse_frames(ps, u.bufs + (size_t)bid * URING_BUF_SZ, (size_t)res,
+                                         file_size, payload_uring, &ctx) < 0) {
+                            /* 不正なフレーム: この経路を打ち切る */
+                            bad[i] = 1;
+                            shutdown(ps->sock, SHUT_RDWR);
+                        }
+                        note_probe(ps);
+                    }
+                    uring_buf_put(&u, bid);
+                    if (!(flags & IORING_CQE_F_MORE)) uring_arm_recv(&u, i, ps->sock);
+                } else if (res == -ENOBUFS) {
+                    /* バッファが空くまで待ってから受信を出し直す */
+                    u.starved[i] = 1;
+                } else if (!(flags & IORING_CQE_F_MORE)) {
+                    /* 切断 (res=0) またはエラー */
+                    if (res < 0) {
+                        fprintf(stderr, "path %d recv: %s\n", i, strerror(-res));
+                    } else if (!path_ended(ps) && !bad[i]) {
+                        fprintf(stderr, "path %d closed before END frame\n", i);
+                    }
+                    telem_close_sock(telem_p, &ps->tm, ps->sock);
+                    active--;
+                }
+            } else {
+                /* 書き込みの完了 */
+                uring_write_t *w = (uring_write_t *)(uintptr_t)ud;
+                if (res < 0) {
+                    fprintf(stderr, "write: %s\n", strerror(-res));
+                    failed = 1;
+                } else if ((size_t)res < w->len) {
+                    /* 短い書き込み: 残りを出し直す */
+                    w->p += res;
+                    w->len -= (size_t)res;
+                    w->off += (uint64_t)res;
+                    if (uring_queue_write(&u, fd, w) == 0) continue;
+                    failed = 1;
+                }
+                uring_buf_put(&u, w->bid);
+                free(w);
+                writes--;
+            }
+        }
+        __atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+
+        /* バッファが戻ったので止まっていた経路の受信を再開する */
+        for (i = 0; u.recycled && i < n_paths; i++) {
+            if (u.starved[i]) uring_arm_recv(&u, i, paths[i].sock);
+        }
+        u.recycled = 0;
+
+        /* 書き込みが出揃っている時だけ再開用の記録を取り，パリティから復元する */
+        if (writes == 0) {
+            resume_checkpoint(*file_size, 0);
+            early_finish(1);
+        }
+    }
+
+    free(bad);
+    uring_teardown(&u);
+    return failed;
+}
+#endif /* HAVE_URING_RECV */
+
+/* 接続先ごとに今回のRTTと帯域をプロファイルに取り込んで保存する       */
+/* 帯域は接続先の全接続の受信バイト数を，開始からENDフレームまで (届いて */
+/* いなければ終了まで) の時間で割ったもの。帯域測定モードでは測定値を使う */
+void tune_record(tune_db_t *db, char **hosts, int n_hosts, const path_state_t *paths,
+                 char **conn_hosts, int n_conns, const struct timespec *start, const struct timespec *end)
+{
+    int i, c;
+
+    for (i = 0; i < n_hosts; i++) {
+        uint64_t bytes = 0;
+        uint32_t rtt_us = 0;
+        double sec = 0.0, mbps;
+        int path_id = -1;           /* 帯域測定モードで測った経路 */
+        tune_profile_t *p;
+
+        for (c = 0; c < n_conns; c++) {
+            const struct timespec *t;
+            double dt;
+            if (conn_hosts[c] != hosts[i]) continue;
+            bytes += paths[c].tm.bytes;
+            if (paths[c].rtt_us > 0 && (rtt_us == 0 || paths[c].rtt_us < rtt_us)) rtt_us = paths[c].rtt_us;
+            t = paths[c].ended_at.tv_sec != 0 ? &paths[c].ended_at : end;
+            dt = telem_elapsed(start, t);
+            if (dt > sec) sec = dt;
+            if (paths[c].probe_bytes > 0) path_id = paths[c].path_id;
+        }
+        mbps = sec > 0 ? bytes * 8.0 / sec / 1000000.0 : 0.0;
+        if (path_id >= 0) mbps = calib_path_mbps(paths, n_conns, path_id);
+        p = tune_update(db, hosts[i], rtt_us / 1000.0, mbps, -1.0);
+        if (p != NULL) {
+            char desc[256];
+            tune_describe(p, desc, sizeof(desc));
+            printf("%s: %s\n", hosts[i], desc);
+        }
+    }
+    tune_save(db);
+}
+
+/* 経路の測定スループット [Mbps] */
+double calib_mbps(const path_state_t *ps)
+{
+    double sec = (ps->probe_last.tv_sec - ps->probe_first.tv_sec)
+               + (ps->probe_last.tv_nsec - ps->probe_first.tv_nsec) / 1000000000.0;
+    if (sec <= 0) return 0.0;
+    return (ps->probe_bytes - ps->probe_base) * 8.0 / sec / 1000000.0;
+}
+
+/* 経路の測定スループット [Mbps]: 同じ経路の接続をすべて足す */
+double calib_path_mbps(const path_state_t *paths, int n, int path_id)
+{
+    double sum = 0.0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (paths[i].path_id == path_id) sum += calib_mbps(&paths[i]);
+    }
+    return sum;
+}
+
+/* paths[i] がその経路の最初の接続か */
+int calib_first(const path_state_t *paths, int i)
+{
+    int j;
+
+    for (j = 0; j < i; j++) {
+        if (paths[j].path_id == paths[i].path_id) return 0;
+    }
+    return 1;
+}
+
+/* 測定結果を履歴ファイルに追記し，履歴から求めた比率を ratio_file に書き出す */
+/* 履歴の1行: <UNIX時刻> <経路番号> <Mbps> <ホスト>                            */
+/* 比率は経路ごとの指数移動平均 (新しい測定ほど重い) で，経路番号の順に1行ずつ */
+/* 並べる。filesplit.out の load_weights() がそのまま読める形式にしている      */
+int calib_save(const path_state_t *paths, int n, char **hosts,
+               const char *history_file, const char *ratio_file)
+{
+    double ewma[MAX_CALIB_PATHS];
+    int seen[MAX_CALIB_PATHS];
+    int max_id = -1;
+    char line[512];
+    FILE *fp;
+    int i;
+
+    fp = fopen(history_file, "a");
+    if (!fp) {
+        perror("fopen history");
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        if (paths[i].path_id < 0 || paths[i].path_id >= MAX_CALIB_PATHS) continue;
+        if (!calib_first(paths, i)) continue;
+        fprintf(fp, "%ld %d %.3f %s\n", (long)time(NULL), paths[i].path_id,
+                calib_path_mbps(paths, n, paths[i].path_id), hosts[i]);
+    }
+    fclose(fp);
+
+    /* 履歴を古い順に読み，経路ごとに指数移動平均をとる */
+    memset(seen, 0, sizeof(seen));
+    fp = fopen(history_file, "r");
+    if (!fp) {
+        perror("fopen history");
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        long t;
+        int id;
+        double mbps;
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%ld %d %lf", &t, &id, &mbps) != 3) continue;
+        if (id < 0 || id >= MAX_CALIB_PATHS) continue;
+        if (!seen[id]) {
+            ewma[id] = mbps;
+            seen[id] = 1;
+        } else {
+            ewma[id] = CALIB_HISTORY_ALPHA * mbps + (1.0 - CALIB_HISTORY_ALPHA) * ewma[id];
+        }
+        if (id > max_id) max_id = id;
+    }
+    fclose(fp);
+
+    if (max_id < 0) {
+        fprintf(stderr, "no calibration samples in %s\n", history_file);
+        return -1;
+    }
+
+    fp = fopen(ratio_file, "w");
+    if (!fp) {
+        perror("fopen ratio file");
+        return -1;
+    }
+    fprintf(fp, "# generated from %s (EWMA Mbps per path, path 0 first)\n", history_file);
+    for (i = 0; i <= max_id; i++) {
+        fprintf(fp, "%.3f\n", seen[i] ? ewma[i] : 0.0);
+    }
+    fclose(fp);
+    printf("Updated %s from %s\n", ratio_file, history_file);
+    return 0;
+}
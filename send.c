@@ -1,10 +1,19 @@
 /* -*- coding: utf-8-unix; -*-                                     */
 /* FILENAME     :  send.c (Server Mode)                            */
 /* DESCRIPTION  :  TCP Multi-Interface File Server                 */
-/* USAGE        :  ./send.out [file_node1] [file_node2] ...        */
+/* USAGE        :  ./send.out [-p path] [-m mode] [file_node1] ... */
 /* ----------------------------------------------------------------*/
 
+#define _GNU_SOURCE  // splice, F_SETPIPE_SZ用
 #include "icslab2_net.h"
+#include "icslab2_telemetry.h"
+#include "icslab2_crc32c.h"
+#include "icslab2_tune.h"
+#include "icslab2_rs.h"
+#include "icslab2_tree.h"
+#include "icslab2_cdc.h"
+#include "icslab2_metrics.h"
+#include "icslab2_pack.h"
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -15,21 +24,1970 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <arpa/inet.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <zlib.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <ftw.h>            // nftw (-d)
+#include <netinet/udp.h>    // UDP_SEGMENT (GSO)
 
-#define NUM_TARGET_NODES 4
+#define NUM_TARGET_NODES 4  // 既定の経路数 (5ノードメッシュのNode3)
+#define MAX_PATHS        16 // -p で指定できる経路数の上限
+#define SPLICE_PIPE_SZ   (1024 * 1024)  // splice用パイプの容量
+#define STREAM_ACCEPT_MS 10000  // 2本目以降の接続を待つ時間
+
+// 送信エンジン
+enum {
+    SEND_COPY,      // read/write (BUF_LENバイトずつユーザ空間へコピー)
+    SEND_SENDFILE,  // sendfile (ゼロコピー，使えなければspliceへ)
+    SEND_SPLICE     // splice (ファイル -> パイプ -> ソケット)
+};
+int send_mode = SEND_SENDFILE;
+int calib_seconds = 0;      // >0 なら帯域測定モード (ファイルの代わりにPROBEを送る)
+int use_zlib = 0;           // 1なら経路ごとに適応圧縮する (-z)
+int default_streams = 1;    // 経路あたりのTCP接続の本数 (-P，-p の /N が優先)
+double udp_rate_mbps = 100; // UDP経路の最初の送信レート (-U，プロファイルがあればその帯域)
+int fec_k = 0, fec_m = 0;   // 消失訂正 (-E k+m): k チャンクごとに m 個のパリティを足す
+uint64_t endgame_bytes = 0; // 終盤の重複送信 (-G MiB): 確認待ちがこれ以下になったら重ねて送る (0 = しない)
+char *tree_root = NULL;     // ディレクトリを送る (-d): ツリーの根
+char *pack_file = NULL;     // パートをまとめたファイル (-k, split.out -p の出力)
+uint64_t stream_budget = 64ULL << 20;   // 標準入力などを送るときに読み溜めておく上限 (-B MiB)
+
+// 経路の設定 (待ち受けるローカルIPとポート)。-p で置き換えられる
+// 先頭の経路への接続が全経路の送信開始のトリガーになる
+typedef struct {
+    char name[16];          // 経路名 (表示用)
+    char ip[16];            // BindするローカルIP
+    int port;               // 待ち受けポート
+    int streams;            // この経路に張るTCP接続の本数 (0 = -P の値)
+    int udp;                // データをUDPで送る (/udp)
+} PathSpec;
+
+PathSpec path_specs[MAX_PATHS] = {
+    { .name = "Node1", .ip = "172.21.0.30", .port = TCP_SERVER_PORT },
+    { .name = "Node2", .ip = "172.24.0.30", .port = TCP_SERVER_PORT },
+    { .name = "Node4", .ip = "172.27.0.30", .port = TCP_SERVER_PORT },
+    { .name = "Node5", .ip = "172.28.0.30", .port = TCP_SERVER_PORT },
+};
+int n_paths = NUM_TARGET_NODES;
+
+// "[name=]ip[:port][/streams|/udp]" を解釈する
+int parse_path_spec(const char *arg, PathSpec *ps) {
+    const char *eq = strchr(arg, '=');
+    const char *addr = eq ? eq + 1 : arg;
+    const char *slash = strchr(addr, '/');
+    const char *colon = strchr(addr, ':');
+    size_t iplen;
+    struct in_addr tmp;
+
+    memset(ps, 0, sizeof(*ps));
+    if (colon != NULL && slash != NULL && colon > slash) return -1;
+    iplen = colon ? (size_t)(colon - addr) : slash ? (size_t)(slash - addr) : strlen(addr);
+    if (iplen == 0 || iplen >= sizeof(ps->ip)) return -1;
+    memcpy(ps->ip, addr, iplen);
+    if (inet_pton(AF_INET, ps->ip, &tmp) != 1) return -1;
+    ps->port = colon ? atoi(colon + 1) : TCP_SERVER_PORT;
+    if (ps->port <= 0 || ps->port > 65535) return -1;
+    if (slash != NULL && strcmp(slash + 1, "udp") == 0) {
+        ps->udp = 1;
+    } else if (slash != NULL) {
+        ps->streams = atoi(slash + 1);
+        if (ps->streams <= 0 || ps->streams > MAX_STREAMS) return -1;
+    }
+    if (eq) {
+        snprintf(ps->name, sizeof(ps->name), "%.*s", (int)(eq - arg), arg);
+    } else {
+        snprintf(ps->name, sizeof(ps->name), "%s", ps->ip);
+    }
+    return 0;
+}
+
+// 経路ごとの時系列計測 (-T)
+char *telem_file = NULL;
+int telem_interval = TELEM_INTERVAL_MS;
+telem_t telem;
+telem_t *telem_p = NULL;    // 計測していなければNULL
+
+// 経路ごとのソケット調整 (-t)
+char *tune_file = NULL;     // NULLなら調整しない (カーネルの既定値)
+tune_db_t tune_db;
+pthread_mutex_t tune_lock = PTHREAD_MUTEX_INITIALIZER;  // 経路のスレッドが同時に更新する
+
+// 動作中の計測値 (-M)。出していなければ行は NULL で，数えない
+char *metrics_spec = NULL;
+metric_t *m_sendfile, *m_splice, *m_sendmmsg, *m_pread;
 
 // ★同期用グローバル変数
 pthread_mutex_t trigger_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t  trigger_cond  = PTHREAD_COND_INITIALIZER;
 int is_node1_active = 0; // Node1が接続され、送信中であることを示すフラグ
 
-// サーバー設定をスレッドに渡すためのデータ構造
+// ===================================================================
+// チャンクキュー
+// 送信範囲をchunk_lenごとに切り出し，取りに来たスレッドへ順に配る。
+// 複数経路で1つのキューを共有すれば，速い経路ほど多くのチャンクを運ぶ
+// ===================================================================
+typedef struct {
+    int fd;             // 読み出し元ファイル
+    off_t src_off;      // 読み出し元ファイル内の位置
+    uint64_t dst_off;   // 元ファイル内の位置 (フレームのoffset)
+    size_t len;
+    uint32_t crc;       // ペイロードのCRC32C
+    int parity;         // 0 = データ，j + 1 = dst_off から始まるストライプのパリティ j
+    int path;           // 配った経路 (path_id)
+    int dup;            // 終盤に別の経路と重ねて配った
+    unsigned char *buf; // 読み込んである中身 (ストリームのとき，NULLなら fd から送る)
+} chunk_t;
+
+// 今回送る部分 (範囲先頭からの相対)
+typedef struct {
+    uint64_t off;
+    uint64_t len;
+} span_t;
+
+// 配ったが受信側の確認 (ACK) が取れていないチャンク (-G)
+typedef struct {
+    chunk_t c;
+    uint32_t paths;     // このチャンクを配った経路 (ビット path_id)
+    int copies;         // 送信中の数
+    double sent_at;     // 最後に送り終えた時刻 (送信中なら0)
+} out_chunk_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int fd;             // 読み出し元ファイル
+    off_t src_base;     // 送信範囲の先頭 (読み出し元ファイル内)
+    uint64_t dst_base;  // 送信範囲の先頭 (元ファイル内)
+    uint64_t size;      // 送信範囲の長さ
+    span_t *spans;      // 今回送る部分 (再開時は受信側に欠けている部分だけ)
+    int n_spans, cap_spans;
+    int cur_span;       // 切り出し中の部分
+    uint64_t next;      // 次に切り出す位置 (cur_span の先頭からの相対)
+    uint64_t total;     // 今回送るバイト数
+    size_t chunk_len;   // 1チャンクの長さ
+    chunk_t *retry;     // 送信に失敗して戻されたチャンク
+    int n_retry, cap_retry;
+    int inflight;       // 配布済みで完了していないチャンク数
+    // チェックサム用
+    const unsigned char *map;   // 送信範囲をmmapした領域 (NULLならpreadで読む)
+    size_t map_len;
+    size_t map_skip;    // map の先頭から src_base までのバイト数 (ページ境界合わせ)
+    uint32_t *crcs;     // チャンクごとのCRC32C (範囲全体のCRCを組み立てる)
+    uint64_t done_bytes;// 送信を終えたバイト数
+    // 消失訂正 (-E): 連続する fec_k チャンクをストライプとし，fec_m 個のパリティを足す。
+    // ストライプ FEC_DEPTH 個分の要素を交互に並べて配るので，続けて取り出した
+    // チャンクは別々のストライプに属し，1つの経路が止まっても各ストライプの
+    // 欠けはパリティで埋められる数に収まる
+    int fec_k, fec_m;   // 0ならパリティを付けない
+    int fec_on;         // 今回の転送で付ける (範囲全体を送るときだけ)
+    uint64_t n_stripes;
+    uint64_t item;      // 次に配る要素の番号 (交互に並べた順)
+    // 終盤の重複送信 (-G): 受信側はチャンクごとにACKを返し，確認が取れるまで
+    // out に残す。新しいチャンクが尽きて確認待ちが eg_bytes 以下になったら，
+    // 空いて待っている経路のうち一番速いものに，それより遅い経路が運んでいる
+    // 確認待ちのチャンクを重ねて配る。先に届いた方のACKで確認待ちから消す
+    uint64_t eg_bytes;  // 0ならACKを求めない
+    int acks;           // 今回の転送でACKを求める (範囲全体を送るときだけ)
+    out_chunk_t *out;   // 確認待ちのチャンク (配った順)
+    int n_out, cap_out;
+    uint64_t out_bytes; // 確認待ちのバイト数
+    double t_start;     // 今回の転送を始めた時刻
+    uint64_t acked[MAX_PATHS];  // 経路ごとの確認の取れたバイト数 (経路の速さの目安)
+    double idle_at[MAX_PATHS];  // 経路が最後に空いて待った時刻
+    int n_dups;         // 重ねて配ったチャンク数
+    uint64_t waits[MAX_PATHS];      // 経路がチャンクを待った回数 (-M)
+    uint64_t wait_ns[MAX_PATHS];    // 待った時間の合計
+    // ディレクトリの転送 (-d): 送信範囲はツリーのファイルを並べたもので，
+    // チャンクの中身は送る直前に chunk_queue_source で開くか読み集める
+    const tree_t *tree; // NULLなら fd の1ファイル
+    int tree_fd;        // ツリーの根 (ファイルを openat で開く)
+    // ストリーム (-s - やパイプ): 長さが分からないので，読み込みスレッドが
+    // fd から chunk_len ずつ読んで ready に並べ，届いたチャンクのバッファを
+    // 次の読み込みに使い回す。読み溜めるのは n_slots チャンクまでなので，
+    // 経路が詰まれば入力を読むのを待つ (size, total は読んだ分だけ増える)
+    int stream;
+    unsigned char *pool;        // n_slots * chunk_len バイト
+    int *free_slots;            // 空いているバッファの番号
+    int n_slots, n_free;
+    chunk_t *ready;             // 読んでまだ配っていないチャンク (読んだ順の環状バッファ)
+    int ready_head, n_ready;
+    uint64_t cap_crcs;          // crcs の要素数
+    int eof;                    // 入力を読み切った (読めなくなった)
+    int stream_err;             // 読み込みに失敗した (長さを知らせずに終える)
+    pthread_t reader;
+} chunk_queue_t;
+
+#define FEC_DEPTH 4     // 交互に並べるストライプの数
+#define ENDGAME_POLL_MS  10     // 空いた接続がACKを待ちながらキューを見直す間隔
+#define ENDGAME_STALE_MS 3000   // 送り終えてからこの間ACKが無ければ失われたものとして送り直す
+
+static double mono_sec(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+size_t chunk_len = FRAME_CHUNK_LEN;
+
+void chunk_queue_init(chunk_queue_t *q, int fd, off_t src_base, uint64_t dst_base, uint64_t size) {
+    memset(q, 0, sizeof(*q));
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    q->fd = fd;
+    q->src_base = src_base;
+    q->dst_base = dst_base;
+    q->size = size;
+    q->chunk_len = chunk_len;
+    q->crcs = calloc(size / chunk_len + 1, sizeof(uint32_t));
+    q->spans = malloc(sizeof(span_t));
+    q->cap_spans = 1;
+    q->fec_k = fec_k;
+    q->fec_m = fec_m;
+    q->eg_bytes = endgame_bytes;
+
+    // CRCはsendfileが読むのと同じページキャッシュをmmap越しに読んで求める
+    // (ユーザ空間へのコピーも，別パスでの読み直しもしない)
+    if (size > 0) {
+        size_t skip = (size_t)(src_base % sysconf(_SC_PAGESIZE));
+        void *m = mmap(NULL, size + skip, PROT_READ, MAP_SHARED, fd, src_base - (off_t)skip);
+        if (m != MAP_FAILED) {
+            q->map = m;
+            q->map_len = size + skip;
+            q->map_skip = skip;
+        }
+    }
+    if (q->fec_k > 0 && q->map == NULL) {
+        fprintf(stderr, "[Queue] cannot map the source file: sending without parity\n");
+        q->fec_k = 0;
+    }
+}
+
+// 範囲全体を送り終えた: チャンクのCRCをつないで範囲全体のCRCを出す (q->lock を持って呼ぶ)
+static void chunk_queue_report(chunk_queue_t *q) {
+    uint32_t crc = 0;
+    uint64_t pos;
+
+    for (pos = 0; pos < q->size; pos += q->chunk_len) {
+        uint64_t len = q->size - pos < q->chunk_len ? q->size - pos : q->chunk_len;
+        crc = crc32c_combine(crc, q->crcs[pos / q->chunk_len], len);
+    }
+    printf("[Queue] Sent offset %llu, %llu bytes: CRC32C %08x\n",
+           (unsigned long long)q->dst_base, (unsigned long long)q->size, crc);
+    if (q->n_dups > 0) {
+        printf("[Queue] End-game: sent %d chunks over a second path\n", q->n_dups);
+    }
+}
+
+// ストリームの読み込みスレッド。空いたバッファに chunk_len ずつ読んで ready に並べる
+static void *chunk_queue_reader(void *arg) {
+    chunk_queue_t *q = (chunk_queue_t *)arg;
+    int eof = 0;
+
+    while (!eof) {
+        unsigned char *p;
+        size_t got = 0;
+        int slot, err = 0;
+
+        pthread_mutex_lock(&q->lock);
+        while (q->n_free == 0) pthread_cond_wait(&q->cond, &q->lock);
+        slot = q->free_slots[--q->n_free];
+        pthread_mutex_unlock(&q->lock);
+
+        // パイプは少しずつしか読めないので，チャンクが埋まるか入力が終わるまで読む
+        p = q->pool + (size_t)slot * q->chunk_len;
+        while (got < q->chunk_len) {
+            ssize_t n = read(q->fd, p + got, q->chunk_len - got);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                if (n < 0) {
+                    perror("[Queue] read stream");
+                    err = 1;
+                }
+                eof = 1;
+                break;
+            }
+            got += (size_t)n;
+        }
+
+        pthread_mutex_lock(&q->lock);
+        if (got > 0 && q->size / q->chunk_len >= q->cap_crcs) {
+            uint32_t *tmp = realloc(q->crcs, sizeof(uint32_t) * q->cap_crcs * 2);
+            if (tmp == NULL) {
+                perror("realloc");
+                got = 0;
+                err = eof = 1;
+            } else {
+                q->crcs = tmp;
+                q->cap_crcs *= 2;
+            }
+        }
+        if (got > 0) {
+            chunk_t *c = &q->ready[(q->ready_head + q->n_ready++) % q->n_slots];
+            memset(c, 0, sizeof(*c));
+            c->fd = -1;
+            c->buf = p;
+            c->src_off = (off_t)q->size;
+            c->dst_off = q->dst_base + q->size;
+            c->len = got;
+            q->size += got;
+            q->total = q->size;
+        } else {
+            q->free_slots[q->n_free++] = slot;
+        }
+        if (eof) {
+            q->eof = 1;
+            q->stream_err = err;
+            if (err) {
+                fprintf(stderr, "[Queue] Stream stopped after %llu bytes\n", (unsigned long long)q->size);
+            } else if (q->done_bytes == q->size) {
+                chunk_queue_report(q);  // 最後に読めたのが0バイト: 読んだ分は送り終えている
+            }
+        }
+        pthread_cond_broadcast(&q->cond);
+        pthread_mutex_unlock(&q->lock);
+    }
+    return NULL;
+}
+
+// 長さの分からない入力 fd (標準入力，パイプ) を読みながら配るキューを作る。
+// 読み溜めるのは budget バイト (2チャンク以上) まで。届いたチャンクの
+// バッファはすぐ使い回すので，パリティ (-E) と終盤の重複 (-G) は付けない
+int chunk_queue_init_stream(chunk_queue_t *q, int fd, uint64_t budget) {
+    uint64_t n;
+    int i;
+
+    chunk_queue_init(q, fd, 0, 0, 0);
+    n = budget / q->chunk_len;
+    q->stream = 1;
+    q->n_slots = n < 2 ? 2 : n > 65536 ? 65536 : (int)n;
+    q->pool = malloc((size_t)q->n_slots * q->chunk_len);
+    q->free_slots = malloc(sizeof(int) * (size_t)q->n_slots);
+    q->ready = malloc(sizeof(chunk_t) * (size_t)q->n_slots);
+    q->cap_crcs = 1;
+    if (q->pool == NULL || q->free_slots == NULL || q->ready == NULL || q->crcs == NULL) return -1;
+    for (i = 0; i < q->n_slots; i++) q->free_slots[i] = i;
+    q->n_free = q->n_slots;
+    errno = pthread_create(&q->reader, NULL, chunk_queue_reader, q);
+    return errno == 0 ? 0 : -1;
+}
+
+// チャンクの中身をmmap上で指す (mmapできなかった範囲ならNULL)
+const unsigned char *chunk_queue_data(chunk_queue_t *q, const chunk_t *c) {
+    if (c->buf != NULL) return c->buf;
+    if (q->map == NULL) return NULL;
+    return q->map + q->map_skip + (c->src_off - q->src_base);
+}
+
+// チャンクのCRC32Cを求める
+uint32_t chunk_queue_crc(chunk_queue_t *q, const chunk_t *c) {
+    unsigned char buf[64 * 1024];
+    off_t off = c->src_off;
+    size_t len = c->len;
+    uint32_t crc = 0;
+
+    if (c->buf != NULL || q->map != NULL) {
+        return crc32c(0, chunk_queue_data(q, c), c->len);
+    }
+    while (len > 0) {
+        ssize_t n = pread(c->fd, buf, len > sizeof(buf) ? sizeof(buf) : len, off);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            break; // 読めなければ送信側で失敗する
+        }
+        crc = crc32c(crc, buf, (size_t)n);
+        off += n;
+        len -= (size_t)n;
+    }
+    return crc;
+}
+
+// パリティチャンク c の中身を out (c->len バイト) に作る。
+// ストライプのデータチャンクはmmap上から読む (パリティを付けるのはmmapできたときだけ)
+void chunk_queue_parity(chunk_queue_t *q, const chunk_t *c, unsigned char *out) {
+    const uint8_t *data[RS_MAX_K];
+    size_t lens[RS_MAX_K];
+    uint64_t pos = c->dst_off - q->dst_base;
+    int k;
+
+    for (k = 0; k < q->fec_k && pos < q->size; k++) {
+        data[k] = q->map + q->map_skip + pos;
+        lens[k] = q->size - pos > q->chunk_len ? q->chunk_len : (size_t)(q->size - pos);
+        pos += lens[k];
+    }
+    rs_encode(out, c->len, data, lens, k, c->parity - 1);
+}
+
+// ディレクトリを送るとき (-d): チャンクの中身の在りかを決める。
+// 1つのファイルに収まるチャンクはそのファイルを開いて c->fd と c->src_off を
+// 設定し0を返す (そのままsendfileで送り，送った側が閉じる)。
+// 小さいファイルをまとめたチャンクは buf (c->len バイト) に読み集めて1を返す。
+// 開けない・読めなければ-1
+int chunk_queue_source(chunk_queue_t *q, chunk_t *c, unsigned char *buf) {
+    const tree_t *t = q->tree;
+    int i = tree_find(t, c->dst_off);
+    size_t got = 0;
+
+    if (c->dst_off + c->len <= t->e[i].base + t->e[i].size) {
+        c->fd = openat(q->tree_fd, t->e[i].path, O_RDONLY);
+        c->src_off = (off_t)(c->dst_off - t->e[i].base);
+        return c->fd < 0 ? -1 : 0;
+    }
+    c->fd = -1;
+    for (; i < t->n && got < c->len; i++) {
+        const tree_entry_t *e = &t->e[i];
+        uint64_t off = c->dst_off + got;
+        size_t seg, n;
+        int fd;
+
+        if (off >= e->base + e->size) continue;     // 空のファイル，ディレクトリ
+        seg = e->base + e->size - off < c->len - got ? (size_t)(e->base + e->size - off) : c->len - got;
+        if ((fd = openat(q->tree_fd, e->path, O_RDONLY)) < 0) return -1;
+        for (n = 0; n < seg; ) {
+            ssize_t r = pread(fd, buf + got + n, seg - n, (off_t)(off - e->base + n));
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) {
+                if (r == 0) errno = EIO;    // 一覧を作ってから縮んだ
+                close(fd);
+                return -1;
+            }
+            n += (size_t)r;
+        }
+        close(fd);
+        got += seg;
+    }
+    if (got < c->len) {
+        errno = EIO;
+        return -1;
+    }
+    return 1;
+}
+
+// このストライプのデータチャンク数 (末尾のストライプは fec_k より少ないことがある)
+int chunk_queue_stripe_k(chunk_queue_t *q, const chunk_t *c) {
+    uint64_t left = q->size - (c->dst_off - q->dst_base);
+    uint64_t n = (left + q->chunk_len - 1) / q->chunk_len;
+    return n < (uint64_t)q->fec_k ? (int)n : q->fec_k;
+}
+
+// 新しい転送のために配り直す。ranges は受信側から届いた (開始位置, 長さ) の
+// 組 (元ファイル内の位置) で，この送信範囲と重なる部分だけを送る。
+// n == 0 なら範囲全体を送る
+void chunk_queue_reset(chunk_queue_t *q, const uint64_t *ranges, int n) {
+    int i;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->stream) n = 0;   // 読み直せないので再開範囲は使わない (受信側も -R を断る)
+    q->n_spans = 0;
+    q->total = 0;
+    if (n == 0) {
+        q->spans[0].off = 0;
+        q->spans[0].len = q->size;
+        q->n_spans = 1;
+        q->total = q->size;
+    } else if (q->cap_spans < n) {
+        span_t *tmp = realloc(q->spans, sizeof(span_t) * n);
+        if (tmp == NULL) {
+            perror("realloc");  // 送るものが無い扱いになる (受信側では欠けたまま)
+            n = 0;
+        } else {
+            q->spans = tmp;
+            q->cap_spans = n;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        uint64_t start = ranges[2 * i], end = ranges[2 * i] + ranges[2 * i + 1];
+        if (start < q->dst_base) start = q->dst_base;
+        if (end > q->dst_base + q->size) end = q->dst_base + q->size;
+        if (start >= end) continue;
+        q->spans[q->n_spans].off = start - q->dst_base;
+        q->spans[q->n_spans].len = end - start;
+        q->total += end - start;
+        q->n_spans++;
+    }
+    q->cur_span = 0;
+    q->next = 0;
+    q->n_retry = 0;
+    q->inflight = 0;
+    q->done_bytes = 0;
+    // 再開時に一部だけ送るときは，受信側に残っているデータでストライプを
+    // 組めるとは限らないのでパリティを付けない
+    q->fec_on = q->fec_k > 0 && n == 0 && q->size > 0;
+    q->n_stripes = (q->size + (uint64_t)q->fec_k * q->chunk_len - 1) /
+                   ((uint64_t)(q->fec_k > 0 ? q->fec_k : 1) * q->chunk_len);
+    q->item = 0;
+    // 受信側はチャンクの位置で重複を見分けるので，チャンクが揃った位置から
+    // 切り出せる範囲全体の転送でだけACKを求める
+    q->acks = q->eg_bytes > 0 && n == 0 && q->size > 0;
+    q->n_out = 0;
+    q->out_bytes = 0;
+    q->t_start = mono_sec();
+    memset(q->acked, 0, sizeof(q->acked));
+    memset(q->idle_at, 0, sizeof(q->idle_at));
+    q->n_dups = 0;
+    pthread_mutex_unlock(&q->lock);
+}
+
+// パリティを付けるときの切り出し: ストライプ FEC_DEPTH 個ごとに，
+// 各ストライプの0番目の要素，1番目の要素，... の順に配る
+// (要素 0..k-1 がデータチャンク，k..k+m-1 がパリティ)
+static int chunk_queue_take_fec(chunk_queue_t *q, chunk_t *c) {
+    uint64_t per = (uint64_t)(q->fec_k + q->fec_m);
+    uint64_t stripe_len = (uint64_t)q->fec_k * q->chunk_len;
+
+    while (q->item < (q->n_stripes + FEC_DEPTH - 1) / FEC_DEPTH * FEC_DEPTH * per) {
+        uint64_t t = q->item % (FEC_DEPTH * per);
+        uint64_t s = q->item / (FEC_DEPTH * per) * FEC_DEPTH + t % FEC_DEPTH;
+        uint64_t e = t / FEC_DEPTH;
+        uint64_t start = s * stripe_len;
+        q->item++;
+        if (s >= q->n_stripes) continue;
+        if (e < (uint64_t)q->fec_k) {
+            uint64_t pos = start + e * q->chunk_len;
+            if (pos >= q->size) continue;   // 末尾のストライプはデータが少ない
+            c->len = q->size - pos > q->chunk_len ? q->chunk_len : (size_t)(q->size - pos);
+            c->parity = 0;
+            c->src_off = q->src_base + (off_t)pos;
+            c->dst_off = q->dst_base + pos;
+        } else {
+            // パリティの長さはストライプで一番長いデータチャンクと同じ
+            c->len = q->size - start > q->chunk_len ? q->chunk_len : (size_t)(q->size - start);
+            c->parity = (int)(e - (uint64_t)q->fec_k) + 1;
+            c->src_off = q->src_base + (off_t)start;
+            c->dst_off = q->dst_base + start;
+        }
+        c->fd = q->fd;
+        c->buf = NULL;
+        q->inflight++;
+        return 1;
+    }
+    return 0;
+}
+
+// 戻されたチャンクか，次の範囲を切り出す (q->lock を持って呼ぶ)
+static int chunk_queue_take_new(chunk_queue_t *q, chunk_t *c) {
+    if (q->n_retry > 0) {
+        *c = q->retry[--q->n_retry];
+        q->inflight++;
+        return 1;
+    }
+    if (q->fec_on) return chunk_queue_take_fec(q, c);
+    if (q->stream) {
+        if (q->n_ready == 0) return 0;
+        *c = q->ready[q->ready_head];
+        q->ready_head = (q->ready_head + 1) % q->n_slots;
+        q->n_ready--;
+        q->inflight++;
+        return 1;
+    }
+    while (q->cur_span < q->n_spans && q->next == q->spans[q->cur_span].len) {
+        q->cur_span++;
+        q->next = 0;
+    }
+    if (q->cur_span < q->n_spans) {
+        const span_t *sp = &q->spans[q->cur_span];
+        uint64_t left = sp->len - q->next;
+        c->fd = q->fd;
+        c->src_off = q->src_base + (off_t)(sp->off + q->next);
+        c->dst_off = q->dst_base + sp->off + q->next;
+        c->len = left > q->chunk_len ? q->chunk_len : (size_t)left;
+        c->parity = 0;
+        c->buf = NULL;
+        q->next += c->len;
+        q->inflight++;
+        return 1;
+    }
+    return 0;
+}
+
+// 確認待ちのチャンクを探す (q->lock を持って呼ぶ)
+static out_chunk_t *chunk_queue_find(chunk_queue_t *q, uint64_t dst_off) {
+    int i;
+
+    for (i = 0; i < q->n_out; i++) {
+        if (q->out[i].c.dst_off == dst_off) return &q->out[i];
+    }
+    return NULL;
+}
+
+// 配ったデータチャンクを確認待ちに加える (q->lock を持って呼ぶ)
+static void chunk_queue_track(chunk_queue_t *q, const chunk_t *c) {
+    out_chunk_t *e;
+
+    if (!q->acks || c->parity > 0) return;
+    e = chunk_queue_find(q, c->dst_off);
+    if (e == NULL) {
+        if (q->n_out == q->cap_out) {
+            int cap = q->cap_out ? q->cap_out * 2 : 64;
+            out_chunk_t *tmp = realloc(q->out, sizeof(out_chunk_t) * cap);
+            if (tmp == NULL) {
+                perror("realloc");  // 確認を待たずに送るだけになる
+                return;
+            }
+            q->out = tmp;
+            q->cap_out = cap;
+        }
+        e = &q->out[q->n_out++];
+        memset(e, 0, sizeof(*e));
+        e->c = *c;
+        q->out_bytes += c->len;
+    }
+    e->paths |= 1u << c->path;
+    e->copies++;
+    e->sent_at = 0;
+}
+
+// 経路 path が確認の取れたチャンクを運んだ速さ [バイト/秒]
+static double chunk_queue_rate(chunk_queue_t *q, int path, double now) {
+    return now > q->t_start ? q->acked[path] / (now - q->t_start) : 0;
+}
+
+// 終盤: 空いた経路 path に確認待ちのチャンクを重ねて配る (q->lock を持って呼ぶ)
+static int chunk_queue_take_dup(chunk_queue_t *q, chunk_t *c, int path) {
+    double now = mono_sec();
+    double rate = chunk_queue_rate(q, path, now);
+    int i, j;
+
+    // 空いて待っている経路のうち一番速いものだけが重ねて運ぶ
+    for (j = 0; j < MAX_PATHS; j++) {
+        if (j != path && now - q->idle_at[j] < 3 * ENDGAME_POLL_MS / 1000.0 &&
+            chunk_queue_rate(q, j, now) > rate) {
+            return 0;
+        }
+    }
+    // 配った順に見るので，一番長く確認を待っているチャンクから重ねる
+    for (i = 0; i < q->n_out; i++) {
+        out_chunk_t *e = &q->out[i];
+        int ok = e->copies == 0 && e->sent_at > 0 && now - e->sent_at > ENDGAME_STALE_MS / 1000.0;
+        if (!ok && q->out_bytes <= q->eg_bytes && !(e->paths & (1u << path))) {
+            // 運んでいる経路より速いときだけ重ねる
+            ok = 1;
+            for (j = 0; j < MAX_PATHS; j++) {
+                if ((e->paths & (1u << j)) && chunk_queue_rate(q, j, now) >= rate) ok = 0;
+            }
+        }
+        if (!ok) continue;
+        *c = e->c;
+        c->path = path;
+        c->dup = 1;
+        e->paths |= 1u << path;
+        e->copies++;
+        e->sent_at = 0;
+        q->inflight++;
+        q->n_dups++;
+        return 1;
+    }
+    return 0;
+}
+
+// 経路 path に次のチャンクを配る (q->lock を持って呼ぶ)
+static int chunk_queue_take(chunk_queue_t *q, chunk_t *c, int path) {
+    if (chunk_queue_take_new(q, c)) {
+        c->path = path;
+        c->dup = 0;
+        chunk_queue_track(q, c);
+        q->idle_at[path] = 0;
+        return 1;
+    }
+    if (q->acks && chunk_queue_take_dup(q, c, path)) {
+        q->idle_at[path] = 0;
+        return 1;
+    }
+    return 0;
+}
+
+// 経路が t0 から空いたキューを待っていたことを数える (-M)
+static void chunk_queue_waited(chunk_queue_t *q, int path, double t0) {
+    __atomic_fetch_add(&q->waits[path], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&q->wait_ns[path], (uint64_t)((mono_sec() - t0) * 1e9), __ATOMIC_RELAXED);
+}
+
+// 次のチャンクを取り出す。空でも他スレッドの送信中チャンクが戻される
+// 可能性がある間 (ストリームならまだ読める間も) は待ち，すべて完了したら0を返す
+int chunk_queue_pop(chunk_queue_t *q, chunk_t *c, int path) {
+    double t0 = 0;
+    int got;
+
+    pthread_mutex_lock(&q->lock);
+    while (!(got = chunk_queue_take(q, c, path)) && (q->inflight > 0 || (q->stream && !q->eof))) {
+        if (t0 == 0) t0 = mono_sec();
+        pthread_cond_wait(&q->cond, &q->lock);
+    }
+    pthread_mutex_unlock(&q->lock);
+    if (t0 != 0) chunk_queue_waited(q, path, t0);
+    return got;
+}
+
+// 待たずに取り出す。取り出せたら1，すべて完了していれば0，
+// 送信中のチャンク (自分の確認待ちを含む) があって今は無ければ-1。
+// ACKを求める転送では確認待ちが無くなれば完了 (遅い経路がまだ送っている
+// チャンクも，重ねて送った方で届いていれば待たない)
+int chunk_queue_trypop(chunk_queue_t *q, chunk_t *c, int path) {
+    int rc;
+
+    pthread_mutex_lock(&q->lock);
+    rc = chunk_queue_take(q, c, path) ? 1 :
+         ((q->acks ? q->n_out : q->inflight) > 0 || (q->stream && !q->eof)) ? -1 : 0;
+    if (rc < 0) q->idle_at[path] = mono_sec();
+    pthread_mutex_unlock(&q->lock);
+    return rc;
+}
+
+// ストリームのチャンクのバッファを次の読み込みに回す (q->lock を持って呼ぶ)
+static void chunk_queue_release(chunk_queue_t *q, const chunk_t *c) {
+    if (c->buf != NULL) q->free_slots[q->n_free++] = (int)((c->buf - q->pool) / q->chunk_len);
+}
+
+// データチャンクが受信側に届いた (q->lock を持って呼ぶ)
+static void chunk_queue_finish(chunk_queue_t *q, const chunk_t *c) {
+    q->crcs[(c->dst_off - q->dst_base) / q->chunk_len] = c->crc;
+    q->done_bytes += c->len;
+    chunk_queue_release(q, c);
+    if (q->stream && (!q->eof || q->stream_err)) return;   // まだ続きを読む
+    if (q->done_bytes == q->total && q->total < q->size) {
+        // 再開: 欠けていた部分だけを送った (範囲全体のCRCは受信側が出す)
+        printf("[Queue] Resent %llu missing bytes in %d ranges of offset %llu\n",
+               (unsigned long long)q->total, q->n_spans, (unsigned long long)q->dst_base);
+    } else if (q->done_bytes == q->size) {
+        chunk_queue_report(q);
+    }
+}
+
+// 確認待ちから e を消す (配った順を保つ)
+static void chunk_queue_forget(chunk_queue_t *q, out_chunk_t *e) {
+    int i = (int)(e - q->out);
+
+    q->out_bytes -= e->c.len;
+    memmove(e, e + 1, sizeof(out_chunk_t) * (size_t)(q->n_out - i - 1));
+    q->n_out--;
+}
+
+// 送り終えて，受信側にも届いたことが分かっている (ACKを待たないとき，UDP経路，パリティ)
+void chunk_queue_done(chunk_queue_t *q, const chunk_t *c) {
+    pthread_mutex_lock(&q->lock);
+    q->inflight--;
+    if (c->parity == 0 && q->acks) {
+        out_chunk_t *e = chunk_queue_find(q, c->dst_off);
+        if (e == NULL) goto out;    // 重ねて送った別の経路で先に届いた
+        chunk_queue_forget(q, e);
+        q->acked[c->path] += c->len;
+    }
+    if (c->parity == 0) chunk_queue_finish(q, c);
+out:
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// 送り終えた。ACKが届くまで確認待ちに残す
+void chunk_queue_sent(chunk_queue_t *q, const chunk_t *c) {
+    out_chunk_t *e;
+
+    pthread_mutex_lock(&q->lock);
+    q->inflight--;
+    e = chunk_queue_find(q, c->dst_off);
+    if (e != NULL) {
+        e->c.crc = c->crc;
+        if (--e->copies == 0) e->sent_at = mono_sec();
+    }
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// 経路 path でACKが届いた。確認待ちだったら1
+int chunk_queue_ack(chunk_queue_t *q, uint64_t dst_off, uint32_t len, int path) {
+    out_chunk_t *e;
+    int found = 0;
+
+    pthread_mutex_lock(&q->lock);
+    e = chunk_queue_find(q, dst_off);
+    if (e != NULL && e->c.len == len) {
+        chunk_t c = e->c;
+        chunk_queue_forget(q, e);
+        q->acked[path] += len;
+        chunk_queue_finish(q, &c);
+        found = 1;
+        pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+// 確認待ちのチャンク数
+int chunk_queue_unacked(chunk_queue_t *q) {
+    int n;
+
+    pthread_mutex_lock(&q->lock);
+    n = q->n_out;
+    pthread_mutex_unlock(&q->lock);
+    return n;
+}
+
+// ストリームを読み切っていれば1を返し，*len に全体の長さを入れる
+int chunk_queue_stream_end(chunk_queue_t *q, uint64_t *len) {
+    int end;
+
+    pthread_mutex_lock(&q->lock);
+    end = q->stream && q->eof && !q->stream_err;
+    *len = q->size;
+    pthread_mutex_unlock(&q->lock);
+    return end;
+}
+
+// 送信できなかったチャンクを戻し，他の経路に運ばせる。
+// 重ねて送った別の経路で届いている (か，まだ送っている) なら戻さない
+void chunk_queue_requeue(chunk_queue_t *q, const chunk_t *c) {
+    pthread_mutex_lock(&q->lock);
+    if (c->parity == 0 && q->acks) {
+        out_chunk_t *e = chunk_queue_find(q, c->dst_off);
+        if (e == NULL || --e->copies > 0) {
+            q->inflight--;
+            pthread_cond_broadcast(&q->cond);
+            pthread_mutex_unlock(&q->lock);
+            return;
+        }
+        // 戻したチャンクを配り直すときに copies を数え直す
+    }
+    if (q->n_retry == q->cap_retry) {
+        int cap = q->cap_retry ? q->cap_retry * 2 : 16;
+        chunk_t *tmp = realloc(q->retry, sizeof(chunk_t) * cap);
+        if (tmp == NULL) {
+            // 戻せなければ諦める (受信側では欠けた範囲になる)
+            perror("realloc");
+            chunk_queue_release(q, c);
+            q->inflight--;
+            pthread_cond_broadcast(&q->cond);
+            pthread_mutex_unlock(&q->lock);
+            return;
+        }
+        q->retry = tmp;
+        q->cap_retry = cap;
+    }
+    q->retry[q->n_retry++] = *c;
+    q->inflight--;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// ===================================================================
+// 適応圧縮 (-z)
+// 経路ごとに圧縮率・圧縮速度・回線に流せる速度を測り，圧縮した方が
+// その経路で速く運べると見込めるチャンクだけを deflate で圧縮する。
+// 縮まないデータや，回線よりCPUが遅い経路では生のままsendfileで送る
+// ===================================================================
+#define ZLIB_LEVEL        1             // 速度優先
+#define ZLIB_SAMPLE_LEN   (64 * 1024)   // 生で送っている間に圧縮率を見積もる標本の長さ
+#define ZLIB_MAX_RATIO    0.9           // これより縮まないチャンクは生で送る
+#define ZLIB_GAIN         1.1           // 生より1割以上速くなるときだけ圧縮する
+#define ZLIB_MAX_SKIP     64            // 生で送り続けるときの標本を取る間隔の上限
+#define ZLIB_ALPHA        0.3           // 測定値の指数移動平均の重み
+
+typedef struct {
+    z_stream zs;
+    int ready;              // deflateInit2済み
+    unsigned char *out;     // 圧縮結果
+    size_t out_cap;
+    double ratio;           // 圧縮後 / 圧縮前
+    double comp_Bps;        // 圧縮速度 [圧縮前のバイト/秒]
+    double link_Bps;        // ソケットへ流せた速度 [バイト/秒]
+    int compressing;        // 直前のチャンクを圧縮したか
+    int skip;               // 次に標本を取るまで生で送るチャンク数
+    int backoff;            // 生が続いたときの次のskip
+    long long n_zchunks;    // 圧縮して送ったチャンク数
+    long long wire_bytes;   // 実際に送ったペイロードのバイト数
+} zpath_t;
+
+static double elapsed_since(const struct timespec *t0) {
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1000000000.0;
+}
+
+static void zpath_ewma(double *v, double x) {
+    *v = *v > 0 ? ZLIB_ALPHA * x + (1.0 - ZLIB_ALPHA) * *v : x;
+}
+
+// p の len バイトを z->out に圧縮し，圧縮率と速度を記録する。
+// 縮まなければ (圧縮後 >= 圧縮前) -1
+static int zpath_deflate(zpath_t *z, const unsigned char *p, size_t len, size_t *out_len) {
+    struct timespec t0;
+    size_t bound;
+    int rc;
+
+    if (!z->ready) {
+        if (deflateInit2(&z->zs, ZLIB_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+        z->ready = 1;
+        z->backoff = 1;
+    }
+    bound = deflateBound(&z->zs, len);
+    if (bound > z->out_cap) {
+        unsigned char *tmp = realloc(z->out, bound);
+        if (tmp == NULL) return -1;
+        z->out = tmp;
+        z->out_cap = bound;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    deflateReset(&z->zs);
+    z->zs.next_in = (unsigned char *)p;
+    z->zs.avail_in = (uInt)len;
+    z->zs.next_out = z->out;
+    z->zs.avail_out = (uInt)z->out_cap;
+    rc = deflate(&z->zs, Z_FINISH);
+    zpath_ewma(&z->comp_Bps, len / elapsed_since(&t0));
+    if (rc != Z_STREAM_END) return -1;
+    *out_len = z->out_cap - z->zs.avail_out;
+    zpath_ewma(&z->ratio, (double)*out_len / len);
+    return *out_len < len ? 0 : -1;
+}
+
+// このチャンクを圧縮するか決める。
+// 圧縮しながら送ると，1チャンクあたり圧縮(CPU)と送信(回線)のうち遅い方で
+// 律速されるので，その速度 min(圧縮速度, 回線速度 / 圧縮率) が
+// 生で送る速度 (回線速度) を上回るときだけ圧縮する
+static int zpath_decide(zpath_t *z, const unsigned char *p, size_t len) {
+    double zspeed;
+    size_t n;
+
+    if (z->skip > 0) {
+        z->skip--;
+        return 0;
+    }
+    if (!z->compressing) {
+        // 生で送っている間は先頭の標本だけ圧縮して見積もりを更新する
+        size_t sample = len < ZLIB_SAMPLE_LEN ? len : ZLIB_SAMPLE_LEN;
+        zpath_deflate(z, p, sample, &n);
+    }
+    zspeed = z->ratio > 0 ? z->link_Bps / z->ratio : 0;
+    if (z->comp_Bps < zspeed) zspeed = z->comp_Bps;
+    if (z->ratio > 0 && z->ratio < ZLIB_MAX_RATIO &&
+        (z->link_Bps == 0 || zspeed > z->link_Bps * ZLIB_GAIN)) {
+        z->compressing = 1;
+        z->backoff = 1;
+        return 1;
+    }
+    z->compressing = 0;
+    z->skip = z->backoff;
+    if (z->backoff < ZLIB_MAX_SKIP) z->backoff *= 2;
+    return 0;
+}
+
+// 経路内の1本のTCP接続。経路あたり複数本張ると，1本の輻輳ウィンドウで
+// 頭打ちになる遅延の大きい経路でも帯域を使い切れる。同じ経路の接続は
+// 経路のチャンクキューを共有し，空いた接続から次のチャンクを取りに行く
+typedef struct {
+    struct server_config *conf;
+    int sock;
+    int pipefd[2];          // splice用 (初回に作成し，使い回す)
+    zpath_t z;              // 適応圧縮の状態 (-z)
+    tune_meas_t meas;       // 今回の接続で測ったRTT・帯域 (-t)
+    int n_chunks;           // 今回送ったチャンク数
+    int n_parity;           // 今回送ったパリティチャンク数 (-E)
+    unsigned char *par;     // パリティを作るバッファ (chunk_len バイト，初回に確保)
+    unsigned char *batch;   // 小さいファイルを読み集めるバッファ (-d，chunk_len バイト，初回に確保)
+    int n_dups;             // 今回重ねて送ったチャンク数 (-G)
+    unsigned char ack_hdr[FRAME_HDR_LEN];   // 受信途中のACKフレーム (-G)
+    int ack_got;
+    long long bytes;        // 今回送ったバイト数
+    pthread_t th;
+    int started;            // th を起動した
+} stream_t;
+
+// サーバー設定をスレッドに渡すためのデータ構造
+typedef struct server_config {
+    char local_ip[16];      // BindするローカルIP (例: 172.21.0.30)
+    char target_name[16];   // 対象ノード名 (表示用: Node1など)
+    char filename[256];     // 送信するファイル名
+    int port;               // 待ち受けポート
+    int path_id;            // 経路番号 (フレームに載せる)
+    uint32_t file_id;       // 元ファイルの識別子
+    off_t base_offset;      // 元ファイル内でのこのパートの開始位置
+    off_t total_size;       // 元ファイル全体のサイズ
+    telem_path_t tm;        // 送信バイト数のカウンタ
+    metric_t *m_chunks;     // 送ったチャンク数 (-M)
+    chunk_queue_t *queue;   // 送信するチャンクを取り出すキュー
+    chunk_queue_t own_queue;// 経路ごとに別ファイルを送る場合のキュー
+    int n_streams;          // この経路に張るTCP接続の本数
+    stream_t streams[MAX_STREAMS];
+    tune_profile_t prof;    // 前回までの測定から決めたソケット設定 (-t)
+    int have_prof;
+    // UDP経路 (/udp): TCP接続は制御だけに使い，データはUDPで送る
+    int udp;
+    int udp_sock;           // local_ip:port にbindしたUDPソケット
+    int udp_gso;            // UDP_SEGMENT (GSO) が使える
+    uint32_t udp_token;     // 今回のセッション識別子 (STREAMSで受信側に渡す)
+    struct sockaddr_in udp_peer;    // HELLOの送信元 (データの宛先)
+    double udp_rate;        // 送信レート [バイト/秒] (セッションをまたいで引き継ぐ)
+    uint32_t udp_seq;       // 次に送るデータグラムの通し番号
+    uint32_t udp_cut_seq;   // 最後にレートを下げたときの udp_seq
+} ServerConfig;
+
+// ===================================================================
+// 送信エンジン (send_range)
+// ファイルのoffから lenバイトをソケットへ送る。短い送信は続きから再送する
+// pipefd は splice 用 (初回に作成し，スレッドで使い回す)
+// ===================================================================
+static int send_range_copy(int sock, int fd, off_t off, size_t len) {
+    char buf[BUF_LEN];
+    while (len > 0) {
+        size_t want = len > BUF_LEN ? BUF_LEN : len;
+        ssize_t n = pread(fd, buf, want, off);
+        metric_add(m_pread, 1);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            if (n == 0) errno = EIO; // 途中でファイルが短くなった
+            return -1;
+        }
+        if (write_all(sock, buf, n) < 0) return -1;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// 途中で失敗したパイプには送り残しが入っていることがある。次のチャンクや
+// 接続がそれを自分のフレームより先に送らないよう，閉じて次回に作り直させる
+static void splice_pipe_drop(int pipefd[2]) {
+    int err = errno;
+    close(pipefd[0]);
+    close(pipefd[1]);
+    pipefd[0] = pipefd[1] = -1;
+    errno = err;
+}
+
+static int send_range_splice(int sock, int fd, off_t off, size_t len, int pipefd[2]) {
+    if (pipefd[0] < 0) {
+        if (pipe(pipefd) < 0) return -1;
+        fcntl(pipefd[1], F_SETPIPE_SZ, SPLICE_PIPE_SZ); // 失敗しても既定サイズで動く
+    }
+    while (len > 0) {
+        ssize_t in = splice(fd, &off, pipefd[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        metric_add(m_splice, 1);
+        if (in <= 0) {
+            if (in < 0 && errno == EINTR) continue;
+            if (in == 0) errno = EIO;
+            splice_pipe_drop(pipefd);
+            return -1;
+        }
+        len -= in;
+        // パイプに入った分をすべてソケットへ流す
+        while (in > 0) {
+            ssize_t out = splice(pipefd[0], NULL, sock, NULL, in,
+                                 SPLICE_F_MOVE | (len > 0 ? SPLICE_F_MORE : 0));
+            metric_add(m_splice, 1);
+            if (out < 0) {
+                if (errno == EINTR) continue;
+                splice_pipe_drop(pipefd);
+                return -1;
+            }
+            in -= out;
+        }
+    }
+    return 0;
+}
+
+static int send_range_sendfile(int sock, int fd, off_t off, size_t len, int pipefd[2]) {
+    while (len > 0) {
+        ssize_t n = sendfile(sock, fd, &off, len);
+        metric_add(m_sendfile, 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL || errno == ENOSYS) {
+                // このファイル/ソケットの組み合わせでは使えない -> splice で続行
+                return send_range_splice(sock, fd, off, len, pipefd);
+            }
+            return -1;
+        }
+        if (n == 0) {
+            errno = EIO;
+            return -1;
+        }
+        len -= n; // offはsendfileが進める
+    }
+    return 0;
+}
+
+int send_range(int sock, int fd, off_t off, size_t len, int pipefd[2]) {
+    switch (send_mode) {
+    case SEND_COPY:   return send_range_copy(sock, fd, off, len);
+    case SEND_SPLICE: return send_range_splice(sock, fd, off, len, pipefd);
+    default:          return send_range_sendfile(sock, fd, off, len, pipefd);
+    }
+}
+
+// ===================================================================
+// 帯域測定 (send_probe)
+// 経路のソケットにcalib_seconds秒間PROBEフレームを流し続ける。
+// 受信側が経路ごとのスループットを測り，分割比率を決める
+// ===================================================================
+long long send_probe(int sock, int path_id, telem_path_t *tm, tune_meas_t *meas) {
+    static char zeros[64 * 1024];
+    struct timespec start, now;
+    long long total_bytes = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        if (send_frame_hdr(sock, FRAME_PROBE, path_id, 0, 0, sizeof(zeros)) < 0 ||
+            write_all(sock, zeros, sizeof(zeros)) < 0) {
+            perror("[Thread] send probe failed");
+            break;
+        }
+        total_bytes += sizeof(zeros);
+        telem_add(tm, sizeof(zeros));
+        if (meas != NULL) tune_sample(meas, sock);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (now.tv_sec - start.tv_sec < calib_seconds);
+
+    send_frame_hdr(sock, FRAME_END, path_id, 0, 0, 0);
+    return total_bytes;
+}
+
+// ファイル情報を送る。パリティを付ける転送なら受信側にストライプの形を伝える
+static int send_file_frame(ServerConfig *conf, int sock) {
+    frame_hdr_t h;
+
+    memset(&h, 0, sizeof(h));
+    h.type = FRAME_FILE;
+    h.path_id = conf->path_id;
+    h.file_id = conf->file_id;
+    h.offset = conf->total_size;
+    if (conf->queue->fec_on) {
+        h.flags = FRAME_F_FEC;
+        h.raw_len = ((uint32_t)conf->queue->fec_k << 8) | (uint32_t)conf->queue->fec_m;
+        h.crc = (uint32_t)conf->queue->chunk_len;
+    }
+    if (conf->queue->acks) {
+        h.flags |= FRAME_F_ACK;
+        h.crc = (uint32_t)conf->queue->chunk_len;
+    }
+    if (conf->queue->stream) h.flags |= FRAME_F_STREAM;    // 長さは最後にEOSで知らせる
+    return send_frame(sock, &h);
+}
+
+// この接続での送信を終える。ストリームを読み切っていれば先に全体の長さを知らせる
+static int send_end(ServerConfig *conf, int sock) {
+    uint64_t len;
+
+    if (chunk_queue_stream_end(conf->queue, &len) &&
+        send_frame_hdr(sock, FRAME_EOS, conf->path_id, conf->file_id, len, 0) < 0) {
+        return -1;
+    }
+    return send_frame_hdr(sock, FRAME_END, conf->path_id, conf->file_id, conf->total_size, 0);
+}
+
+// パリティチャンクを作って送る
+static int send_parity(stream_t *st, int sock, chunk_t *c) {
+    ServerConfig *conf = st->conf;
+    frame_hdr_t h;
+
+    if (st->par == NULL && (st->par = malloc(conf->queue->chunk_len)) == NULL) return -1;
+    chunk_queue_parity(conf->queue, c, st->par);
+    c->crc = crc32c(0, st->par, c->len);
+    memset(&h, 0, sizeof(h));
+    h.type = FRAME_PARITY;
+    h.flags = FRAME_F_CRC;
+    h.path_id = conf->path_id;
+    h.file_id = conf->file_id;
+    h.offset = c->dst_off;
+    h.length = (uint32_t)c->len;
+    h.crc = c->crc;
+    h.raw_len = ((uint32_t)chunk_queue_stripe_k(conf->queue, c) << 8) | (uint32_t)(c->parity - 1);
+    if (send_frame(sock, &h) < 0 || write_all(sock, st->par, c->len) < 0) return -1;
+    telem_add(&conf->tm, c->len);
+    st->n_parity++;
+    return 0;
+}
+
+// 届いているACKを読んで確認待ちを消す (待たない)。接続が切れていれば-1
+static int read_acks(stream_t *st) {
+    ServerConfig *conf = st->conf;
+    frame_hdr_t h;
+
+    for (;;) {
+        ssize_t n = recv(st->sock, st->ack_hdr + st->ack_got, FRAME_HDR_LEN - st->ack_got, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (n <= 0) {
+            if (n == 0) errno = ECONNRESET;
+            return -1;
+        }
+        st->ack_got += (int)n;
+        if (st->ack_got < FRAME_HDR_LEN) continue;
+        st->ack_got = 0;
+        if (frame_hdr_unpack(st->ack_hdr, &h) < 0 || h.type != FRAME_ACK) {
+            fprintf(stderr, "[Thread %s] unexpected frame from the receiver\n", conf->target_name);
+            errno = EPROTO;
+            return -1;
+        }
+        chunk_queue_ack(conf->queue, h.offset, h.raw_len, conf->path_id);
+    }
+}
+
+// 送信に失敗した。ACKを求める転送で確認待ちが残っていなければ，受信側が
+// 揃ったチャンクを重ねて運んでいた接続を止めただけなので失敗とはしない
+static void stream_error(stream_t *st, const char *what) {
+    ServerConfig *conf = st->conf;
+    int err = errno, i;
+
+    if (conf->queue->acks) {
+        // 他の接続が最後のACKをまだ読んでいないことがあるので少し待つ
+        for (i = 0; i < 20 && chunk_queue_unacked(conf->queue) > 0; i++) usleep(ENDGAME_POLL_MS * 1000);
+        if (chunk_queue_unacked(conf->queue) == 0) {
+            printf("[Thread %s] receiver has every chunk and closed this connection\n", conf->target_name);
+            return;
+        }
+    }
+    errno = err;
+    perror(what);
+}
+
+// 次に送るチャンクを取り出す。ACKを求める転送では，キューが空いても
+// 確認待ちが残る間はACKを読みながら待ち，終盤の重複を受け取る
+static int next_chunk(stream_t *st, chunk_t *c) {
+    ServerConfig *conf = st->conf;
+
+    double t0 = 0;
+
+    if (!conf->queue->acks) return chunk_queue_pop(conf->queue, c, conf->path_id);
+    for (;;) {
+        struct pollfd pfd = { st->sock, POLLIN, 0 };
+        int rc;
+
+        if (read_acks(st) < 0) return -1;
+        rc = chunk_queue_trypop(conf->queue, c, conf->path_id);
+        if (rc >= 0) {
+            if (t0 != 0) chunk_queue_waited(conf->queue, conf->path_id, t0);
+            return rc;
+        }
+        if (t0 == 0) t0 = mono_sec();
+        poll(&pfd, 1, ENDGAME_POLL_MS);
+    }
+}
+
+// ===================================================================
+// ファイル送信処理 (send_chunks)
+// FILE -> DATA(チャンクごとにヘッダ付き) -> END の順にフレームを送る。
+// チャンクは送り終えるたびにキューから次を取りに行く
+// ===================================================================
+long long send_chunks(stream_t *st) {
+    ServerConfig *conf = st->conf;
+    zpath_t *z = &st->z;
+    int sock = st->sock;
+    long long total_bytes = 0;
+    chunk_t c;
+    int rc;
+
+    if (send_file_frame(conf, sock) < 0) {
+        perror("[Thread] send FILE frame failed");
+        return 0;
+    }
+    while ((rc = next_chunk(st, &c)) > 0) {
+        frame_hdr_t h;
+        const unsigned char *data = chunk_queue_data(conf->queue, &c);
+        struct timespec t0;
+        size_t zlen = 0;
+        int zipped = 0;
+        int in_mem = c.buf != NULL; // 中身がメモリにある (ストリーム，-d で小さいファイルを読み集めた)
+
+        if (c.parity > 0) {
+            if (send_parity(st, sock, &c) < 0) {
+                stream_error(st, "[Thread] send parity failed");
+                chunk_queue_requeue(conf->queue, &c);
+                return total_bytes;
+            }
+            chunk_queue_done(conf->queue, &c);
+            continue;
+        }
+
+        if (conf->queue->tree != NULL) {
+            if (st->batch == NULL) st->batch = malloc(conf->queue->chunk_len);
+            in_mem = st->batch != NULL ? chunk_queue_source(conf->queue, &c, st->batch) : -1;
+            if (in_mem == 0 && use_zlib) {
+                // 1つのファイルに収まるチャンクはmmapが無いので，圧縮するなら読んでおく
+                in_mem = pread(c.fd, st->batch, c.len, c.src_off) == (ssize_t)c.len ? 1 : -1;
+                close(c.fd);
+            }
+            if (in_mem < 0) {
+                perror("[Thread] read source files failed");
+                chunk_queue_requeue(conf->queue, &c);
+                return total_bytes;
+            }
+            if (in_mem) data = st->batch;
+        }
+        c.crc = in_mem ? crc32c(0, data, c.len) : chunk_queue_crc(conf->queue, &c);
+        memset(&h, 0, sizeof(h));
+        h.type = FRAME_DATA;
+        h.flags = FRAME_F_CRC;
+        h.path_id = conf->path_id;
+        h.file_id = conf->file_id;
+        h.offset = c.dst_off;
+        h.length = (uint32_t)c.len;
+        h.crc = c.crc;
+        if (use_zlib && data != NULL && zpath_decide(z, data, c.len) &&
+            zpath_deflate(z, data, c.len, &zlen) == 0) {
+            // 圧縮できたチャンクは圧縮結果を送る (CRCは圧縮前のデータのもの)
+            zipped = 1;
+            h.flags |= FRAME_F_ZLIB;
+            h.length = (uint32_t)zlen;
+            h.raw_len = (uint32_t)c.len;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (zipped) {
+            rc = send_frame(sock, &h) < 0 || write_all(sock, z->out, zlen) < 0 ? -1 : 0;
+        } else if (in_mem) {
+            rc = send_frame(sock, &h) < 0 || write_all(sock, data, c.len) < 0 ? -1 : 0;
+        } else {
+            rc = send_frame(sock, &h) < 0 || send_range(sock, c.fd, c.src_off, c.len, st->pipefd) < 0 ? -1 : 0;
+        }
+        if (conf->queue->tree != NULL && !in_mem) close(c.fd);
+        if (rc < 0) {
+            stream_error(st, "[Thread] send failed");
+            chunk_queue_requeue(conf->queue, &c);
+            return total_bytes;
+        }
+        if (use_zlib) {
+            // 回線の速度はカーネルの配送レートを使う (ソケットバッファが空いている
+            // 間は送信がすぐ終わるので，送信時間からだと速く見積もってしまう)
+            struct tcp_info ti;
+            socklen_t tlen = sizeof(ti);
+            if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &ti, &tlen) == 0 && ti.tcpi_delivery_rate > 0) {
+                zpath_ewma(&z->link_Bps, (double)ti.tcpi_delivery_rate);
+            } else {
+                zpath_ewma(&z->link_Bps, h.length / elapsed_since(&t0));
+            }
+            z->wire_bytes += h.length;
+            z->n_zchunks += zipped;
+        }
+        if (conf->queue->acks) {
+            chunk_queue_sent(conf->queue, &c);
+        } else {
+            chunk_queue_done(conf->queue, &c);
+        }
+        telem_add(&conf->tm, c.len);
+        if (tune_file != NULL) tune_sample(&st->meas, sock);
+        total_bytes += c.len;
+        st->n_chunks++;
+        metric_add(conf->m_chunks, 1);
+        st->n_dups += c.dup;
+    }
+    if (rc < 0) {
+        stream_error(st, "[Thread] read ACK failed");
+        return total_bytes;
+    }
+    if (send_end(conf, sock) < 0) {
+        perror("[Thread] send END frame failed");
+    }
+    return total_bytes;
+}
+
+// ===================================================================
+// 再開範囲の受け取り (read_resume)
+// 受信側は接続直後にRESUMEフレームで欲しい範囲を送ってくる。
+// *ranges に (開始位置, 長さ) の組を入れ，組の数を返す (0 = 全体)。失敗なら-1
+// flags が NULL でなければフレームのフラグ (FRAME_F_DEDUP など) を入れる
+// ===================================================================
+int read_resume(int sock, uint64_t **ranges, int *flags) {
+    unsigned char hdr[FRAME_HDR_LEN];
+    frame_hdr_t h;
+    uint64_t *r;
+    int n, i;
+
+    *ranges = NULL;
+    if (read_all(sock, hdr, sizeof(hdr)) < 0) return -1;
+    if (frame_hdr_unpack(hdr, &h) < 0 || h.type != FRAME_RESUME ||
+        h.length % 16 != 0 || h.length / 16 > FRAME_RESUME_MAX) {
+        fprintf(stderr, "[Thread] bad RESUME frame\n");
+        return -1;
+    }
+    if (flags != NULL) *flags = h.flags;
+    n = (int)(h.length / 16);
+    if (n == 0) return 0;
+    r = malloc(h.length);
+    if (r == NULL || read_all(sock, r, h.length) < 0) {
+        free(r);
+        return -1;
+    }
+    for (i = 0; i < 2 * n; i++) r[i] = be64toh(r[i]);
+    *ranges = r;
+    return n;
+}
+
+// ===================================================================
+// UDP転送 (-p ...:port/udp)
+// 経路のTCP接続は制御用 (FILE・POLL・NACK・END) に残し，チャンクの中身は
+// UDP_SEG_LEN ごとのデータグラムにして，送信側で決めたレートで流す。
+// チャンクを送り終えるたびにPOLLを送り，受信側はチャンクごとの受信
+// ビットマップから欠けた範囲をNACKで返す。欠けが無くなったチャンクから
+// キューに完了を返すので，他の経路 (TCP) と同じキューを分担できる
+// ===================================================================
+#define UDP_MIN_MBPS      1.0
+#define UDP_MAX_MBPS      40000.0
+#define UDP_RATE_UP       1.05          // 欠けの無かったチャンクごとにレートを上げる割合
+#define UDP_LOSS_TARGET   0.01          // これより多く欠けたらレートを下げる
+#define UDP_WINDOW        (16 * 1024 * 1024)  // 確認待ちにしておけるバイト数
+#define UDP_BATCH_SEGS    44            // 1回のsendmmsgで送るデータグラム数 (GSOで64KiB未満)
+#define UDP_SNDBUF        (4 * 1024 * 1024)
+#define UDP_HELLO_MS      5000          // 受信側のHELLOを待つ時間
+#define UDP_TIMEOUT_MS    10000         // この間NACKが来なければ経路を諦める
+
+// 確認待ちのチャンク
 typedef struct {
-    char local_ip[16];      // BindするローカルIP (例: 172.21.0.30)
-    char target_name[16];   // 対象ノード名 (表示用: Node1など)
-    char filename[256];     // 送信するファイル名
-    int port;               // 待ち受けポート
-} ServerConfig;
+    chunk_t c;
+    const unsigned char *data;  // チャンクの中身 (mmap上，できなければ buf)
+    unsigned char *buf;
+    uint64_t *todo;             // これから(再)送信する (チャンク内の位置, 長さ) の組
+    int n_todo;
+    int answered;               // 受け取ったNACKの数 (最初のNACKの欠けでレートを決める)
+    uint32_t seq0;              // 最初に送ったデータグラムの通し番号
+} udp_chunk_t;
+
+// UDPソケットを作って経路のアドレスにbindする。GSOが使えるかもここで調べる
+int udp_open(ServerConfig *conf) {
+    struct sockaddr_in addr;
+    int size = UDP_SNDBUF;
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (sock < 0) {
+        perror("[Thread] UDP socket failed");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(conf->port);
+    inet_pton(AF_INET, conf->local_ip, &addr.sin_addr.s_addr);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "[Thread %s] UDP bind failed on %s: ", conf->target_name, conf->local_ip);
+        perror("");
+        close(sock);
+        return -1;
+    }
+    if (setsockopt(sock, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) < 0) {
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    }
+    conf->udp_gso = 0;
+#ifdef UDP_SEGMENT
+    // 以降の送信は UDP_HDR_LEN + UDP_SEG_LEN ごとにカーネルが切り分ける
+    size = UDP_HDR_LEN + UDP_SEG_LEN;
+    conf->udp_gso = setsockopt(sock, SOL_UDP, UDP_SEGMENT, &size, sizeof(size)) == 0;
+#endif
+    conf->udp_sock = sock;
+    return 0;
+}
+
+// 受信側のHELLOを待ち，送信元をデータの宛先にする
+static int udp_wait_hello(ServerConfig *conf) {
+    struct timespec t0;
+    unsigned char buf[256];
+    frame_hdr_t h;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (;;) {
+        struct pollfd pfd = { conf->udp_sock, POLLIN, 0 };
+        struct sockaddr_in from;
+        socklen_t flen = sizeof(from);
+        int left = UDP_HELLO_MS - (int)(elapsed_since(&t0) * 1000);
+        ssize_t n;
+
+        if (left <= 0 || poll(&pfd, 1, left) <= 0) return -1;
+        n = recvfrom(conf->udp_sock, buf, sizeof(buf), 0, (struct sockaddr *)&from, &flen);
+        // 前のセッションのHELLOが残っていれば読み捨てる
+        if (n < FRAME_HDR_LEN || frame_hdr_unpack(buf, &h) < 0 ||
+            h.type != FRAME_HELLO || h.file_id != conf->udp_token) continue;
+        conf->udp_peer = from;
+        return 0;
+    }
+}
+
+// 組み立てたデータグラム (iov に ヘッダ, ペイロード の順に n 個) を送る。
+// GSOが使えれば1つのメッセージにまとめ，カーネルに切り分けさせる
+static int udp_send_batch(ServerConfig *conf, struct iovec *iov, int n) {
+    struct mmsghdr msgs[UDP_BATCH_SEGS];
+    int n_msgs, i, sent = 0;
+
+retry:
+    n_msgs = conf->udp_gso ? 1 : n;
+    memset(msgs, 0, sizeof(msgs[0]) * n_msgs);
+    for (i = 0; i < n_msgs; i++) {
+        msgs[i].msg_hdr.msg_name = &conf->udp_peer;
+        msgs[i].msg_hdr.msg_namelen = sizeof(conf->udp_peer);
+        msgs[i].msg_hdr.msg_iov = &iov[2 * i];
+        msgs[i].msg_hdr.msg_iovlen = conf->udp_gso ? 2 * n : 2;
+    }
+    while (sent < n_msgs) {
+        int r = sendmmsg(conf->udp_sock, msgs + sent, n_msgs - sent, 0);
+        metric_add(m_sendmmsg, 1);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+#ifdef UDP_SEGMENT
+            if (errno == EIO && conf->udp_gso && sent == 0) {
+                // チェックサムをオフロードできないデバイス: 1つずつ送る
+                int off = 0;
+                setsockopt(conf->udp_sock, SOL_UDP, UDP_SEGMENT, &off, sizeof(off));
+                conf->udp_gso = 0;
+                fprintf(stderr, "[Thread %s] UDP GSO is not usable, sending datagrams one by one\n",
+                        conf->target_name);
+                goto retry;
+            }
+#endif
+            if (errno == ENOBUFS) break;    // 送信キューで捨てられた分はNACKで再送される
+            return -1;
+        }
+        sent += r;
+    }
+    return 0;
+}
+
+// チャンク内の [off, off + len) をデータグラムにして送る (off は UDP_SEG_LEN の倍数)。
+// UDP_BATCH_SEGS 個ずつ，conf->udp_rate を超えないよう間隔を空けて送る
+static int udp_send_range(ServerConfig *conf, udp_chunk_t *u, uint64_t off, uint64_t len,
+                          struct timespec *next, tune_meas_t *meas) {
+    unsigned char hdrs[UDP_BATCH_SEGS][UDP_HDR_LEN];
+    struct iovec iov[2 * UDP_BATCH_SEGS];
+    uint64_t end = off + len;
+
+    while (off < end) {
+        struct timespec now;
+        size_t bytes = 0;
+        int n;
+
+        for (n = 0; n < UDP_BATCH_SEGS && off < end; n++) {
+            size_t seg = end - off < UDP_SEG_LEN ? (size_t)(end - off) : UDP_SEG_LEN;
+            const unsigned char *p = u->data + off;
+            udp_hdr_t uh;
+
+            memset(&uh, 0, sizeof(uh));
+            uh.h.type = FRAME_DATA;
+            uh.h.flags = FRAME_F_CRC;
+            uh.h.path_id = conf->path_id;
+            uh.h.file_id = conf->udp_token;
+            uh.h.offset = u->c.dst_off + off;
+            uh.h.length = (uint32_t)seg;
+            uh.h.crc = crc32c(0, p, seg);
+            uh.h.raw_len = conf->udp_seq++;
+            uh.chunk_off = u->c.dst_off;
+            uh.chunk_len = (uint32_t)u->c.len;
+            uh.chunk_crc = u->c.crc;
+            udp_hdr_pack(hdrs[n], &uh);
+            iov[2 * n].iov_base = hdrs[n];
+            iov[2 * n].iov_len = UDP_HDR_LEN;
+            iov[2 * n + 1].iov_base = (void *)p;
+            iov[2 * n + 1].iov_len = seg;
+            bytes += UDP_HDR_LEN + seg;
+            off += seg;
+        }
+
+        // ペーシング: 前のバッチから bytes / rate 秒空ける。遅れた分は取り返さない
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL);
+        if (udp_send_batch(conf, iov, n) < 0) return -1;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (next->tv_sec < now.tv_sec || (next->tv_sec == now.tv_sec && next->tv_nsec < now.tv_nsec)) {
+            *next = now;
+        }
+        next->tv_nsec += (long)(bytes / conf->udp_rate * 1e9);
+        next->tv_sec += next->tv_nsec / 1000000000;
+        next->tv_nsec %= 1000000000;
+        telem_add(&conf->tm, bytes);
+        meas->segs_out += (uint32_t)n;
+    }
+    return 0;
+}
+
+static void udp_chunk_free(udp_chunk_t *u) {
+    free(u->buf);
+    free(u->todo);
+}
+
+// 受信側のNACKを1つ読み，該当するチャンクの再送範囲を決める。
+// 欠けが無ければチャンクを完了にして窓から外す。送り終えたバイト数を返す (失敗なら-1)
+static long long udp_read_nack(stream_t *st, udp_chunk_t *win, int *n_win) {
+    ServerConfig *conf = st->conf;
+    unsigned char hdr[FRAME_HDR_LEN];
+    frame_hdr_t h;
+    uint64_t *r = NULL;
+    udp_chunk_t *u = NULL;
+    uint64_t lost = 0;
+    int n, i, k;
+
+    if (read_all(st->sock, hdr, sizeof(hdr)) < 0) return -1;
+    if (frame_hdr_unpack(hdr, &h) < 0 || h.type != FRAME_NACK ||
+        h.length % 16 != 0 || h.length / 16 > FRAME_RESUME_MAX) {
+        fprintf(stderr, "[Thread %s] bad NACK frame\n", conf->target_name);
+        return -1;
+    }
+    n = (int)(h.length / 16);
+    if (n > 0) {
+        r = malloc(h.length);
+        if (r == NULL || read_all(st->sock, r, h.length) < 0) {
+            free(r);
+            return -1;
+        }
+    }
+    for (k = 0; k < *n_win; k++) {
+        if (win[k].c.dst_off == h.offset) u = &win[k];
+    }
+    if (u == NULL) {    // 既に完了したチャンク
+        free(r);
+        return 0;
+    }
+
+    if (n == 0) {
+        // 受信完了
+        long long len = (long long)u->c.len;
+        chunk_queue_done(conf->queue, &u->c);
+        st->n_chunks++;
+        metric_add(conf->m_chunks, 1);
+        if (u->answered == 0 && conf->udp_rate > st->meas.max_rate_Bps) {
+            st->meas.max_rate_Bps = (uint64_t)conf->udp_rate;  // 欠けなく運べたレート
+        }
+        if (u->answered == 0 && (int32_t)(u->seq0 - conf->udp_cut_seq) >= 0) conf->udp_rate *= UDP_RATE_UP;
+        udp_chunk_free(u);
+        *u = win[--*n_win];
+        free(r);
+        if (conf->udp_rate > UDP_MAX_MBPS * 1e6 / 8) conf->udp_rate = UDP_MAX_MBPS * 1e6 / 8;
+        return len;
+    }
+
+    // 欠けた範囲 (元ファイル内の位置) をチャンク内の位置にして再送に回す
+    free(u->todo);
+    u->todo = r;
+    u->n_todo = 0;
+    for (i = 0; i < n; i++) {
+        uint64_t off = be64toh(r[2 * i]), len = be64toh(r[2 * i + 1]);
+        if (off < u->c.dst_off || off + len > u->c.dst_off + u->c.len ||
+            (off - u->c.dst_off) % UDP_SEG_LEN != 0) continue;
+        r[2 * u->n_todo] = off - u->c.dst_off;
+        r[2 * u->n_todo + 1] = len;
+        u->n_todo++;
+        lost += len;
+    }
+    st->meas.retrans += (uint32_t)((lost + UDP_SEG_LEN - 1) / UDP_SEG_LEN);
+    if (u->answered++ == 0 && (int32_t)(u->seq0 - conf->udp_cut_seq) >= 0) {
+        // 最初の返事で欠けた割合が大きければ，その分だけレートを下げる。
+        // 下げる前のレートで送ったチャンクの欠けでさらに下げないよう，
+        // 以降はこの時点より後に送り始めたチャンクだけを見る
+        double loss = (double)lost / u->c.len;
+        if (loss > UDP_LOSS_TARGET) {
+            conf->udp_rate *= loss < 0.5 ? 1.0 - loss : 0.5;
+            conf->udp_cut_seq = conf->udp_seq;
+            if (conf->udp_rate < UDP_MIN_MBPS * 1e6 / 8) conf->udp_rate = UDP_MIN_MBPS * 1e6 / 8;
+        } else {
+            conf->udp_rate *= UDP_RATE_UP;
+        }
+    }
+    return 0;
+}
+
+// UDP経路の送信ループ。窓に空きがあればキューから次のチャンクを取り，
+// NACKで欠けが分かったチャンクは新しいチャンクより先に再送する
+long long udp_send_chunks(stream_t *st) {
+    ServerConfig *conf = st->conf;
+    int sock = st->sock;
+    int max_win = (int)(UDP_WINDOW / conf->queue->chunk_len);
+    udp_chunk_t *win;
+    int n_win = 0, done = 0, k;
+    struct timespec next, progress;
+    long long total_bytes = 0;
+    tune_meas_t tcp_meas;
+
+    if (send_file_frame(conf, sock) < 0) {
+        perror("[Thread] send FILE frame failed");
+        return 0;
+    }
+    if (udp_wait_hello(conf) < 0) {
+        // データが届かない経路 (中継ルーターが -u なしなど)。チャンクは他の経路が運ぶ
+        fprintf(stderr, "[Thread %s] no UDP HELLO from the receiver, leaving this path idle\n",
+                conf->target_name);
+        send_end(conf, sock);
+        return 0;
+    }
+    if (max_win < 2) max_win = 2;
+    if (max_win > 256) max_win = 256;
+    win = calloc((size_t)max_win, sizeof(udp_chunk_t));
+    if (win == NULL) return 0;
+    memset(&tcp_meas, 0, sizeof(tcp_meas));
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    progress = next;
+
+    while (!done || n_win > 0) {
+        struct pollfd pfd = { sock, POLLIN, 0 };
+        udp_chunk_t *u = NULL;
+
+        // 届いているNACKを先に処理する
+        while (poll(&pfd, 1, 0) > 0) {
+            long long got = udp_read_nack(st, win, &n_win);
+            if (got < 0) goto fail;
+            total_bytes += got;
+            clock_gettime(CLOCK_MONOTONIC, &progress);
+        }
+
+        for (k = 0; k < n_win && u == NULL; k++) {
+            if (win[k].n_todo > 0) u = &win[k];
+        }
+        if (u == NULL && !done && n_win < max_win) {
+            chunk_t c;
+            int rc = chunk_queue_trypop(conf->queue, &c, conf->path_id);
+            if (rc > 0 && c.parity > 0) {
+                // パリティは制御用のTCP接続でそのまま送る
+                if (send_parity(st, sock, &c) < 0) {
+                    perror("[Thread] send parity failed");
+                    chunk_queue_requeue(conf->queue, &c);
+                    goto fail;
+                }
+                chunk_queue_done(conf->queue, &c);
+                continue;
+            }
+            if (rc == 0) {
+                done = 1;
+            } else if (rc > 0) {
+                st->n_dups += c.dup;
+                u = &win[n_win++];
+                memset(u, 0, sizeof(*u));
+                u->c = c;
+                u->data = chunk_queue_data(conf->queue, &c);
+                u->todo = malloc(2 * sizeof(uint64_t));
+                if (u->data == NULL) {
+                    // mmapできなかったファイルやディレクトリ: 再送に備えてチャンクを読んでおく
+                    int got = -1;
+                    u->buf = malloc(c.len);
+                    if (u->buf != NULL && conf->queue->tree != NULL) {
+                        got = chunk_queue_source(conf->queue, &c, u->buf);
+                        if (got == 0) {
+                            got = pread(c.fd, u->buf, c.len, c.src_off) == (ssize_t)c.len ? 1 : -1;
+                            close(c.fd);
+                        }
+                    } else if (u->buf != NULL) {
+                        got = pread(c.fd, u->buf, c.len, c.src_off) == (ssize_t)c.len ? 1 : -1;
+                    }
+                    if (got < 0) {
+                        perror("[Thread] read chunk failed");
+                        goto fail;
+                    }
+                    u->data = u->buf;
+                }
+                u->c.crc = crc32c(0, u->data, c.len);
+                if (u->todo == NULL) goto fail;
+                u->todo[0] = 0;
+                u->todo[1] = c.len;
+                u->n_todo = 1;
+                u->seq0 = conf->udp_seq;
+            }
+        }
+
+        if (u != NULL) {
+            frame_hdr_t h;
+            for (k = 0; k < u->n_todo; k++) {
+                if (udp_send_range(conf, u, u->todo[2 * k], u->todo[2 * k + 1], &next, &st->meas) < 0) {
+                    perror("[Thread] UDP send failed");
+                    goto fail;
+                }
+            }
+            u->n_todo = 0;
+            // 送り終えたことを知らせ，欠けを聞く
+            memset(&h, 0, sizeof(h));
+            h.type = FRAME_POLL;
+            h.path_id = conf->path_id;
+            h.file_id = conf->udp_seq - 1;     // 受信側はここまで届くのを待って欠けを数える
+            h.offset = u->c.dst_off;
+            h.raw_len = (uint32_t)u->c.len;
+            h.crc = u->c.crc;
+            if (send_frame(sock, &h) < 0) {
+                perror("[Thread] send POLL frame failed");
+                goto fail;
+            }
+            if (tune_file != NULL) tune_sample(&tcp_meas, sock);
+            continue;
+        }
+
+        // 返事待ち (他の経路のチャンクが戻されるかもしれないので時々キューも見る)
+        if (poll(&pfd, 1, 10) == 0 && n_win > 0 && elapsed_since(&progress) * 1000 > UDP_TIMEOUT_MS) {
+            fprintf(stderr, "[Thread %s] no NACK for %d ms, giving up this path\n",
+                    conf->target_name, UDP_TIMEOUT_MS);
+            goto fail;
+        }
+    }
+    free(win);
+    st->meas.min_rtt_us = tcp_meas.min_rtt_us;
+    if (send_end(conf, sock) < 0) {
+        perror("[Thread] send END frame failed");
+    }
+    return total_bytes;
+
+fail:
+    // 確認の取れていないチャンクは他の経路に運ばせる
+    for (k = 0; k < n_win; k++) {
+        chunk_queue_requeue(conf->queue, &win[k].c);
+        udp_chunk_free(&win[k]);
+    }
+    free(win);
+    return total_bytes;
+}
+
+// ディレクトリの一覧を送る (-d)
+static int send_manifest(ServerConfig *conf, int sock) {
+    const tree_t *t = conf->queue->tree;
+    frame_hdr_t h;
+    unsigned char *p;
+    size_t len;
+    int rc;
+
+    if ((p = tree_pack(t, &len)) == NULL) return -1;
+    memset(&h, 0, sizeof(h));
+    h.type = FRAME_MANIFEST;
+    h.flags = FRAME_F_CRC;
+    h.path_id = conf->path_id;
+    h.length = (uint32_t)len;
+    h.offset = t->total;
+    h.crc = crc32c(0, p, len);
+    h.raw_len = (uint32_t)t->n;
+    rc = send_frame(sock, &h) < 0 || write_all(sock, p, len) < 0 ? -1 : 0;
+    free(p);
+    return rc;
+}
+
+// 重複排除 (RESUME に FRAME_F_DEDUP): 送るファイルのチャンク一覧を返す。
+// 一覧は初めて求められたときに作り ("<ファイル>.cdc" が使えればそれを読む)，
+// 以後の転送と他の経路で使い回す。送ったら1，送れない転送なら0，失敗なら-1
+static int send_cdc(ServerConfig *conf, int sock) {
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    static cdc_list_t list;
+    static int state;   // 0 = まだ，1 = 作った，-1 = 作れなかった
+    chunk_queue_t *q = conf->queue;
+    frame_hdr_t h;
+    unsigned char *p;
+    size_t len;
+    int rc;
+
+    // 全経路で1つのファイルを分担するときだけ (-r や -d，ストリームは対象外)
+    if (q == NULL || q == &conf->own_queue || q->tree != NULL || q->stream) return 0;
+    pthread_mutex_lock(&lock);
+    if (state == 0) {
+        double t0 = mono_sec();
+        rc = cdc_index(conf->filename, q->fd, &list);
+        state = rc < 0 ? -1 : 1;
+        if (rc < 0) perror("[Thread] chunk index failed");
+        else printf("[Thread %s] chunk index of %s: %zu chunks (%s %.2f s) ",
+                    conf->target_name, conf->filename, list.n,
+                    rc == 0 ? "read" : "computed", mono_sec() - t0);
+    }
+    pthread_mutex_unlock(&lock);
+    if (state < 0 || q->src_base != 0 || q->dst_base != 0 || list.size != q->size) return 0;
+
+    if ((p = cdc_pack(&list, &len)) == NULL) return -1;
+    memset(&h, 0, sizeof(h));
+    h.type = FRAME_CDC;
+    h.flags = FRAME_F_CRC;
+    h.path_id = conf->path_id;
+    h.length = (uint32_t)len;
+    h.offset = list.size;
+    h.crc = crc32c(0, p, len);
+    h.raw_len = (uint32_t)list.n;
+    rc = send_frame(sock, &h) < 0 || write_all(sock, p, len) < 0 ? -1 : 1;
+    free(p);
+    return rc;
+}
+
+// RESUMEへの返事。UDP経路ならセッション識別子を付けて，データはUDPで送ると伝える
+// 経路の1本目の接続 (first) でディレクトリを送るときは一覧を続けて送る
+static int send_streams(ServerConfig *conf, int sock, int first) {
+    frame_hdr_t h;
+    int tree = first && conf->queue != NULL && conf->queue->tree != NULL;
+
+    memset(&h, 0, sizeof(h));
+    h.type = FRAME_STREAMS;
+    h.path_id = conf->path_id;
+    h.offset = conf->n_streams;
+    if (conf->udp && calib_seconds == 0) {
+        h.flags = FRAME_F_UDP;
+        h.file_id = conf->udp_token;
+    }
+    if (tree) h.flags |= FRAME_F_TREE;
+    if (send_frame(sock, &h) < 0) return -1;
+    return tree ? send_manifest(conf, sock) : 0;
+}
+
+// 同じ経路の残りの接続を受け付ける。受信側は1本目で届いたSTREAMSフレームを
+// 見て同じ宛先に接続し直してくるので，STREAM_ACCEPT_MS 待っても来なければ
+// そこまでの本数で送る。受け付けた本数を返す
+int accept_streams(ServerConfig *conf, int serv_sock) {
+    int n_open = 1;
+
+    while (n_open < conf->n_streams) {
+        struct pollfd pfd = { serv_sock, POLLIN, 0 };
+        uint64_t *ranges;
+        int sock;
+
+        if (poll(&pfd, 1, STREAM_ACCEPT_MS) <= 0) {
+            fprintf(stderr, "[Thread %s] only %d of %d streams connected\n",
+                    conf->target_name, n_open, conf->n_streams);
+            break;
+        }
+        sock = accept(serv_sock, NULL, NULL);
+        if (sock < 0) {
+            perror("[Thread] accept failed");
+            continue;
+        }
+        if (conf->have_prof) tune_apply(sock, &conf->prof, TUNE_SEND);
+        // 2本目以降の再送範囲は1本目と同じものなので読み捨てる
+        if (read_resume(sock, &ranges, NULL) < 0 || send_streams(conf, sock, 0) < 0) {
+            perror("[Thread] stream handshake failed");
+            close(sock);
+            continue;
+        }
+        free(ranges);
+        conf->streams[n_open++].sock = sock;
+    }
+    return n_open;
+}
+
+// 今回の接続で測った値を経路のプロファイルに取り込んで保存する。
+// RTTは接続の最小値，帯域は接続ごとの配送レートの最大値の合計
+void tune_record(ServerConfig *conf, int n_open) {
+    uint32_t rtt_us = 0;
+    uint64_t rate = 0, retrans = 0, segs = 0;
+    tune_profile_t *p;
+    char desc[256];
+    int k;
+
+    for (k = 0; k < n_open; k++) {
+        const tune_meas_t *m = &conf->streams[k].meas;
+        if (m->min_rtt_us > 0 && (rtt_us == 0 || m->min_rtt_us < rtt_us)) rtt_us = m->min_rtt_us;
+        rate += m->max_rate_Bps;
+        retrans += m->retrans;
+        segs += m->segs_out;
+    }
+    pthread_mutex_lock(&tune_lock);
+    p = tune_update(&tune_db, conf->target_name, rtt_us / 1000.0, rate * 8.0 / 1000000.0,
+                    segs > 0 ? (double)retrans / segs : 0.0);
+    if (p != NULL) {
+        conf->prof = *p;
+        conf->have_prof = 1;
+        tune_save(&tune_db);
+        tune_describe(p, desc, sizeof(desc));
+        printf("[Thread %s] Tuning profile: %s\n", conf->target_name, desc);
+    }
+    pthread_mutex_unlock(&tune_lock);
+}
+
+// 1本の接続で送る (経路の2本目以降は別スレッドでこれを回す)
+void *stream_worker(void *arg) {
+    stream_t *st = (stream_t *)arg;
+
+    st->n_chunks = 0;
+    st->n_parity = 0;
+    st->n_dups = 0;
+    st->ack_got = 0;
+    memset(&st->meas, 0, sizeof(st->meas));
+    if (calib_seconds > 0) {
+        st->bytes = send_probe(st->sock, st->conf->path_id, &st->conf->tm,
+                               tune_file != NULL ? &st->meas : NULL);
+    } else if (st->conf->udp) {
+        st->bytes = udp_send_chunks(st);
+    } else {
+        st->bytes = send_chunks(st);
+    }
+    return NULL;
+}
 
 // ===================================================================
 // サーバー用スレッド関数 (server_thread)
@@ -40,10 +1998,12 @@ void* server_thread(void* arg) {
     int serv_sock, client_sock;
     struct sockaddr_in servAddr, clientAddr;
     socklen_t clientAddrLen;
-    int fd, n;
-    char buf[BUF_LEN];
     int yes = 1;
-    int is_trigger_node = (strcmp(conf->target_name, "Node1") == 0); // Node1かどうか
+    int n_open, k;
+    int owns_queue = (conf->queue == &conf->own_queue); // 自分専用のキューか
+    int is_trigger_node = (conf->path_id == 0); // 先頭の経路 (既定ではNode1) かどうか
+    uint64_t *ranges;   // 受信側から届いた再送範囲
+    int n_ranges, flags, rc;
 
     // ソケット作成
     if ((serv_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
@@ -68,14 +2028,22 @@ void* server_thread(void* arg) {
     }
 
     // Listen
-    if (listen(serv_sock, 5) < 0) {
+    if (listen(serv_sock, MAX_STREAMS + 5) < 0) {
         perror("[Thread] listen failed");
         close(serv_sock);
         return NULL;
     }
 
-    printf("[Thread %s] Listening on %s:%d (File: %s)...\n", 
-           conf->target_name, conf->local_ip, conf->port, conf->filename);
+    // UDP経路はデータ用のUDPソケットも同じアドレスとポートで開いておく
+    if (conf->udp && calib_seconds == 0 && udp_open(conf) < 0) {
+        close(serv_sock);
+        return NULL;
+    }
+
+    printf("[Thread %s] Listening on %s:%d%s (File: %s)...\n", 
+           conf->target_name, conf->local_ip, conf->port,
+           conf->udp && calib_seconds == 0 ? (conf->udp_gso ? " +UDP/GSO" : " +UDP") : "",
+           conf->filename);
 
     // 接続待機ループ
     while (1) {
@@ -88,49 +2056,113 @@ void* server_thread(void* arg) {
 
         printf("[Thread %s] Accepted connection from %s. ", 
                conf->target_name, inet_ntoa(clientAddr.sin_addr));
+        if (conf->have_prof) tune_apply(client_sock, &conf->prof, TUNE_SEND);
+
+        // 受信側が持っていない範囲を聞く (新規の転送なら全体)
+        n_ranges = read_resume(client_sock, &ranges, &flags);
+        // 重複排除: チャンク一覧を返し，受信側の手元に無い範囲を改めて聞く
+        // (一覧を作れないときや1ファイルの転送でないときは普通に全体を送る)
+        if (n_ranges == 0 && (flags & FRAME_F_DEDUP) && (rc = send_cdc(conf, client_sock)) != 0) {
+            n_ranges = rc < 0 ? -1 : read_resume(client_sock, &ranges, NULL);
+            if (n_ranges >= 0) printf("(dedup: %d ranges) ", n_ranges);
+        }
+        if (n_ranges < 0) {
+            perror("[Thread] read RESUME frame failed");
+            close(client_sock);
+            continue;
+        }
+        if (n_ranges > 0 && !(flags & FRAME_F_DEDUP)) printf("(resume: %d ranges) ", n_ranges);
+        // この経路に何本張るかを返事し，残りの接続を待つ
+        if (conf->udp) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            conf->udp_token = ((uint32_t)now.tv_nsec ^ ((uint32_t)now.tv_sec << 20) ^
+                               ((uint32_t)conf->path_id << 8)) | 1;
+        }
+        if (send_streams(conf, client_sock, 1) < 0) {
+            perror("[Thread] send STREAMS frame failed");
+            close(client_sock);
+            free(ranges);
+            continue;
+        }
+        conf->streams[0].sock = client_sock;
+        n_open = accept_streams(conf, serv_sock);
+        if (n_open > 1) printf("(%d streams) ", n_open);
+        telem_set_sock(telem_p, &conf->tm, client_sock);
 
         // ★★★ 同期処理開始 ★★★
         if (is_trigger_node) {
             // Node1の場合: トリガーを引く
             printf("Triggering start!\n");
+            if (conf->queue != NULL) chunk_queue_reset(conf->queue, ranges, n_ranges);
             pthread_mutex_lock(&trigger_mutex);
             is_node1_active = 1;
             pthread_cond_broadcast(&trigger_cond); // 待機中の他スレッドを一斉に起こす
             pthread_mutex_unlock(&trigger_mutex);
         } else {
             // Node1以外の場合: Node1が来るまで待つ
-            printf("Waiting for Node1 trigger...\n");
+            printf("Waiting for %s trigger...\n", path_specs[0].name);
             pthread_mutex_lock(&trigger_mutex);
             while (!is_node1_active) {
                 pthread_cond_wait(&trigger_cond, &trigger_mutex);
             }
             pthread_mutex_unlock(&trigger_mutex);
             printf("[Thread %s] Trigger received! Starting transfer.\n", conf->target_name);
+            if (owns_queue && conf->queue != NULL) chunk_queue_reset(conf->queue, ranges, n_ranges);
         }
         // ★★★ 同期処理終了 ★★★
 
-        // ファイルオープン
-        if ((fd = open(conf->filename, O_RDONLY)) < 0) {
-            perror("[Thread] open file failed");
-            close(client_sock);
-            continue;
+        // 2本目以降は別スレッドで送り，1本目はこのスレッドで送る
+        for (k = 1; k < n_open; k++) {
+            conf->streams[k].started =
+                pthread_create(&conf->streams[k].th, NULL, stream_worker, &conf->streams[k]) == 0;
+            if (!conf->streams[k].started) perror("[Thread] pthread_create stream failed");
         }
-
-        // ファイル送信処理
-        long long total_bytes = 0;
-        while ((n = read(fd, buf, BUF_LEN)) > 0) {
-            if (write(client_sock, buf, n) != n) {
-                perror("[Thread] write failed");
-                break;
+        stream_worker(&conf->streams[0]);
+        {
+            long long total_bytes = conf->streams[0].bytes;
+            long long zchunks = conf->streams[0].z.n_zchunks;
+            long long wire = conf->streams[0].z.wire_bytes;
+            int n_chunks = conf->streams[0].n_chunks;
+            int n_parity = conf->streams[0].n_parity;
+            int n_dups = conf->streams[0].n_dups;
+            for (k = 1; k < n_open; k++) {
+                if (conf->streams[k].started) {
+                    pthread_join(conf->streams[k].th, NULL);
+                    total_bytes += conf->streams[k].bytes;
+                    n_chunks += conf->streams[k].n_chunks;
+                    n_parity += conf->streams[k].n_parity;
+                    n_dups += conf->streams[k].n_dups;
+                    zchunks += conf->streams[k].z.n_zchunks;
+                    wire += conf->streams[k].z.wire_bytes;
+                }
+                close(conf->streams[k].sock);
+            }
+            if (calib_seconds > 0) {
+                printf("[Thread %s] Sent %lld probe bytes. Closing connection.\n",
+                       conf->target_name, total_bytes);
+            } else {
+                printf("[Thread %s] Sent %d chunks of '%s' (%lld bytes). Closing connection.\n", 
+                       conf->target_name, n_chunks, conf->filename, total_bytes);
+                if (n_parity > 0) {
+                    printf("[Thread %s] Sent %d parity chunks\n", conf->target_name, n_parity);
+                }
+                if (n_dups > 0) {
+                    printf("[Thread %s] Sent %d end-game duplicates of chunks on slower paths\n",
+                           conf->target_name, n_dups);
+                }
+                if (use_zlib) {
+                    printf("[Thread %s] Compressed %lld chunks, %lld bytes on the wire so far\n",
+                           conf->target_name, zchunks, wire);
+                }
             }
-            total_bytes += n;
         }
 
-        printf("[Thread %s] Sent file '%s' (%lld bytes). Closing connection.\n", 
-               conf->target_name, conf->filename, total_bytes);
-
-        close(fd);
-        close(client_sock);
+        if (tune_file != NULL) tune_record(conf, n_open);
+        telem_close_sock(telem_p, &conf->tm, client_sock);
+        free(ranges);
+        // 標準入力やパイプは読み直せないので，1回送ったら終える
+        if (conf->queue != NULL && conf->queue->stream) break;
 
         /* 修正: すぐにフラグを下ろさず、少し待つか、あるいはこの実験では下ろさない */
         /* 連続実験を行わないなら、以下のブロックをコメントアウトするのが一番確実です */
@@ -153,45 +2185,372 @@ void* server_thread(void* arg) {
         }
     }
 
+    if (conf->udp_sock >= 0) close(conf->udp_sock);
+    for (k = 0; k < conf->n_streams; k++) {
+        free(conf->streams[k].par);
+        free(conf->streams[k].batch);
+        if (conf->streams[k].pipefd[0] >= 0) {
+            close(conf->streams[k].pipefd[0]);
+            close(conf->streams[k].pipefd[1]);
+        }
+    }
     close(serv_sock);
     return NULL;
 }
 
+// ===================================================================
+// 範囲表の読み込み (split.out -r の出力)
+// 各行 "パート番号 開始位置 長さ" を part_off[part], part_len[part] に入れる
+// ===================================================================
+#define MAX_PARTS 256
+
+int load_ranges(const char *rangefile, off_t *part_off, off_t *part_len) {
+    FILE *fp = fopen(rangefile, "r");
+    char line[256];
+    int n = 0;
+
+    if (!fp) {
+        perror("fopen range file");
+        return -1;
+    }
+    for (int i = 0; i < MAX_PARTS; i++) part_len[i] = -1;
+    while (fgets(line, sizeof(line), fp)) {
+        int part;
+        long long off, len;
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%d %lld %lld", &part, &off, &len) != 3) continue;
+        if (part < 0 || part >= MAX_PARTS || off < 0 || len < 0) continue;
+        part_off[part] = off;
+        part_len[part] = len;
+        n++;
+    }
+    fclose(fp);
+    return n;
+}
+
+// ===================================================================
+// ディレクトリの一覧 (-d)
+// ツリーをたどって通常ファイルとディレクトリを集め，パス順に並べて
+// 各ファイルの位置を決める。シンボリックリンクなどは送らない
+// ===================================================================
+static tree_t *walk_tree;       // nftw のコールバックに渡せないのでここに置く
+static size_t walk_skip;        // fpath のうち根の部分の長さ
+
+static int walk_entry(const char *fpath, const struct stat *sb, int flag, struct FTW *ftw) {
+    const char *rel = fpath + walk_skip;
+
+    if (ftw->level == 0) return 0;  // 根そのもの
+    if (flag == FTW_DNR || flag == FTW_NS) {
+        fprintf(stderr, "cannot read %s\n", fpath);
+        return -1;
+    }
+    if (flag == FTW_D || S_ISREG(sb->st_mode)) {
+        if (tree_add(walk_tree, rel, (uint64_t)sb->st_size, (uint32_t)sb->st_mode) < 0) {
+            perror(fpath);
+            return -1;
+        }
+    } else {
+        fprintf(stderr, "skipping %s (not a regular file or directory)\n", fpath);
+    }
+    return 0;
+}
+
+int tree_walk(const char *root, tree_t *t) {
+    char *r = strdup(root);
+    size_t n = strlen(r);
+    int rc;
+
+    if (r == NULL) return -1;
+    while (n > 1 && r[n - 1] == '/') r[--n] = '\0';    // "dir/" の末尾の / を除く
+    memset(t, 0, sizeof(*t));
+    walk_tree = t;
+    walk_skip = strcmp(r, "/") == 0 ? 1 : n + 1;
+    rc = nftw(r, walk_entry, 64, FTW_PHYS);
+    free(r);
+    if (rc != 0) {
+        if (rc < 0) perror(root);
+        tree_free(t);
+        return -1;
+    }
+    tree_layout(t);
+    return 0;
+}
+
+// 経路ごと・キューごとの計測値を登録する (-M)。値は既にあるカウンタを読む
+static void send_metrics(ServerConfig *configs, const int *use, const chunk_queue_t *shared) {
+    static const char calls[] = "System calls made to move data, by call.";
+    int i, shared_done = 0;
+
+    m_sendfile = metric_new("icslab2_send_syscalls_total", METRIC_COUNTER, calls, "call=\"sendfile\"");
+    m_splice = metric_new("icslab2_send_syscalls_total", METRIC_COUNTER, calls, "call=\"splice\"");
+    m_sendmmsg = metric_new("icslab2_send_syscalls_total", METRIC_COUNTER, calls, "call=\"sendmmsg\"");
+    m_pread = metric_new("icslab2_send_syscalls_total", METRIC_COUNTER, calls, "call=\"pread\"");
+    metric_watch_u64("icslab2_send_syscalls_total", METRIC_COUNTER, calls, &net_writes, "call=\"write\"");
+    metric_watch_u64("icslab2_send_syscalls_total", METRIC_COUNTER, calls, &net_reads, "call=\"read\"");
+    for (i = 0; i < n_paths; i++) {
+        ServerConfig *c = &configs[i];
+        chunk_queue_t *q = c->queue;
+        const char *label;
+
+        if (!use[i]) continue;
+        metric_watch_u64("icslab2_send_bytes_total", METRIC_COUNTER, "Payload bytes sent, by path.",
+                         &c->tm.bytes, "path=\"%s\"", c->target_name);
+        c->m_chunks = metric_new("icslab2_send_chunks_total", METRIC_COUNTER, "Chunks sent, by path.",
+                                 "path=\"%s\"", c->target_name);
+        if (q == NULL) continue;    // 帯域測定
+        metric_watch_u64("icslab2_send_queue_waits_total", METRIC_COUNTER,
+                         "Times a path found the chunk queue empty and waited.",
+                         &q->waits[c->path_id], "path=\"%s\"", c->target_name);
+        metric_scaled(metric_watch_u64("icslab2_send_queue_wait_seconds_total", METRIC_COUNTER,
+                                       "Time a path spent waiting on an empty chunk queue.",
+                                       &q->wait_ns[c->path_id], "path=\"%s\"", c->target_name), 1e-9);
+        // 全経路で分担するキューは1度だけ
+        if (q == shared && shared_done) continue;
+        if (q == shared) shared_done = 1;
+        label = q == shared ? "shared" : c->target_name;
+        metric_watch_int("icslab2_send_inflight_chunks", METRIC_GAUGE,
+                         "Chunks handed to a connection and not finished yet.",
+                         &q->inflight, "queue=\"%s\"", label);
+        metric_watch_u64("icslab2_send_done_bytes_total", METRIC_COUNTER, "Bytes whose chunks are finished.",
+                         &q->done_bytes, "queue=\"%s\"", label);
+        if (q->stream) {
+            metric_watch_int("icslab2_send_stream_buffered_chunks", METRIC_GAUGE,
+                             "Chunks read from the stream and not handed out yet.",
+                             &q->n_ready, "queue=\"%s\"", label);
+        }
+        if (endgame_bytes > 0) {
+            metric_watch_u64("icslab2_send_unacked_bytes", METRIC_GAUGE,
+                             "Bytes sent and not acknowledged by the receiver yet.",
+                             &q->out_bytes, "queue=\"%s\"", label);
+        }
+    }
+}
+
 // ===================================================================
 // サーバー起動関数
 // ===================================================================
-void start_multi_server(char **filenames) {
+// source が NULL なら経路ごとに別々のパートファイルを送る。
+// source を指定すると，その1ファイルを共有チャンクキューから全経路で分担する
+// (filenames は '0' 以外なら使う経路として扱う)。
+// さらに rangefile を指定すると，filenames をパート番号として読み，
+// 各経路は source のうち範囲表のそのパートの範囲だけを送る。
+// pack_file (-k) なら，filenames をパート番号としてパックの索引から範囲を引く。
+// tree_root (-d) なら，そのディレクトリのファイルを並べたものを source と同じように分担する
+void start_multi_server(char **filenames, const char *source, const char *rangefile) {
     
-    ServerConfig configs[NUM_TARGET_NODES];
-    pthread_t threads[NUM_TARGET_NODES];
-    
-    // Node3が持つ各インターフェースのIPアドレス
-    const char *local_ips[] = {"172.21.0.30", "172.24.0.30", "172.27.0.30", "172.28.0.30"};
-    const char *target_names[] = {"Node1", "Node2", "Node4", "Node5"};
+    ServerConfig configs[MAX_PATHS];
+    pthread_t threads[MAX_PATHS];
+    chunk_queue_t shared_queue;
+    tree_t tree;
+    pack_t pack;
+    off_t part_off[MAX_PARTS], part_len[MAX_PARTS];
+    int source_fd = -1;
+    int started[MAX_PATHS] = {0};
+    int use[MAX_PATHS] = {0};
+    telem_path_t *tm_paths[MAX_PATHS];
+    int n_tm = 0;
 
-    printf("\n--- Starting Multi-Interface File Server (Trigger: Node1) ---\n");
-    int i;
+    printf("\n--- Starting Multi-Interface File Server (Trigger: %s) ---\n", path_specs[0].name);
+    int i, k;
+
+    // 引数の順に並べたパートが元ファイルを構成するものとして，各パートの開始位置を求める
+    off_t offsets[MAX_PATHS];
+    off_t sizes[MAX_PATHS];
+    int fds[MAX_PATHS];
+    off_t total_size = 0;
+    for (i = 0; i < n_paths; i++) {
+        struct stat st;
+        offsets[i] = total_size;
+        sizes[i] = 0;
+        fds[i] = -1;
+        if (source != NULL || tree_root != NULL || pack_file != NULL || calib_seconds > 0 ||
+            strcmp(filenames[i], "0") == 0) continue;
+        if ((fds[i] = open(filenames[i], O_RDONLY)) < 0 || fstat(fds[i], &st) < 0) {
+            // 後のパートの位置がこのパートの長さで決まるので，欠けたまま送らない
+            fprintf(stderr, "open %s: ", filenames[i]);
+            perror("");
+            for (k = 0; k <= i; k++) {
+                if (fds[k] >= 0) close(fds[k]);
+            }
+            return;
+        }
+        sizes[i] = st.st_size;
+        total_size += st.st_size;
+    }
+
+    if (source != NULL && calib_seconds == 0) {
+        struct stat st;
+        int fd = strcmp(source, "-") == 0 ? STDIN_FILENO : open(source, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            fprintf(stderr, "open %s: ", source);
+            perror("");
+            return;
+        }
+        total_size = st.st_size;
+        source_fd = fd;
+        if (!S_ISREG(st.st_mode)) {
+            // 標準入力，パイプなど: 長さが分からないので読みながら切って配る
+            if (rangefile != NULL || fec_k > 0 || endgame_bytes > 0) {
+                fprintf(stderr, "%s is not a regular file: -r, -E and -G need one\n", source);
+                return;
+            }
+            if (chunk_queue_init_stream(&shared_queue, fd, stream_budget) < 0) {
+                perror("[Queue] set up stream");
+                return;
+            }
+            total_size = 0;
+            printf("Streaming '%s' in %zu-byte chunks across paths (buffering up to %d chunks)\n",
+                   source, chunk_len, shared_queue.n_slots);
+        } else if (rangefile == NULL) {
+            chunk_queue_init(&shared_queue, fd, 0, 0, (uint64_t)st.st_size);
+            printf("Sharing '%s' (%lld bytes) in %zu-byte chunks across paths\n",
+                   source, (long long)total_size, chunk_len);
+            if (shared_queue.fec_k > 0) {
+                printf("Adding %d Reed-Solomon parity chunks to every %d chunks\n", fec_m, fec_k);
+            }
+            if (endgame_bytes > 0) {
+                printf("End-game: duplicating unacknowledged chunks on idle faster paths below %llu MiB\n",
+                       (unsigned long long)(endgame_bytes >> 20));
+            }
+        } else if (load_ranges(rangefile, part_off, part_len) <= 0) {
+            fprintf(stderr, "no ranges in %s\n", rangefile);
+            close(fd);
+            return;
+        }
+    }
+
+    if (pack_file != NULL && calib_seconds == 0) {
+        if (pack_open(pack_file, &pack) < 0) {
+            fprintf(stderr, "open %s: %s\n", pack_file,
+                    errno == EINVAL ? "not a pack file (split.out -p) or a damaged index" : strerror(errno));
+            return;
+        }
+        total_size = (off_t)pack.total;
+        printf("Serving parts of '%s' (%u parts, %lld bytes)\n", pack_file, pack.n_parts, (long long)total_size);
+    }
+
+    if (tree_root != NULL && calib_seconds == 0) {
+        int root_fd;
+        if (tree_walk(tree_root, &tree) < 0) return;
+        if ((root_fd = open(tree_root, O_RDONLY | O_DIRECTORY)) < 0) {
+            perror(tree_root);
+            tree_free(&tree);
+            return;
+        }
+        total_size = (off_t)tree.total;
+        chunk_queue_init(&shared_queue, -1, 0, 0, tree.total);
+        shared_queue.tree = &tree;
+        shared_queue.tree_fd = root_fd;
+        printf("Sharing directory '%s' (%d files, %d directories, %lld bytes) in %zu-byte chunks across paths\n",
+               tree_root, tree.n_files, tree.n_dirs, (long long)total_size, chunk_len);
+        if (endgame_bytes > 0) {
+            printf("End-game: duplicating unacknowledged chunks on idle faster paths below %llu MiB\n",
+                   (unsigned long long)(endgame_bytes >> 20));
+        }
+    }
 
-    for (i = 0; i < NUM_TARGET_NODES; i++) {
+    for (i = 0; i < n_paths; i++) {
         char *filename = filenames[i];
         
         if (strcmp(filename, "0") == 0) {
-            printf("Skipping server for %s (file is '0')\n", target_names[i]);
+            printf("Skipping server for %s (file is '0')\n", path_specs[i].name);
             continue;
         }
 
-        strncpy(configs[i].local_ip, local_ips[i], 15);
-        strncpy(configs[i].target_name, target_names[i], 15);
-        strncpy(configs[i].filename, filename, 255);
-        configs[i].port = TCP_SERVER_PORT; // 10000
+        snprintf(configs[i].local_ip, sizeof(configs[i].local_ip), "%.15s", path_specs[i].ip);
+        snprintf(configs[i].target_name, sizeof(configs[i].target_name), "%.15s", path_specs[i].name);
+        strncpy(configs[i].filename, source != NULL ? source : tree_root != NULL ? tree_root :
+                pack_file != NULL ? pack_file : filename, 255);
+        configs[i].port = path_specs[i].port; // 既定は10000
+        configs[i].path_id = i;
+        memset(&configs[i].tm, 0, sizeof(configs[i].tm));
+        snprintf(configs[i].tm.name, sizeof(configs[i].tm.name), "%.15s", path_specs[i].name);
+        configs[i].tm.sock = -1;
+        configs[i].file_id = 0;
+        configs[i].base_offset = offsets[i];
+        configs[i].total_size = total_size;
+        configs[i].n_streams = path_specs[i].streams > 0 ? path_specs[i].streams : default_streams;
+        configs[i].udp = path_specs[i].udp;
+        configs[i].udp_sock = -1;
+        if (configs[i].udp) configs[i].n_streams = 1;  // レートは送信側で決めるので1本で足りる
+        configs[i].have_prof = 0;
+        if (tune_file != NULL) {
+            tune_profile_t *p = tune_find(&tune_db, path_specs[i].name);
+            if (p != NULL) {
+                char desc[256];
+                configs[i].prof = *p;
+                configs[i].have_prof = 1;
+                tune_describe(p, desc, sizeof(desc));
+                printf("%s: %s\n", path_specs[i].name, desc);
+            }
+        }
+        // UDP経路の最初のレートは前回までに測った帯域 (無ければ -U)
+        configs[i].udp_rate = (configs[i].have_prof ? configs[i].prof.bw_mbps : udp_rate_mbps) * 1e6 / 8;
+        memset(configs[i].streams, 0, sizeof(configs[i].streams));
+        for (k = 0; k < MAX_STREAMS; k++) {
+            configs[i].streams[k].conf = &configs[i];
+            configs[i].streams[k].sock = -1;
+            configs[i].streams[k].pipefd[0] = -1;
+            configs[i].streams[k].pipefd[1] = -1;
+        }
+        if (calib_seconds > 0) {
+            configs[i].queue = NULL;
+        } else if (source != NULL && rangefile != NULL) {
+            // 元ファイルの該当範囲をそのまま送る (パートファイルは作らない)
+            int part = atoi(filename);
+            if (part < 0 || part >= MAX_PARTS || part_len[part] < 0 ||
+                part_off[part] + part_len[part] > total_size) {
+                fprintf(stderr, "Skipping server for %s (no valid range for part '%s')\n",
+                        path_specs[i].name, filename);
+                continue;
+            }
+            chunk_queue_init(&configs[i].own_queue, source_fd, part_off[part],
+                             (uint64_t)part_off[part], (uint64_t)part_len[part]);
+            configs[i].queue = &configs[i].own_queue;
+            printf("%s sends part %d: offset %lld, %lld bytes\n", path_specs[i].name, part,
+                   (long long)part_off[part], (long long)part_len[part]);
+        } else if (pack_file != NULL) {
+            // パックの中のパートを送る。索引をパート番号で直接引き，
+            // 元ファイル内の位置に届くようにする
+            const pack_entry_t *e = pack_part(&pack, atol(filename));
+            if (e == NULL) {
+                fprintf(stderr, "Skipping server for %s (no part '%s' in %s)\n",
+                        path_specs[i].name, filename, pack_file);
+                continue;
+            }
+            chunk_queue_init(&configs[i].own_queue, pack.fd, (off_t)e->pack_off, e->src_off, e->len);
+            configs[i].queue = &configs[i].own_queue;
+            printf("%s sends part %u: offset %llu, %llu bytes (CRC32C %08x)\n", path_specs[i].name, e->part,
+                   (unsigned long long)e->src_off, (unsigned long long)e->len, e->crc);
+        } else if (source != NULL || tree_root != NULL) {
+            configs[i].queue = &shared_queue;
+        } else {
+            chunk_queue_init(&configs[i].own_queue, fds[i], 0, (uint64_t)offsets[i], (uint64_t)sizes[i]);
+            configs[i].queue = &configs[i].own_queue;
+        }
+
+        tm_paths[n_tm++] = &configs[i].tm;
+        use[i] = 1;
+    }
+
+    // 時系列計測は経路の設定が揃ってから始める
+    if (telem_file != NULL && telem_start(&telem, telem_file, telem_interval, tm_paths, n_tm) == 0) {
+        telem_p = &telem;
+    }
+
+    if (metrics_spec != NULL) send_metrics(configs, use, &shared_queue);
 
+    for (i = 0; i < n_paths; i++) {
+        if (!use[i]) continue;
         if (pthread_create(&threads[i], NULL, server_thread, &configs[i]) != 0) {
             perror("pthread_create failed");
+        } else {
+            started[i] = 1;
         }
     }
 
-    for (i = 0; i < NUM_TARGET_NODES; i++) {
-        if (strcmp(filenames[i], "0") != 0) {
+    for (i = 0; i < n_paths; i++) {
+        if (started[i]) {
             pthread_join(threads[i], NULL);
         }
     }
@@ -202,13 +2561,177 @@ void start_multi_server(char **filenames) {
 // ===================================================================
 int main(int argc, char** argv)
 {
-    if (argc < 5) {
-        printf("Usage: %s [file_for_node1] [file_for_node2] [file_for_node4] [file_for_node5]\n", argv[0]);
-        printf("Use '0' to skip a node.\n");
+    int opt;
+    char *source = NULL;
+    char *rangefile = NULL;
+    int custom_paths = 0;
+
+    while ((opt = getopt(argc, argv, "p:m:s:r:c:C:T:i:zP:t:U:E:G:d:B:M:k:")) != -1) {
+        switch (opt) {
+        case 't':
+            tune_file = optarg;
+            if (tune_load(&tune_db, tune_file) < 0) {
+                perror(tune_file);
+                return 1;
+            }
+            break;
+        case 'E':
+            // "k+m" (k データチャンクごとに m 個のパリティ)
+            if (sscanf(optarg, "%d+%d", &fec_k, &fec_m) != 2 ||
+                fec_k < 1 || fec_k > RS_MAX_K || fec_m < 1 || fec_m > RS_MAX_M) {
+                fprintf(stderr, "invalid parity spec: %s (expected k+m, k <= %d, m <= %d)\n",
+                        optarg, RS_MAX_K, RS_MAX_M);
+                return 1;
+            }
+            break;
+        case 'G':
+            // 確認待ちがこの量 (MiB) 以下になったら終盤の重複送信を始める
+            endgame_bytes = strtoull(optarg, NULL, 0) << 20;
+            if (endgame_bytes == 0) {
+                fprintf(stderr, "invalid end-game threshold: %s (MiB, > 0)\n", optarg);
+                return 1;
+            }
+            break;
+        case 'B':
+            // ストリームを読み溜めておく上限 (MiB)
+            stream_budget = strtoull(optarg, NULL, 0) << 20;
+            if (stream_budget == 0) {
+                fprintf(stderr, "invalid stream buffer: %s (MiB, > 0)\n", optarg);
+                return 1;
+            }
+            break;
+        case 'U':
+            udp_rate_mbps = atof(optarg);
+            if (udp_rate_mbps <= 0) {
+                fprintf(stderr, "invalid UDP rate: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'P':
+            default_streams = atoi(optarg);
+            if (default_streams <= 0 || default_streams > MAX_STREAMS) {
+                fprintf(stderr, "invalid stream count: %s (1..%d)\n", optarg, MAX_STREAMS);
+                return 1;
+            }
+            break;
+        case 'z':
+            use_zlib = 1;
+            break;
+        case 'p':
+            // 最初の -p で既定の経路表を捨てて，指定された順に並べる
+            if (!custom_paths) {
+                n_paths = 0;
+                custom_paths = 1;
+            }
+            if (n_paths >= MAX_PATHS || parse_path_spec(optarg, &path_specs[n_paths]) < 0) {
+                fprintf(stderr, "invalid path: %s (expected [name=]ip[:port][/streams|/udp])\n", optarg);
+                return 1;
+            }
+            n_paths++;
+            break;
+        case 'T':
+            telem_file = optarg;
+            break;
+        case 'M':
+            metrics_spec = optarg;
+            net_count_io = 1;   // 接続の最初から数える
+            break;
+        case 'i':
+            telem_interval = atoi(optarg);
+            break;
+        case 'r':
+            rangefile = optarg;
+            break;
+        case 'C':
+            calib_seconds = atoi(optarg);
+            if (calib_seconds <= 0) calib_seconds = CALIB_SECONDS;
+            break;
+        case 's':
+            source = optarg;
+            break;
+        case 'd':
+            tree_root = optarg;
+            break;
+        case 'k':
+            pack_file = optarg;
+            break;
+        case 'c':
+            chunk_len = (size_t)strtoull(optarg, NULL, 0);
+            if (chunk_len == 0 || chunk_len > 0x40000000) {
+                fprintf(stderr, "invalid chunk size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'm':
+            if (strcmp(optarg, "copy") == 0) send_mode = SEND_COPY;
+            else if (strcmp(optarg, "sendfile") == 0) send_mode = SEND_SENDFILE;
+            else if (strcmp(optarg, "splice") == 0) send_mode = SEND_SPLICE;
+            else {
+                fprintf(stderr, "unknown mode: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            return 1;
+        }
+    }
+
+    if (argc - optind < n_paths) {
+        printf("Usage: %s [-m copy|sendfile|splice] [file_for_node1] [file_for_node2] [file_for_node4] [file_for_node5]\n", argv[0]);
+        printf("       %s [-m mode] [-c chunk_bytes] -s source_file [node1] [node2] [node4] [node5]\n", argv[0]);
+        printf("       %s [-c chunk_bytes] [-B mib] -s - [node1] [node2] [node4] [node5]   (stdin or a pipe)\n", argv[0]);
+        printf("       %s [-m mode] [-c chunk_bytes] -s source_file -r range_file [part_for_node1] ... [part_for_node5]\n", argv[0]);
+        printf("       %s [-m mode] [-c chunk_bytes] -k pack_file [part_for_node1] ... [part_for_node5]   (split.out -p)\n", argv[0]);
+        printf("       %s [-m mode] [-c chunk_bytes] -d directory [node1] [node2] [node4] [node5]   (receiver -d)\n", argv[0]);
+        printf("       %s -C seconds [node1] [node2] [node4] [node5]   (bandwidth probe)\n", argv[0]);
+        printf("Common options: -T telemetry.csv [-i interval_ms]  per-path throughput and TCP_INFO samples\n");
+        printf("                -z  compress chunks per path when the link, not the CPU, is the limit\n");
+        printf("                -p [name=]ip[:port][/streams|/udp] (repeatable) replaces the default Node1..Node5 paths;\n");
+        printf("                   give one positional argument per -p path, the first path triggers the start;\n");
+        printf("                   /udp sends the data as paced UDP datagrams, keeping TCP for control\n");
+        printf("                -U mbps  first sending rate of /udp paths without a profile (default 100)\n");
+        printf("                -P streams  parallel TCP connections per path (default 1, /streams overrides)\n");
+        printf("                -E k+m  with -s (no -r): add m Reed-Solomon parity chunks to every k chunks,\n");
+        printf("                   so the receiver can finish without a stalled path's chunks\n");
+        printf("                -G mib  with -s (no -r) or -d: the receiver acknowledges every chunk, and once no more\n");
+        printf("                   than mib MiB are unacknowledged, idle paths also send chunks a slower path holds\n");
+        printf("                -B mib  with -s - or a pipe: read ahead at most mib MiB of the stream (default 64)\n");
+        printf("                -t profile  size socket buffers from each path's measured RTT and bandwidth,\n");
+        printf("                   and update the per-path profile after every transfer\n");
+        printf("                -M [host:]port|unix:path  serve live counters in Prometheus text format over HTTP\n");
+        printf("Use '0' to skip a node. With -s, -d or -C, any other value enables the node.\n");
+        return 1;
+    }
+
+    if (rangefile != NULL && source == NULL) {
+        fprintf(stderr, "-r requires -s source_file\n");
+        return 1;
+    }
+    if (tree_root != NULL && source != NULL) {
+        fprintf(stderr, "-d and -s cannot be combined\n");
+        return 1;
+    }
+    if (pack_file != NULL && (source != NULL || tree_root != NULL)) {
+        fprintf(stderr, "-k cannot be combined with -s or -d\n");
+        return 1;
+    }
+    if (fec_k > 0 && (source == NULL || rangefile != NULL)) {
+        // パリティは全経路で分担するキューに混ぜて配る。-r は範囲ごとに経路が
+        // 決まっているので，範囲から作ったパリティも同じ経路を通ってしまい，
+        // その経路が止まったときに欠けを埋められない
+        fprintf(stderr, "-E requires -s source_file without -r\n");
+        return 1;
+    }
+    if (endgame_bytes > 0 && ((source == NULL && tree_root == NULL) || rangefile != NULL)) {
+        // 重ねて配るのは全経路で分担するキューのチャンク
+        fprintf(stderr, "-G requires -s source_file without -r, or -d directory\n");
         return 1;
     }
+    // 受信側は揃ったら遅い経路の接続を止めるので，切れた接続への書き込みで終わらない
+    signal(SIGPIPE, SIG_IGN);
+    if (metrics_spec != NULL && metrics_serve(metrics_spec) < 0) return 1;
 
-    start_multi_server(&argv[1]);
+    start_multi_server(&argv[optind], source, rangefile);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -4,84 +4,613 @@
 /*                                                                  */
 /*  VERSION      :                                                  */
 /*  DATE         :  Sep 01, 2020                                    */
-/*  UPDATE       :                                                  */
+/*  UPDATE       :  epollによる複数セッション中継，splice転送      */
 /*                                                                  */
 
+#define _GNU_SOURCE                 /* splice, accept4, F_SETPIPE_SZ用 */
 #include "icslab2_net.h"
+#include "icslab2_tune.h"
+#include "icslab2_metrics.h"
+#include <signal.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#define MAX_EVENTS      64
+#define RELAY_PIPE_SZ   (1024 * 1024)   /* 1方向あたりのパイプ容量 */
+
+/* 中継の1方向分 (src -> パイプ -> dst) */
+typedef struct {
+    int pipefd[2];
+    size_t pipe_cap;        /* パイプの容量 */
+    size_t in_pipe;         /* パイプに溜まっているバイト数 */
+    int eof;                /* srcからEOFを受け取った */
+    int done;               /* dstへ書き切ってshutdown済み */
+} relay_dir_t;
+
+typedef struct session session_t;
+
+/* epollに登録する端点 (クライアント側 / サーバ側) */
+typedef struct {
+    session_t *s;
+    int fd;
+    int side;               /* 0: クライアント, 1: サーバ(上流) */
+    uint32_t events;        /* 現在epollに登録しているイベント */
+    int hup;                /* 相手が完全に切断した (EPOLLHUP) */
+    int unwatched;          /* hup のあと epoll から外している */
+} endpoint_t;
+
+struct session {
+    endpoint_t ep[2];
+    relay_dir_t dir[2];     /* dir[i]: ep[i] -> ep[1 - i] */
+    int connecting;         /* 上流へのconnect完了待ち */
+    int closed;
+    session_t *next_free;   /* 解放待ちリスト */
+};
+
+static int epfd;
+static session_t *free_list;    /* epoll_waitの1周が終わってから解放するセッション */
+static const tune_profile_t *relay_prof;  /* 中継する経路の調整値 (-t, なければNULL) */
+
+/* 動作中の計測値 (-M)。出していなければ NULL で，数えない              */
+/* 向きはデータの流れで数える: dir[0] (下流 -> 上流) が up，dir[1] が down */
+static const char *const dir_label[2] = { "up", "down" };
+static metric_t *m_sessions, *m_sessions_total, *m_udp_flows;
+static metric_t *m_bytes[2], *m_buffered[2], *m_dgrams[2];
+static metric_t *m_splice, *m_recvmmsg, *m_sendmmsg, *m_epoll_wait;
+
+static void relay_metrics(void)
+{
+    static const char calls[] = "System calls made by the relay loop, by call.";
+    int i;
+
+    m_sessions = metric_new("icslab2_relay_sessions", METRIC_GAUGE, "TCP sessions being relayed.", NULL);
+    m_sessions_total = metric_new("icslab2_relay_sessions_total", METRIC_COUNTER, "TCP sessions accepted.", NULL);
+    m_udp_flows = metric_new("icslab2_relay_udp_flows", METRIC_GAUGE, "UDP flows being relayed.", NULL);
+    for (i = 0; i < 2; i++) {
+        m_bytes[i] = metric_new("icslab2_relay_bytes_total", METRIC_COUNTER,
+                                "TCP bytes written to the far side, by direction.", "dir=\"%s\"", dir_label[i]);
+        m_buffered[i] = metric_new("icslab2_relay_buffered_bytes", METRIC_GAUGE,
+                                   "TCP bytes held in relay pipes, by direction.", "dir=\"%s\"", dir_label[i]);
+        m_dgrams[i] = metric_new("icslab2_relay_udp_datagrams_total", METRIC_COUNTER,
+                                 "UDP datagrams forwarded, by direction.", "dir=\"%s\"", dir_label[i]);
+    }
+    m_splice = metric_new("icslab2_relay_syscalls_total", METRIC_COUNTER, calls, "call=\"splice\"");
+    m_recvmmsg = metric_new("icslab2_relay_syscalls_total", METRIC_COUNTER, calls, "call=\"recvmmsg\"");
+    m_sendmmsg = metric_new("icslab2_relay_syscalls_total", METRIC_COUNTER, calls, "call=\"sendmmsg\"");
+    m_epoll_wait = metric_new("icslab2_relay_syscalls_total", METRIC_COUNTER, calls, "call=\"epoll_wait\"");
+}
+
+static int relay_dir_init(relay_dir_t *d)
+{
+    int sz;
+
+    memset(d, 0, sizeof(*d));
+    if (pipe2(d->pipefd, O_NONBLOCK) < 0) {
+        perror("pipe2");
+        return -1;
+    }
+    fcntl(d->pipefd[1], F_SETPIPE_SZ, RELAY_PIPE_SZ);   /* 失敗しても既定サイズで動く */
+    sz = fcntl(d->pipefd[1], F_GETPIPE_SZ);
+    d->pipe_cap = sz > 0 ? (size_t)sz : 65536;
+    return 0;
+}
+
+static void session_close(session_t *s)
+{
+    int i;
+
+    if (s->closed) return;
+    s->closed = 1;
+    for (i = 0; i < 2; i++) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, s->ep[i].fd, NULL);
+        close(s->ep[i].fd);
+        close(s->dir[i].pipefd[0]);
+        close(s->dir[i].pipefd[1]);
+        metric_add(m_buffered[i], -(int64_t)s->dir[i].in_pipe);    /* 届けずに捨てた分 */
+    }
+    metric_add(m_sessions, -1);
+    s->next_free = free_list;
+    free_list = s;
+    printf("closed\n");
+}
+
+/* 1方向分の転送: 読めるだけパイプへ入れ，書けるだけパイプから出す */
+/* 戻り値: 0 = 継続, -1 = セッションを閉じる */
+static int relay_pump(session_t *s, int i)
+{
+    relay_dir_t *d = &s->dir[i];
+    int src = s->ep[i].fd;
+    int dst = s->ep[1 - i].fd;
+    ssize_t n;
+
+    for (;;) {
+        int progress = 0;
+
+        /* src -> パイプ (パイプに空きがある間だけ読む = 背圧) */
+        if (!d->eof && d->in_pipe < d->pipe_cap) {
+            n = splice(src, NULL, d->pipefd[1], NULL, d->pipe_cap - d->in_pipe,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            metric_add(m_splice, 1);
+            if (n > 0) {
+                d->in_pipe += (size_t)n;
+                metric_add(m_buffered[i], n);
+                progress = 1;
+            } else if (n == 0) {
+                d->eof = 1;
+            } else if (errno != EAGAIN && errno != EINTR) {
+                return -1;
+            }
+        }
+
+        /* パイプ -> dst (上流のconnect完了前は書かない) */
+        if (d->in_pipe > 0 && !s->connecting) {
+            n = splice(d->pipefd[0], NULL, dst, NULL, d->in_pipe,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            metric_add(m_splice, 1);
+            if (n > 0) {
+                d->in_pipe -= (size_t)n;
+                metric_add(m_buffered[i], -n);
+                metric_add(m_bytes[i], n);
+                progress = 1;
+            } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                return -1;
+            }
+        }
+
+        if (!progress) break;
+    }
+
+    /* EOFを受け取り，パイプも空になったら相手側へ送信終了を伝える */
+    if (d->eof && d->in_pipe == 0 && !d->done && !s->connecting) {
+        shutdown(dst, SHUT_WR);
+        d->done = 1;
+    }
+    return 0;
+}
+
+/* 各端点の監視イベントを状態に合わせて更新する */
+static void session_update_events(session_t *s)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        endpoint_t *ep = &s->ep[i];
+        relay_dir_t *out = &s->dir[i];          /* この端点から読む方向 */
+        relay_dir_t *in = &s->dir[1 - i];       /* この端点へ書く方向 */
+        uint32_t ev = 0;
+
+        if (!out->eof && out->in_pipe < out->pipe_cap) ev |= EPOLLIN;
+        if (in->in_pipe > 0 || (i == 1 && s->connecting)) ev |= EPOLLOUT;
+
+        if (ep->hup) {
+            /* 切断した相手へは書かない。EPOLLHUP は登録している間届き続けるので */
+            /* 読み残しをパイプに入れられるときだけ登録する                       */
+            ev &= EPOLLIN;
+            if (ev == 0) {
+                if (!ep->unwatched) epoll_ctl(epfd, EPOLL_CTL_DEL, ep->fd, NULL);
+                ep->unwatched = 1;
+                continue;
+            }
+        }
+        if (ev != ep->events || ep->unwatched) {
+            struct epoll_event e;
+            memset(&e, 0, sizeof(e));
+            e.events = ev;
+            e.data.ptr = ep;
+            epoll_ctl(epfd, ep->unwatched ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, ep->fd, &e);
+            ep->events = ev;
+            ep->unwatched = 0;
+        }
+    }
+}
+
+static void session_handle(endpoint_t *ep, uint32_t events)
+{
+    session_t *s = ep->s;
+
+    if (s->closed) return;
+
+    if (ep->side == 1 && s->connecting && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(ep->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            errno = err;
+            perror("connect");
+            session_close(s);
+            return;
+        }
+        s->connecting = 0;
+    }
+
+    if (relay_pump(s, 0) < 0 || relay_pump(s, 1) < 0) {
+        session_close(s);
+        return;
+    }
+    if (s->dir[0].done && s->dir[1].done) {
+        session_close(s);
+        return;
+    }
+    if ((events & EPOLLERR) && !s->connecting) {
+        session_close(s);
+        return;
+    }
+    /* 相手が完全に切断し，そこから読んだものも届け終えていれば中継を終える。 */
+    /* パイプに残っていれば，遅い反対側へ流し終えるまで続ける                   */
+    if ((events & EPOLLHUP) && !s->connecting) {
+        ep->hup = 1;
+        if (s->dir[ep->side].eof && s->dir[ep->side].in_pipe == 0) {
+            session_close(s);
+            return;
+        }
+    }
+    session_update_events(s);
+}
+
+/* 受け付けた接続に対して上流への接続を開始し，セッションを作る */
+static session_t *session_open(int sock, struct addrinfo *upstream)
+{
+    session_t *s;
+    int socks, i;
+    struct epoll_event e;
+
+    socks = socket(upstream->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (socks < 0) {
+        perror("socket");
+        return NULL;
+    }
+    /* 中継ノードは上流から受け取り，下流へ送る */
+    if (relay_prof != NULL) {
+        tune_apply(socks, relay_prof, TUNE_RECV);
+        tune_apply(sock, relay_prof, TUNE_SEND);
+    }
+    if (connect(socks, upstream->ai_addr, upstream->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        perror("connect");
+        close(socks);
+        return NULL;
+    }
+
+    s = calloc(1, sizeof(session_t));
+    if (!s) {
+        perror("calloc");
+        close(socks);
+        return NULL;
+    }
+    if (relay_dir_init(&s->dir[0]) < 0) {
+        free(s);
+        close(socks);
+        return NULL;
+    }
+    if (relay_dir_init(&s->dir[1]) < 0) {
+        close(s->dir[0].pipefd[0]);
+        close(s->dir[0].pipefd[1]);
+        free(s);
+        close(socks);
+        return NULL;
+    }
+    s->connecting = 1;
+    s->ep[0].fd = sock;
+    s->ep[1].fd = socks;
+    for (i = 0; i < 2; i++) {
+        s->ep[i].s = s;
+        s->ep[i].side = i;
+        s->ep[i].events = (i == 0) ? EPOLLIN : EPOLLIN | EPOLLOUT;
+        memset(&e, 0, sizeof(e));
+        e.events = s->ep[i].events;
+        e.data.ptr = &s->ep[i];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, s->ep[i].fd, &e);
+    }
+    metric_add(m_sessions, 1);
+    metric_add(m_sessions_total, 1);
+    return s;
+}
+
+/* ---- UDPの中継 (-u) ----                                                */
+/* send.out の /udp 経路のデータグラムを中継する。受信側から最初に届いた   */
+/* データグラム (HELLO) ごとに上流へconnectしたソケットを作り (フロー)，    */
+/* 上流から届いたものをその受信側へ返す。どちらの向きも recvmmsg で        */
+/* まとめて受け，上流から来た大量のデータは sendmmsg でまとめて送る        */
+#define MAX_UDP_FLOWS   256
+#define UDP_FLOW_IDLE   60              /* 秒: この間何も流れなければフローを捨てる */
+#define UDP_RELAY_BATCH 64              /* 1回のrecvmmsg/sendmmsgで扱うデータグラム数 */
+#define UDP_RELAY_DGRAM 2048            /* データグラム1つの最大長 (MTU 1500 の経路を想定) */
+#define UDP_RELAY_RCVBUF (8 * 1024 * 1024)
+
+typedef struct {
+    int used;
+    struct sockaddr_in client;  /* 受信側 (下流) のアドレス */
+    int sock;                   /* 上流 (送信側) へconnectしたソケット */
+    time_t last;                /* 最後に中継した時刻 */
+} udp_flow_t;
+
+static int udp_sock = -1;               /* 下流からのデータグラムを待ち受けるソケット */
+static int udp_listen_tag;              /* epoll上で udp_sock を表す印 */
+static udp_flow_t udp_flows[MAX_UDP_FLOWS];
+static unsigned char udp_bufs[UDP_RELAY_BATCH][UDP_RELAY_DGRAM];
+
+static int udp_is_flow(const void *p)
+{
+    return p >= (const void *)udp_flows && p < (const void *)(udp_flows + MAX_UDP_FLOWS);
+}
+
+static void udp_setbuf(int sock)
+{
+    int size = UDP_RELAY_RCVBUF;
+
+    if (relay_prof != NULL && tune_bufsize(relay_prof) > size) size = tune_bufsize(relay_prof);
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0) {
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+}
+
+static udp_flow_t *udp_flow_open(const struct sockaddr_in *client, struct addrinfo *upstream)
+{
+    udp_flow_t *f = NULL;
+    struct epoll_event e;
+    int i;
+
+    for (i = 0; i < MAX_UDP_FLOWS; i++) {
+        if (!udp_flows[i].used) {
+            f = &udp_flows[i];
+            break;
+        }
+    }
+    if (f == NULL) {
+        fprintf(stderr, "too many UDP flows\n");
+        return NULL;
+    }
+    f->sock = socket(upstream->ai_family, SOCK_DGRAM, 0);
+    if (f->sock < 0) {
+        perror("socket");
+        return NULL;
+    }
+    if (connect(f->sock, upstream->ai_addr, upstream->ai_addrlen) < 0) {
+        perror("connect");
+        close(f->sock);
+        return NULL;
+    }
+    udp_setbuf(f->sock);
+    memset(&e, 0, sizeof(e));
+    e.events = EPOLLIN;
+    e.data.ptr = f;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, f->sock, &e) < 0) {
+        perror("epoll_ctl");
+        close(f->sock);
+        return NULL;
+    }
+    f->used = 1;
+    metric_add(m_udp_flows, 1);
+    f->client = *client;
+    f->last = time(NULL);
+    printf("UDP flow: %s:%d\n", inet_ntoa(client->sin_addr), ntohs(client->sin_port));
+    return f;
+}
+
+/* 下流 -> 上流 (HELLOなど少量) */
+static void udp_relay_up(struct addrinfo *upstream)
+{
+    struct mmsghdr msgs[UDP_RELAY_BATCH];
+    struct iovec iov[UDP_RELAY_BATCH];
+    struct sockaddr_in from[UDP_RELAY_BATCH];
+    int n, i, k;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < UDP_RELAY_BATCH; i++) {
+        iov[i].iov_base = udp_bufs[i];
+        iov[i].iov_len = UDP_RELAY_DGRAM;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &from[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+    }
+    n = recvmmsg(udp_sock, msgs, UDP_RELAY_BATCH, MSG_DONTWAIT, NULL);
+    metric_add(m_recvmmsg, 1);
+    for (i = 0; i < n; i++) {
+        udp_flow_t *f = NULL;
+        for (k = 0; k < MAX_UDP_FLOWS; k++) {
+            if (udp_flows[k].used && udp_flows[k].client.sin_addr.s_addr == from[i].sin_addr.s_addr &&
+                udp_flows[k].client.sin_port == from[i].sin_port) {
+                f = &udp_flows[k];
+                break;
+            }
+        }
+        if (f == NULL && (f = udp_flow_open(&from[i], upstream)) == NULL) continue;
+        f->last = time(NULL);
+        if (send(f->sock, udp_bufs[i], msgs[i].msg_len, 0) < 0) {
+            if (errno != ECONNREFUSED) perror("send");
+        } else {
+            metric_add(m_dgrams[0], 1);
+        }
+    }
+}
+
+/* 上流 -> 下流 (データ) */
+static void udp_relay_down(udp_flow_t *f)
+{
+    struct mmsghdr msgs[UDP_RELAY_BATCH];
+    struct iovec iov[UDP_RELAY_BATCH];
+    int n, i, sent, round;
+
+    for (round = 0; round < 16; round++) {
+        memset(msgs, 0, sizeof(msgs));
+        for (i = 0; i < UDP_RELAY_BATCH; i++) {
+            iov[i].iov_base = udp_bufs[i];
+            iov[i].iov_len = UDP_RELAY_DGRAM;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        n = recvmmsg(f->sock, msgs, UDP_RELAY_BATCH, MSG_DONTWAIT, NULL);
+        metric_add(m_recvmmsg, 1);
+        if (n <= 0) break;
+        /* 受け取った長さのまま，宛先を受信側にして送り直す */
+        for (i = 0; i < n; i++) {
+            iov[i].iov_len = msgs[i].msg_len;
+            msgs[i].msg_hdr.msg_name = &f->client;
+            msgs[i].msg_hdr.msg_namelen = sizeof(f->client);
+        }
+        for (sent = 0; sent < n; ) {
+            int r = sendmmsg(udp_sock, msgs + sent, n - sent, 0);
+            metric_add(m_sendmmsg, 1);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                if (errno != ENOBUFS) perror("sendmmsg");
+                break;  /* 捨てた分は受信側のNACKで再送される */
+            }
+            sent += r;
+            metric_add(m_dgrams[1], r);
+        }
+        f->last = time(NULL);
+        if (n < UDP_RELAY_BATCH) break;
+    }
+}
+
+/* しばらく何も流れていないフローを閉じる */
+static void udp_flow_expire(void)
+{
+    time_t now = time(NULL);
+    int i;
+
+    for (i = 0; i < MAX_UDP_FLOWS; i++) {
+        if (udp_flows[i].used && now - udp_flows[i].last > UDP_FLOW_IDLE) {
+            close(udp_flows[i].sock);   /* epollからも外れる */
+            udp_flows[i].used = 0;
+            metric_add(m_udp_flows, -1);
+        }
+    }
+}
 
 int
 main(int argc, char** argv)
 {
     char *server_ipaddr_str = "127.0.0.1";      /* サーバIPアドレス（文字列） */
-    unsigned int port = TCP_SERVER_PORT;        /* ポート番号 */
-    char* port_num_str = TCP_SERVER_PORT_STR;
+    char *port_num_str = TCP_SERVER_PORT_STR;   /* ポート番号（文字列） */
+    char *listen_str = NULL;                    /* 待ち受けアドレス "[addr:]port" (-l) */
+    char *tune_file = NULL;                     /* 調整プロファイル (-t) */
+    char *tune_name = NULL;                     /* プロファイル中の経路名 (-n) */
+    char *metrics_spec = NULL;                  /* 計測値を出すアドレス (-M) */
+    int use_udp = 0;                            /* UDPのデータグラムも中継する (-u) */
+    static tune_db_t tune_db;
+    in_addr_t listen_ip = htonl(INADDR_ANY);
+    int listen_port = TCP_SERVER_PORT;
+    int opt;
 
-    int     socks;                   /* ソケットディスクリプタ */
     int     sock0;                  /* 待ち受け用ソケットディスクリプタ */
     int     sock;                   /* ソケットディスクリプタ */
-    struct sockaddr_in  myAddr; /* 自分用アドレス構造体 */
+    struct sockaddr_in  myAddr;     /* 自分用アドレス構造体 */
     struct sockaddr_in  clientAddr; /* クライアント用アドレス構造体 */
-    struct sockaddr_in serverAddr;  /* サーバ＝相手用のアドレス構造体 */
-    int     addrLen;                /* clientAddrのサイズ */
+    socklen_t addrLen;              /* clientAddrのサイズ */
 
     struct addrinfo hints, *res;
-	int err = 1;
+    int err;
+    struct rlimit rl;               /* fdの上限 */
 
-    char    buf[BUF_LEN];           /* 受信バッファ */
-    int     n;                      /* 受信バイト数 */
-    int     isEnd = 0;              /* 終了フラグ，0でなければ終了 */
+    struct epoll_event events[MAX_EVENTS];
+    int nfds, i;
 
     int     yes = 1;                /* setsockopt()用 */
     struct in_addr addr;            /* アドレス表示用 */
 
     /* コマンドライン引数の処理 */
-    if(argc == 2 && strncmp(argv[1], "-h", 2) == 0) {
-        printf("Usage: %s [dst_ip_addr] [port]\n", argv[0]);
-        return 0;
+    while ((opt = getopt(argc, argv, "l:t:n:uM:h")) != -1) {
+        switch (opt) {
+        case 'l':
+            listen_str = optarg;
+            break;
+        case 't':
+            tune_file = optarg;
+            break;
+        case 'n':
+            tune_name = optarg;
+            break;
+        case 'u':
+            use_udp = 1;
+            break;
+        case 'M':
+            metrics_spec = optarg;
+            break;
+        default:
+            printf("Usage: %s [-l [listen_addr:]port] [-u] [-t profile_file [-n path_name]] [-M metrics_addr] [dst_ip_addr] [port]\n", argv[0]);
+            printf("  -u  also relay UDP datagrams on the same port (send.out paths with /udp)\n");
+            printf("  -t  apply the socket tuning profile of the path (see send.out -t)\n");
+            printf("  -n  path name in the profile (default: dst_ip_addr)\n");
+            printf("  -M  serve live counters in Prometheus text format over HTTP ([host:]port or unix:path)\n");
+            return 0;
+        }
+    }
+    if(argc > optind)       /* 宛先を指定のIPアドレスにする。 portはデフォルト */
+        server_ipaddr_str = argv[optind];
+    if(argc > optind + 1)   /* 宛先を指定のIPアドレス、portにする */
+        port_num_str = argv[optind + 1];
+
+    /* 待ち受けアドレスの解釈 ("port" または "addr:port") */
+    if (listen_str != NULL) {
+        char *colon = strrchr(listen_str, ':');
+        if (colon != NULL) {
+            *colon = '\0';
+            if (inet_pton(AF_INET, listen_str, &listen_ip) != 1) {
+                fprintf(stderr, "invalid listen address: %s\n", listen_str);
+                return 1;
+            }
+            listen_port = atoi(colon + 1);
+        } else {
+            listen_port = atoi(listen_str);
+        }
+        if (listen_port <= 0 || listen_port > 65535) {
+            fprintf(stderr, "invalid listen port\n");
+            return 1;
+        }
     }
-    if(argc > 1)    /* 宛先を指定のIPアドレスにする。 portはデフォルト */
-        server_ipaddr_str = argv[1];
-    if(argc > 2)    /* 宛先を指定のIPアドレス、portにする */
-        port = (unsigned int)atoi(argv[2]);
-
-
-
-    /* IPアドレス（文字列）から変換 */
-    if (inet_pton(AF_INET, server_ipaddr_str, &serverAddr.sin_addr.s_addr) == 1) {
-		addr.s_addr = serverAddr.sin_addr.s_addr;
-	} else {
-		/* 解決 */
-		memset(&hints, 0, sizeof(hints));
-		hints.ai_family = AF_INET;
-		hints.ai_socktype = SOCK_STREAM;  /* TCP */
 
-		err = getaddrinfo(server_ipaddr_str, port_num_str, &hints, &res);
-		if (err != 0) {
-			perror("getaddrinfo");
-			return 1;
-		}
+    /* 調整プロファイル (中継ノードは計測せず，送受信ノードが書いた値を使うだけ) */
+    if (tune_file != NULL) {
+        char desc[256];
+        if (tune_name == NULL) tune_name = server_ipaddr_str;
+        tune_load(&tune_db, tune_file);
+        relay_prof = tune_find(&tune_db, tune_name);
+        if (relay_prof != NULL) {
+            tune_describe(relay_prof, desc, sizeof(desc));
+            printf("tuning: %s\n", desc);
+        } else {
+            printf("tuning: no profile for %s\n", tune_name);
+        }
+    }
 
-		addr.s_addr = ((struct sockaddr_in*)(res->ai_addr))->sin_addr.s_addr;
-	}
+    /* 中継先のアドレスを解決 (IPアドレス・ホスト名のどちらでもよい) */
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;  /* TCP */
+    err = getaddrinfo(server_ipaddr_str, port_num_str, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+        return 1;
+    }
 
     /* 確認用：IPアドレスを文字列に変換して表示 */
-    
+    addr.s_addr = ((struct sockaddr_in*)(res->ai_addr))->sin_addr.s_addr;
     printf("ip address: %s\n", inet_ntoa(addr));
-    printf("port#: %d\n", ntohs(serverAddr.sin_port));
+    printf("port#: %d\n", ntohs(((struct sockaddr_in*)(res->ai_addr))->sin_port));
 
+    /* 相手が先に切断してもプロセスが落ちないようにする */
+    signal(SIGPIPE, SIG_IGN);
 
+    if (metrics_spec != NULL) {
+        if (metrics_serve(metrics_spec) < 0) return 1;
+        relay_metrics();
+    }
 
-    
+    /* 1セッションでソケット2つとパイプ4端を使うので，経路あたり複数本の */
+    /* 接続 (send.out -P) を中継できるようにfdの上限を引き上げておく     */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0) perror("setrlimit");
+    }
 
     /* STEP 1: TCPソケットをオープンする */
-    if((sock0 = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socke");
+    if((sock0 = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+        perror("socket");
         return  1;
     }
 
-
-
-
     /* sock0のコネクションがTIME_WAIT状態でもbind()できるように設定 */
     setsockopt(sock0, SOL_SOCKET, SO_REUSEADDR,
                (const char *)&yes, sizeof(yes));
@@ -89,8 +618,8 @@ main(int argc, char** argv)
     /* STEP 2: クライアントからの要求を受け付けるIPアドレスとポートを設定する */
     memset(&myAddr, 0, sizeof(myAddr));     /* ゼロクリア */
     myAddr.sin_family = AF_INET;                /* Internetプロトコル */
-    myAddr.sin_port = htons(TCP_SERVER_PORT);   /* 待ち受けるポート */
-    myAddr.sin_addr.s_addr = htonl(INADDR_ANY); /* どのIPアドレス宛でも */
+    myAddr.sin_port = htons(listen_port);       /* 待ち受けるポート */
+    myAddr.sin_addr.s_addr = listen_ip;         /* 既定はどのIPアドレス宛でも */
 
     /* STEP 3: ソケットとアドレスをbindする */
     if(bind(sock0, (struct sockaddr *)&myAddr, sizeof(myAddr)) < 0) {
@@ -99,73 +628,104 @@ main(int argc, char** argv)
     }
 
     /* STEP 4: コネクションの最大同時受け入れ数を指定する */
-    if(listen(sock0, 5) != 0) {
+    if(listen(sock0, SOMAXCONN) != 0) {
         perror("listen");
         return  1;
     }
 
-    while(!isEnd) {     /* 終了フラグが0の間は繰り返す */
+    /* STEP 5: 待ち受けソケットと各セッションのソケットをepollで監視する */
+    epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
+    memset(&events[0], 0, sizeof(events[0]));
+    events[0].events = EPOLLIN;
+    events[0].data.ptr = NULL;      /* NULL = 待ち受けソケット */
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock0, &events[0]) < 0) {
+        perror("epoll_ctl");
+        return 1;
+    }
 
-        /* STEP 5: クライアントからの接続要求を受け付ける */
-        printf("waiting connection...\n");
-        addrLen = sizeof(clientAddr);
-        sock = accept(sock0, (struct sockaddr *)&clientAddr, (socklen_t *)&addrLen);
-        if(sock < 0) {
-            perror("accept");
-            return  1;
+    /* STEP 5': UDPも中継するなら同じアドレスとポートで待ち受ける */
+    if (use_udp) {
+        udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if (udp_sock < 0 || bind(udp_sock, (struct sockaddr *)&myAddr, sizeof(myAddr)) < 0) {
+            perror("UDP bind");
+            return 1;
         }
-
-        /* STEP 2: TCPソケットをオープン */
-        socks = socket(AF_INET, SOCK_STREAM, 0);
-        if(socks < 0) {
-            perror("socket");
-            close(sock);
-            return  1;
+        udp_setbuf(udp_sock);
+        memset(&events[0], 0, sizeof(events[0]));
+        events[0].events = EPOLLIN;
+        events[0].data.ptr = &udp_listen_tag;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, udp_sock, &events[0]) < 0) {
+            perror("epoll_ctl");
+            return 1;
         }
+    }
 
-        if(err != 0 && connect(socks, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
-            perror("connect");
-            return  1;
-        } else if (err == 0 && connect(socks, res->ai_addr, res->ai_addrlen) < 0) {
-            perror("connect");
-            return -11;
+    printf("waiting connection...\n");
+    for (;;) {
+        nfds = epoll_wait(epfd, events, MAX_EVENTS, use_udp ? 1000 : -1);
+        metric_add(m_epoll_wait, 1);
+        if (nfds < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
         }
 
+        for (i = 0; i < nfds; i++) {
+            endpoint_t *ep = events[i].data.ptr;
 
+            if (events[i].data.ptr == &udp_listen_tag) {
+                udp_relay_up(res);
+                continue;
+            }
+            if (udp_is_flow(events[i].data.ptr)) {
+                udp_relay_down(events[i].data.ptr);
+                continue;
+            }
+            if (ep != NULL) {
+                /* STEP 7: 受信データをpipe経由でそのまま相手側へ転送 */
+                session_handle(ep, events[i].events);
+                continue;
+            }
 
-        /* 受信パケットの送信元IPアドレスとポート番号を表示 */        
-        addr.s_addr = clientAddr.sin_addr.s_addr;
-        printf("accepted:  ip address: %s, ", inet_ntoa(addr));
-        printf("port#: %d\n", ntohs(clientAddr.sin_port));
-
-        /* STEP 6: サーバーから受信 */
-        while((n = read(socks, buf, BUF_LEN)) > 0) { /* 受信するたびに */
-
-            /* STEP 7: 受信データをそのままクライアントに転送 */
-            write(sock, buf, n);
-            
-            if(strncmp(buf, "quit", 4) == 0) {      /* "quit"なら停止 */
-                isEnd = 1;                      
-                break;
+            /* STEP 6: クライアントからの接続要求をすべて受け付ける */
+            for (;;) {
+                addrLen = sizeof(clientAddr);
+                sock = accept4(sock0, (struct sockaddr *)&clientAddr, &addrLen, SOCK_NONBLOCK);
+                if (sock < 0) {
+                    if (errno != EAGAIN && errno != EINTR) perror("accept");
+                    break;
+                }
+
+                /* 受信パケットの送信元IPアドレスとポート番号を表示 */
+                addr.s_addr = clientAddr.sin_addr.s_addr;
+                printf("accepted:  ip address: %s, ", inet_ntoa(addr));
+                printf("port#: %d\n", ntohs(clientAddr.sin_port));
+
+                if (session_open(sock, res) == NULL) close(sock);
             }
         }
 
-        /* STEP 8: 通信用のソケットのクローズ */
-        close(sock);
-        /* STEP 6: ソケットのクローズ */
-        close(socks);
-        printf("closed\n");
-            
+        if (use_udp) udp_flow_expire();
+
+        /* STEP 8: 閉じたセッションはイベント処理が終わってから解放する */
+        while (free_list != NULL) {
+            session_t *s = free_list;
+            free_list = s->next_free;
+            free(s);
+        }
     }
 
-    
     /* STEP 9: 待ち受け用ソケットのクローズ */
-    close(sock0);  
-
+    freeaddrinfo(res);
+    close(sock0);
 
     return  0;
 }
 
 /* Local Variables: */
-/* compile-command: "gcc tcp_echo_server.c -o tcp_echo_server.out" */
+/* compile-command: "gcc tcp_echo_rooter.c -o rooter.out -lpthread" */
 /* End: */